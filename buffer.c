@@ -10,6 +10,8 @@
  */
 #include "buffer.h"
 
+#include "nbtx_internal.h"
+
 #include <assert.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -29,7 +31,7 @@ static int lazy_init(struct buffer* b) {
   size_t cap = 1024;
 
   *b = (struct buffer) {
-      .data = malloc(cap),
+      .data = nbtx_malloc_(cap),
       .len = 0,
       .cap = cap
   };
@@ -43,7 +45,7 @@ static int lazy_init(struct buffer* b) {
 void buffer_free(struct buffer* b) {
   assert(b);
 
-  free(b->data);
+  nbtx_free_(b->data);
 
   b->data = NULL;
   b->len = 0;
@@ -63,7 +65,8 @@ int buffer_reserve(struct buffer* b, size_t reserved_amount) {
   while (b->cap < reserved_amount)
     b->cap *= 2;
 
-  unsigned char* temp = realloc(b->data, b->cap);
+  NBTX_STATS_ADD(buffer_reallocations, 1);
+  unsigned char* temp = nbtx_realloc_(b->data, b->cap);
 
   if (unlikely(temp == NULL))
     return buffer_free(b), 1;
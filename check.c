@@ -1,7 +1,12 @@
 #include "nbtx.h"
+#include <dirent.h>
 
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +40,2097 @@ static bool check_size(nbtx_node* n, void* aux) {
   return true;
 }
 
+static bool is_nested_compound(const nbtx_node* n, void* root) {
+  return n != root && n->type == NBTX_TAG_COMPOUND;
+}
+
+static void check_same_bytes(struct buffer a, struct buffer b) {
+  if (a.data == NULL || b.data == NULL) die_with_err(errno);
+  if (a.len != b.len || memcmp(a.data, b.data, a.len) != 0)
+    die("FAILED. Cached and uncached dumps differ.");
+}
+
+struct position {
+  double x, y, z;
+};
+
+struct player {
+  int32_t health;
+  uint64_t id;
+  nbtx_span name;
+  struct position pos;
+};
+
+static void check_structs(void) {
+  nbtx_schema* position = nbtx_schema_new((nbtx_field[]) {
+    NBTX_FIELD(struct position, x, NBTX_TAG_DOUBLE),
+    NBTX_FIELD(struct position, y, NBTX_TAG_DOUBLE),
+    NBTX_FIELD(struct position, z, NBTX_TAG_DOUBLE),
+  }, 3);
+  if (position == NULL) die_with_err(errno);
+
+  nbtx_field fields[] = {
+    NBTX_FIELD(struct player, health, NBTX_TAG_INT),
+    NBTX_FIELD(struct player, id, NBTX_TAG_UNSIGNED_LONG),
+    NBTX_FIELD(struct player, name, NBTX_TAG_STRING),
+    NBTX_FIELD(struct player, pos, NBTX_TAG_COMPOUND),
+  };
+  fields[3].schema = position;
+
+  nbtx_schema* player = nbtx_schema_new(fields, 4);
+  if (player == NULL) die_with_err(errno);
+
+  const struct player in = { 20, 1234567890123u, { "Notch", 5 }, { 1.5, 64, -3.25 } };
+  struct buffer b = nbtx_encode_struct(&in, player, "player");
+  if (b.data == NULL) die_with_err(errno);
+
+  /* What we encode is a regular tree... */
+  nbtx_node* tree = nbtx_parse(b.data, b.len);
+  if (tree == NULL) die_with_err(errno);
+
+  const nbtx_node* y = nbtx_find_by_path(tree, "player.pos.y");
+  if (y == NULL || y->type != NBTX_TAG_DOUBLE || y->payload.tag_double != 64)
+    die("FAILED. The encoded struct doesn't parse back.");
+
+  /* ...and regular trees decode, skipping what the schema doesn't know about. */
+  if (nbtx_put_string(tree, "unknown", "skip me").reference == NULL ||
+      nbtx_put_list(tree, "unknown list", nbtx_new_tag_list_payload(NBTX_TAG_STRING)).reference == NULL)
+    die_with_err(errno);
+
+  buffer_free(&b);
+  b = nbtx_dump_binary(tree);
+  if (b.data == NULL) die_with_err(errno);
+
+  struct player out = { 0 };
+  nbtx_status err;
+  if ((err = nbtx_decode_struct(b.data, b.len, player, &out)) != NBTX_OK)
+    die_with_err(err);
+
+  if (out.health != in.health || out.id != in.id ||
+      out.name.length != 5 || memcmp(out.name.data, "Notch", 5) != 0 ||
+      out.pos.x != in.pos.x || out.pos.y != in.pos.y || out.pos.z != in.pos.z)
+    die("FAILED. The decoded struct differs from the encoded one.");
+
+  /* Members with the wrong type are errors. */
+  if (nbtx_put_string(tree, "health", "full").reference == NULL)
+    die_with_err(errno);
+
+  buffer_free(&b);
+  b = nbtx_dump_binary(tree);
+  if (nbtx_decode_struct(b.data, b.len, player, &out) != NBTX_ERR)
+    die("FAILED. A mistyped member was decoded.");
+
+  buffer_free(&b);
+  nbtx_free(tree);
+  nbtx_schema_free(player);
+  nbtx_schema_free(position);
+}
+
+/* Keeps track of what went through it, and fails once `budget' is spent. */
+struct counting_allocator {
+  size_t allocations;
+  size_t outstanding;
+  size_t largest;
+  size_t budget;
+};
+
+static void* counting_malloc(size_t size, void* user) {
+  struct counting_allocator* a = user;
+  if (a->allocations >= a->budget) return NULL;
+
+  a->allocations++;
+  a->outstanding++;
+  if (size > a->largest) a->largest = size;
+  return malloc(size);
+}
+
+static void* counting_realloc(void* ptr, size_t size, void* user) {
+  struct counting_allocator* a = user;
+  if (ptr == NULL) return counting_malloc(size, user);
+  if (a->allocations >= a->budget) return NULL;
+
+  a->allocations++;
+  if (size > a->largest) a->largest = size;
+  return realloc(ptr, size);
+}
+
+static void counting_free(void* ptr, void* user) {
+  struct counting_allocator* a = user;
+  a->outstanding--;
+  free(ptr);
+}
+
+/* Dumps and reparses `tree' through the allocator. Returns true if that worked. */
+static bool round_trip_with(struct counting_allocator* a, const nbtx_node* tree) {
+  const nbtx_allocator allocator = { counting_malloc, counting_realloc, counting_free, a };
+  if (nbtx_set_allocator(&allocator) != NBTX_OK) die("FAILED. The allocator was refused.");
+
+  bool ret = false;
+  struct buffer compressed = nbtx_dump_compressed(tree, NBTX_STRATEGY_GZIP);
+
+  if (compressed.data) {
+    nbtx_node* parsed = nbtx_parse_compressed(compressed.data, compressed.len);
+    ret = parsed && nbtx_eq(parsed, tree);
+    nbtx_free(parsed);
+    buffer_free(&compressed);
+  }
+
+  nbtx_set_allocator(NULL);
+  return ret;
+}
+
+static void check_allocator(const nbtx_node* tree) {
+  struct counting_allocator a = { 0, 0, 0, SIZE_MAX };
+
+  if (!round_trip_with(&a, tree))
+    die("FAILED. Could not round trip through a custom allocator.");
+  if (a.outstanding != 0)
+    die("FAILED. Memory leaked, or was freed by a different allocator.");
+  if (a.largest < 32768)
+    die("FAILED. zlib didn't use the allocator.");
+
+  /* Running out of memory anywhere along the way fails cleanly. That's a lot of
+   * round trips, so big trees (like the generated corpora) skip it. */
+  if (nbtx_size(tree) > 4096) return;
+
+  const size_t needed = a.allocations;
+  for (size_t budget = 0; budget < needed; budget += 1 + budget / 8) {
+    a = (struct counting_allocator) { 0, 0, 0, budget };
+
+    if (round_trip_with(&a, tree))
+      die("FAILED. The round trip worked without enough memory.");
+    if (a.outstanding != 0)
+      die("FAILED. Memory leaked after running out of it.");
+  }
+}
+
+static void check_ctx(const nbtx_node* tree) {
+  struct counting_allocator a = { 0, 0, 0, SIZE_MAX };
+  const nbtx_allocator allocator = { counting_malloc, counting_realloc, counting_free, &a };
+  if (nbtx_set_allocator(&allocator) != NBTX_OK) die("FAILED. The allocator was refused.");
+
+  nbtx_parse_ctx* ctx = nbtx_ctx_new();
+  if (ctx == NULL) die_with_err(errno);
+
+  struct buffer compressed = nbtx_dump_compressed(tree, NBTX_STRATEGY_GZIP);
+  if (compressed.data == NULL) die_with_err(errno);
+
+  for (int i = 0; i < 3; ++i) {
+    const size_t before = a.allocations;
+
+    nbtx_node* parsed = nbtx_ctx_parse_compressed(ctx, compressed.data, compressed.len);
+    if (parsed == NULL) die_with_err(errno);
+    if (!nbtx_eq(parsed, tree))
+      die("FAILED. The context parsed a different tree.");
+
+    /* Once warmed up, parsing the same thing again takes no new memory. */
+    if (i > 0 && a.allocations != before)
+      die("FAILED. Parsing with a warm context allocated.");
+
+    nbtx_ctx_recycle(ctx, parsed);
+  }
+
+  /* Trees parsed with a context are ordinary trees. */
+  nbtx_node* parsed = nbtx_ctx_parse_compressed(ctx, compressed.data, compressed.len);
+  if (parsed == NULL) die_with_err(errno);
+  nbtx_free(parsed);
+  nbtx_ctx_free(ctx);
+
+  /* A context with its own allocator keeps its trees apart from the library's. */
+  struct counting_allocator own = { 0, 0, 0, SIZE_MAX };
+  const nbtx_allocator own_allocator = { counting_malloc, counting_realloc, counting_free, &own };
+
+  if ((ctx = nbtx_ctx_new_with_allocator(&own_allocator)) == NULL) die_with_err(errno);
+
+  for (int i = 0; i < 2; ++i) {
+    parsed = nbtx_ctx_parse_compressed(ctx, compressed.data, compressed.len);
+    if (parsed == NULL) die_with_err(errno);
+    if (!nbtx_eq(parsed, tree))
+      die("FAILED. A context with an allocator parsed a different tree.");
+
+    nbtx_ctx_recycle(ctx, parsed);
+  }
+
+  /* What fails halfway goes back to the context too. */
+  struct buffer raw = nbtx_dump_binary(tree);
+  if (raw.data == NULL) die_with_err(errno);
+  if (nbtx_ctx_parse(ctx, raw.data, raw.len / 2) != NULL)
+    die("FAILED. Half a tree was parsed.");
+
+  const size_t shared = a.allocations;
+  parsed = nbtx_ctx_parse(ctx, raw.data, raw.len);
+  if (parsed == NULL) die_with_err(errno);
+  nbtx_ctx_recycle(ctx, parsed);
+
+  if (own.allocations == 0 || a.allocations != shared)
+    die("FAILED. A context didn't allocate through its own allocator.");
+
+  /* Past its limit, a context frees what it's handed back. */
+  if (nbtx_ctx_set_limit(ctx, 1) != NBTX_CTX_DEFAULT_LIMIT)
+    die("FAILED. The previous limit wasn't returned.");
+
+  /* Lowering the limit keeps what's kept, but nothing more. */
+  nbtx_ctx_set_limit(ctx, NBTX_CTX_DEFAULT_LIMIT);
+  parsed = nbtx_ctx_parse(ctx, raw.data, raw.len);
+  if (parsed == NULL) die_with_err(errno);
+  nbtx_node* more = nbtx_ctx_parse(ctx, raw.data, raw.len);
+  if (more == NULL) die_with_err(errno);
+
+  nbtx_ctx_recycle(ctx, parsed);
+  const size_t kept = own.outstanding;
+  nbtx_ctx_set_limit(ctx, 1);
+  nbtx_ctx_recycle(ctx, more);
+
+  if (own.outstanding >= kept)
+    die("FAILED. A context kept more after its limit was lowered.");
+
+  nbtx_ctx_free(ctx);
+  if ((ctx = nbtx_ctx_new_with_allocator(&own_allocator)) == NULL) die_with_err(errno);
+  nbtx_ctx_set_limit(ctx, 1);
+
+  parsed = nbtx_ctx_parse(ctx, raw.data, raw.len);
+  if (parsed == NULL) die_with_err(errno);
+  nbtx_ctx_recycle(ctx, parsed);
+
+  if (own.outstanding != 0)
+    die("FAILED. A context kept more than its limit.");
+
+  nbtx_ctx_free(ctx);
+  if (own.outstanding != 0)
+    die("FAILED. A context with an allocator leaked memory.");
+
+  const nbtx_allocator incomplete = { counting_malloc, NULL, counting_free, &own };
+  if (nbtx_ctx_new_with_allocator(&incomplete) != NULL || errno != NBTX_ERR)
+    die("FAILED. An incomplete allocator was taken.");
+
+  buffer_free(&raw);
+  buffer_free(&compressed);
+  nbtx_set_allocator(NULL);
+
+  if (a.outstanding != 0)
+    die("FAILED. The context leaked memory.");
+}
+
+/* Returns the binary form of `depth' lists nested in each other. */
+static struct buffer nested_lists(const size_t depth) {
+  const char root[] = { NBTX_TAG_LIST, 0, 0 }; /* An unnamed list... */
+  const uint32_t one = 1, none = 0;
+  char outer[5] = { NBTX_TAG_LIST };           /* ...of one list... */
+  char inner[5] = { NBTX_TAG_INVALID };        /* ...the last being empty. */
+  memcpy(outer + 1, &one, sizeof one);
+  memcpy(inner + 1, &none, sizeof none);
+
+  struct buffer b = NBTX_BUFFER_INIT;
+
+  if (buffer_append(&b, root, sizeof root) != 0) die_with_err(NBTX_EMEM);
+  for (size_t i = 1; i < depth; ++i)
+    if (buffer_append(&b, outer, sizeof outer) != 0) die_with_err(NBTX_EMEM);
+  if (buffer_append(&b, inner, sizeof inner) != 0) die_with_err(NBTX_EMEM);
+
+  return b;
+}
+
+/*
+ * An unnamed compound holding `depth' nested lists in "deep", and then the int
+ * "v", which is 7.
+ */
+static struct buffer deep_member(const size_t depth) {
+  const char root[] = { NBTX_TAG_COMPOUND, 0, 0, NBTX_TAG_LIST, 0, 0, 'd', 'e', 'e', 'p' };
+  const char tail[] = { NBTX_TAG_INT, 0, 0, 'v', 0, 0, 0, 0, 0 }; /* ...and TAG_End. */
+  const uint16_t four = 4, one = 1;
+  const int32_t seven = 7;
+
+  struct buffer lists = nested_lists(depth);
+  struct buffer b = NBTX_BUFFER_INIT;
+
+  char head[sizeof root];
+  memcpy(head, root, sizeof root);
+  memcpy(head + 4, &four, sizeof four);
+
+  char end[sizeof tail];
+  memcpy(end, tail, sizeof tail);
+  memcpy(end + 1, &one, sizeof one);
+  memcpy(end + 4, &seven, sizeof seven);
+
+  /* Leave out the name of the root list. */
+  if (buffer_append(&b, head, sizeof head) != 0 ||
+      buffer_append(&b, lists.data + 3, lists.len - 3) != 0 ||
+      buffer_append(&b, end, sizeof end) != 0)
+    die_with_err(NBTX_EMEM);
+
+  buffer_free(&lists);
+  return b;
+}
+
+static void check_max_depth(void) {
+  struct buffer deepest = nested_lists(NBTX_DEFAULT_MAX_DEPTH);
+  struct buffer too_deep = nested_lists(NBTX_DEFAULT_MAX_DEPTH + 1);
+
+  nbtx_node* parsed = nbtx_parse(deepest.data, deepest.len);
+  if (parsed == NULL) die_with_err(errno);
+  if (nbtx_size(parsed) != NBTX_DEFAULT_MAX_DEPTH)
+    die("FAILED. The nested lists were parsed wrong.");
+  nbtx_free(parsed);
+
+  if (nbtx_parse(too_deep.data, too_deep.len) != NULL || errno != NBTX_EDEPTH)
+    die("FAILED. A tree nested too deeply was parsed.");
+
+  nbtx_parse_ctx* ctx = nbtx_ctx_new();
+  if (ctx == NULL) die_with_err(errno);
+  if (nbtx_ctx_parse(ctx, too_deep.data, too_deep.len) != NULL || errno != NBTX_EDEPTH)
+    die("FAILED. A context parsed a tree nested too deeply.");
+
+  /* Without a limit, only memory bounds the parser. */
+  if (nbtx_set_max_depth(0) != NBTX_DEFAULT_MAX_DEPTH)
+    die("FAILED. The previous limit wasn't returned.");
+
+  parsed = nbtx_ctx_parse(ctx, too_deep.data, too_deep.len);
+  if (parsed == NULL) die_with_err(errno);
+  nbtx_free(parsed);
+
+  nbtx_set_max_depth(NBTX_DEFAULT_MAX_DEPTH);
+  nbtx_ctx_free(ctx);
+  buffer_free(&deepest);
+  buffer_free(&too_deep);
+
+  /* Members nobody asked for are skipped under the same limit. */
+  struct buffer skipped = deep_member((size_t)1 << 20);
+
+  nbtx_schema* schema = nbtx_schema_new((nbtx_field[]) { { "v", NBTX_TAG_INT, 0, NULL } }, 1);
+  if (schema == NULL) die_with_err(errno);
+
+  int32_t v = 0;
+  if (nbtx_decode_struct(skipped.data, skipped.len, schema, &v) != NBTX_EDEPTH)
+    die("FAILED. A member nested too deeply was skipped.");
+
+  nbtx_set_max_depth(0);
+  nbtx_status err;
+  if ((err = nbtx_decode_struct(skipped.data, skipped.len, schema, &v)) != NBTX_OK)
+    die_with_err(err);
+  if (v != 7) die("FAILED. The member after a deep one was decoded wrong.");
+  nbtx_set_max_depth(NBTX_DEFAULT_MAX_DEPTH);
+
+  nbtx_schema_free(schema);
+  buffer_free(&skipped);
+}
+
+static bool count_node(nbtx_node* n, void* aux) {
+  (void)n;
+  ++*(size_t*)aux;
+
+  return true;
+}
+
+static void check_deep_trees(void) {
+  const size_t depth = 100000;
+  struct buffer raw = nested_lists(depth);
+  const size_t previous = nbtx_set_max_depth(0);
+
+  nbtx_node* a = nbtx_parse(raw.data, raw.len);
+  if (a == NULL) die_with_err(errno);
+  nbtx_node* b = nbtx_parse(raw.data, raw.len);
+  if (b == NULL) die_with_err(errno);
+
+  size_t visited = 0;
+  if (nbtx_size(a) != depth || !nbtx_map(a, count_node, &visited) || visited != depth)
+    die("FAILED. Wrong number of nodes in a deep tree.");
+  if (!nbtx_eq(a, b))
+    die("FAILED. Deep trees aren't equal to themselves.");
+
+  nbtx_cursor cursor;
+  size_t entered = 0, deepest = 0;
+  nbtx_cursor_init(&cursor, a);
+  for (nbtx_cursor_event e; (e = nbtx_cursor_next(&cursor)) > NBTX_CURSOR_END;) {
+    if (e == NBTX_CURSOR_ENTER) entered++;
+    if (cursor.depth > deepest) deepest = cursor.depth;
+  }
+  nbtx_cursor_free(&cursor);
+
+  if (entered != depth || deepest != depth - 1)
+    die("FAILED. A cursor got lost in a deep tree.");
+
+  /* Without memory for their stacks, the walks recurse instead. */
+  struct buffer small = nested_lists(1000);
+  nbtx_node* c = nbtx_parse(small.data, small.len);
+  nbtx_node* d = nbtx_parse(small.data, small.len);
+  if (c == NULL || d == NULL) die_with_err(errno);
+
+  struct counting_allocator none = { 0, 0, 0, 0 };
+  const nbtx_allocator allocator = { counting_malloc, counting_realloc, counting_free, &none };
+  if (nbtx_set_allocator(&allocator) != NBTX_OK) die("FAILED. The allocator was refused.");
+
+  visited = 0;
+  const bool right = nbtx_size(c) == 1000 && nbtx_map(c, count_node, &visited) && visited == 1000 &&
+                     nbtx_eq(c, d);
+
+  /* Cursors can't recurse, so they stop. */
+  nbtx_cursor_event e;
+  nbtx_cursor_init(&cursor, c);
+  while ((e = nbtx_cursor_next(&cursor)) > NBTX_CURSOR_END) {}
+  nbtx_cursor_free(&cursor);
+  nbtx_set_allocator(NULL);
+
+  if (!right)
+    die("FAILED. Walking a tree without memory for the stack went wrong.");
+  if (e != NBTX_CURSOR_ERROR || errno != NBTX_EMEM || cursor.depth != NBTX_CURSOR_LOCAL_FRAMES)
+    die("FAILED. A cursor without memory for its stack didn't fail.");
+
+  nbtx_free(c);
+  nbtx_free(d);
+
+  /* Freeing and recycling don't need a stack at all. */
+  nbtx_parse_ctx* ctx = nbtx_ctx_new();
+  if (ctx == NULL) die_with_err(errno);
+
+  nbtx_free(a);
+  nbtx_ctx_recycle(ctx, b);
+  nbtx_ctx_free(ctx);
+
+  nbtx_set_max_depth(previous);
+  buffer_free(&raw);
+  buffer_free(&small);
+}
+
+struct recording {
+  nbtx_node** nodes;
+  size_t count;
+};
+
+static bool record_node(nbtx_node* n, void* aux) {
+  struct recording* r = aux;
+  r->nodes[r->count++] = n;
+  return true;
+}
+
+static void check_cursor(nbtx_node* tree) {
+  const size_t size = nbtx_size(tree);
+  struct recording mapped = { malloc(size * sizeof(nbtx_node*)), 0 };
+  if (mapped.nodes == NULL) die_with_err(NBTX_EMEM);
+  nbtx_map(tree, record_node, &mapped);
+
+  /* Cursors go through the nodes in the order nbtx_map does. */
+  nbtx_cursor c;
+  nbtx_cursor_event e;
+  size_t seen = 0, open = 0;
+
+  nbtx_cursor_init(&c, tree);
+  while ((e = nbtx_cursor_next(&c)) > NBTX_CURSOR_END) {
+    if (e == NBTX_CURSOR_LEAVE) {
+      if (open == 0 || c.depth != --open) die("FAILED. A cursor left something it didn't enter.");
+      continue;
+    }
+
+    if (seen == size || c.node != mapped.nodes[seen++] || c.depth != open)
+      die("FAILED. A cursor and nbtx_map disagree.");
+    if (e == NBTX_CURSOR_ENTER) open++;
+  }
+  nbtx_cursor_free(&c);
+
+  if (e != NBTX_CURSOR_END || seen != size || open != 0)
+    die("FAILED. A cursor didn't see the whole tree.");
+
+  /* Skipping the members of the root leaves nothing but its end. */
+  nbtx_cursor_init(&c, tree);
+  if (nbtx_cursor_next(&c) == NBTX_CURSOR_ENTER) {
+    nbtx_cursor_skip_children(&c);
+    if (nbtx_cursor_next(&c) != NBTX_CURSOR_LEAVE || c.node != tree || c.depth != 0 ||
+        nbtx_cursor_next(&c) != NBTX_CURSOR_END)
+      die("FAILED. A cursor didn't skip the members of the root.");
+  }
+  nbtx_cursor_free(&c);
+
+  if (tree->type == NBTX_TAG_LIST || tree->type == NBTX_TAG_COMPOUND) {
+    const nbtx_node* child;
+    const struct list_head* pos;
+    size_t children = 0;
+
+    nbtx_for_each_child(child, pos, tree)
+      if (child != NULL) children++;
+
+    if (children != list_length(&tree->payload.tag_list->entry))
+      die("FAILED. nbtx_for_each_child missed members.");
+  }
+
+  free(mapped.nodes);
+}
+
+/* A compound of compounds, big enough for its hash to be cached. */
+static nbtx_node* hash_fixture(void) {
+  nbtx_node* root = nbtx_new_compound("root");
+  if (root == NULL) die_with_err(errno);
+
+  for (int i = 0; i < 64; ++i) {
+    char name[32];
+    snprintf(name, sizeof name, "block%d", i);
+
+    nbtx_node* block = nbtx_put_compound(root, name, nbtx_new_tag_compound_payload()).reference;
+    if (block == NULL ||
+        nbtx_put_string(block, "id", "minecraft:chest").reference == NULL ||
+        nbtx_put_int(block, "x", i).reference == NULL)
+      die_with_err(errno);
+  }
+
+  return root;
+}
+
+static void check_hash(nbtx_node* tree) {
+  struct buffer raw = nbtx_dump_binary(tree);
+  if (raw.data == NULL) die_with_err(errno);
+  nbtx_node* copy = nbtx_parse(raw.data, raw.len);
+  if (copy == NULL) die_with_err(errno);
+
+  const uint64_t h = nbtx_hash(tree);
+  if (nbtx_hash(copy) != h || nbtx_hash(tree) != h)
+    die("FAILED. Equal trees hash differently.");
+
+  /* The hash is the same on every run and platform. */
+  nbtx_node* small = nbtx_new_compound("a");
+  if (small == NULL || nbtx_put_int(small, "b", 1).reference == NULL ||
+      nbtx_put_string(small, "c", "d").reference == NULL)
+    die_with_err(errno);
+  if (nbtx_hash(small) != UINT64_C(0x80de189502ed5849))
+    die("FAILED. The hash of a known tree changed.");
+
+  nbtx_node* unnamed = nbtx_new_compound(NULL);
+  nbtx_node* empty = nbtx_new_compound("");
+  if (unnamed == NULL || empty == NULL) die_with_err(errno);
+  if (nbtx_hash(unnamed) == nbtx_hash(empty))
+    die("FAILED. Unnamed and empty names hash the same.");
+
+  /* Floats hash by value: nbtx_eq lets them be a little off, nbtx_eq_hashed doesn't. */
+  nbtx_node* close = nbtx_clone(small);
+  if (close == NULL ||
+      nbtx_put_double(small, "e", 1.0).reference == NULL ||
+      nbtx_put_double(close, "e", 1.0 + 1e-9).reference == NULL)
+    die_with_err(errno);
+  if (!nbtx_eq(small, close))
+    die("FAILED. Nearly equal doubles aren't nbtx_eq.");
+  if (nbtx_hash(small) == nbtx_hash(close) || nbtx_eq_hashed(small, close))
+    die("FAILED. Nearly equal doubles hash or compare the same.");
+
+  /* ...but the same canonical value hashes the same, whatever its bits. */
+  if (nbtx_put_double(small, "e", 0.0).reference == NULL ||
+      nbtx_put_double(close, "e", -0.0).reference == NULL ||
+      nbtx_put_float(small, "f", NAN).reference == NULL ||
+      nbtx_put_float(close, "f", -NAN).reference == NULL)
+    die_with_err(errno);
+  if (nbtx_hash(small) != nbtx_hash(close) || !nbtx_eq_hashed(small, close))
+    die("FAILED. Zeros or NaNs of different signs hash differently.");
+
+  /* Changes through the library are noticed under cached hashes... */
+  nbtx_node* big = hash_fixture();
+  const uint64_t before = nbtx_hash(big);
+
+  nbtx_node* clone = nbtx_clone_shared(big);
+  if (clone == NULL) die_with_err(errno);
+  nbtx_node* block = nbtx_find_by_path_mut(clone, "root.block7");
+  if (block == NULL || nbtx_put_int(block, "x", -1).reference == NULL)
+    die_with_err(errno);
+
+  if (nbtx_hash(clone) == before || nbtx_hash(big) != before)
+    die("FAILED. Modifying a clone didn't change its hash alone.");
+  if (nbtx_eq_hashed(big, clone) || nbtx_eq_hashed(clone, big))
+    die("FAILED. Trees with different hashes are equal.");
+
+  /* ...and undoing them brings the hash back. */
+  if (nbtx_put_int(block, "x", 7).reference == NULL) die_with_err(errno);
+  if (nbtx_hash(clone) != before || !nbtx_eq_hashed(big, clone))
+    die("FAILED. Undoing a change didn't restore the hash.");
+
+  /* Changes by hand leave the hash stale, which nbtx_eq doesn't look at. */
+  nbtx_node* x = nbtx_find_by_path_mut(clone, "root.block7.x");
+  if (x == NULL) die_with_err(errno);
+  x->payload.tag_int = -1;
+  nbtx_mark_dirty(block);
+  nbtx_hash(clone);
+  x->payload.tag_int = 7;
+
+  if (!nbtx_eq(big, clone) || !nbtx_eq(clone, big))
+    die("FAILED. nbtx_eq trusted a stale hash.");
+
+  /* Shared nodes are equal without a look, even if a NaN makes them unequal to a copy. */
+  nbtx_node* nan_block = nbtx_find_by_path_mut(big, "root.block3");
+  if (nan_block == NULL || nbtx_put_double(nan_block, "nan", NAN).reference == NULL)
+    die_with_err(errno);
+  nbtx_node* sharer = nbtx_clone_shared(big);
+  nbtx_node* deep = nbtx_clone(big);
+  if (sharer == NULL || deep == NULL) die_with_err(errno);
+  if (!nbtx_eq(big, big) || !nbtx_eq(big, sharer) || !nbtx_eq_hashed(sharer, big))
+    die("FAILED. A tree isn't equal to the nodes it shares.");
+  if (nbtx_eq(big, deep))
+    die("FAILED. A NaN in a copy compared equal.");
+  nbtx_free(sharer);
+  nbtx_free(deep);
+
+  nbtx_free(copy);
+  nbtx_free(small);
+  nbtx_free(unnamed);
+  nbtx_free(empty);
+  nbtx_free(close);
+  nbtx_free(big);
+  nbtx_free(clone);
+  buffer_free(&raw);
+}
+
+/*
+ * A compound with a compound for each of `names', in that order. Their zeros
+ * and NaNs have the sign bit set if `negative' is.
+ */
+static nbtx_node* compound_of(const char* const* names, const size_t count, const bool negative) {
+  nbtx_node* ret = nbtx_new_compound("c");
+  if (ret == NULL) die_with_err(errno);
+
+  for (size_t i = 0; i < count; ++i) {
+    nbtx_node* member = nbtx_put_compound(ret, names[i], nbtx_new_tag_compound_payload()).reference;
+    if (member == NULL ||
+        nbtx_put_int(member, "length", (int32_t)strlen(names[i])).reference == NULL ||
+        nbtx_put_double(member, "zero", negative ? -0.0 : 0.0).reference == NULL ||
+        nbtx_put_float(member, "nan", negative ? -NAN : NAN).reference == NULL)
+      die_with_err(errno);
+  }
+
+  return ret;
+}
+
+static void check_canonical(void) {
+  const char* forward[] = { "a", "b", "ab", "" };
+  const char* backward[] = { "", "ab", "b", "a" };
+
+  nbtx_node* a = compound_of(forward, 4, false);
+  nbtx_node* b = compound_of(backward, 4, true);
+
+  struct buffer ca = nbtx_dump_canonical(a);
+  struct buffer cb = nbtx_dump_canonical(b);
+  if (ca.data == NULL || cb.data == NULL) die_with_err(errno);
+  check_same_bytes(ca, cb);
+
+  /* Members come out sorted, and the result parses like any other dump. */
+  nbtx_node* parsed = nbtx_parse(ca.data, ca.len);
+  if (parsed == NULL) die_with_err(errno);
+
+  const char* sorted[] = { "", "a", "ab", "b" };
+  const struct list_head* pos;
+  size_t i = 0;
+  list_for_each(pos, &parsed->payload.tag_compound->entry) {
+    const nbtx_node* member = list_entry(pos, struct nbtx_list, entry)->data;
+    if (i >= 4 || strcmp(member->name, sorted[i++]) != 0)
+      die("FAILED. Canonical members aren't sorted.");
+  }
+
+  /* Equal canonical forms are stored once. */
+  nbtx_store* store = nbtx_store_new();
+  if (store == NULL) die_with_err(errno);
+
+  nbtx_digest ka, kb, kp;
+  if (nbtx_store_put(store, a, &ka) != NBTX_OK ||
+      nbtx_store_put(store, b, &kb) != NBTX_OK ||
+      nbtx_store_put(store, parsed, &kp) != NBTX_OK)
+    die("FAILED. Couldn't put trees in the store.");
+
+  size_t entries, bytes, length;
+  nbtx_store_usage(store, &entries, &bytes);
+  if (ka.hi != kb.hi || ka.lo != kb.lo || kp.hi != ka.hi || kp.lo != ka.lo ||
+      entries != 1 || bytes != ca.len)
+    die("FAILED. Equal trees were stored twice.");
+
+  const void* stored = nbtx_store_get(store, ka, &length);
+  if (stored == NULL || length != ca.len || memcmp(stored, ca.data, length) != 0)
+    die("FAILED. The store gave back different bytes.");
+
+  /* Lots of trees, some of them repeated, come and go. */
+  nbtx_digest keys[300];
+  for (int32_t j = 0; j < 300; ++j) {
+    nbtx_node* t = nbtx_new_compound("t");
+    if (t == NULL || nbtx_put_int(t, "v", j % 100).reference == NULL) die_with_err(errno);
+    if (nbtx_store_put(store, t, &keys[j]) != NBTX_OK) die("FAILED. Couldn't put a tree in the store.");
+    nbtx_free(t);
+  }
+
+  nbtx_store_usage(store, &entries, NULL);
+  if (entries != 101) die("FAILED. Repeated trees were stored more than once.");
+
+  for (int j = 0; j < 300; j += 3)
+    if (nbtx_store_release(store, keys[j]) != NBTX_OK) die("FAILED. Couldn't release a key.");
+
+  for (int j = 0; j < 300; ++j)
+    if (nbtx_store_get(store, keys[j], NULL) == NULL) die("FAILED. A key went away too early.");
+
+  for (int j = 0; j < 300; ++j)
+    if (j % 3 != 0 && nbtx_store_release(store, keys[j]) != NBTX_OK) die("FAILED. Couldn't release a key.");
+
+  nbtx_store_usage(store, &entries, NULL);
+  if (entries != 1 || nbtx_store_get(store, keys[0], NULL) != NULL ||
+      nbtx_store_release(store, keys[0]) != NBTX_ERR)
+    die("FAILED. Released trees were kept.");
+
+  for (int j = 0; j < 3; ++j)
+    if (nbtx_store_release(store, ka) != NBTX_OK) die("FAILED. Couldn't release a key.");
+  if (nbtx_store_get(store, ka, NULL) != NULL) die("FAILED. Released trees were kept.");
+
+  nbtx_store_free(store);
+  nbtx_free(a);
+  nbtx_free(b);
+  nbtx_free(parsed);
+  buffer_free(&ca);
+  buffer_free(&cb);
+}
+
+static bool count_atomically(nbtx_node* n, void* aux) {
+  (void)n;
+  atomic_fetch_add((atomic_size_t*)aux, 1);
+  return true;
+}
+
+static bool is_not(nbtx_node* n, void* aux) {
+  return n != aux;
+}
+
+/* Drops some of the tree, in a way that doesn't depend on the order it's walked. */
+static bool has_even_name(const nbtx_node* n, void* aux) {
+  (void)aux;
+  return n->name == NULL || strlen(n->name) % 2 == 0;
+}
+
+static void check_filter_inplace(void) {
+  nbtx_node* big = hash_fixture();
+  const uint64_t before = nbtx_hash(big);
+
+  nbtx_node* expected = nbtx_filter(big, has_even_name, NULL);
+  if (expected == NULL) die_with_err(errno);
+
+  /* Filtering a clone copies what it shares with the original first... */
+  nbtx_node* shared = nbtx_clone_shared(big);
+  if (shared == NULL) die_with_err(errno);
+
+  shared = nbtx_filter_inplace(shared, has_even_name, NULL);
+  if (shared == NULL || errno != NBTX_OK) die_with_err(errno);
+  if (!nbtx_eq(shared, expected) || nbtx_hash(big) != before)
+    die("FAILED. Filtering a clone in place went wrong.");
+  nbtx_free(shared);
+
+  /* ...and says so when it can't, leaving those parts unfiltered. */
+  if ((shared = nbtx_clone_shared(big)) == NULL) die_with_err(errno);
+
+  struct counting_allocator a = { 0, 0, 0, 0 };
+  const nbtx_allocator allocator = { counting_malloc, counting_realloc, counting_free, &a };
+  if (nbtx_set_allocator(&allocator) != NBTX_OK) die("FAILED. The allocator was refused.");
+
+  nbtx_node* filtered = nbtx_filter_inplace(shared, has_even_name, NULL);
+  const int err = errno;
+  nbtx_set_allocator(NULL);
+
+  if (filtered != shared || err != NBTX_EMEM)
+    die("FAILED. Running out of memory while filtering wasn't reported.");
+  if (nbtx_find_by_path(filtered, "root.block11") != NULL ||
+      nbtx_find_by_path(filtered, "root.block0.x") == NULL || nbtx_hash(big) != before)
+    die("FAILED. Filtering without memory changed the wrong things.");
+
+  nbtx_free(filtered);
+  nbtx_free(expected);
+  nbtx_free(big);
+}
+
+/* Returns how many threads the process has, or 0 if that can't be told. */
+static size_t threads_running(void) {
+  DIR* d = opendir("/proc/self/task");
+  if (d == NULL) return 0;
+
+  size_t ret = 0;
+  for (struct dirent* e; (e = readdir(d)) != NULL;)
+    ret += e->d_name[0] != '.';
+
+  closedir(d);
+  return ret;
+}
+
+static void check_parallel(nbtx_node* tree) {
+  nbtx_node* big = hash_fixture();
+  nbtx_node* trees[] = { tree, big };
+
+  for (size_t i = 0; i < sizeof trees / sizeof trees[0]; ++i) {
+    for (unsigned threads = 0; threads <= 4; threads += 2) {
+      atomic_size_t visited = 0;
+
+      if (!nbtx_map_parallel(trees[i], count_atomically, &visited, threads) ||
+          atomic_load(&visited) != nbtx_size(trees[i]))
+        die("FAILED. nbtx_map_parallel didn't visit every node once.");
+
+      nbtx_node* serial = nbtx_filter(trees[i], has_even_name, NULL);
+      if (serial == NULL && errno != NBTX_OK) die_with_err(errno);
+      nbtx_node* parallel = nbtx_filter_parallel(trees[i], has_even_name, NULL, threads);
+      if (parallel == NULL && errno != NBTX_OK) die_with_err(errno);
+
+      if ((serial == NULL) != (parallel == NULL) || (serial && !nbtx_eq(serial, parallel)))
+        die("FAILED. nbtx_filter_parallel differs from nbtx_filter.");
+
+      nbtx_free(serial);
+      nbtx_free(parallel);
+    }
+  }
+
+  /* The threads of one call are kept for the next ones. */
+  const size_t threads = threads_running();
+
+  for (int i = 0; i < 16; ++i) {
+    atomic_size_t visited = 0;
+    if (!nbtx_map_parallel(big, count_atomically, &visited, 4)) die_with_err(errno);
+  }
+
+  if (threads != 0 && (threads == 1 || threads_running() != threads))
+    die("FAILED. nbtx_map_parallel didn't reuse its threads.");
+
+  /* Visitors can stop the others. */
+  nbtx_node* last = nbtx_find_by_path(big, "root.block63.x");
+  if (last == NULL) die("FAILED. Couldn't find a member.");
+  if (nbtx_map_parallel(big, is_not, last, 4))
+    die("FAILED. nbtx_map_parallel wasn't stopped by a visitor.");
+
+  nbtx_free(big);
+}
+
+#define BATCH_FILES 100
+#define BATCH_MISSING 37 /* Never written. */
+#define BATCH_CORRUPT 50 /* Not compressed. */
+
+static void check_parse_paths(nbtx_node* tree) {
+  nbtx_node* big = hash_fixture();
+  char dir[] = "/tmp/nbtx-check-XXXXXX";
+  char paths[BATCH_FILES][sizeof dir + 16];
+  const char* path_list[BATCH_FILES];
+
+  if (mkdtemp(dir) == NULL) die("Could not make a temporary directory.");
+
+  /* Small and big files, with both kinds of headers. */
+  for (size_t i = 0; i < BATCH_FILES; ++i) {
+    snprintf(paths[i], sizeof paths[i], "%s/%zu.nbtx", dir, i);
+    path_list[i] = paths[i];
+
+    if (i == BATCH_MISSING) continue;
+
+    FILE* fp = fopen(paths[i], "wb");
+    if (fp == NULL) die("Could not write a temporary file.");
+
+    if (i == BATCH_CORRUPT) {
+      fputs("not compressed at all", fp);
+    } else {
+      const nbtx_status err = nbtx_dump_file(i % 2 ? big : tree, fp,
+                                             i % 3 ? NBTX_STRATEGY_GZIP : NBTX_STRATEGY_INFLATE);
+      if (err != NBTX_OK) die_with_err(err);
+    }
+
+    fclose(fp);
+  }
+
+  const nbtx_io_mode modes[] = { NBTX_IO_AUTO, NBTX_IO_THREADS };
+
+  for (size_t m = 0; m < sizeof modes / sizeof modes[0]; ++m) {
+    for (unsigned threads = 1; threads <= 4; threads += 3) {
+      nbtx_node* trees[BATCH_FILES];
+      nbtx_status errors[BATCH_FILES];
+
+      if (nbtx_parse_paths(path_list, BATCH_FILES, trees, errors, threads, modes[m]) != BATCH_FILES - 2)
+        die("FAILED. nbtx_parse_paths didn't load every file it could.");
+      if (errno != NBTX_EIO)
+        die("FAILED. nbtx_parse_paths didn't report the first error.");
+
+      for (size_t i = 0; i < BATCH_FILES; ++i) {
+        if (i == BATCH_MISSING || i == BATCH_CORRUPT) {
+          if (trees[i] != NULL || errors[i] == NBTX_OK)
+            die("FAILED. nbtx_parse_paths loaded a file it shouldn't have.");
+          if (i == BATCH_MISSING && errors[i] != NBTX_EIO)
+            die("FAILED. A missing file isn't an IO error.");
+          continue;
+        }
+
+        if (errors[i] != NBTX_OK || trees[i] == NULL || !nbtx_eq(trees[i], i % 2 ? big : tree))
+          die("FAILED. nbtx_parse_paths loaded a file wrong.");
+
+        nbtx_free(trees[i]);
+      }
+    }
+  }
+
+  /* Nothing to load, and no errors to report. */
+  if (nbtx_parse_paths(NULL, 0, NULL, NULL, 0, NBTX_IO_AUTO) != 0 || errno != NBTX_OK)
+    die("FAILED. nbtx_parse_paths loaded nothing wrong.");
+
+  for (size_t i = 0; i < BATCH_FILES; ++i)
+    if (i != BATCH_MISSING) remove(paths[i]);
+  remove(dir);
+
+  nbtx_free(big);
+}
+
+/* Changes the tree as much as it can while a save of it runs. */
+static void change_while_saving(nbtx_node* tree, const nbtx_save* s) {
+  for (int i = 0; i < 64 || !nbtx_save_done(s); ++i) {
+    char path[32];
+    snprintf(path, sizeof path, "root.block%d.x", i % 64);
+
+    nbtx_node* x = nbtx_find_by_path_mut(tree, path);
+    if (x == NULL) die_with_err(errno);
+    x->payload.tag_int += 1000;
+
+    if (i < 64 && nbtx_put_int(tree, path + 5, -i).reference == NULL)
+      die_with_err(errno);
+  }
+}
+
+static size_t files_in(const char* dir) {
+  DIR* d = opendir(dir);
+  if (d == NULL) die("Could not list a temporary directory.");
+
+  size_t ret = 0;
+  for (struct dirent* e; (e = readdir(d)) != NULL;)
+    ret += e->d_name[0] != '.';
+
+  closedir(d);
+  return ret;
+}
+
+static void check_save(void) {
+  char dir[] = "/tmp/nbtx-check-XXXXXX";
+  char path[sizeof dir + 16];
+
+  if (mkdtemp(dir) == NULL) die("Could not make a temporary directory.");
+  snprintf(path, sizeof path, "%s/level.nbtx", dir);
+
+  nbtx_node* tree = hash_fixture();
+
+  for (int round = 0; round < 8; ++round) {
+    struct buffer before = nbtx_dump_binary(tree);
+    if (before.data == NULL) die_with_err(errno);
+    nbtx_node* expected = nbtx_parse(before.data, before.len);
+    if (expected == NULL) die_with_err(errno);
+    buffer_free(&before);
+
+    nbtx_save* s = nbtx_dump_file_async(tree, path, round % 2 ? NBTX_STRATEGY_INFLATE : NBTX_STRATEGY_GZIP);
+    if (s == NULL) die_with_err(errno);
+
+    /* What nbtx_find* finds below the root is the snapshot's too, until it's done. */
+    const bool was_done = nbtx_save_done(s);
+    nbtx_node* found = nbtx_find_by_name(tree, "block0");
+    if (found == NULL) die_with_err(errno);
+    if (nbtx_put_int(found, "found", round).reference == NULL && (was_done || errno != NBTX_ERR))
+      die("FAILED. A put into a node shared with a save went wrong.");
+
+    change_while_saving(tree, s);
+
+    /* The last round frees the tree before the save is over. */
+    if (round == 7) {
+      nbtx_free(tree);
+      tree = NULL;
+    }
+
+    const nbtx_status err = nbtx_save_wait(s);
+    if (err != NBTX_OK) die_with_err(err);
+
+    nbtx_node* saved = nbtx_parse_path(path);
+    if (saved == NULL) die_with_err(errno);
+
+    if (!nbtx_eq(saved, expected))
+      die("FAILED. nbtx_dump_file_async saved changes made after it was called.");
+    if (tree && nbtx_eq(saved, tree))
+      die("FAILED. The tree didn't change while it was saved.");
+    if (files_in(dir) != 1)
+      die("FAILED. nbtx_dump_file_async left a temporary file behind.");
+
+    nbtx_free(saved);
+    nbtx_free(expected);
+  }
+
+  /* Saving where there's no directory fails, and leaves nothing behind. */
+  char missing[sizeof dir + 32];
+  snprintf(missing, sizeof missing, "%s/missing/level.nbtx", dir);
+
+  nbtx_node* small = hash_fixture();
+  nbtx_save* s = nbtx_dump_file_async(small, missing, NBTX_STRATEGY_GZIP);
+  if (s == NULL) die_with_err(errno);
+  if (nbtx_save_wait(s) != NBTX_EIO)
+    die("FAILED. nbtx_dump_file_async saved into a missing directory.");
+  if (files_in(dir) != 1)
+    die("FAILED. A failed save left a file behind.");
+  nbtx_free(small);
+
+  remove(path);
+  remove(dir);
+}
+
+static nbtx_node* added(const nbtx_result r) {
+  if (r.reference == NULL) die_with_err(errno);
+  return r.reference;
+}
+
+/* A tree to query: some entities, one of them with a passenger. */
+static nbtx_node* query_fixture(void) {
+  static const struct { const char* id; float health; } entities[] = {
+    { "zombie", 20 }, { "skeleton", 10 }, { "zombie", 5 }
+  };
+
+  nbtx_node* root = nbtx_new_compound("level");
+  if (root == NULL) die_with_err(errno);
+
+  nbtx_node* list = added(nbtx_put_list(root, "Entities", nbtx_new_tag_list_payload(NBTX_TAG_COMPOUND)));
+
+  for (size_t i = 0; i < sizeof entities / sizeof entities[0]; ++i) {
+    nbtx_node* entity = added(nbtx_put_compound(list, NULL, nbtx_new_tag_compound_payload()));
+    added(nbtx_put_string(entity, "id", entities[i].id));
+    added(nbtx_put_float(entity, "Health", entities[i].health));
+  }
+
+  nbtx_node* passengers = added(nbtx_put_list(nbtx_list_item(list, 2), "Passengers",
+                                              nbtx_new_tag_list_payload(NBTX_TAG_COMPOUND)));
+  nbtx_node* passenger = added(nbtx_put_compound(passengers, NULL, nbtx_new_tag_compound_payload()));
+  added(nbtx_put_string(passenger, "id", "zombie"));
+  added(nbtx_put_float(passenger, "Health", 1));
+
+  nbtx_node* pos = added(nbtx_put_list(root, "Pos", nbtx_new_tag_list_payload(NBTX_TAG_DOUBLE)));
+  for (int i = 1; i <= 3; ++i)
+    added(nbtx_put_double(pos, NULL, i));
+
+  added(nbtx_put_int(root, "Version", 3));
+  added(nbtx_put_ulong(root, "big", UINT64_MAX));
+  added(nbtx_put_byte(root, "weird name.x", -1));
+
+  return root;
+}
+
+/* Logs the matches of a query, so that runs on trees and buffers can be compared. */
+struct matches {
+  struct buffer log;
+  size_t count;
+  size_t limit;
+  double sum; /* Of floats and doubles. */
+};
+
+static bool log_match(const nbtx_value* v, void* aux) {
+  struct matches* m = aux;
+  const unsigned char type = (unsigned char)v->type;
+
+  if (buffer_append(&m->log, &type, 1) ||
+      (v->name && buffer_append(&m->log, v->name, v->name_length)) ||
+      (type != NBTX_TAG_LIST && type != NBTX_TAG_COMPOUND && buffer_append(&m->log, v->data, v->length)))
+    die_with_err(NBTX_EMEM);
+
+  float f;
+  double d;
+  if (type == NBTX_TAG_FLOAT)  { memcpy(&f, v->data, sizeof f); m->sum += f; }
+  if (type == NBTX_TAG_DOUBLE) { memcpy(&d, v->data, sizeof d); m->sum += d; }
+
+  return ++m->count != m->limit;
+}
+
+/* Runs `text' on `tree' and its dump, which have to agree. Returns the number of matches. */
+static size_t run_query(const nbtx_node* tree, const struct buffer raw, const char* text,
+                        const size_t limit, double* sum) {
+  nbtx_query* query = nbtx_query_compile(text);
+  if (query == NULL) die_with_err(errno);
+
+  struct matches on_tree = { { NULL, 0, 0 }, 0, limit, 0 };
+  struct matches on_raw = { { NULL, 0, 0 }, 0, limit, 0 };
+  nbtx_status err;
+
+  if ((err = nbtx_query_run(query, tree, log_match, &on_tree)) != NBTX_OK ||
+      (err = nbtx_query_run_raw(query, raw.data, raw.len, log_match, &on_raw)) != NBTX_OK)
+    die_with_err(err);
+
+  if (on_tree.count != on_raw.count || on_tree.log.len != on_raw.log.len ||
+      (on_tree.log.len && memcmp(on_tree.log.data, on_raw.log.data, on_tree.log.len) != 0))
+    die("FAILED. A query found different things in a tree and its dump.");
+
+  if (sum) *sum = on_tree.sum;
+
+  buffer_free(&on_tree.log);
+  buffer_free(&on_raw.log);
+  nbtx_query_free(query);
+  return on_tree.count;
+}
+
+static void check_query(const nbtx_node* tree) {
+  static const struct { const char* text; size_t matches; double sum; } cases[] = {
+    { "Entities[*][id==\"zombie\"].Health", 2, 25 },
+    { "Entities[*][ id != \"zombie\" ].Health", 1, 10 },
+    { "..Health", 4, 36 },
+    { "..*[id == \"zombie\"].Health", 3, 26 },
+    { "Entities[*][Health < 10]", 1, 0 },
+    { "Entities[*][Passengers]..id", 2, 0 },
+    { "Entities[0].id", 1, 0 },
+    { "Entities[-1].Passengers[-1].Health", 1, 1 },
+    { "Entities[3]", 0, 0 },
+    { "Pos[1]", 1, 2 },
+    { "Pos[-1]", 1, 3 },
+    { "Pos[-4]", 0, 0 },
+    { ".Pos[*]", 1 + 1 + 1, 6 },
+    { "[Version >= 3].Version", 1, 0 },
+    { "[Version > 3.5]", 0, 0 },
+    { "[big > 9223372036854775807]", 1, 0 },
+    { "[big == -1]", 0, 0 },
+    { "[\"weird name.x\" == -1]", 1, 0 },
+    { "[Pos == 1]", 0, 0 },
+    { "[Pos != 1]", 1, 0 },
+    { "Version.x", 0, 0 },
+    { "", 1, 0 },
+  };
+
+  nbtx_node* fixture = query_fixture();
+  struct buffer raw = nbtx_dump_binary(fixture);
+  if (raw.data == NULL) die_with_err(errno);
+
+  for (size_t i = 0; i < sizeof cases / sizeof cases[0]; ++i) {
+    double sum;
+    if (run_query(fixture, raw, cases[i].text, 0, &sum) != cases[i].matches || sum != cases[i].sum) {
+      printf("\"%s\"", cases[i].text);
+      die("FAILED. A query found the wrong things.");
+    }
+  }
+
+  if (run_query(fixture, raw, "..*", 2, NULL) != 2)
+    die("FAILED. A query wasn't stopped.");
+
+  /* Truncated buffers are corrupt. */
+  nbtx_query* query = nbtx_query_compile("..*");
+  struct matches m = { { NULL, 0, 0 }, 0, 0, 0 };
+  if (query == NULL) die_with_err(errno);
+  if (nbtx_query_run_raw(query, raw.data, raw.len - 1, log_match, &m) != NBTX_ERR)
+    die("FAILED. A query ran on a truncated buffer.");
+  buffer_free(&m.log);
+  nbtx_query_free(query);
+
+  static const char* const malformed[] = {
+    "Entities[", "Entities]", "a b", "a..", "[x ==]", "[x = 1]", "[x == \"y]", "\"x",
+    "[-]", "Entities*", "a[0", "a.", "[*x]"
+  };
+
+  for (size_t i = 0; i < sizeof malformed / sizeof malformed[0]; ++i) {
+    if (nbtx_query_compile(malformed[i]) != NULL || errno != NBTX_ERR) {
+      printf("\"%s\"", malformed[i]);
+      die("FAILED. A malformed query compiled.");
+    }
+  }
+
+  buffer_free(&raw);
+  nbtx_free(fixture);
+
+  /* Everything below the root, in the same order as nbtx_map. */
+  raw = nbtx_dump_binary(tree);
+  if (raw.data == NULL) die_with_err(errno);
+
+  if (run_query(tree, raw, "..*", 0, NULL) != nbtx_size(tree) - 1)
+    die("FAILED. Recursive descent missed nodes.");
+
+  buffer_free(&raw);
+}
+
+/* Whether nbtx_peek_path found `node'. */
+static bool peeked(const nbtx_node* node, const nbtx_value* v) {
+  const size_t name_length = node->name ? strlen(node->name) : 0;
+
+  if (v->type != node->type || v->name_length != name_length ||
+      (name_length && memcmp(v->name, node->name, name_length) != 0))
+    return false;
+
+  switch (node->type) {
+    case NBTX_TAG_LIST:
+    case NBTX_TAG_COMPOUND:
+      return true;
+    case NBTX_TAG_STRING:
+      return v->length == strlen(node->payload.tag_string) &&
+             memcmp(v->data, node->payload.tag_string, v->length) == 0;
+    case NBTX_TAG_BYTE_ARRAY:
+      return v->length == node->payload.tag_byte_array.length &&
+             (v->length == 0 || memcmp(v->data, node->payload.tag_byte_array.data, v->length) == 0);
+    default:
+      return memcmp(v->data, &node->payload, v->length) == 0;
+  }
+}
+
+/* Peeks at the paths to the first nodes of `tree' in `raw', which has to be its dump. */
+static void check_peek_paths(const nbtx_node* tree, const struct buffer raw) {
+  char path[4096];
+  size_t lengths[64] = { 0 };
+  size_t checked = 0;
+
+  nbtx_value v;
+  nbtx_cursor c;
+  nbtx_cursor_event e;
+
+  nbtx_cursor_init(&c, (nbtx_node*)tree);
+  while (checked < 1000 && (e = nbtx_cursor_next(&c)) > NBTX_CURSOR_END) {
+    if (e == NBTX_CURSOR_LEAVE) continue;
+
+    const char* name = c.node->name ? c.node->name : "";
+    const size_t at = lengths[c.depth];
+
+    if (c.depth + 1 >= sizeof lengths / sizeof lengths[0] || at + strlen(name) + 2 > sizeof path) {
+      nbtx_cursor_skip_children(&c);
+      continue;
+    }
+
+    snprintf(path + at, sizeof path - at, "%s%s", c.depth ? "." : "", name);
+    lengths[c.depth + 1] = strlen(path);
+
+    /* Names with dots in them can't be looked up by either. */
+    const nbtx_node* found = nbtx_find_by_path((nbtx_node*)tree, path);
+    const nbtx_status status = nbtx_peek_path(raw.data, raw.len, path, &v);
+
+    if (status != (found ? NBTX_OK : NBTX_ENOTFOUND) || (found && !peeked(found, &v))) {
+      printf("\"%s\"", path);
+      die("FAILED. nbtx_peek_path and nbtx_find_by_path disagree.");
+    }
+
+    checked++;
+  }
+  nbtx_cursor_free(&c);
+}
+
+static void check_peek(const nbtx_node* tree) {
+  nbtx_node* fixture = query_fixture();
+  struct buffer raw = nbtx_dump_binary(fixture);
+  if (raw.data == NULL) die_with_err(errno);
+
+  nbtx_value v;
+  int64_t l;
+  double d;
+
+  if (nbtx_peek_path(raw.data, raw.len, "level.Version", &v) != NBTX_OK ||
+      !nbtx_value_to_long(&v, &l) || l != 3 || !nbtx_value_to_double(&v, &d) || d != 3)
+    die("FAILED. Couldn't peek at a number.");
+
+  if (nbtx_peek_path(raw.data, raw.len, "level.Entities..id", &v) != NBTX_OK ||
+      v.type != NBTX_TAG_STRING || v.length != 6 || memcmp(v.data, "zombie", 6) != 0 ||
+      nbtx_value_to_long(&v, &l))
+    die("FAILED. Couldn't peek at a string.");
+
+  /* Only the third entity has passengers, so the first two are gone past. */
+  if (nbtx_peek_path(raw.data, raw.len, "level.Entities..Passengers..Health", &v) != NBTX_OK ||
+      !nbtx_value_to_double(&v, &d) || d != 1)
+    die("FAILED. Couldn't peek past members that don't lead anywhere.");
+
+  if (nbtx_peek_path(raw.data, raw.len, "level.big", &v) != NBTX_OK ||
+      !nbtx_value_to_long(&v, &l) || l != INT64_MAX)
+    die("FAILED. A big number wasn't clamped.");
+
+  if (nbtx_peek_path(raw.data, raw.len, "level", &v) != NBTX_OK || v.type != NBTX_TAG_COMPOUND ||
+      (const char*)v.data + v.length != (const char*)raw.data + raw.len)
+    die("FAILED. Couldn't peek at the root.");
+
+  if (nbtx_peek_path(raw.data, raw.len, "level.nope", &v) != NBTX_ENOTFOUND ||
+      nbtx_peek_path(raw.data, raw.len, "other.Version", &v) != NBTX_ENOTFOUND ||
+      nbtx_peek_path(raw.data, raw.len, "level.Version.x", &v) != NBTX_ENOTFOUND)
+    die("FAILED. Peeked at something that isn't there.");
+
+  if (nbtx_peek_path(raw.data, raw.len - 1, "level.nope", &v) != NBTX_ERR)
+    die("FAILED. Peeked into a truncated buffer.");
+
+  buffer_free(&raw);
+  nbtx_free(fixture);
+
+  /* Members in the way that nest too deeply can't be jumped over... */
+  struct buffer deep = deep_member((size_t)1 << 20);
+  const int32_t seven = 7;
+  v = (nbtx_value) { NBTX_TAG_INT, NULL, 0, &seven, sizeof seven, NULL };
+
+  if (nbtx_peek_path(deep.data, deep.len, ".v", &v) != NBTX_EDEPTH ||
+      nbtx_poke_path(deep.data, deep.len, ".v", &v) != NBTX_EDEPTH ||
+      nbtx_peek_path(deep.data, deep.len, ".deep", &v) != NBTX_EDEPTH)
+    die("FAILED. Peeked past a member nested too deeply.");
+
+  /* ...unless there's no limit. */
+  nbtx_set_max_depth(0);
+  if (nbtx_peek_path(deep.data, deep.len, ".v", &v) != NBTX_OK ||
+      !nbtx_value_to_long(&v, &l) || l != 7)
+    die("FAILED. Couldn't peek past a deep member.");
+  nbtx_set_max_depth(NBTX_DEFAULT_MAX_DEPTH);
+
+  buffer_free(&deep);
+
+  /* Paths to the first nodes of the tree lead to what nbtx_find_by_path finds. */
+  raw = nbtx_dump_binary(tree);
+  if (raw.data == NULL) die_with_err(errno);
+
+  check_peek_paths(tree, raw);
+  buffer_free(&raw);
+}
+
+/* Whether `raw' parses to a tree equal to `expected'. */
+static bool parses_to(const struct buffer raw, const nbtx_node* expected) {
+  nbtx_node* parsed = nbtx_parse(raw.data, raw.len);
+  if (parsed == NULL) die_with_err(errno);
+
+  const bool ret = nbtx_eq(parsed, expected);
+  nbtx_free(parsed);
+  return ret;
+}
+
+static void check_poke(void) {
+  nbtx_node* fixture = query_fixture();
+  struct buffer raw = nbtx_dump_binary(fixture);
+  if (raw.data == NULL) die_with_err(errno);
+
+  const int32_t version = 4;
+  const int64_t wrong = 4;
+  nbtx_value v = { NBTX_TAG_INT, NULL, 0, &version, sizeof version, NULL };
+
+  if (nbtx_poke_path(raw.data, raw.len, "level.Version", &v) != NBTX_OK)
+    die("FAILED. Couldn't poke a number.");
+  added(nbtx_put_int(fixture, "Version", version));
+
+  v = (nbtx_value) { NBTX_TAG_STRING, NULL, 0, "walker", 6, NULL };
+  if (nbtx_poke_path(raw.data, raw.len, "level.Entities..id", &v) != NBTX_OK)
+    die("FAILED. Couldn't poke a string of the same length.");
+  added(nbtx_put_string(nbtx_list_item(nbtx_find_by_path(fixture, "level.Entities"), 0), "id", "walker"));
+
+  if (!parses_to(raw, fixture))
+    die("FAILED. Poking didn't change the right things.");
+
+  v = (nbtx_value) { NBTX_TAG_LONG, NULL, 0, &wrong, sizeof wrong, NULL };
+  if (nbtx_poke_path(raw.data, raw.len, "level.Version", &v) != NBTX_ERR)
+    die("FAILED. Poked a number of another type.");
+
+  v = (nbtx_value) { NBTX_TAG_STRING, NULL, 0, "creeper", 7, NULL };
+  if (nbtx_poke_path(raw.data, raw.len, "level.Entities..id", &v) != NBTX_ERR)
+    die("FAILED. Poked a longer string.");
+  if (nbtx_poke_path(raw.data, raw.len, "level.nope", &v) != NBTX_ENOTFOUND)
+    die("FAILED. Poked something that isn't there.");
+
+  /* Splicing grows and shrinks the rest, and can change the type of members. */
+  if (nbtx_splice_path(&raw, "level.Entities..id", &v) != NBTX_OK)
+    die("FAILED. Couldn't splice in a longer string.");
+  added(nbtx_put_string(nbtx_list_item(nbtx_find_by_path(fixture, "level.Entities"), 0), "id", "creeper"));
+
+  v = (nbtx_value) { NBTX_TAG_STRING, NULL, 0, "v4", 2, NULL };
+  if (nbtx_splice_path(&raw, "level.Version", &v) != NBTX_OK)
+    die("FAILED. Couldn't splice in a value of another type.");
+  added(nbtx_put_string(fixture, "Version", "v4"));
+
+  if (!parses_to(raw, fixture))
+    die("FAILED. Splicing didn't change the right things.");
+
+  /* Whole lists come from elsewhere. */
+  nbtx_node* other = nbtx_new_compound("other");
+  if (other == NULL) die_with_err(errno);
+  nbtx_node* ints = added(nbtx_put_list(other, "ints", nbtx_new_tag_list_payload(NBTX_TAG_INT)));
+  for (int i = 0; i < 100; ++i)
+    added(nbtx_put_int(ints, NULL, i));
+
+  struct buffer from = nbtx_dump_binary(other);
+  if (from.data == NULL) die_with_err(errno);
+  if (nbtx_peek_path(from.data, from.len, "other.ints", &v) != NBTX_OK)
+    die("FAILED. Couldn't peek at a list.");
+  if (nbtx_splice_path(&raw, "level.Pos", &v) != NBTX_OK)
+    die("FAILED. Couldn't splice in a list.");
+  added(nbtx_put_list(fixture, "Pos", nbtx_extract_tag_list_payload(nbtx_clone(ints))));
+
+  if (!parses_to(raw, fixture))
+    die("FAILED. Splicing in a list went wrong.");
+
+  /* Elements keep the type of their list, and lists have to be whole. */
+  const double d = 1;
+  v = (nbtx_value) { NBTX_TAG_DOUBLE, NULL, 0, &d, sizeof d, NULL };
+  if (nbtx_splice_path(&raw, "level.Pos.", &v) != NBTX_ERR)
+    die("FAILED. Spliced an element of the wrong type into a list.");
+
+  if (nbtx_peek_path(from.data, from.len, "other.ints", &v) != NBTX_OK)
+    die("FAILED. Couldn't peek at a list.");
+  v.length--;
+  if (nbtx_splice_path(&raw, "level.Pos", &v) != NBTX_ERR || !parses_to(raw, fixture))
+    die("FAILED. Spliced in a truncated list.");
+
+  buffer_free(&from);
+  buffer_free(&raw);
+  nbtx_free(other);
+  nbtx_free(fixture);
+}
+
+/* A tree with containers big enough to be indexed. */
+static nbtx_node* index_fixture(void) {
+  nbtx_node* root = nbtx_new_compound("big");
+  if (root == NULL) die_with_err(errno);
+
+  char name[16];
+  for (int i = 0; i < 1000; ++i) {
+    snprintf(name, sizeof name, "m%d", i);
+    added(nbtx_put_int(root, name, i));
+  }
+
+  nbtx_node* list = added(nbtx_put_list(root, "list", nbtx_new_tag_list_payload(NBTX_TAG_COMPOUND)));
+  for (int i = 0; i < 1000; ++i)
+    added(nbtx_put_int(added(nbtx_put_compound(list, NULL, nbtx_new_tag_compound_payload())), "i", i));
+
+  nbtx_node* names = added(nbtx_put_list(root, "names", nbtx_new_tag_list_payload(NBTX_TAG_STRING)));
+  for (int i = 0; i < 100; ++i) {
+    snprintf(name, sizeof name, "n%d", i);
+    added(nbtx_put_string(names, NULL, name));
+  }
+
+  /* Few members, but too many bytes to skip. */
+  static unsigned char blob[8192];
+  nbtx_node* blobs = added(nbtx_put_compound(root, "blobs", nbtx_new_tag_compound_payload()));
+  added(nbtx_put_byte_array(blobs, "blob", blob, sizeof blob));
+  added(nbtx_put_int(blobs, "after", 1));
+
+  return root;
+}
+
+/* Breaks the type byte of the member peeked at by `path', without touching its neighbours. */
+static void corrupt_member(const struct buffer raw, const char* path) {
+  nbtx_value v;
+  if (nbtx_peek_path(raw.data, raw.len, path, &v) != NBTX_OK)
+    die("FAILED. Couldn't peek at a member to corrupt.");
+
+  ((unsigned char*)raw.data)[(const unsigned char*)v.name - 3 - (const unsigned char*)raw.data] = 0xee;
+}
+
+static void check_index(const nbtx_node* tree) {
+  struct buffer plain = nbtx_dump_binary(tree);
+  struct buffer indexed = nbtx_dump_binary_indexed(tree);
+  if (plain.data == NULL || indexed.data == NULL) die_with_err(errno);
+
+  /* The index only ever trails a plain dump, which readers that don't know about it still read. */
+  if (indexed.len <= plain.len || memcmp(indexed.data, plain.data, plain.len) != 0 || !parses_to(indexed, tree))
+    die("FAILED. The index didn't come after a plain dump.");
+
+  check_peek_paths(tree, indexed);
+  if (run_query(tree, indexed, "..*", 0, NULL) != nbtx_size(tree) - 1)
+    die("FAILED. Recursive descent missed nodes in an indexed dump.");
+
+  buffer_free(&indexed);
+  buffer_free(&plain);
+
+  static const struct { const char* text; size_t matches; } cases[] = {
+    { "m999", 1 }, { "m0", 1 }, { "m1000", 0 }, { "[m500 == 500].m999", 1 },
+    { "list[777].i", 1 }, { "list[-1].i", 1 }, { "list[1000]", 0 }, { "list[*][i >= 990]", 10 },
+    { "names[99]", 1 }, { "names[31]", 1 }, { "names[32]", 1 }, { "..i", 1000 },
+    { "blobs.after", 1 },
+  };
+
+  nbtx_node* fixture = index_fixture();
+  plain = nbtx_dump_binary(fixture);
+  indexed = nbtx_dump_binary_indexed(fixture);
+  if (plain.data == NULL || indexed.data == NULL) die_with_err(errno);
+
+  for (size_t i = 0; i < sizeof cases / sizeof cases[0]; ++i) {
+    if (run_query(fixture, plain, cases[i].text, 0, NULL) != cases[i].matches ||
+        run_query(fixture, indexed, cases[i].text, 0, NULL) != cases[i].matches) {
+      printf("\"%s\"", cases[i].text);
+      die("FAILED. A query found the wrong things in an indexed dump.");
+    }
+  }
+
+  check_peek_paths(fixture, indexed);
+
+  /*
+   * Lookups through the index never look at what comes before their target,
+   * so breaking an earlier member only shows in the plain dump.
+   */
+  corrupt_member(plain, "big.blobs.blob");
+  corrupt_member(indexed, "big.blobs.blob");
+  corrupt_member(plain, "big.list..i");
+  corrupt_member(indexed, "big.list..i");
+  corrupt_member(plain, "big.m1");
+  corrupt_member(indexed, "big.m1");
+
+  nbtx_value v;
+  int64_t l;
+
+  if (nbtx_peek_path(plain.data, plain.len, "big.m999", &v) != NBTX_ERR)
+    die("FAILED. Peeked past a corrupt member.");
+  if (nbtx_peek_path(indexed.data, indexed.len, "big.m999", &v) != NBTX_OK ||
+      !nbtx_value_to_long(&v, &l) || l != 999)
+    die("FAILED. A peek didn't use the index.");
+  if (nbtx_peek_path(indexed.data, indexed.len, "big.blobs.after", &v) != NBTX_OK)
+    die("FAILED. A compound with big members wasn't indexed.");
+
+  nbtx_query* query = nbtx_query_compile("list[777].i");
+  struct matches m = { { NULL, 0, 0 }, 0, 0, 0 };
+  if (query == NULL) die_with_err(errno);
+
+  if (nbtx_query_run_raw(query, plain.data, plain.len, log_match, &m) != NBTX_ERR)
+    die("FAILED. A query went past a corrupt element.");
+  if (nbtx_query_run_raw(query, indexed.data, indexed.len, log_match, &m) != NBTX_OK || m.count != 1)
+    die("FAILED. A query didn't use the index.");
+
+  buffer_free(&m.log);
+  nbtx_query_free(query);
+  buffer_free(&indexed);
+  buffer_free(&plain);
+
+  /* Splicing leaves a plain dump behind, since the offsets in the index would be stale. */
+  indexed = nbtx_dump_binary_indexed(fixture);
+  if (indexed.data == NULL) die_with_err(errno);
+
+  v = (nbtx_value) { NBTX_TAG_STRING, NULL, 0, "zero", 4, NULL };
+  if (nbtx_splice_path(&indexed, "big.m0", &v) != NBTX_OK)
+    die("FAILED. Couldn't splice into an indexed dump.");
+  added(nbtx_put_string(fixture, "m0", "zero"));
+
+  plain = nbtx_dump_binary(fixture);
+  if (plain.data == NULL) die_with_err(errno);
+
+  if (indexed.len != plain.len || memcmp(indexed.data, plain.data, plain.len) != 0)
+    die("FAILED. Splicing didn't drop the index.");
+
+  if (nbtx_peek_path(indexed.data, indexed.len, "big.m999", &v) != NBTX_OK ||
+      !nbtx_value_to_long(&v, &l) || l != 999)
+    die("FAILED. Couldn't peek after splicing.");
+
+  buffer_free(&indexed);
+  buffer_free(&plain);
+  nbtx_free(fixture);
+}
+
+/* Puts strings and byte arrays into a new compound. Returns false as soon as one fails. */
+static bool put_copies(nbtx_node** out) {
+  static unsigned char bytes[] = { 1, 2, 3 };
+
+  *out = nbtx_new_compound("root");
+  return *out &&
+         nbtx_put_string(*out, "string", "value").reference &&
+         nbtx_put_byte_array(*out, "bytes", bytes, sizeof bytes).reference &&
+         nbtx_put_byte_array(*out, "empty", bytes, 0).reference &&
+         nbtx_put_string(*out, "string", "replaced").reference &&
+         nbtx_put_string(*out, "bytes", "replaced").reference;
+}
+
+/* The cached dump and hash of `tree' must match those of a tree parsed from scratch. */
+static void check_caches_fresh(nbtx_node* tree) {
+  struct buffer plain = nbtx_dump_binary(tree);
+  struct buffer cached = nbtx_dump_binary_cached(tree);
+  if (plain.data == NULL || cached.data == NULL) die_with_err(errno);
+  check_same_bytes(plain, cached);
+
+  nbtx_node* fresh = nbtx_parse(plain.data, plain.len);
+  if (fresh == NULL) die_with_err(errno);
+
+  if (nbtx_hash(tree) != nbtx_hash(fresh))
+    die("FAILED. A stale hash survived an extraction.");
+  if (!nbtx_eq(tree, fresh))
+    die("FAILED. An extracted tree isn't equal to its own dump.");
+
+  nbtx_free(fresh);
+  buffer_free(&cached);
+  buffer_free(&plain);
+}
+
+/* Extracting from a leaf must invalidate what the containers above cached. */
+static void check_extract_invalidates(void) {
+  static unsigned char blob[4096];
+  char* taken;
+
+  nbtx_node* root = nbtx_new_compound("root");
+  if (root == NULL) die_with_err(errno);
+
+  nbtx_node* inner = added(nbtx_put_compound(root, "inner", nbtx_new_tag_compound_payload()));
+  nbtx_node* array = added(nbtx_put_byte_array(inner, "bytes", blob, sizeof blob));
+  nbtx_node* text = added(nbtx_put_string(inner, "text", "some text"));
+  nbtx_node* names = added(nbtx_put_list(root, "names", nbtx_new_tag_list_payload(NBTX_TAG_STRING)));
+  nbtx_node* name = added(nbtx_put_string(names, NULL, "a name"));
+  added(nbtx_put_byte_array(root, "padding", blob, sizeof blob));
+
+  check_caches_fresh(root);
+
+  nbtx_free_memory(nbtx_extract_byte_array(array, NULL));
+  check_caches_fresh(root);
+
+  if ((taken = nbtx_extract_string(text)) == NULL) die_with_err(errno);
+  nbtx_free_memory(taken);
+  check_caches_fresh(root);
+
+  if ((taken = nbtx_extract_string(name)) == NULL) die_with_err(errno);
+  nbtx_free_memory(taken);
+  check_caches_fresh(root);
+
+  nbtx_free(root);
+}
+
+/* Cached dumps must copy what didn't change from the right place, however things moved. */
+static void check_cached_spans(void) {
+  static unsigned char blob[4096];
+
+  nbtx_node* root = nbtx_new_compound("root");
+  if (root == NULL) die_with_err(errno);
+
+  nbtx_node* first = added(nbtx_put_compound(root, "first", nbtx_new_tag_compound_payload()));
+  nbtx_node* a = added(nbtx_put_compound(root, "a", nbtx_new_tag_compound_payload()));
+  nbtx_node* a1 = added(nbtx_put_compound(a, "a1", nbtx_new_tag_compound_payload()));
+  added(nbtx_put_byte_array(a1, "blob", blob, sizeof blob));
+  nbtx_node* b = added(nbtx_put_compound(root, "b", nbtx_new_tag_compound_payload()));
+  nbtx_node* b1 = added(nbtx_put_compound(b, "b1", nbtx_new_tag_compound_payload()));
+  added(nbtx_put_byte_array(b1, "blob", blob, sizeof blob));
+
+  check_caches_fresh(root);
+
+  /* Everything after `first' moves. */
+  added(nbtx_put_string(first, "grown", "a few bytes longer"));
+  check_caches_fresh(root);
+
+  added(nbtx_put_string(a1, "dirty", "yes"));
+  check_caches_fresh(root);
+
+  added(nbtx_put_string(b1, "dirty", "yes"));
+  check_caches_fresh(root);
+
+  /* `a1' shows up twice now, and only one of its places moves next. */
+  nbtx_node* clone = nbtx_clone_shared(a);
+  if (clone == NULL) die_with_err(errno);
+  added(nbtx_put_compound(root, "a2", nbtx_extract_tag_compound_payload(clone)));
+  check_caches_fresh(root);
+
+  added(nbtx_put_string(b, "dirty", "yes"));
+  check_caches_fresh(root);
+
+  added(nbtx_put_string(first, "grown", "shorter"));
+  check_caches_fresh(root);
+
+  nbtx_free(root);
+}
+
+static void check_take(void) {
+  nbtx_node* root = nbtx_new_compound("root");
+  if (root == NULL) die_with_err(errno);
+
+  unsigned char* bytes = nbtx_alloc_memory(1 << 16);
+  char* string = nbtx_alloc_memory(6);
+  if (bytes == NULL || string == NULL) die_with_err(NBTX_EMEM);
+
+  for (int i = 0; i < 1 << 16; ++i)
+    bytes[i] = (unsigned char)i;
+  memcpy(string, "taken", 6);
+
+  /* The nodes adopt the storage as it is. */
+  nbtx_node* array = added(nbtx_put_byte_array_take(root, "bytes", bytes, 1 << 16));
+  nbtx_node* text = added(nbtx_put_string_take(root, "string", string));
+
+  if (array->payload.tag_byte_array.data != bytes || text->payload.tag_string != string)
+    die("FAILED. Taken storage was copied.");
+
+  /* And hand it back without copying, staying in the tree. */
+  uint32_t length;
+  if (nbtx_extract_byte_array(array, &length) != bytes || length != 1 << 16 ||
+      array->payload.tag_byte_array.length != 0 || nbtx_list_item(root, 0) != array)
+    die("FAILED. Couldn't extract a byte array.");
+  if (nbtx_extract_string(text) != string || strcmp(text->payload.tag_string, "") != 0)
+    die("FAILED. Couldn't extract a string.");
+
+  /* Storage can go back and forth between trees. */
+  nbtx_node* copy = nbtx_clone(root);
+  if (copy == NULL) die_with_err(errno);
+
+  added(nbtx_put_byte_array_take(copy, "bytes", bytes, 1 << 16));
+  added(nbtx_put_string_take(copy, "string", string));
+
+  nbtx_node* expected = nbtx_new_compound("root");
+  if (expected == NULL) die_with_err(errno);
+  added(nbtx_put_byte_array(expected, "bytes", bytes, 1 << 16));
+  added(nbtx_put_string(expected, "string", "taken"));
+
+  if (!nbtx_eq(copy, expected))
+    die("FAILED. Taken storage didn't end up in the tree.");
+
+  /* Shared nodes are left alone, and the caller gets a copy. */
+  nbtx_node* shared = nbtx_clone_shared(copy);
+  if (shared == NULL) die_with_err(errno);
+
+  array = nbtx_find_by_path(shared, "root.bytes");
+  text = nbtx_find_by_path(shared, "root.string");
+
+  unsigned char* copied_bytes = nbtx_extract_byte_array(array, &length);
+  char* copied_string = nbtx_extract_string(text);
+
+  if (copied_bytes == NULL || copied_bytes == bytes || length != 1 << 16 ||
+      memcmp(copied_bytes, bytes, length) != 0 || array->payload.tag_byte_array.data != bytes)
+    die("FAILED. A shared byte array was extracted.");
+  if (copied_string == NULL || copied_string == string || strcmp(copied_string, "taken") != 0 ||
+      text->payload.tag_string != string)
+    die("FAILED. A shared string was extracted.");
+
+  nbtx_free_memory(copied_bytes);
+  nbtx_free_memory(copied_string);
+
+  /* What can't be put still belongs to the caller. */
+  string = nbtx_alloc_memory(1);
+  if (string == NULL) die_with_err(NBTX_EMEM);
+  string[0] = '\0';
+
+  nbtx_node* inner = added(nbtx_put_compound(copy, "inner", nbtx_new_tag_compound_payload()));
+  nbtx_node* sharing = nbtx_clone_shared(copy);
+  if (sharing == NULL) die_with_err(errno);
+
+  if (nbtx_put_string_take(inner, "string", string).reference != NULL || errno != NBTX_ERR)
+    die("FAILED. Put into a shared compound.");
+
+  /* Deep clones share nothing, so whatever is found in them can be put into. */
+  nbtx_node* deep = nbtx_clone(copy);
+  if (deep == NULL) die_with_err(errno);
+  added(nbtx_put_int(nbtx_find_by_name(deep, "inner"), "deep", 1));
+  if (nbtx_find_by_path(copy, "root.inner.deep") != NULL)
+    die("FAILED. Putting into a deep clone changed the original.");
+  nbtx_free(deep);
+  if (nbtx_extract_string(nbtx_find_by_path(shared, "root.bytes")) != NULL || errno != NBTX_ERR)
+    die("FAILED. Extracted a string from a byte array.");
+
+  nbtx_free_memory(string);
+  nbtx_free(sharing);
+  nbtx_free(shared);
+  nbtx_free(expected);
+  nbtx_free(copy);
+  nbtx_free(root);
+
+  check_extract_invalidates();
+  check_cached_spans();
+
+  /* Running out of memory in any put fails cleanly. */
+  struct counting_allocator a = { 0, 0, 0, SIZE_MAX };
+  nbtx_allocator allocator = { counting_malloc, counting_realloc, counting_free, &a };
+  nbtx_node* tree;
+
+  if (nbtx_set_allocator(&allocator) != NBTX_OK) die("FAILED. The allocator was refused.");
+  if (!put_copies(&tree)) die_with_err(errno);
+  nbtx_free(tree);
+
+  const size_t needed = a.allocations;
+  for (size_t budget = 0; budget < needed; ++budget) {
+    a = (struct counting_allocator) { 0, 0, 0, budget };
+
+    if (put_copies(&tree) || errno != NBTX_EMEM)
+      die("FAILED. A put worked without enough memory.");
+    nbtx_free(tree);
+
+    if (a.outstanding != 0)
+      die("FAILED. Memory leaked after running out of it.");
+  }
+
+  nbtx_set_allocator(NULL);
+}
+
+/* Writes `tree' with a writer, the way a program would describe it. */
+static nbtx_status write_tree(nbtx_writer* w, nbtx_node* tree) {
+  nbtx_cursor c;
+  nbtx_cursor_event e;
+  nbtx_status err = NBTX_OK;
+
+  nbtx_cursor_init(&c, tree);
+  while (err == NBTX_OK && (e = nbtx_cursor_next(&c)) > NBTX_CURSOR_END) {
+    const nbtx_node* n = c.node;
+
+    if (e == NBTX_CURSOR_LEAVE) {
+      err = nbtx_writer_end(w);
+      continue;
+    }
+
+    switch (n->type) {
+      case NBTX_TAG_BYTE:           err = nbtx_writer_write_byte(w, n->name, n->payload.tag_byte); break;
+      case NBTX_TAG_UNSIGNED_BYTE:  err = nbtx_writer_write_ubyte(w, n->name, n->payload.tag_ubyte); break;
+      case NBTX_TAG_SHORT:          err = nbtx_writer_write_short(w, n->name, n->payload.tag_short); break;
+      case NBTX_TAG_UNSIGNED_SHORT: err = nbtx_writer_write_ushort(w, n->name, n->payload.tag_ushort); break;
+      case NBTX_TAG_INT:            err = nbtx_writer_write_int(w, n->name, n->payload.tag_int); break;
+      case NBTX_TAG_UNSIGNED_INT:   err = nbtx_writer_write_uint(w, n->name, n->payload.tag_uint); break;
+      case NBTX_TAG_LONG:           err = nbtx_writer_write_long(w, n->name, n->payload.tag_long); break;
+      case NBTX_TAG_UNSIGNED_LONG:  err = nbtx_writer_write_ulong(w, n->name, n->payload.tag_ulong); break;
+      case NBTX_TAG_FLOAT:          err = nbtx_writer_write_float(w, n->name, n->payload.tag_float); break;
+      case NBTX_TAG_DOUBLE:         err = nbtx_writer_write_double(w, n->name, n->payload.tag_double); break;
+      case NBTX_TAG_STRING:         err = nbtx_writer_write_string(w, n->name, n->payload.tag_string); break;
+      case NBTX_TAG_COMPOUND:       err = nbtx_writer_begin_compound(w, n->name); break;
+
+      case NBTX_TAG_BYTE_ARRAY:
+        err = nbtx_writer_write_byte_array(w, n->name, n->payload.tag_byte_array.data,
+                                           n->payload.tag_byte_array.length);
+        break;
+
+      case NBTX_TAG_LIST: {
+        const struct list_head* entries = &n->payload.tag_list->entry;
+        const nbtx_type type = list_empty(entries)
+          ? n->payload.tag_list->data->type
+          : list_entry(entries->flink, struct nbtx_list, entry)->data->type;
+
+        err = nbtx_writer_begin_list(w, n->name, type, (uint32_t)list_length(entries));
+        break;
+      }
+
+      default:
+        die("FAILED. The tree has a tag of no known type.");
+    }
+  }
+  nbtx_cursor_free(&c);
+
+  if (err == NBTX_OK && e == NBTX_CURSOR_ERROR)
+    die_with_err(errno);
+  return err;
+}
+
+static void check_writer(nbtx_node* tree) {
+  struct buffer expected = nbtx_dump_binary(tree);
+  struct buffer out = NBTX_BUFFER_INIT;
+  size_t length;
+
+  if (expected.data == NULL) die_with_err(errno);
+
+  /* Writing a tree gives what dumping it does, any number of times. */
+  nbtx_writer* w = nbtx_writer_new(&out);
+  if (w == NULL) die_with_err(errno);
+
+  for (int i = 0; i < 2; ++i) {
+    if (write_tree(w, tree) != NBTX_OK || nbtx_writer_finish(w, &length) != NBTX_OK)
+      die("FAILED. Couldn't write a tree.");
+    if (length != expected.len || out.len != (i + 1) * expected.len)
+      die("FAILED. A writer wrote too much or too little.");
+  }
+
+  if (memcmp(out.data, expected.data, expected.len) != 0 ||
+      memcmp(out.data + expected.len, expected.data, expected.len) != 0)
+    die("FAILED. Writing a tree and dumping it differ.");
+
+  /* Unfinished trees are taken back. */
+  if (nbtx_writer_begin_compound(w, "root") != NBTX_OK ||
+      nbtx_writer_write_int(w, "x", 1) != NBTX_OK ||
+      nbtx_writer_finish(w, &length) != NBTX_ERR || out.len != 2 * expected.len)
+    die("FAILED. An unfinished tree was kept.");
+
+  nbtx_writer_free(w);
+  buffer_free(&out);
+
+  /* Into the caller's memory, which may be just big enough. */
+  unsigned char* memory = malloc(expected.len);
+  if (memory == NULL) die_with_err(NBTX_EMEM);
+
+  w = nbtx_writer_new_fixed(memory, expected.len);
+  if (w == NULL) die_with_err(errno);
+
+  if (write_tree(w, tree) != NBTX_OK || nbtx_writer_finish(w, &length) != NBTX_OK || length != expected.len)
+    die("FAILED. Couldn't write a tree into memory.");
+  if (memcmp(memory, expected.data, length) != 0)
+    die("FAILED. Writing a tree into memory and dumping it differ.");
+
+  if (write_tree(w, tree) != NBTX_EMEM || nbtx_writer_finish(w, NULL) != NBTX_EMEM)
+    die("FAILED. A writer wrote past the end of its memory.");
+
+  nbtx_writer_free(w);
+  free(memory);
+
+  /* Compressed, one tree after the other. */
+  w = nbtx_writer_new_compressed(&out, NBTX_STRATEGY_GZIP);
+  if (w == NULL) die_with_err(errno);
+
+  size_t first;
+  if (write_tree(w, tree) != NBTX_OK || nbtx_writer_finish(w, &first) != NBTX_OK ||
+      write_tree(w, tree) != NBTX_OK || nbtx_writer_finish(w, &length) != NBTX_OK ||
+      first + length != out.len)
+    die("FAILED. Couldn't write a compressed tree.");
+
+  for (size_t at = 0; at < out.len; at += first) {
+    nbtx_node* parsed = nbtx_parse_compressed(out.data + at, at ? length : first);
+    if (parsed == NULL) die_with_err(errno);
+
+    if (!nbtx_eq(parsed, tree))
+      die("FAILED. A compressed tree didn't come back the same.");
+    nbtx_free(parsed);
+  }
+
+  nbtx_writer_free(w);
+  buffer_free(&out);
+  buffer_free(&expected);
+}
+
+/* Things a writer won't write. Each begins a new tree. */
+static void check_writer_errors(void) {
+  struct buffer out = NBTX_BUFFER_INIT;
+  nbtx_writer* w = nbtx_writer_new(&out);
+  if (w == NULL) die_with_err(errno);
+
+  const int32_t ints[] = { 1, 2, 3 };
+
+  /* Elements have to be of the list's type, and as many as it said. */
+  nbtx_writer_begin_compound(w, NULL);
+  nbtx_writer_begin_list(w, "l", NBTX_TAG_INT, 2);
+  nbtx_writer_write_int(w, NULL, 1);
+  if (nbtx_writer_write_short(w, NULL, 2) != NBTX_ERR || nbtx_writer_write_int(w, NULL, 2) != NBTX_ERR ||
+      nbtx_writer_finish(w, NULL) != NBTX_ERR)
+    die("FAILED. A list got an element of the wrong type.");
+
+  nbtx_writer_begin_compound(w, NULL);
+  nbtx_writer_begin_list(w, "l", NBTX_TAG_INT, 1);
+  if (nbtx_writer_end(w) != NBTX_ERR || nbtx_writer_finish(w, NULL) != NBTX_ERR)
+    die("FAILED. A list was ended too early.");
+
+  nbtx_writer_begin_compound(w, NULL);
+  nbtx_writer_begin_list(w, "l", NBTX_TAG_INT, 1);
+  nbtx_writer_write_int(w, NULL, 1);
+  if (nbtx_writer_write_int(w, NULL, 2) != NBTX_ERR || nbtx_writer_finish(w, NULL) != NBTX_ERR)
+    die("FAILED. A list got too many elements.");
+
+  /* Members need names, and trees have one root and end. */
+  nbtx_writer_begin_compound(w, NULL);
+  if (nbtx_writer_write_int(w, NULL, 1) != NBTX_ERR || nbtx_writer_finish(w, NULL) != NBTX_ERR)
+    die("FAILED. A member had no name.");
+
+  nbtx_writer_write_int(w, "a", 1);
+  if (nbtx_writer_write_int(w, "b", 1) != NBTX_ERR || nbtx_writer_finish(w, NULL) != NBTX_ERR)
+    die("FAILED. A tree had two roots.");
+
+  if (nbtx_writer_end(w) != NBTX_ERR || nbtx_writer_finish(w, NULL) != NBTX_ERR)
+    die("FAILED. Ended nothing.");
+
+  if (nbtx_writer_finish(w, NULL) != NBTX_ERR)
+    die("FAILED. Finished an empty tree.");
+
+  if (out.len != 0)
+    die("FAILED. Broken trees were kept.");
+
+  /* Lists of numbers can be written at once. */
+  nbtx_node* expected = nbtx_new_compound("root");
+  if (expected == NULL) die_with_err(errno);
+  nbtx_node* list = added(nbtx_put_list(expected, "ints", nbtx_new_tag_list_payload(NBTX_TAG_INT)));
+  for (size_t i = 0; i < sizeof ints / sizeof ints[0]; ++i)
+    added(nbtx_put_int(list, NULL, ints[i]));
+  added(nbtx_put_list(expected, "none", nbtx_new_tag_list_payload(NBTX_TAG_STRING)));
+
+  if (nbtx_writer_begin_compound(w, "root") != NBTX_OK ||
+      nbtx_writer_write_list(w, "ints", NBTX_TAG_INT, ints, 3) != NBTX_OK ||
+      nbtx_writer_begin_list(w, "none", NBTX_TAG_STRING, 0) != NBTX_OK ||
+      nbtx_writer_end(w) != NBTX_OK ||
+      nbtx_writer_end(w) != NBTX_OK ||
+      nbtx_writer_finish(w, NULL) != NBTX_OK)
+    die("FAILED. Couldn't write a list of numbers.");
+
+  if (!parses_to(out, expected))
+    die("FAILED. A list of numbers was written wrong.");
+
+  if (nbtx_writer_write_list(w, "strings", NBTX_TAG_STRING, ints, 3) != NBTX_ERR)
+    die("FAILED. Wrote a list of strings at once.");
+
+  nbtx_free(expected);
+  nbtx_writer_free(w);
+  buffer_free(&out);
+}
+
+/*
+ * Puts 1000 members, and some of them again, into `compound' or `b'. Returns
+ * false if a put failed.
+ */
+static bool put_members(nbtx_node* compound, nbtx_compound_builder* b) {
+  char name[16];
+
+  for (int i = 0; i < 1000 + 10; ++i) {
+    snprintf(name, sizeof name, "m%d", i < 1000 ? i : (i - 1000) * 97);
+
+    const nbtx_result r = compound
+      ? (i % 2 ? nbtx_put_int(compound, name, i) : nbtx_put_string(compound, name, name))
+      : (i % 2 ? nbtx_compound_builder_put_int(b, name, i) : nbtx_compound_builder_put_string(b, name, name));
+
+    if (r.reference == NULL) return false;
+  }
+
+  return true;
+}
+
+static void check_builder(void) {
+  nbtx_node* expected = nbtx_new_compound("root");
+  if (expected == NULL || !put_members(expected, NULL)) die_with_err(errno);
+
+  for (size_t hint = 0; hint <= 2000; hint += 2000) {
+    nbtx_compound_builder* b = nbtx_compound_builder_new("root", hint);
+    if (b == NULL || !put_members(NULL, b)) die_with_err(errno);
+
+    nbtx_node* built = nbtx_compound_builder_finish(b);
+    if (!nbtx_eq(built, expected) || nbtx_size(built) != 1 + 1000)
+      die("FAILED. A builder and puts disagree.");
+
+    /* The last value, where the first one was. */
+    const nbtx_node* replaced = nbtx_list_item(built, 97);
+    if (strcmp(replaced->name, "m97") != 0 || replaced->type != NBTX_TAG_INT || replaced->payload.tag_int != 1001)
+      die("FAILED. A builder didn't resolve a duplicate like a put would.");
+
+    nbtx_free(built);
+  }
+
+  /* Without memory for finding duplicates quickly, they're found slowly. */
+  struct counting_allocator a = { 0, 0, 0, SIZE_MAX };
+  const nbtx_allocator allocator = { counting_malloc, counting_realloc, counting_free, &a };
+  if (nbtx_set_allocator(&allocator) != NBTX_OK) die("FAILED. The allocator was refused.");
+
+  nbtx_compound_builder* b = nbtx_compound_builder_new("root", 0);
+  if (b == NULL || !put_members(NULL, b)) die_with_err(errno);
+
+  a.budget = a.allocations;
+  nbtx_node* built = nbtx_compound_builder_finish(b);
+  a.budget = SIZE_MAX;
+
+  if (!nbtx_eq(built, expected))
+    die("FAILED. A builder without memory and puts disagree.");
+  nbtx_free(built);
+
+  /* Abandoned builders free what was built. */
+  b = nbtx_compound_builder_new("root", 10);
+  if (b == NULL || !put_members(NULL, b)) die_with_err(errno);
+  if (nbtx_compound_builder_put_int(b, NULL, 1).reference != NULL || errno != NBTX_ERR)
+    die("FAILED. A builder put a member without a name.");
+  nbtx_compound_builder_free(b);
+
+  nbtx_set_allocator(NULL);
+  if (a.outstanding != 0)
+    die("FAILED. A builder leaked memory.");
+
+  nbtx_free(expected);
+}
+
+#ifdef NBTX_STATS
+static void* make_a_node(void* arg) {
+  (void)arg;
+  nbtx_free(nbtx_new_compound("thread"));
+  return NULL;
+}
+#endif
+
+static void check_stats(const nbtx_node* tree) {
+  nbtx_stats_reset(NBTX_STATS_THREAD);
+
+  struct buffer raw = nbtx_dump_binary(tree);
+  if (raw.data == NULL) die_with_err(errno);
+  struct buffer compressed = nbtx_dump_compressed(tree, NBTX_STRATEGY_GZIP);
+  if (compressed.data == NULL) die_with_err(errno);
+
+  nbtx_node* parsed = nbtx_parse_compressed(compressed.data, compressed.len);
+  if (parsed == NULL) die_with_err(errno);
+  const size_t size = nbtx_size(parsed);
+  nbtx_free(parsed);
+
+  const nbtx_stats s = nbtx_stats_get(NBTX_STATS_THREAD);
+  const nbtx_stats all = nbtx_stats_get(NBTX_STATS_PROCESS);
+
+#ifdef NBTX_STATS
+  if (s.nodes_created != size || s.nodes_freed != size)
+    die("FAILED. Wrong number of nodes created or freed.");
+  if (s.bytes_inflated != raw.len || s.bytes_deflated != compressed.len)
+    die("FAILED. Wrong number of bytes inflated or deflated.");
+  if (s.allocations[NBTX_SUBSYSTEM_PARSE] < size ||
+      s.allocations[NBTX_SUBSYSTEM_DUMP] == 0 || s.allocations[NBTX_SUBSYSTEM_COMPRESS] == 0 ||
+      s.bytes_allocated[NBTX_SUBSYSTEM_PARSE] < raw.len - size * 3)
+    die("FAILED. Allocations weren't counted.");
+  if (all.nodes_created < s.nodes_created)
+    die("FAILED. The process counts less than the thread.");
+
+  nbtx_stats_reset(NBTX_STATS_PROCESS);
+  if (nbtx_stats_get(NBTX_STATS_THREAD).nodes_created != 0)
+    die("FAILED. The counters weren't reset.");
+
+  /* What threads counted stays in the process totals after they exit. */
+  for (int i = 0; i < 4; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, make_a_node, NULL) != 0) die("FAILED. No thread.");
+    pthread_join(thread, NULL);
+  }
+
+  if (nbtx_stats_get(NBTX_STATS_PROCESS).nodes_created != 4)
+    die("FAILED. Exited threads weren't counted.");
+#else
+  if (s.nodes_created != 0 || all.allocations[NBTX_SUBSYSTEM_PARSE] != 0 || size == 0)
+    die("FAILED. Statistics are compiled out, but something was counted.");
+#endif
+
+  buffer_free(&raw);
+  buffer_free(&compressed);
+}
+
 int main(int argc, char** argv) {
   if (argc == 1 || strcmp(argv[1], "--help") == 0) {
     printf("Usage: %s [nbt file]\n", argv[0]);
@@ -45,6 +2141,8 @@ int main(int argc, char** argv) {
   nbtx_node* tree = get_tree(argv[1]);
   printf("OK.\n");
 
+  nbtx_status err;
+
   /* Use this to refer to the tree in gdb. */
   char* the_tree = nbtx_dump_ascii(tree, NBTX_DEFAULT_STYLE);
 
@@ -73,19 +2171,180 @@ int main(int argc, char** argv) {
     printf("OK.\n");
   }
 
-  FILE* temp = fopen("delete_me.nbt", "wb");
-  if (temp == NULL) die("Could not open a temporary file.");
+  {
+    printf("Checking nbtx_clone_shared... ");
+    nbtx_node* clone = nbtx_clone_shared(tree);
+    if (clone == NULL) die_with_err(errno);
 
-  nbtx_status err;
+    if (nbtx_put_int(clone, "cow", 42).reference == NULL)
+      die("FAILED. Could not put into the clone.");
+
+    /* Modify the first compound under the root too, if there's one. */
+    nbtx_node* nested = nbtx_list_item(clone, 0);
+    if (tree->type == NBTX_TAG_COMPOUND && nested && nested->type == NBTX_TAG_COMPOUND) {
+      char path[512];
+      snprintf(path, sizeof path, "%s.%s", tree->name, nested->name);
+
+      nested = nbtx_find_by_path_mut(clone, path);
+      if (nested == NULL || nbtx_put_int(nested, "cow", 42).reference == NULL)
+        die("FAILED. Could not put into a nested compound of the clone.");
+    }
+
+    char* original = nbtx_dump_ascii(tree, NBTX_DEFAULT_STYLE);
+    if (original == NULL) die_with_err(errno);
+    if (strcmp(original, the_tree) != 0)
+      die("FAILED. Modifying the clone changed the original tree.");
+    if (nbtx_eq(tree, clone))
+      die("FAILED. The clone wasn't modified.");
+
+    free(original);
+    printf("OK.\n");
+
+    printf("Checking nbtx_diff and nbtx_patch... ");
+    struct buffer patch = nbtx_diff(tree, clone);
+    if (patch.data == NULL) die_with_err(errno);
+
+    nbtx_node* patched = nbtx_clone(tree);
+    if (patched == NULL) die_with_err(errno);
+
+    if ((err = nbtx_patch(patched, patch.data, patch.len)) != NBTX_OK)
+      die_with_err(err);
+    if (!nbtx_eq(patched, clone))
+      die("FAILED. The patched tree doesn't match the modified one.");
+
+    buffer_free(&patch);
+    patch = nbtx_diff(tree, tree);
+    if (patch.data == NULL) die_with_err(errno);
+    if (patch.len != 1)
+      die("FAILED. Equal trees produced a non-empty patch.");
+
+    buffer_free(&patch);
+    nbtx_free(patched);
+    nbtx_free(clone);
+    printf("OK.\n");
+  }
+
+  {
+    printf("Checking nbtx_dump_binary_cached... ");
+    struct buffer plain = nbtx_dump_binary(tree);
+    struct buffer cached = nbtx_dump_binary_cached(tree);
+    check_same_bytes(plain, cached);
+    buffer_free(&cached);
+
+    /* The second time around, things come from the cache. */
+    cached = nbtx_dump_binary_cached(tree);
+    check_same_bytes(plain, cached);
+    buffer_free(&cached);
+
+    nbtx_node* nested = nbtx_find(tree, is_nested_compound, tree);
+    if (nested == NULL) nested = tree;
+    if (nbtx_put_string(nested, "dirty", "yes").reference == NULL)
+      die("FAILED. Could not put into the tree.");
+
+    buffer_free(&plain);
+    plain = nbtx_dump_binary(tree);
+    cached = nbtx_dump_binary_cached(tree);
+    check_same_bytes(plain, cached);
+
+    buffer_free(&plain);
+    buffer_free(&cached);
+    free(the_tree);
+    the_tree = nbtx_dump_ascii(tree, NBTX_DEFAULT_STYLE);
+    if (the_tree == NULL) die_with_err(errno);
+    printf("OK.\n");
+  }
+
+  printf("Checking nbtx_encode_struct and nbtx_decode_struct... ");
+  check_structs();
+  printf("OK.\n");
+
+  printf("Checking nbtx_set_allocator... ");
+  check_allocator(tree);
+  printf("OK.\n");
+
+  printf("Checking parse contexts... ");
+  check_ctx(tree);
+  printf("OK.\n");
+
+  printf("Checking nbtx_set_max_depth... ");
+  check_max_depth();
+  printf("OK.\n");
+
+  printf("Checking deep trees... ");
+  check_deep_trees();
+  printf("OK.\n");
+
+  printf("Checking cursors... ");
+  check_cursor(tree);
+  printf("OK.\n");
+
+  printf("Checking nbtx_hash... ");
+  check_hash(tree);
+  printf("OK.\n");
+
+  printf("Checking nbtx_dump_canonical and nbtx_store... ");
+  check_canonical();
+  printf("OK.\n");
+
+  printf("Checking nbtx_filter_inplace... ");
+  check_filter_inplace();
+  printf("OK.\n");
+
+  printf("Checking nbtx_map_parallel and nbtx_filter_parallel... ");
+  check_parallel(tree);
+  printf("OK.\n");
+
+  printf("Checking nbtx_parse_paths... ");
+  check_parse_paths(tree);
+  printf("OK.\n");
+
+  printf("Checking nbtx_dump_file_async... ");
+  check_save();
+  printf("OK.\n");
+
+  printf("Checking queries... ");
+  check_query(tree);
+  printf("OK.\n");
+
+  printf("Checking nbtx_peek_path... ");
+  check_peek(tree);
+  printf("OK.\n");
+
+  printf("Checking nbtx_poke_path and nbtx_splice_path... ");
+  check_poke();
+  printf("OK.\n");
+
+  printf("Checking nbtx_dump_binary_indexed... ");
+  check_index(tree);
+  printf("OK.\n");
+
+  printf("Checking the _take puts and extraction... ");
+  check_take();
+  printf("OK.\n");
+
+  printf("Checking nbtx_writer... ");
+  check_writer(tree);
+  check_writer_errors();
+  printf("OK.\n");
+
+  printf("Checking nbtx_compound_builder... ");
+  check_builder();
+  printf("OK.\n");
+
+  printf("Checking nbtx_stats_get... ");
+  check_stats(tree);
+  printf("OK.\n");
+
+  /* Each run gets its own file, so the tests can run in parallel. */
+  FILE* temp = tmpfile();
+  if (temp == NULL) die("Could not open a temporary file.");
 
   printf("Dumping binary... ");
   if ((err = nbtx_dump_file(tree, temp, NBTX_STRATEGY_GZIP)) != NBTX_OK)
     die_with_err(err);
   printf("OK.\n");
 
-  fclose(temp);
-  temp = fopen("delete_me.nbt", "rb");
-  if (temp == NULL) die("Could not re-open a temporary file.");
+  rewind(temp);
 
   printf("Reparsing... ");
   nbtx_node* tree_copy = nbtx_parse_file(temp);
@@ -106,10 +2365,7 @@ int main(int argc, char** argv) {
 
   printf("Freeing resources... ");
 
-  fclose(temp);
-
-  if (remove("delete_me.nbt") == -1)
-    die("Could not delete delete_me.nbt. Race condition?");
+  fclose(temp); /* This deletes it. */
 
   nbtx_free(tree);
   nbtx_free(tree_copy);
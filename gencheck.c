@@ -0,0 +1,213 @@
+/*
+ * Checks the code nbtxgen generates for testdata/player.schema, and for the
+ * schema it infers from the file given on the command line, against what the
+ * library parses and dumps.
+ */
+#include "nbtx.h"
+
+#include "level_gen.h"
+#include "player_gen.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void die(const char* message) {
+  fprintf(stderr, "%s\n", message);
+  exit(1);
+}
+
+static void die_with_err(int err) {
+  fprintf(stderr, "Error %i: %s\n", err, nbtx_error_to_string(err));
+  exit(1);
+}
+
+static const float motion[] = { 0.5f, -1.0f, 2.25f };
+static unsigned char skin[] = { 0xde, 0xad, 0xbe, 0xef };
+
+/* Builds the tree player_encode should write, with the members in schema order. */
+static nbtx_node* make_player_tree(void) {
+  nbtx_node* tree = nbtx_new_compound("player");
+  if (tree == NULL) die_with_err(errno);
+
+  nbtx_node* list;
+  nbtx_node* pos;
+
+  if (nbtx_put_int(tree, "health", 20).reference == NULL ||
+      nbtx_put_ulong(tree, "id", 1234567890123u).reference == NULL ||
+      nbtx_put_string(tree, "name", "Notch").reference == NULL ||
+      nbtx_put_byte_array(tree, "Skin Data", skin, sizeof skin).reference == NULL ||
+      (list = nbtx_put_list(tree, "motion", nbtx_new_tag_list_payload(NBTX_TAG_FLOAT)).reference) == NULL ||
+      (pos = nbtx_put_compound(tree, "pos", nbtx_new_tag_compound_payload()).reference) == NULL ||
+      nbtx_put_ubyte(tree, "level", 7).reference == NULL ||
+      nbtx_put_short(tree, "armor", -3).reference == NULL)
+    die_with_err(errno);
+
+  for (size_t i = 0; i < sizeof motion / sizeof motion[0]; ++i)
+    if (nbtx_put_float(list, NULL, motion[i]).reference == NULL)
+      die_with_err(errno);
+
+  if (nbtx_put_double(pos, "x", 1.5).reference == NULL ||
+      nbtx_put_double(pos, "y", 64).reference == NULL ||
+      nbtx_put_double(pos, "z", -3.25).reference == NULL)
+    die_with_err(errno);
+
+  return tree;
+}
+
+static void check_player(const struct player* p) {
+  float m[3];
+
+  if (p->motion.length != 3)
+    die("FAILED. Wrong list length.");
+  memcpy(m, p->motion.data, sizeof m);
+
+  if (p->health != 20 || p->id != 1234567890123u || p->level != 7 || p->armor != -3 ||
+      p->name.length != 5 || memcmp(p->name.data, "Notch", 5) != 0 ||
+      p->skin.length != sizeof skin || memcmp(p->skin.data, skin, sizeof skin) != 0 ||
+      memcmp(m, motion, sizeof m) != 0 ||
+      p->pos.x != 1.5 || p->pos.y != 64 || p->pos.z != -3.25)
+    die("FAILED. The decoded struct has the wrong values.");
+}
+
+int main(int argc, char** argv) {
+  if (argc == 1 || strcmp(argv[1], "--help") == 0) {
+    printf("Usage: %s [nbt file]\n", argv[0]);
+    return 0;
+  }
+
+  nbtx_status err;
+
+  printf("Checking generated code against nbtx_dump_binary... ");
+  nbtx_node* tree = make_player_tree();
+  struct buffer dumped = nbtx_dump_binary(tree);
+  if (dumped.data == NULL) die_with_err(errno);
+
+  struct player p = { 0 };
+  if ((err = player_decode(dumped.data, dumped.len, &p)) != NBTX_OK)
+    die_with_err(err);
+  check_player(&p);
+
+  struct buffer encoded = player_encode(&p, "player");
+  if (encoded.data == NULL) die_with_err(errno);
+  if (encoded.len != dumped.len || memcmp(encoded.data, dumped.data, dumped.len) != 0)
+    die("FAILED. The generated encoder doesn't write what nbtx_dump_binary does.");
+  printf("OK.\n");
+
+  printf("Checking generated code against nbtx_parse... ");
+  nbtx_node* parsed = nbtx_parse(encoded.data, encoded.len);
+  if (parsed == NULL) die_with_err(errno);
+  if (!nbtx_eq(parsed, tree))
+    die("FAILED. The encoded struct doesn't parse back to the same tree.");
+  printf("OK.\n");
+
+  printf("Checking members out of order... ");
+  buffer_free(&dumped);
+  nbtx_free(parsed);
+
+  nbtx_node* shuffled = nbtx_new_compound("player");
+  if (shuffled == NULL) die_with_err(errno);
+
+  /* The same members, shared with `tree', in reverse order. */
+  const struct list_head* pos;
+  list_for_each_reverse(pos, &tree->payload.tag_compound->entry) {
+    nbtx_node* member = list_entry(pos, struct nbtx_list, entry)->data;
+    struct nbtx_list* entry = malloc(sizeof(*entry));
+    if (entry == NULL) die_with_err(NBTX_EMEM);
+
+    member->refcount++;
+    entry->data = member;
+    list_add_tail(&entry->entry, &shuffled->payload.tag_compound->entry);
+  }
+
+  if (nbtx_put_string(shuffled, "unknown", "skip me").reference == NULL)
+    die_with_err(errno);
+
+  dumped = nbtx_dump_binary(shuffled);
+  if (dumped.data == NULL) die_with_err(errno);
+
+  memset(&p, 0, sizeof p);
+  if ((err = player_decode(dumped.data, dumped.len, &p)) != NBTX_OK)
+    die_with_err(err);
+  check_player(&p);
+  printf("OK.\n");
+
+  printf("Checking unknown members nested too deeply... ");
+  nbtx_node* nest = nbtx_put_compound(shuffled, "nest", nbtx_new_tag_compound_payload()).reference;
+  for (int i = 0; nest && i < 2; ++i)
+    nest = nbtx_put_compound(nest, "nest", nbtx_new_tag_compound_payload()).reference;
+  if (nest == NULL) die_with_err(errno);
+
+  buffer_free(&dumped);
+  dumped = nbtx_dump_binary(shuffled);
+  if (dumped.data == NULL) die_with_err(errno);
+
+  /* The parser would fail on the same tree too, with the root and three nests. */
+  const size_t previous = nbtx_set_max_depth(3);
+  if (player_decode(dumped.data, dumped.len, &p) != NBTX_EDEPTH)
+    die("FAILED. An unknown member was skipped past the depth limit.");
+
+  nbtx_set_max_depth(previous);
+  if ((err = player_decode(dumped.data, dumped.len, &p)) != NBTX_OK)
+    die_with_err(err);
+
+  /* Without a limit, skipping takes no stack however deep the member nests. */
+  struct buffer deep = NBTX_BUFFER_INIT;
+  const uint8_t list_type = NBTX_TAG_LIST, end = 0;
+  const uint16_t name_length = 4;
+  const uint32_t one = 1, none = 0;
+
+  bool failed = buffer_append(&deep, dumped.data, dumped.len - 1) ||
+                buffer_append(&deep, &list_type, 1) ||
+                buffer_append(&deep, &name_length, sizeof name_length) ||
+                buffer_append(&deep, "deep", 4);
+  for (int i = 0; !failed && i < 1 << 20; ++i)
+    failed = buffer_append(&deep, &list_type, 1) || buffer_append(&deep, &one, sizeof one);
+  failed = failed ||
+           buffer_append(&deep, &end, 1) || buffer_append(&deep, &none, sizeof none) ||
+           buffer_append(&deep, &end, 1);
+  if (failed) die_with_err(NBTX_EMEM);
+
+  nbtx_set_max_depth(0);
+  if ((err = player_decode(deep.data, deep.len, &p)) != NBTX_OK)
+    die_with_err(err);
+  nbtx_set_max_depth(previous);
+
+  buffer_free(&deep);
+  printf("OK.\n");
+
+  printf("Checking code generated from %s... ", argv[1]);
+  nbtx_node* sample = nbtx_parse_path(argv[1]);
+  if (sample == NULL) die_with_err(errno);
+
+  struct buffer raw = nbtx_dump_binary(sample);
+  if (raw.data == NULL) die_with_err(errno);
+
+  struct Level level = { 0 };
+  if ((err = Level_decode(raw.data, raw.len, &level)) != NBTX_OK)
+    die_with_err(err);
+
+  const nbtx_node* ushort_test = nbtx_find_by_name(sample, "ushortTest");
+  const nbtx_node* ulong_test = nbtx_find_by_name(sample, "ulongTest");
+  const nbtx_node* buffer = nbtx_find_by_name(sample, "buffer");
+
+  if (ushort_test == NULL || ulong_test == NULL || buffer == NULL ||
+      level.ushortTest != ushort_test->payload.tag_ushort ||
+      level.ulongTest != ulong_test->payload.tag_ulong ||
+      level.buffer_.length != buffer->payload.tag_byte_array.length ||
+      memcmp(level.buffer_.data, buffer->payload.tag_byte_array.data, level.buffer_.length) != 0 ||
+      level.Entities.length != 5)
+    die("FAILED. The decoded struct has the wrong values.");
+  printf("OK.\n");
+
+  buffer_free(&raw);
+  buffer_free(&dumped);
+  buffer_free(&encoded);
+  nbtx_free(sample);
+  nbtx_free(shuffled);
+  nbtx_free(tree);
+
+  return 0;
+}
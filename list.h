@@ -53,6 +53,23 @@ static inline void list_del(struct list_head* loc)
     loc->blink = NULL;
 }
 
+/* Moves all the elements of `list' to the beginning of `head', in order,
+ * leaving `list' empty. */
+static inline void list_splice_head(struct list_head* restrict list,
+                                    struct list_head* restrict head)
+{
+    if (list->flink == list)
+        return;
+
+    list->flink->blink = head;
+    list->blink->flink = head->flink;
+
+    head->flink->blink = list->blink;
+    head->flink = list->flink;
+
+    INIT_LIST_HEAD(list);
+}
+
 /* Tests if the list is empty */
 #define list_empty(head) ((head)->flink == (head))
 
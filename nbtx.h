@@ -29,7 +29,9 @@ extern "C" {
     NBTX_ERR = -1, /* Generic error, most likely of the parsing variety. */
     NBTX_EMEM = -2, /* Out of memory. */
     NBTX_EIO = -3, /* IO error. */
-    NBTX_EZ = -4  /* Zlib compression/decompression error. */
+    NBTX_EZ = -4, /* Zlib compression/decompression error. */
+    NBTX_EDEPTH = -5, /* Lists and compounds nested deeper than nbtx_set_max_depth allows. */
+    NBTX_ENOTFOUND = -6 /* Nothing is at the path that was looked up. */
   } nbtx_status;
 
   typedef enum {
@@ -56,6 +58,23 @@ extern "C" {
   } nbtx_compression_strategy;
 
   struct nbtx_node;
+  struct nbtx_node_cache;
+
+  /*
+   * Design addendum: we make tag_list a linked list instead of an array
+   * so that nbtx_node can be a true recursive data structure. If we used
+   * an array, it would be incorrect to call free() on any element except
+   * the first one. By using a linked list, the context of the node is
+   * irrelevant. One tradeoff of this design is that we don't get tight
+   * list packing when memory is a concern and huge lists are created.
+   *
+   * For more information on using the linked list, see `list.h'. The API
+   * is well documented.
+   */
+  struct nbtx_list {
+    struct nbtx_node* data; /* A single node's data. */
+    struct list_head entry;
+  };
 
   /*
    * Represents a single node in the tree. You should switch on `type' and ONLY
@@ -63,9 +82,17 @@ extern "C" {
    * recursive nbtx_node entries, so those will have to be switched on too. I
    * recommended being VERY comfortable with recursion before traversing this
    * beast, or at least sticking to the library routines provided.
+   *
+   * Nodes are reference counted so that clones can share subtrees. A node with
+   * a `refcount' greater than one is shared between several trees and MUST NOT
+   * be modified in place; see nbtx_clone_shared and nbtx_find_by_path_mut. If
+   * you allocate nodes yourself, set `refcount' to 1 and `cache' to NULL. The
+   * library changes refcounts atomically, so trees that share nodes can be
+   * freed on different threads.
    */
   typedef struct nbtx_node {
     nbtx_type type;
+    uint32_t refcount; /* Number of lists, compounds or handles owning this node. */
     char* name; /* This may be NULL. Check your damn pointers. */
 
     union { /* payload */
@@ -89,23 +116,6 @@ extern "C" {
 
       char* tag_string; /* TODO: technically, this should be a UTF-8 string */
 
-      /*
-       * Design addendum: we make tag_list a linked list instead of an array
-       * so that nbtx_node can be a true recursive data structure. If we used
-       * an array, it would be incorrect to call free() on any element except
-       * the first one. By using a linked list, the context of the node is
-       * irrelevant. One tradeoff of this design is that we don't get tight
-       * list packing when memory is a concern and huge lists are created.
-       *
-       * For more information on using the linked list, see `list.h'. The API
-       * is well documented.
-       */
-      struct nbtx_list {
-        struct nbtx_node* data; /* A single node's data. */
-        struct list_head entry;
-      } *tag_list,
-        * tag_compound;
-
       /*
        * The primary difference between a tag_list and a tag_compound is the
        * use of the first (sentinel) node.
@@ -119,7 +129,12 @@ extern "C" {
        * beginning and end of the doubly linked list. The data pointer is
        * unused and set to NULL.
        */
+      struct nbtx_list* tag_list;
+      struct nbtx_list* tag_compound;
     } payload;
+
+    /* Library-private data derived from the payload. See nbtx_dump_binary_cached. */
+    struct nbtx_node_cache* cache;
   } nbtx_node;
 
   /***** High Level Loading/Saving Functions *****/
@@ -146,6 +161,25 @@ extern "C" {
    */
   nbtx_node* nbtx_parse_compressed(const void* chunk_start, size_t length);
 
+  typedef enum {
+    NBTX_IO_AUTO,   /* io_uring where the kernel has it, NBTX_IO_THREADS elsewhere. */
+    NBTX_IO_THREADS /* Blocking reads, one file at a time on each thread. */
+  } nbtx_io_mode;
+
+  /*
+   * Loads `count' compressed files, like nbtx_parse_path on each of them, and
+   * stores their trees in `trees', in the same order as `paths'. The reads of
+   * many files are in flight at once, and each file is parsed on one of
+   * `threads' threads (the calling one included, 0 for one per CPU) as soon as
+   * it has been read.
+   *
+   * Returns how many files were loaded. The trees of the others are NULL, and
+   * if `errors' isn't NULL, errors[i] says what went wrong with paths[i]. errno
+   * is set to the error of the first file that failed, or to NBTX_OK.
+   */
+  size_t nbtx_parse_paths(const char* const* paths, size_t count, nbtx_node** trees,
+                          nbtx_status* errors, unsigned threads, nbtx_io_mode);
+
   /*
    * Dumps a tree into a file. Check your damn error codes. This function should
    * return NBTX_OK.
@@ -167,6 +201,45 @@ extern "C" {
   struct buffer nbtx_dump_compressed(const nbtx_node* tree,
                                      nbtx_compression_strategy);
 
+  /* A save running on a thread of its own. */
+  typedef struct nbtx_save nbtx_save;
+
+  /*
+   * Saves a tree to the file at `path' like nbtx_dump_file, but serializes,
+   * compresses and writes it on another thread. All that happens on the
+   * calling thread is taking a snapshot, which is an nbtx_clone_shared of the
+   * tree: it costs as much as the root has members, however big the tree under
+   * it.
+   *
+   * What's saved is the tree as it was when this was called. You can go on
+   * changing and freeing it through the library in the meantime, with one
+   * catch: until the snapshot is serialized, which is at the latest when
+   * nbtx_save_done returns true, every list and compound below the root is
+   * shared with it. Puts into those fail with errno set to NBTX_ERR if you
+   * got them from nbtx_find, nbtx_find_by_name or nbtx_find_by_path; get them
+   * with nbtx_find_by_path_mut instead, which copies them out of the snapshot,
+   * and don't change nodes in place that you got any other way. Puts into the
+   * root itself always work.
+   *
+   * The tree is written to a temporary file next to `path', synced to disk
+   * and renamed over `path', so `path' always has either the old file or the
+   * whole new one.
+   *
+   * Returns NULL and sets errno if the save couldn't be started. Otherwise,
+   * the save must be finished with nbtx_save_wait.
+   */
+  nbtx_save* nbtx_dump_file_async(nbtx_node* tree, const char* path,
+                                  nbtx_compression_strategy);
+
+  /* Returns true once the save is over, without waiting for it. */
+  bool nbtx_save_done(const nbtx_save*);
+
+  /*
+   * Waits for the save to be over, frees it and returns how it went: NBTX_OK
+   * once the file is in place.
+   */
+  nbtx_status nbtx_save_wait(nbtx_save*);
+
   /***** Low Level Loading/Saving Functions *****/
 
 /*
@@ -176,6 +249,21 @@ extern "C" {
  */
   nbtx_node* nbtx_parse(const void* memory, size_t length);
 
+  #define NBTX_DEFAULT_MAX_DEPTH 512
+
+  /*
+   * Sets how deeply lists and compounds may be nested in the trees the parsers
+   * read, counting the root, and returns the previous limit. Deeper trees fail
+   * to parse with NBTX_EDEPTH. 0 means no limit: the parsers don't recurse, so
+   * they're only bounded by memory. nbtx_free, nbtx_map, nbtx_size and
+   * nbtx_eq don't recurse either, but some other functions do. It may be set
+   * while other threads parse; each parse uses the limit it started with.
+   */
+  size_t nbtx_set_max_depth(size_t depth);
+
+  /* Returns the limit set with nbtx_set_max_depth. */
+  size_t nbtx_get_max_depth(void);
+
   typedef struct nbtx_style {
     enum {
       NBTX_SAME_LINE = 1,
@@ -212,21 +300,208 @@ extern "C" {
    */
   struct buffer nbtx_dump_binary(const nbtx_node* tree);
 
+  /*
+   * The same as nbtx_dump_binary, but the tree keeps a copy of its binary
+   * form, and every list and compound in it whose payload takes at least
+   * NBTX_CACHE_MIN_SIZE bytes remembers where it is in there. Later calls
+   * copy the subtrees that didn't change since from that copy instead of
+   * serializing them again, so dumping a big tree over and over costs about
+   * as much as what changed in it, plus a walk over its lists and compounds.
+   *
+   * The library functions that modify trees keep track of the changes. If you
+   * modify a node by hand, call nbtx_mark_dirty on the list or compound that
+   * contains it, or on the node itself if it's a list or compound. Cached
+   * dumps of trees that share nodes must not run concurrently.
+   */
+  struct buffer nbtx_dump_binary_cached(nbtx_node* tree);
+
+  /*
+   * Tells nbtx_dump_binary_cached that the children of a list or compound
+   * changed, so neither it nor the nodes containing it can be dumped from
+   * their caches anymore.
+   */
+  void nbtx_mark_dirty(nbtx_node* list_or_compound);
+
+  /*
+   * The same as nbtx_dump_binary, but trees that only differ in the order of
+   * their compound members dump to the same bytes: members are written sorted
+   * by name (bytewise, unnamed ones first, equal names in their order), every
+   * NaN is written as the same NaN and -0.0 as 0.0. Lists keep their order.
+   * Use this to compare or address trees by their bytes. It doesn't use the
+   * caches of nbtx_dump_binary_cached.
+   */
+  struct buffer nbtx_dump_canonical(const nbtx_node* tree);
+
+  /*
+   * The same as nbtx_dump_binary, followed by an index of where the members
+   * of big compounds and some elements of long lists are. nbtx_parse and
+   * other readers that don't know about it just stop before it, while
+   * nbtx_peek_path, nbtx_poke_path and nbtx_query_run_raw use it to jump
+   * straight to members by name and to list elements by position, instead
+   * of walking through the ones before them.
+   */
+  struct buffer nbtx_dump_binary_indexed(const nbtx_node* tree);
+
+  /***** Parse Contexts *****/
+
+  /*
+   * A parse context keeps memory around between parses: the decompression
+   * buffer and inflate state, and the nodes, list entries, names, strings and
+   * byte arrays of the trees handed back to it with nbtx_ctx_recycle. Parsing
+   * a tree of roughly the same shape as a recycled one then barely allocates;
+   * one with the same sizes doesn't allocate at all.
+   *
+   * Trees parsed with a context are regular trees: they may be modified, and
+   * freed with nbtx_free instead of being recycled. A context must only be
+   * used by one thread at a time.
+   */
+  typedef struct nbtx_parse_ctx nbtx_parse_ctx;
+
+  /* Returns NULL on memory errors. See also nbtx_ctx_new_with_allocator. */
+  nbtx_parse_ctx* nbtx_ctx_new(void);
+
+  #define NBTX_CTX_DEFAULT_LIMIT ((size_t)64 << 20)
+
+  /*
+   * Sets how many bytes of recycled memory `ctx' keeps at most, and returns
+   * the previous limit. Past it, recycled memory is freed instead; lowering
+   * the limit doesn't free what's already kept. 0 means no limit. New
+   * contexts start out with NBTX_CTX_DEFAULT_LIMIT.
+   */
+  size_t nbtx_ctx_set_limit(nbtx_parse_ctx* ctx, size_t bytes);
+
+  /* Frees the context and the memory it kept, but not the trees parsed with it. */
+  void nbtx_ctx_free(nbtx_parse_ctx* ctx);
+
+  /* nbtx_parse and nbtx_parse_compressed, taking memory from `ctx'. */
+  nbtx_node* nbtx_ctx_parse(nbtx_parse_ctx* ctx, const void* memory, size_t length);
+  nbtx_node* nbtx_ctx_parse_compressed(nbtx_parse_ctx* ctx, const void* chunk_start, size_t length);
+
+  /*
+   * Frees `tree' like nbtx_free, but hands its memory to `ctx' for the next
+   * parses. Any tree can be recycled, not just those parsed with `ctx'.
+   * Nodes still shared with other trees are left to them.
+   */
+  void nbtx_ctx_recycle(nbtx_parse_ctx* ctx, nbtx_node* tree);
+
+  /***** Streaming Writers *****/
+
+  /*
+   * A writer encodes a tree in binary form as it's described, without building
+   * it first:
+   *
+   *   nbtx_writer_begin_compound(w, "player");
+   *     nbtx_writer_write_string(w, "name", "Steve");
+   *     nbtx_writer_begin_list(w, "Pos", NBTX_TAG_DOUBLE, 3);
+   *       nbtx_writer_write_double(w, NULL, x);
+   *       ...
+   *     nbtx_writer_end(w);
+   *   nbtx_writer_end(w);
+   *   nbtx_writer_finish(w, &length);
+   *
+   * What's written is checked as it goes: members of compounds need names,
+   * elements of lists have to be of the list's type and as many as announced,
+   * and every list and compound has to be ended. The first error is returned
+   * by that call and every later one, up to nbtx_writer_finish.
+   *
+   * The output is the same as nbtx_dump_binary's for the same tree. A writer
+   * may write any number of trees, one after the other, and must only be used
+   * by one thread at a time.
+   */
+  typedef struct nbtx_writer nbtx_writer;
+
+  /*
+   * Returns a writer that appends to `out', which must stay around while the
+   * writer does. Returns NULL and sets errno on errors.
+   */
+  nbtx_writer* nbtx_writer_new(struct buffer* out);
+
+  /* The same, for `capacity' bytes at `memory'. Writing more is NBTX_EMEM. */
+  nbtx_writer* nbtx_writer_new_fixed(void* memory, size_t capacity);
+
+  /* The same as nbtx_writer_new, but each tree is compressed on its way to `out'. */
+  nbtx_writer* nbtx_writer_new_compressed(struct buffer* out, nbtx_compression_strategy strategy);
+
+  void nbtx_writer_free(nbtx_writer* w);
+
+  /*
+   * Ends the tree being written. If all went well, the number of bytes it took
+   * goes to `length', unless that's NULL. Otherwise, what was written of it is
+   * taken back (out of the buffer, or the memory is written over by the next
+   * tree) and the error is returned. Either way, the writer can start on
+   * another tree.
+   */
+  nbtx_status nbtx_writer_finish(nbtx_writer* w, size_t* length);
+
+  /*
+   * Begins a compound, or a list of `count' elements of type `type', which take
+   * the calls up to the matching nbtx_writer_end. `name' is that of the new tag
+   * in compounds, and ignored in lists. The root may have no name.
+   */
+  nbtx_status nbtx_writer_begin_compound(nbtx_writer* w, const char* name);
+  nbtx_status nbtx_writer_begin_list(nbtx_writer* w, const char* name, nbtx_type type, uint32_t count);
+  nbtx_status nbtx_writer_end(nbtx_writer* w);
+
+  /* Writes a tag. Like with the nbtx_put_* functions, `name' is ignored in lists. */
+  #define NBTX_SPAWN_WRITE_FUNCTION_DECLARATION(c_type, datatype) \
+    nbtx_status nbtx_writer_write_##datatype(nbtx_writer* w, const char* name, c_type value)
+
+  NBTX_SPAWN_WRITE_FUNCTION_DECLARATION(int8_t, byte);
+  NBTX_SPAWN_WRITE_FUNCTION_DECLARATION(uint8_t, ubyte);
+  NBTX_SPAWN_WRITE_FUNCTION_DECLARATION(int16_t, short);
+  NBTX_SPAWN_WRITE_FUNCTION_DECLARATION(uint16_t, ushort);
+  NBTX_SPAWN_WRITE_FUNCTION_DECLARATION(int32_t, int);
+  NBTX_SPAWN_WRITE_FUNCTION_DECLARATION(uint32_t, uint);
+  NBTX_SPAWN_WRITE_FUNCTION_DECLARATION(int64_t, long);
+  NBTX_SPAWN_WRITE_FUNCTION_DECLARATION(uint64_t, ulong);
+  NBTX_SPAWN_WRITE_FUNCTION_DECLARATION(float, float);
+  NBTX_SPAWN_WRITE_FUNCTION_DECLARATION(double, double);
+  NBTX_SPAWN_WRITE_FUNCTION_DECLARATION(const char*, string);
+
+  #undef NBTX_SPAWN_WRITE_FUNCTION_DECLARATION
+
+  nbtx_status nbtx_writer_write_byte_array(nbtx_writer* w, const char* name,
+                                           const unsigned char* data, uint32_t length);
+
+  /*
+   * Writes a whole list of numbers of type `type' at once, from an array of
+   * `count' of them in host byte order, like nbtx_dump_binary writes them.
+   */
+  nbtx_status nbtx_writer_write_list(nbtx_writer* w, const char* name, nbtx_type type,
+                                     const void* values, uint32_t count);
+
   /***** Tree Manipulation Functions *****/
 
 /*
- * Clones an existing tree. Returns NULL on memory errors.
+ * Clones an existing tree, copying every node of it. Returns NULL on memory
+ * errors.
  */
   nbtx_node* nbtx_clone(nbtx_node*);
 
+/*
+ * Clones an existing tree copy-on-write: only the root node is copied, and
+ * its children are shared with `tree' by bumping their reference counts, so
+ * this runs in time proportional to the number of direct children of the
+ * root, not to the size of the tree. Returns NULL on memory errors.
+ *
+ * Shared nodes can't be changed in place. The nbtx_put_* functions still
+ * work on the roots of both trees, and nbtx_filter_inplace copies what it
+ * filters, but puts into a list or compound below them fail until it is made
+ * private again. Get such nodes with nbtx_find_by_path_mut, which copies the
+ * path down to them, instead of nbtx_find_by_path or nbtx_find.
+ */
+  nbtx_node* nbtx_clone_shared(nbtx_node*);
+
   /*
-   * Recursively deallocates a node and all its children. If this is used on a an
-   * entire tree, no memory will be leaked.
+   * Drops a reference to a node. When the last reference goes away, the node
+   * and all the children that aren't shared with other trees are deallocated.
+   * If this is used on a an entire tree, no memory will be leaked. This doesn't
+   * recurse or allocate, so trees of any depth can be freed.
    */
   void nbtx_free(nbtx_node*);
 
   /*
-   * Recursively frees all the elements of a list, and then frees the list itself.
+   * Frees all the elements of a list, and then frees the list itself.
    */
   void nbtx_free_list(struct nbtx_list*);
 
@@ -249,11 +524,143 @@ extern "C" {
    * Returns false if it was terminated by a visitor, true otherwise. In most
    * cases this can be ignored.
    *
-   * TODO: Is there a way to do this without expensive function pointers? Maybe
-   * something like list_for_each?
+   * To walk a tree without calling through a function pointer for every node,
+   * or to skip subtrees, use a cursor instead. See nbtx_cursor_next.
    */
   bool nbtx_map(nbtx_node* tree, nbtx_visitor_t, void* aux);
 
+  /***** Cursors *****/
+
+  typedef enum {
+    NBTX_CURSOR_ERROR = -1, /* Out of memory. errno is set to NBTX_EMEM. */
+    NBTX_CURSOR_END,        /* There's nothing left. */
+    NBTX_CURSOR_VALUE,      /* `node' is neither a list nor a compound. */
+    NBTX_CURSOR_ENTER,      /* `node' is a list or compound. Its members come next... */
+    NBTX_CURSOR_LEAVE       /* ...and then this, with the same `node' and `depth'. */
+  } nbtx_cursor_event;
+
+  struct nbtx_cursor_frame {
+    struct list_head* head;
+    struct list_head* pos;
+    nbtx_node* node;
+  };
+
+  #define NBTX_CURSOR_LOCAL_FRAMES 32
+
+  /*
+   * Walks a tree in the same order as nbtx_map, one node per call to
+   * nbtx_cursor_next, so the loop can be inlined and stopped at any point:
+   *
+   *   nbtx_cursor c;
+   *   nbtx_cursor_event e;
+   *
+   *   nbtx_cursor_init(&c, tree);
+   *   while ((e = nbtx_cursor_next(&c)) > NBTX_CURSOR_END)
+   *     ...use e, c.node and c.depth...
+   *   nbtx_cursor_free(&c);
+   *
+   * The loop ends with `e' being NBTX_CURSOR_ERROR if memory ran out.
+   *
+   * Lists and compounds nested deeper than NBTX_CURSOR_LOCAL_FRAMES need
+   * memory, which nbtx_cursor_free gives back. A cursor points into itself,
+   * so don't copy it, and don't add or remove members of the lists and
+   * compounds it's in.
+   */
+  typedef struct nbtx_cursor {
+    nbtx_node* node; /* The node of the last event. */
+    size_t depth;    /* Of `node': 0 for the root, 1 for its members and so on. */
+
+    /* Private. */
+    nbtx_node* root; /* Until it's been returned. */
+    struct nbtx_cursor_frame* frames;
+    size_t count;
+    size_t capacity;
+    struct nbtx_cursor_frame local[NBTX_CURSOR_LOCAL_FRAMES];
+  } nbtx_cursor;
+
+  static inline void nbtx_cursor_init(nbtx_cursor* c, nbtx_node* tree) {
+    c->node = NULL;
+    c->depth = 0;
+    c->root = tree;
+    c->frames = c->local;
+    c->count = 0;
+    c->capacity = NBTX_CURSOR_LOCAL_FRAMES;
+  }
+
+  /* Frees the memory `c' took, if any. */
+  void nbtx_cursor_free(nbtx_cursor* c);
+
+  /* Makes room for another frame, for nbtx_cursor_next. Sets errno on failure. */
+  bool nbtx_cursor_grow_(nbtx_cursor* c);
+
+  /*
+   * Moves to the next node and returns what happened. After an error, just
+   * free the cursor.
+   */
+  static inline nbtx_cursor_event nbtx_cursor_next(nbtx_cursor* c) {
+    nbtx_node* node;
+
+    if (c->root) {
+      node = c->root;
+      c->root = NULL;
+      c->depth = 0;
+    } else {
+      if (c->count == 0) {
+        c->node = NULL;
+        return NBTX_CURSOR_END;
+      }
+
+      struct nbtx_cursor_frame* top = &c->frames[c->count - 1];
+      top->pos = top->pos->flink;
+
+      if (top->pos == top->head) {
+        c->node = top->node;
+        c->depth = --c->count;
+        return NBTX_CURSOR_LEAVE;
+      }
+
+      node = list_entry(top->pos, struct nbtx_list, entry)->data;
+      c->depth = c->count;
+    }
+
+    c->node = node;
+
+    if (node->type != NBTX_TAG_LIST && node->type != NBTX_TAG_COMPOUND)
+      return NBTX_CURSOR_VALUE;
+
+    if (c->count == c->capacity && !nbtx_cursor_grow_(c))
+      return NBTX_CURSOR_ERROR;
+
+    /* tag_list and tag_compound share their representation. */
+    struct nbtx_cursor_frame* frame = &c->frames[c->count++];
+    frame->head = frame->pos = &node->payload.tag_list->entry;
+    frame->node = node;
+    return NBTX_CURSOR_ENTER;
+  }
+
+  /*
+   * Right after NBTX_CURSOR_ENTER, skips the members of `c->node': the next
+   * event is its NBTX_CURSOR_LEAVE. Does nothing after other events.
+   */
+  static inline void nbtx_cursor_skip_children(nbtx_cursor* c) {
+    if (c->count == 0) return;
+
+    struct nbtx_cursor_frame* top = &c->frames[c->count - 1];
+    if (top->node == c->node && top->pos == top->head)
+      top->pos = top->head->blink;
+  }
+
+  /*
+   * Iterates over the members of a list or compound, like list_for_each:
+   * `child' is the member and `pos' a struct list_head* for bookkeeping.
+   * Members mustn't be removed along the way.
+   */
+  #define nbtx_for_each_child(child, pos, list_or_compound)                              \
+    for ((pos) = (list_or_compound)->payload.tag_list->entry.flink;                     \
+         (pos) != &(list_or_compound)->payload.tag_list->entry &&                       \
+         ((child) = list_entry((pos), struct nbtx_list, entry)->data, 1);                \
+         (pos) = (pos)->flink)
+
   /*
    * Returns a new tree, consisting of a copy of all the nodes the predicate
    * returned `true' for. If the new tree is empty, this function will return
@@ -267,9 +674,33 @@ extern "C" {
   /*
    * The exact same as nbtx_filter, except instead of returning a new tree, the
    * existing tree is modified in place, and then returned for convenience.
+   * Nodes shared with a clone are copied before being filtered, so the returned
+   * pointer may differ from `tree' if `tree' itself was shared. If one can't be
+   * copied, it is left unfiltered and errno is set to NBTX_EMEM; otherwise
+   * errno is NBTX_OK.
    */
   nbtx_node* nbtx_filter_inplace(nbtx_node* tree, nbtx_predicate_t, void* aux);
 
+  /*
+   * The same as nbtx_map and nbtx_filter, but spread over up to `threads'
+   * threads, the calling one included, or one per processor if `threads' is
+   * 0. Threads steal whole lists and compounds, and the rest of the ones
+   * others are in the middle of, from each other, so they pay off on big
+   * trees only. The other threads are started on first use and kept for the
+   * next calls; those busy with other calls just don't take part.
+   *
+   * The visitor or predicate is called on several nodes at once, in no
+   * particular order, so it has to be thread-safe. Visitors may modify the
+   * node they're given, but not add or remove members of lists and compounds.
+   * Once a visitor says stop, the others stop soon after. nbtx_filter_parallel
+   * returns the same tree as nbtx_filter, siblings in their order.
+   *
+   * nbtx_map_parallel also returns false on memory errors, with errno set to
+   * NBTX_EMEM.
+   */
+  bool nbtx_map_parallel(nbtx_node* tree, nbtx_visitor_t, void* aux, unsigned threads);
+  nbtx_node* nbtx_filter_parallel(const nbtx_node* tree, nbtx_predicate_t, void* aux, unsigned threads);
+
   /*
    * Returns the first node which causes the predicate to return true. If all
    * nodes are rejected, NULL is returned. If you want to find every instance of
@@ -304,6 +735,16 @@ extern "C" {
    */
   nbtx_node* nbtx_find_by_path(nbtx_node* tree, const char* path);
 
+  /*
+   * The same as nbtx_find_by_path, but every node from `tree' down to the
+   * returned one is made private to `tree' first, copying the shared ones (and
+   * only those) as nbtx_clone_shared would. Use this to get a node you're going to
+   * modify in a tree that shares structure with a clone. `tree' itself must
+   * not be shared. Returns NULL if no such node exists or on memory errors, in
+   * which case errno is set to NBTX_EMEM.
+   */
+  nbtx_node* nbtx_find_by_path_mut(nbtx_node* tree, const char* path);
+
   /* Returns the number of nodes in the tree. */
   size_t nbtx_size(const nbtx_node* tree);
 
@@ -371,6 +812,8 @@ extern "C" {
    * For a compound, if the tag already exists with the same or another type,
    * it gets replaced.
    * For a list, the name parameter is ignored.
+   * `list_or_compound' must not be shared with another tree; if it is, nothing
+   * is done and errno is set to NBTX_ERR.
    */
   #define NBTX_SPAWN_PUT_FUNCTION_DECLARATION(c_type, datatype, ...) \
     nbtx_result nbtx_put_##datatype(nbtx_node* list_or_compound, const char* name, c_type tag_##datatype __VA_ARGS__)
@@ -390,15 +833,469 @@ extern "C" {
   NBTX_SPAWN_PUT_FUNCTION_DECLARATION(struct nbtx_list*, list);
   NBTX_SPAWN_PUT_FUNCTION_DECLARATION(struct nbtx_list*, compound);
 
+  /*
+   * The same as nbtx_put_byte_array and nbtx_put_string, but the node adopts
+   * the given storage instead of copying it, so it must come from
+   * nbtx_alloc_memory (or from the allocator given to nbtx_set_allocator) and
+   * be left alone afterwards. If an error occurs, the storage still belongs to
+   * the caller.
+   */
+  NBTX_SPAWN_PUT_FUNCTION_DECLARATION(unsigned char*, byte_array_take, , uint32_t length);
+  NBTX_SPAWN_PUT_FUNCTION_DECLARATION(char*, string_take);
+
   #undef NBTX_SPAWN_PUT_FUNCTION_DECLARATION
 
+  /*
+   * Hands the storage of a TAG_Byte_Array or TAG_String over to the caller,
+   * who frees it with nbtx_free_memory, and leaves the node empty but still in
+   * its tree. The length of the array goes to `length', unless it's NULL. If
+   * the node is shared with another tree, it is left alone and the caller gets
+   * a copy instead. Returns NULL on memory errors or if the node has another
+   * type, and sets errno.
+   */
+  unsigned char* nbtx_extract_byte_array(nbtx_node* node, uint32_t* length);
+  char* nbtx_extract_string(nbtx_node* node);
+
+  /*
+   * A compound builder puts members into a new compound without looking for
+   * others by the same name first, which puts into big compounds spend most of
+   * their time on. Duplicates are resolved once, by
+   * nbtx_compound_builder_finish: the last member put by a name wins, in the
+   * place of the first one, as if they had been put with nbtx_put_*.
+   *
+   * `size_hint' is the number of members to expect, so the memory for
+   * finding duplicates can be reserved up front. Returns NULL on memory
+   * errors.
+   */
+  typedef struct nbtx_compound_builder nbtx_compound_builder;
+
+  nbtx_compound_builder* nbtx_compound_builder_new(const char* name, size_t size_hint);
+
+  /*
+   * Returns the compound that was built, and frees the builder. This can't
+   * fail: if there's no memory to find duplicates quickly, they're found
+   * slowly.
+   */
+  nbtx_node* nbtx_compound_builder_finish(nbtx_compound_builder* b);
+
+  /* Frees the builder and what was built. */
+  void nbtx_compound_builder_free(nbtx_compound_builder* b);
+
+  /*
+   * The same as the nbtx_put_* functions, for a compound being built. `name'
+   * must not be NULL. `inserted' is always true, and nodes returned for names
+   * that are put again are freed by nbtx_compound_builder_finish.
+   */
+  #define NBTX_SPAWN_BUILDER_PUT_DECLARATION(c_type, datatype, ...) \
+    nbtx_result nbtx_compound_builder_put_##datatype(nbtx_compound_builder* b, const char* name, \
+                                                     c_type tag_##datatype __VA_ARGS__)
+
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(int8_t, byte);
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(uint8_t, ubyte);
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(int16_t, short);
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(uint16_t, ushort);
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(int32_t, int);
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(uint32_t, uint);
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(int64_t, long);
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(uint64_t, ulong);
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(float, float);
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(double, double);
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(unsigned char*, byte_array, , uint32_t length);
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(unsigned char*, byte_array_take, , uint32_t length);
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(const char*, string);
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(char*, string_take);
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(struct nbtx_list*, list);
+  NBTX_SPAWN_BUILDER_PUT_DECLARATION(struct nbtx_list*, compound);
+
+  #undef NBTX_SPAWN_BUILDER_PUT_DECLARATION
+
+  /***** Delta Synchronization *****/
+
+  /*
+   * Returns a binary patch which turns `a' into `b' when applied with
+   * nbtx_patch. Subtrees which are equal according to nbtx_eq are skipped, so
+   * the patch only describes what changed: values that were set, compound
+   * members that were removed and ranges of list elements that were replaced.
+   * If an error occurs, a buffer with a NULL `data' pointer will be returned,
+   * and errno will be set.
+   *
+   * Don't forget to free buf->data.
+   */
+  struct buffer nbtx_diff(const nbtx_node* a, const nbtx_node* b);
+
+  /*
+   * Applies a patch made by nbtx_diff to `tree', in place. `tree' is expected
+   * to be equal to the tree the patch was made from, and must not be shared
+   * with a clone. Returns NBTX_ERR if the patch is corrupt or doesn't fit the
+   * tree, in which case the tree may be left partially patched.
+   */
+  nbtx_status nbtx_patch(nbtx_node* tree, const void* patch, size_t length);
+
+  /***** Content-Addressed Storage *****/
+
+  /* Identifies the canonical form of a tree, see nbtx_store_put. */
+  typedef struct nbtx_digest {
+    uint64_t hi, lo;
+  } nbtx_digest;
+
+  /*
+   * A store keeps the canonical forms (see nbtx_dump_canonical) of the trees
+   * put into it, each one once, along with how many times it was put. Putting
+   * the subtrees that repeat across many trees, like default block entities,
+   * stores them once no matter how many trees hold them. A store must only be
+   * used by one thread at a time.
+   */
+  typedef struct nbtx_store nbtx_store;
+
+  /* Returns NULL on memory errors. */
+  nbtx_store* nbtx_store_new(void);
+
+  /* Frees the store and everything in it. */
+  void nbtx_store_free(nbtx_store* store);
+
+  /*
+   * Adds a reference to the canonical form of `tree', storing it if it isn't
+   * there yet, and sets `key' to its digest: a 128-bit hash of the bytes.
+   * Trees with the same canonical form get the same key. Returns NBTX_EMEM on
+   * memory errors, and NBTX_ERR in the unlikely event that different bytes
+   * have the same digest, which the store checks for.
+   */
+  nbtx_status nbtx_store_put(nbtx_store* store, const nbtx_node* tree, nbtx_digest* key);
+
+  /*
+   * Returns the canonical form stored under `key' and sets `length' to its
+   * size, or returns NULL if there's nothing there. Parse it with nbtx_parse.
+   * The memory belongs to the store, and stays good until the key is released
+   * for the last time.
+   */
+  const void* nbtx_store_get(const nbtx_store* store, nbtx_digest key, size_t* length);
+
+  /*
+   * Drops a reference added by nbtx_store_put, removing the canonical form
+   * when no references are left. Returns NBTX_ERR if nothing is stored under
+   * `key'.
+   */
+  nbtx_status nbtx_store_release(nbtx_store* store, nbtx_digest key);
+
+  /* Sets how many distinct trees the store holds, and how many bytes they take. */
+  void nbtx_store_usage(const nbtx_store* store, size_t* entries, size_t* bytes);
+
+  /***** Schema-Directed Decoding *****/
+
+  /*
+   * A string or byte array inside a block of memory. nbtx_decode_struct does
+   * not copy them, so `data' points into the decoded memory and is NOT
+   * null-terminated.
+   */
+  typedef struct nbtx_span {
+    const void* data;
+    uint32_t length;
+  } nbtx_span;
+
+  struct nbtx_schema;
+
+  /*
+   * Describes a member of a C struct which holds the compound member `name'.
+   * The member's C type follows from `type':
+   *
+   *   TAG_Byte ... TAG_Double     int8_t ... double, as in nbtx_node's payload
+   *   TAG_ByteArray, TAG_String   nbtx_span
+   *   TAG_Compound                another struct, described by `schema'
+   *
+   * Lists can't be decoded into structs; they are skipped like any member the
+   * schema doesn't know about.
+   */
+  typedef struct nbtx_field {
+    const char* name;
+    nbtx_type type;
+    size_t offset; /* offsetof the member in the struct. */
+    const struct nbtx_schema* schema; /* Only for TAG_Compound members. */
+  } nbtx_field;
+
+  /* Describes the member `member' of `struct_type'. */
+  #define NBTX_FIELD(struct_type, member, type) \
+    { #member, (type), offsetof(struct_type, member), NULL }
+
+  typedef struct nbtx_schema nbtx_schema;
+
+  /*
+   * Registers a struct layout for nbtx_decode_struct and nbtx_encode_struct.
+   * The fields are copied, but not the names or nested schemas they point to,
+   * which must outlive the schema. Returns NULL if two fields share a name or
+   * a field is invalid, in which case errno is set to NBTX_ERR, or on memory
+   * errors.
+   */
+  nbtx_schema* nbtx_schema_new(const nbtx_field* fields, size_t count);
+
+  /* Frees a schema. Nested schemas must be freed separately. */
+  void nbtx_schema_free(nbtx_schema* schema);
+
+  /*
+   * Decodes an uncompressed tree whose root is a compound straight into the
+   * struct `out', without building any nodes or allocating memory. Members the
+   * schema doesn't know about are skipped, and struct members whose tags are
+   * missing are left untouched, so you'll probably want to zero `out' first.
+   * Spans point into `memory', so keep it around as long as you use them.
+   *
+   * Returns NBTX_ERR if the tree is corrupt or a member has a different type
+   * than the schema says, and NBTX_EDEPTH if a skipped member nests deeper than
+   * nbtx_get_max_depth(). `out' may be partially filled in that case.
+   */
+  nbtx_status nbtx_decode_struct(const void* memory, size_t length,
+                                 const nbtx_schema* schema, void* out);
+
+  /*
+   * Dumps the struct `in' as a compound named `name' (may be NULL), in the same
+   * format as nbtx_dump_binary. If an error occurs, a buffer with a NULL `data'
+   * pointer will be returned, and errno will be set.
+   *
+   * Don't forget to free buf->data.
+   */
+  struct buffer nbtx_encode_struct(const void* in, const nbtx_schema* schema,
+                                   const char* name);
+
+  /***** Queries *****/
+
+  /*
+   * A value found by a query. Names and strings are NOT null-terminated, and
+   * on buffers they point into the buffer, so keep it around as long as you
+   * use them. `data' and `length' hold:
+   *
+   *   TAG_Byte ... TAG_Double     the number, in host byte order (use memcpy,
+   *                               it may be misaligned)
+   *   TAG_ByteArray, TAG_String   the bytes, without their length
+   *   TAG_List, TAG_Compound      the payload as dumped on buffers; nothing
+   *                               on trees, use `node' there
+   */
+  typedef struct nbtx_value {
+    nbtx_type type;
+    const char* name;      /* NULL for list elements. */
+    size_t name_length;
+    const void* data;
+    size_t length;
+    const nbtx_node* node; /* The node, if the query ran on a tree. NULL otherwise. */
+  } nbtx_value;
+
+  /* Called for every match of a query, in document order. Return false to stop. */
+  typedef bool (*nbtx_match_t)(const nbtx_value* value, void* aux);
+
+  typedef struct nbtx_query nbtx_query;
+
+  /*
+   * Compiles a query, which picks values out of a tree starting from the root.
+   * A query is a sequence of steps, each taking the values the ones before it
+   * picked to new ones:
+   *
+   *   name, .name     the member `name' of compounds (the first one, if there
+   *                   are several). Names can be "quoted", with \" and \\
+   *                   escaped inside. An empty query picks the root itself.
+   *   .*, [*]         every member of lists and compounds
+   *   [3], [-1]       an element of lists, counting from the end if negative
+   *   [name]          compounds with a member `name'
+   *   [name == 3]     compounds whose member `name' compares true to a number
+   *                   or "string", with ==, !=, <, <=, > or >=. Values of
+   *                   other types only satisfy !=, as does NaN.
+   *   ..name, ..*     every member named `name' (or any) below, at any depth
+   *
+   * So `Entities[*][id == "zombie"].Health' finds the health of every zombie in
+   * the list `Entities'. Unlike with nbtx_find_by_path, the root's name is not
+   * part of the query. Returns NULL with errno set to NBTX_ERR if the query
+   * is malformed, or on memory errors.
+   */
+  nbtx_query* nbtx_query_compile(const char* text);
+
+  void nbtx_query_free(nbtx_query* query);
+
+  /*
+   * Runs a query on a tree, calling `match' for what it finds. Returns
+   * NBTX_EMEM if recursive descent into a very deep tree runs out of memory.
+   */
+  nbtx_status nbtx_query_run(const nbtx_query* query, const nbtx_node* tree,
+                             nbtx_match_t match, void* aux);
+
+  /*
+   * The same as nbtx_query_run, on an uncompressed tree in binary form instead,
+   * without building any nodes. Strings, byte arrays and lists of numbers
+   * that can't match are jumped over; lists and compounds have to be scanned,
+   * since their size isn't written down. Returns NBTX_ERR if the tree is
+   * corrupt, or NBTX_EDEPTH if something jumped over nests deeper than
+   * nbtx_get_max_depth(), in which case `match' may have been called for some
+   * values already.
+   */
+  nbtx_status nbtx_query_run_raw(const nbtx_query* query, const void* memory, size_t length,
+                                 nbtx_match_t match, void* aux);
+
+  /*
+   * Looks up a path like nbtx_find_by_path does, in an uncompressed tree in
+   * binary form, and sets `out' to what's there. Nothing is built or
+   * allocated: members that don't match are jumped over, and the search
+   * stops at the first hit. Returns NBTX_ENOTFOUND if nothing is at `path',
+   * NBTX_ERR if the part of the tree that had to be read is corrupt, and
+   * NBTX_EDEPTH if something jumped over nests deeper than
+   * nbtx_get_max_depth().
+   */
+  nbtx_status nbtx_peek_path(const void* memory, size_t length, const char* path, nbtx_value* out);
+
+  /*
+   * Overwrites the payload at `path' in an uncompressed tree in binary form,
+   * in place. `value' is described like the values nbtx_peek_path finds, and
+   * must have the same type and size as what's there: that's any number, or
+   * a string or byte array of the same length. Returns NBTX_ENOTFOUND if
+   * nothing is at `path', and NBTX_ERR if the value doesn't fit or the tree
+   * is corrupt.
+   */
+  nbtx_status nbtx_poke_path(void* memory, size_t length, const char* path, const nbtx_value* value);
+
+  /*
+   * The same as nbtx_poke_path, for values of any size: the rest of the buffer
+   * is moved to make room, and it grows if needed. Members of compounds may
+   * change type, elements of lists may not. Lists and compounds are given as
+   * their payload in binary form, like nbtx_peek_path finds them. `b' must
+   * have been allocated by the library (by nbtx_dump_binary, for instance),
+   * and `value' mustn't point into it. The index of nbtx_dump_binary_indexed
+   * is dropped, since it would be out of date. On errors, the buffer is left
+   * as it was.
+   */
+  nbtx_status nbtx_splice_path(struct buffer* b, const char* path, const nbtx_value* value);
+
+  /*
+   * Convert a number found by a query or nbtx_peek_path, whatever its type.
+   * Floats are rounded toward zero, and clamped, to become integers. Return
+   * false if `value' isn't a number.
+   */
+  bool nbtx_value_to_long(const nbtx_value* value, int64_t* out);
+  bool nbtx_value_to_double(const nbtx_value* value, double* out);
+
+  /***** Memory Management *****/
+
+  /*
+   * Where the library gets its memory from, zlib's included. `user' is handed
+   * to every call. `malloc' and `realloc' return NULL when they're out of
+   * memory (or over budget), which the library reports as NBTX_EMEM.
+   */
+  typedef struct nbtx_allocator {
+    void* (*malloc)(size_t size, void* user);
+    void* (*realloc)(void* ptr, size_t size, void* user);
+    void  (*free)(void* ptr, void* user);
+    void* user;
+  } nbtx_allocator;
+
+  /*
+   * Makes the library allocate through `allocator' (which is copied), or
+   * through the C library again if it's NULL. Returns NBTX_ERR if one of the
+   * functions is missing.
+   *
+   * Call this before building any trees, and not while other threads use the
+   * library: memory must be freed by the allocator it came from. That goes for
+   * the memory the library hands out too, like buffers (free them with
+   * buffer_free) and the strings of nbtx_dump_ascii, and for nodes and list
+   * entries you link into trees yourself. To parse with a different allocator
+   * per thread or pool, see nbtx_ctx_new_with_allocator.
+   */
+  nbtx_status nbtx_set_allocator(const nbtx_allocator* allocator);
+
+  /*
+   * Like nbtx_ctx_new, but the trees parsed with the context take their
+   * memory from `allocator' (which is copied) instead of the one given to
+   * nbtx_set_allocator, so threads or pools can each have their own. NULL
+   * means the library's allocator. Returns NULL with NBTX_ERR if one of the
+   * functions is missing.
+   *
+   * Such trees may be read, but not modified, cloned or freed with nbtx_free:
+   * hand them back with nbtx_ctx_recycle, and don't recycle other trees into
+   * the context. The context's own bookkeeping, the decompression buffer and
+   * the inflate state still come from the library's allocator.
+   */
+  nbtx_parse_ctx* nbtx_ctx_new_with_allocator(const nbtx_allocator* allocator);
+
+  /*
+   * Allocates memory with the current allocator, for the nbtx_put_*_take
+   * functions. Returns NULL if it's out of memory.
+   */
+  void* nbtx_alloc_memory(size_t size);
+
+  /* Frees memory the library handed out, with the current allocator. */
+  void nbtx_free_memory(void* ptr);
+
+  /***** Statistics *****/
+
+  /*
+   * The library counts what it does if it was built with NBTX_STATS defined
+   * (the NBTX_STATS option in CMake). Otherwise the counters are compiled out
+   * and always read as zero.
+   *
+   * Every allocation is charged to the subsystem that made it.
+   */
+  typedef enum {
+    NBTX_SUBSYSTEM_PARSE,    /* nbtx_parse and friends. */
+    NBTX_SUBSYSTEM_CLONE,    /* nbtx_clone, nbtx_clone_shared and nbtx_filter. */
+    NBTX_SUBSYSTEM_PUT,      /* nbtx_put_* and nbtx_new_*. */
+    NBTX_SUBSYSTEM_DUMP,     /* nbtx_dump_* and the caches behind nbtx_dump_binary_cached. */
+    NBTX_SUBSYSTEM_COMPRESS, /* Compressing and decompressing. */
+    NBTX_SUBSYSTEM_OTHER,    /* Everything else. */
+    NBTX_SUBSYSTEM_COUNT
+  } nbtx_subsystem;
+
+  typedef struct nbtx_stats {
+    uint64_t allocations[NBTX_SUBSYSTEM_COUNT];
+    uint64_t bytes_allocated[NBTX_SUBSYSTEM_COUNT];
+    uint64_t nodes_created;
+    uint64_t nodes_freed;
+    uint64_t bytes_inflated;       /* Decompressed output. */
+    uint64_t bytes_deflated;       /* Compressed output. */
+    uint64_t buffer_reallocations; /* Times a buffer had to grow. */
+  } nbtx_stats;
+
+  typedef enum {
+    NBTX_STATS_THREAD, /* What the calling thread did. */
+    NBTX_STATS_PROCESS /* What every thread did, summed up. */
+  } nbtx_stats_scope;
+
+  /*
+   * Returns the counters, since the last nbtx_stats_reset covering them. Each
+   * thread counts on its own, so this is cheap enough to leave on; reading the
+   * counters of other threads while they work gives a slightly stale sum.
+   */
+  nbtx_stats nbtx_stats_get(nbtx_stats_scope scope);
+
+  /* Sets the counters of the calling thread, or of every thread, to zero. */
+  void nbtx_stats_reset(nbtx_stats_scope scope);
+
   /* TODO: More utilities as requests are made and patches contributed. */
 
                         /***** Utility Functions *****/
 
-  /* Returns true if the trees are identical. */
+  /*
+   * Returns true if the trees are identical. Floats and doubles only have to
+   * be very close. Nodes shared by both trees, like those of a tree and its
+   * nbtx_clone_shared, are equal without being looked at.
+   */
   bool nbtx_eq(const nbtx_node* restrict a, const nbtx_node* restrict b);
 
+  /*
+   * The same as nbtx_eq, but lists and compounds whose hashes are cached (see
+   * nbtx_hash) and differ are told apart without walking them. Only use it on
+   * trees whose hand-made changes went through nbtx_mark_dirty, or a stale
+   * hash makes equal trees compare different. Floats and doubles compare the
+   * way they hash: exactly, except that all NaNs are equal and so are 0.0 and
+   * -0.0.
+   */
+  bool nbtx_eq_hashed(const nbtx_node* restrict a, const nbtx_node* restrict b);
+
+  /*
+   * Returns a 64-bit hash of a tree: of its type, name and payload, and those
+   * of everything in it, in order. It's the same on every run and platform.
+   * Floats and doubles hash the bits nbtx_dump_canonical would write for them,
+   * so trees that are nbtx_eq_hashed hash the same, but trees that are only
+   * nbtx_eq because their floats are close may not. Returns 0 for NULL.
+   *
+   * Like with nbtx_dump_binary_cached, every list and compound that holds
+   * about NBTX_CACHE_MIN_SIZE bytes or more keeps its hash until it changes,
+   * so hashing a tree again costs about as much as what changed in it. The
+   * same rules about nbtx_mark_dirty and concurrency apply.
+   */
+  uint64_t nbtx_hash(nbtx_node* tree);
+
   /*
    * Converts a type to a print-friendly string. The string is statically
    * allocated, and therefore does not have to be freed by the user.
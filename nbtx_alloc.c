@@ -0,0 +1,81 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbtx.h"
+#include "nbtx_internal.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void* default_malloc(const size_t size, void* user) {
+  (void)user;
+  return malloc(size);
+}
+
+static void* default_realloc(void* ptr, const size_t size, void* user) {
+  (void)user;
+  return realloc(ptr, size);
+}
+
+static void default_free(void* ptr, void* user) {
+  (void)user;
+  free(ptr);
+}
+
+nbtx_allocator nbtx_allocator_ = { default_malloc, default_realloc, default_free, NULL };
+
+nbtx_status nbtx_set_allocator(const nbtx_allocator* allocator) {
+  if (allocator == NULL) {
+    nbtx_allocator_ = (nbtx_allocator) { default_malloc, default_realloc, default_free, NULL };
+    return NBTX_OK;
+  }
+
+  if (allocator->malloc == NULL || allocator->realloc == NULL || allocator->free == NULL)
+    return NBTX_ERR;
+
+  nbtx_allocator_ = *allocator;
+  return NBTX_OK;
+}
+
+void* nbtx_alloc_memory(const size_t size) {
+  return nbtx_malloc_(size);
+}
+
+void nbtx_free_memory(void* ptr) {
+  nbtx_free_(ptr);
+}
+
+void* nbtx_grow_stack_(void* frames, size_t* capacity, const size_t size, const bool on_heap) {
+  const size_t grown = *capacity ? 2 * *capacity : 64;
+  if (grown > SIZE_MAX / size) return NULL;
+
+  void* ret = on_heap ? nbtx_realloc_(frames, grown * size) : nbtx_malloc_(grown * size);
+  if (ret == NULL) return NULL;
+
+  if (!on_heap && *capacity > 0)
+    memcpy(ret, frames, *capacity * size);
+
+  *capacity = grown;
+  return ret;
+}
+
+void* nbtx_zalloc_(void* opaque, const unsigned items, const unsigned size) {
+  (void)opaque;
+
+  /* zlib doesn't need zeroed memory, and its windows are big. */
+  if (size != 0 && items > SIZE_MAX / size) return NULL;
+  return nbtx_malloc_((size_t)items * size);
+}
+
+void nbtx_zfree_(void* opaque, void* ptr) {
+  (void)opaque;
+  nbtx_free_(ptr);
+}
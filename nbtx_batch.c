@@ -0,0 +1,584 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#define _DEFAULT_SOURCE /* For syscall, and for O_CLOEXEC with -std=c11. */
+
+#include "nbtx.h"
+#include "nbtx_internal.h"
+
+#include "buffer.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef NBTX_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/* More threads than this are more likely a bug than a big machine. */
+#define MAX_THREADS 256
+
+/* How much more to read at a time once we're past the size a file said it had. */
+#define READ_SIZE 4096
+
+/*
+ * Files being opened or read at once through io_uring, and also the most read
+ * files that may wait to be parsed, so memory stays bounded when the parsers
+ * fall behind.
+ */
+#define FILES_IN_FLIGHT 64
+
+/* A file that has been read and waits to be parsed. */
+struct loaded {
+  size_t index;
+  struct buffer raw;
+};
+
+struct batch {
+  const char* const* paths;
+  size_t count;
+  nbtx_node** trees;
+  nbtx_status* errors;
+
+  atomic_size_t next;   /* The next file nobody has started reading. */
+  atomic_size_t parsed; /* Files that made it into `trees'. */
+
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct loaded queue[FILES_IN_FLIGHT]; /* From `first', `queued' of them. */
+  size_t first, queued;
+  bool read_all; /* Nothing more will be queued. */
+
+  size_t first_failed; /* Under `lock' too. */
+  nbtx_status first_error;
+};
+
+static void failed(struct batch* b, const size_t i, const nbtx_status status) {
+  if (b->errors) b->errors[i] = status;
+
+  pthread_mutex_lock(&b->lock);
+
+  if (i < b->first_failed) {
+    b->first_failed = i;
+    b->first_error = status;
+  }
+
+  pthread_mutex_unlock(&b->lock);
+}
+
+static void parse(struct batch* b, const size_t i, struct buffer raw) {
+  errno = NBTX_OK;
+
+  nbtx_node* tree = nbtx_parse_compressed(raw.data, raw.len);
+  buffer_free(&raw);
+
+  if (tree == NULL) {
+    failed(b, i, errno != NBTX_OK ? errno : NBTX_ERR);
+    return;
+  }
+
+  b->trees[i] = tree;
+  atomic_fetch_add(&b->parsed, 1);
+}
+
+/*
+ * Reads a whole file with a blocking read or two. Returns a NULL buffer and
+ * sets errno on error.
+ */
+static struct buffer read_path(const char* path) {
+  struct buffer ret = NBTX_BUFFER_INIT;
+
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return (errno = NBTX_EIO), ret;
+
+  /* One more byte than the file has, so the first read already sees the end. */
+  struct stat st;
+  size_t more = fstat(fd, &st) == 0 && st.st_size > 0 ? (size_t)st.st_size + 1 : READ_SIZE;
+
+  for (;;) {
+    if (buffer_reserve(&ret, ret.len + more)) {
+      errno = NBTX_EMEM;
+      break;
+    }
+
+    const ssize_t n = read(fd, ret.data + ret.len, ret.cap - ret.len);
+
+    if (n < 0 && errno == EINTR) continue;
+
+    if (n < 0) {
+      buffer_free(&ret);
+      errno = NBTX_EIO;
+      break;
+    }
+
+    if (n == 0) break;
+
+    ret.len += (size_t)n;
+    more = READ_SIZE;
+  }
+
+  close(fd);
+  return ret;
+}
+
+/* Reads and parses the files nobody has started on, one at a time. */
+static void* run_reader(void* arg) {
+  struct batch* b = arg;
+
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_PARSE);
+
+  for (size_t i; (i = atomic_fetch_add(&b->next, 1)) < b->count;) {
+    struct buffer raw = read_path(b->paths[i]);
+
+    if (raw.data == NULL) failed(b, i, errno);
+    else                  parse(b, i, raw);
+  }
+
+  NBTX_STATS_LEAVE();
+  return NULL;
+}
+
+/* Takes the oldest file that waits to be parsed. Returns false if there's none. */
+static bool take(struct batch* b, struct loaded* l, const bool wait) {
+  pthread_mutex_lock(&b->lock);
+
+  while (wait && b->queued == 0 && !b->read_all)
+    pthread_cond_wait(&b->ready, &b->lock);
+
+  const bool ret = b->queued > 0;
+
+  if (ret) {
+    *l = b->queue[b->first];
+    b->first = (b->first + 1) % FILES_IN_FLIGHT;
+    --b->queued;
+  }
+
+  pthread_mutex_unlock(&b->lock);
+  return ret;
+}
+
+/* Parses what others have read, until they're done reading. */
+static void* run_parser(void* arg) {
+  struct batch* b = arg;
+  struct loaded l;
+
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_PARSE);
+
+  while (take(b, &l, true))
+    parse(b, l.index, l.raw);
+
+  NBTX_STATS_LEAVE();
+  return NULL;
+}
+
+#ifdef NBTX_HAVE_IO_URING
+
+/*
+ * io_uring, through the system calls themselves so it doesn't take liburing.
+ * Only the calling thread touches the ring: it opens, sizes and reads the
+ * files, and hands what it has read to the parsers, parsing too whenever it
+ * has nothing else to do.
+ */
+struct ring {
+  int fd;
+
+  void* sq_map;
+  void* cq_map;
+  size_t sq_size, cq_size;
+
+  atomic_uint* sq_tail;
+  unsigned sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned unsubmitted;
+
+  atomic_uint* cq_head;
+  atomic_uint* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+};
+
+static void ring_free(struct ring* r) {
+  if (r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+  if (r->cq_map != MAP_FAILED && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_size);
+  if (r->sq_map != MAP_FAILED) munmap(r->sq_map, r->sq_size);
+
+  close(r->fd);
+}
+
+/* Whether the kernel knows every operation we use. */
+static bool ring_supported(const struct ring* r) {
+  static const int ops[] = { IORING_OP_OPENAT, IORING_OP_READ };
+  const unsigned max_ops = 256;
+  bool ret = true;
+
+  struct io_uring_probe* probe = nbtx_calloc_(1, sizeof(*probe) + max_ops * sizeof(probe->ops[0]));
+  if (probe == NULL) return false;
+
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, max_ops) < 0)
+    ret = false;
+
+  for (size_t i = 0; ret && i < sizeof(ops) / sizeof(ops[0]); ++i)
+    ret = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+
+  nbtx_free_(probe);
+  return ret;
+}
+
+static bool ring_init(struct ring* r, const unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  *r = (struct ring) { .sq_map = MAP_FAILED, .cq_map = MAP_FAILED, .sqes = MAP_FAILED };
+
+  if ((r->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    return false;
+
+  r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  const bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+
+  r->sq_map = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_map == MAP_FAILED) goto init_error;
+
+  r->cq_map = single_mmap ? r->sq_map : mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  if (r->cq_map == MAP_FAILED) goto init_error;
+
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) goto init_error;
+
+  char* const sq = r->sq_map;
+  char* const cq = r->cq_map;
+
+  r->sq_tail = (atomic_uint*)(sq + p.sq_off.tail);
+  r->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned*)(sq + p.sq_off.array);
+
+  r->cq_head = (atomic_uint*)(cq + p.cq_off.head);
+  r->cq_tail = (atomic_uint*)(cq + p.cq_off.tail);
+  r->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  if (!ring_supported(r)) goto init_error;
+
+  return true;
+
+init_error:
+  ring_free(r);
+  return false;
+}
+
+/*
+ * Queues an operation, to be submitted by the next ring_enter. The kernel
+ * doesn't look at it before that, so the caller may still fill in the rest.
+ */
+static struct io_uring_sqe* ring_queue(struct ring* r, const uint8_t opcode, const int fd, const void* addr,
+                                       const uint32_t len, const uint64_t off, const uint64_t data) {
+  const unsigned tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed);
+  struct io_uring_sqe* sqe = &r->sqes[tail & r->sq_mask];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)addr;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = data;
+
+  r->sq_array[tail & r->sq_mask] = tail & r->sq_mask;
+  atomic_store_explicit(r->sq_tail, tail + 1, memory_order_release);
+  ++r->unsubmitted;
+
+  return sqe;
+}
+
+/*
+ * Submits what's queued and, if `wait', waits for something to complete.
+ * Returns false if the ring broke.
+ */
+static bool ring_enter(struct ring* r, const bool wait) {
+  while (r->unsubmitted > 0 || wait) {
+    const long n = syscall(__NR_io_uring_enter, r->fd, r->unsubmitted, wait ? 1 : 0,
+                           wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return false;
+
+    r->unsubmitted -= (unsigned)n;
+    if (wait) break;
+  }
+
+  return true;
+}
+
+/* A file being opened or read, and what it has read so far. */
+struct file {
+  size_t index;
+  int fd;
+  struct buffer raw;
+};
+
+struct reading {
+  struct batch* b;
+  struct ring* r;
+
+  struct file files[FILES_IN_FLIGHT];
+  size_t free[FILES_IN_FLIGHT]; /* Unused files, `nfree' of them. */
+  size_t nfree;
+};
+
+/* The file and whether it's being opened, which is all a completion needs. */
+static uint64_t user_data(const struct reading* rd, const struct file* f, const bool opening) {
+  return (uint64_t)(f - rd->files) * 2 + opening;
+}
+
+/* Hands a file to the parsers, or fails it, and makes room for another one. */
+static void done(struct reading* rd, struct file* f, const nbtx_status status) {
+  struct batch* b = rd->b;
+
+  if (f->fd >= 0) close(f->fd);
+  rd->free[rd->nfree++] = (size_t)(f - rd->files);
+
+  if (status != NBTX_OK) {
+    buffer_free(&f->raw);
+    failed(b, f->index, status);
+    return;
+  }
+
+  pthread_mutex_lock(&b->lock);
+  b->queue[(b->first + b->queued++) % FILES_IN_FLIGHT] = (struct loaded) { f->index, f->raw };
+  pthread_cond_signal(&b->ready);
+  pthread_mutex_unlock(&b->lock);
+}
+
+/* Reads the rest of the file, at least `more' bytes of it. */
+static void read_more(struct reading* rd, struct file* f, const size_t more) {
+  if (buffer_reserve(&f->raw, f->raw.len + more)) {
+    done(rd, f, NBTX_EMEM);
+    return;
+  }
+
+  const size_t room = f->raw.cap - f->raw.len;
+
+  ring_queue(rd->r, IORING_OP_READ, f->fd, f->raw.data + f->raw.len,
+             room > UINT32_MAX ? UINT32_MAX : (uint32_t)room, f->raw.len, user_data(rd, f, false));
+}
+
+static void start(struct reading* rd, const size_t index) {
+  struct file* f = &rd->files[rd->free[--rd->nfree]];
+
+  *f = (struct file) { .index = index, .fd = -1, .raw = NBTX_BUFFER_INIT };
+
+  ring_queue(rd->r, IORING_OP_OPENAT, AT_FDCWD, rd->b->paths[index], 0, 0, user_data(rd, f, true))
+    ->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+static void complete(struct reading* rd, const struct io_uring_cqe* cqe) {
+  struct file* f = &rd->files[cqe->user_data / 2];
+  const int res = cqe->res;
+
+  if (res < 0) {
+    done(rd, f, NBTX_EIO);
+    return;
+  }
+
+  /*
+   * Once it's open, fstat only looks at the inode the open brought in. Going
+   * through the ring, statx would cost a trip to a kernel worker thread.
+   */
+  if (cqe->user_data % 2) {
+    struct stat st;
+
+    f->fd = res;
+    read_more(rd, f, fstat(f->fd, &st) == 0 && st.st_size > 0 ? (size_t)st.st_size + 1 : READ_SIZE);
+    return;
+  }
+
+  const bool filled = f->raw.len + (size_t)res == f->raw.cap;
+  f->raw.len += (size_t)res;
+
+  /* The buffer has a byte more than the file, so a short read is the end. */
+  if (res > 0 && filled) read_more(rd, f, READ_SIZE);
+  else                   done(rd, f, NBTX_OK);
+}
+
+/* Handles whatever has completed. Returns how much that was. */
+static unsigned reap(struct reading* rd) {
+  struct ring* r = rd->r;
+  unsigned head = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+  const unsigned tail = atomic_load_explicit(r->cq_tail, memory_order_acquire);
+  const unsigned ret = tail - head;
+
+  for (; head != tail; ++head) {
+    const struct io_uring_cqe cqe = r->cqes[head & r->cq_mask];
+
+    /* Free the entry first: completing it may queue more. */
+    atomic_store_explicit(r->cq_head, head + 1, memory_order_release);
+    complete(rd, &cqe);
+  }
+
+  return ret;
+}
+
+/*
+ * Reads every file through the ring and hands them to the parsers. Returns
+ * false if the ring broke; the files it was still reading are then read again
+ * the blocking way. Whatever the kernel still had of them is leaked, since it
+ * may yet write to it.
+ */
+static bool run_ring(struct batch* b, struct ring* r) {
+  struct reading rd = { .b = b, .r = r, .nfree = FILES_IN_FLIGHT };
+  struct loaded l;
+
+  for (size_t i = 0; i < FILES_IN_FLIGHT; ++i)
+    rd.free[i] = FILES_IN_FLIGHT - 1 - i;
+
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_PARSE);
+
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    const size_t queued = b->queued;
+    pthread_mutex_unlock(&b->lock);
+
+    size_t next = atomic_load_explicit(&b->next, memory_order_relaxed);
+
+    /* Files being read and files waiting to be parsed share FILES_IN_FLIGHT. */
+    for (; next < b->count && rd.nfree > queued; ++next)
+      start(&rd, next);
+
+    atomic_store_explicit(&b->next, next, memory_order_relaxed);
+
+    if (next == b->count && rd.nfree == FILES_IN_FLIGHT)
+      break;
+
+    if (!ring_enter(r, false)) goto ring_error;
+    if (reap(&rd) > 0) continue;
+
+    if (take(b, &l, false)) {
+      parse(b, l.index, l.raw);
+      continue;
+    }
+
+    /* The parsers took what held us back, so there's more to start. */
+    if (rd.nfree == FILES_IN_FLIGHT) continue;
+
+    if (!ring_enter(r, true)) goto ring_error;
+    reap(&rd);
+  }
+
+  NBTX_STATS_LEAVE();
+  return true;
+
+ring_error:
+  for (size_t i = 0; i < FILES_IN_FLIGHT; ++i) {
+    bool used = true;
+
+    for (size_t j = 0; used && j < rd.nfree; ++j)
+      used = rd.free[j] != i;
+
+    if (!used) continue;
+
+    const size_t index = rd.files[i].index;
+    struct buffer raw = read_path(b->paths[index]);
+
+    if (raw.data == NULL) failed(b, index, errno);
+    else                  parse(b, index, raw);
+  }
+
+  NBTX_STATS_LEAVE();
+  return false;
+}
+
+#endif /* NBTX_HAVE_IO_URING */
+
+size_t nbtx_parse_paths(const char* const* paths, const size_t count, nbtx_node** trees,
+                        nbtx_status* errors, unsigned threads, const nbtx_io_mode mode) {
+  assert(count == 0 || (paths && trees));
+
+  if (threads == 0) {
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online > 0 ? (unsigned)online : 1;
+  }
+  if (threads > MAX_THREADS) threads = MAX_THREADS;
+  if (threads > count) threads = count > 0 ? (unsigned)count : 1;
+
+  for (size_t i = 0; i < count; ++i) {
+    trees[i] = NULL;
+    if (errors) errors[i] = NBTX_OK;
+  }
+
+  struct batch b = { .paths = paths, .count = count, .trees = trees, .errors = errors,
+                     .first = 0, .queued = 0, .read_all = false,
+                     .first_failed = count, .first_error = NBTX_OK };
+
+  atomic_init(&b.next, 0);
+  atomic_init(&b.parsed, 0);
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.ready, NULL);
+
+  bool ring = false;
+
+#ifdef NBTX_HAVE_IO_URING
+  struct ring r;
+  ring = mode == NBTX_IO_AUTO && count > 0 && ring_init(&r, FILES_IN_FLIGHT);
+#else
+  (void)mode;
+#endif
+
+  /* Threads that fail to start just leave more work to the others. */
+  pthread_t ids[MAX_THREADS];
+  unsigned started = 1;
+
+  for (; started < threads; ++started)
+    if (pthread_create(&ids[started], NULL, ring ? run_parser : run_reader, &b) != 0)
+      break;
+
+#ifdef NBTX_HAVE_IO_URING
+  if (ring) {
+    run_ring(&b, &r);
+    ring_free(&r);
+
+    pthread_mutex_lock(&b.lock);
+    b.read_all = true;
+    pthread_cond_broadcast(&b.ready);
+    pthread_mutex_unlock(&b.lock);
+
+    run_parser(&b);
+  }
+#endif
+
+  /* If the ring broke, this reads whatever it didn't get to. */
+  run_reader(&b);
+
+  for (unsigned i = 1; i < started; ++i)
+    pthread_join(ids[i], NULL);
+
+  pthread_cond_destroy(&b.ready);
+  pthread_mutex_destroy(&b.lock);
+
+  errno = b.first_error;
+  return atomic_load(&b.parsed);
+}
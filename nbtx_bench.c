@@ -0,0 +1,948 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+
+/*
+ * Times the main entry points of the library over trees of different shapes
+ * and sizes. The trees are built from a fixed seed, so every run measures the
+ * same work. Only the operation itself is timed: making its input and freeing
+ * its output happen outside of the clock.
+ *
+ * Allocations are counted when the build wraps malloc, calloc and realloc at
+ * link time (see CMakeLists.txt). Allocations made inside zlib aren't counted.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "nbtx.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef NBTX_BENCH_COUNT_ALLOCATIONS
+/* Atomic, for the parallel operations. */
+static atomic_size_t allocations;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  allocations++;
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+  allocations++;
+  return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  allocations++;
+  return __real_realloc(ptr, size);
+}
+#endif
+
+static void die(const char* message) {
+  fprintf(stderr, "%s\n", message);
+  exit(1);
+}
+
+static void die_with_err(int err) {
+  fprintf(stderr, "Error %i: %s\n", err, nbtx_error_to_string(err));
+  exit(1);
+}
+
+/* Dies if a put failed, otherwise returns the node that was put. */
+static nbtx_node* checked(const nbtx_result r) {
+  if (r.reference == NULL) die_with_err(errno);
+  return r.reference;
+}
+
+/***** Workloads *****/
+
+/* A small LCG, so the trees don't depend on the C library's rand. */
+static uint32_t next_random(uint64_t* state) {
+  *state = *state * 6364136223846793005u + 1442695040888963407u;
+  return (uint32_t)(*state >> 33);
+}
+
+/* Appends a path component, growing the path as needed. */
+static void path_append(char** path, const char* component) {
+  const size_t len = *path ? strlen(*path) : 0;
+  char* ret = realloc(*path, len + strlen(component) + 2);
+  if (ret == NULL) die_with_err(NBTX_EMEM);
+
+  sprintf(ret + len, "%s%s", len ? "." : "", component);
+  *path = ret;
+}
+
+/*
+ * Chains of nested compounds with a few numbers each, as deep as the parsers
+ * allow by default (counting the root).
+ */
+static nbtx_node* build_deep(const size_t nodes, uint64_t* seed, char** path) {
+  nbtx_node* root = nbtx_new_compound("root");
+  if (root == NULL) die_with_err(errno);
+
+  const size_t max = NBTX_DEFAULT_MAX_DEPTH - 2; /* Less the root and the chain. */
+  const size_t depth = nodes / 4 < max ? (nodes / 4 ? nodes / 4 : 1) : max;
+  const size_t chains = nodes / (4 * depth) ? nodes / (4 * depth) : 1;
+
+  path_append(path, "root");
+
+  for (size_t c = 0; c < chains; ++c) {
+    char name[32];
+    snprintf(name, sizeof name, "chain%zu", c);
+
+    nbtx_node* cur = checked(nbtx_put_compound(root, name, nbtx_new_tag_compound_payload()));
+    if (c + 1 == chains) path_append(path, name);
+
+    for (size_t level = 0; level < depth; ++level) {
+      checked(nbtx_put_int(cur, "level", (int32_t)level));
+      checked(nbtx_put_double(cur, "x", next_random(seed) / 65536.0));
+      checked(nbtx_put_string(cur, "tag", "deep"));
+
+      cur = checked(nbtx_put_compound(cur, "child", nbtx_new_tag_compound_payload()));
+      if (c + 1 == chains) path_append(path, "child");
+    }
+  }
+
+  return root;
+}
+
+/*
+ * Appends a new member to a compound. nbtx_put_* looks for a member by the same
+ * name first, which would make building wide trees take quadratic time, but we
+ * know our names are unique.
+ */
+static nbtx_node* append(nbtx_node* compound, const char* name, const nbtx_type type) {
+  nbtx_node* node = calloc(1, sizeof(*node));
+  struct nbtx_list* entry = malloc(sizeof(*entry));
+  char* name_copy = malloc(strlen(name) + 1);
+
+  if (node == NULL || entry == NULL || name_copy == NULL)
+    die_with_err(NBTX_EMEM);
+
+  node->type = type;
+  node->refcount = 1;
+  node->name = strcpy(name_copy, name);
+
+  entry->data = node;
+  list_add_tail(&entry->entry, &compound->payload.tag_compound->entry);
+
+  return node;
+}
+
+/* A single compound with lots of members of different types. */
+static nbtx_node* build_wide(const size_t nodes, uint64_t* seed, char** path) {
+  static const char text[] = "a string of medium length";
+
+  nbtx_node* root = nbtx_new_compound("root");
+  if (root == NULL) die_with_err(errno);
+
+  char name[32];
+
+  for (size_t i = 0; i < nodes; ++i) {
+    snprintf(name, sizeof name, "field%zu", i);
+
+    switch (i % 5) {
+      case 0: append(root, name, NBTX_TAG_INT)->payload.tag_int = (int32_t)next_random(seed); break;
+      case 1: append(root, name, NBTX_TAG_LONG)->payload.tag_long = (int64_t)next_random(seed) << 20; break;
+      case 2: append(root, name, NBTX_TAG_DOUBLE)->payload.tag_double = next_random(seed) / 1024.0; break;
+      case 3: append(root, name, NBTX_TAG_SHORT)->payload.tag_short = (int16_t)next_random(seed); break;
+      case 4: {
+        char* copy = malloc(sizeof text);
+        if (copy == NULL) die_with_err(NBTX_EMEM);
+        append(root, name, NBTX_TAG_STRING)->payload.tag_string = memcpy(copy, text, sizeof text);
+        break;
+      }
+    }
+  }
+
+  path_append(path, "root");
+  path_append(path, name);
+  return root;
+}
+
+/* Lists of numbers, strings and small compounds. */
+static nbtx_node* build_lists(const size_t nodes, uint64_t* seed, char** path) {
+  nbtx_node* root = nbtx_new_compound("root");
+  if (root == NULL) die_with_err(errno);
+
+  const size_t elems = 32;
+  const size_t lists = nodes / elems ? nodes / elems : 1;
+  char name[32];
+
+  for (size_t i = 0; i < lists; ++i) {
+    static const nbtx_type types[] = { NBTX_TAG_INT, NBTX_TAG_DOUBLE, NBTX_TAG_STRING, NBTX_TAG_COMPOUND };
+    const nbtx_type type = types[i % 4];
+
+    snprintf(name, sizeof name, "list%zu", i);
+    nbtx_node* list = checked(nbtx_put_list(root, name, nbtx_new_tag_list_payload(type)));
+
+    for (size_t j = 0; j < elems; ++j) {
+      if (type == NBTX_TAG_INT) {
+        checked(nbtx_put_int(list, NULL, (int32_t)next_random(seed)));
+      } else if (type == NBTX_TAG_DOUBLE) {
+        checked(nbtx_put_double(list, NULL, next_random(seed) / 3.0));
+      } else if (type == NBTX_TAG_STRING) {
+        checked(nbtx_put_string(list, NULL, "element"));
+      } else {
+        nbtx_node* item = checked(nbtx_put_compound(list, NULL, nbtx_new_tag_compound_payload()));
+        checked(nbtx_put_ubyte(item, "count", (uint8_t)next_random(seed)));
+        checked(nbtx_put_string(item, "id", "item"));
+      }
+    }
+  }
+
+  path_append(path, "root");
+  path_append(path, name);
+  return root;
+}
+
+/* Byte arrays between 256 bytes and 4 KiB, one for every hundred nodes. */
+static nbtx_node* build_byte_arrays(const size_t nodes, uint64_t* seed, char** path) {
+  nbtx_node* root = nbtx_new_compound("root");
+  if (root == NULL) die_with_err(errno);
+
+  const size_t arrays = nodes / 100 ? nodes / 100 : 1;
+  unsigned char* data = malloc(4096);
+  if (data == NULL) die_with_err(NBTX_EMEM);
+
+  char name[32];
+
+  for (size_t i = 0; i < arrays; ++i) {
+    const uint32_t length = 256 + next_random(seed) % (4096 - 256);
+
+    for (uint32_t j = 0; j < length; ++j)
+      data[j] = (unsigned char)next_random(seed);
+
+    snprintf(name, sizeof name, "blob%zu", i);
+    checked(nbtx_put_byte_array(root, name, data, length));
+  }
+
+  free(data);
+
+  path_append(path, "root");
+  path_append(path, name);
+  return root;
+}
+
+static const struct shape {
+  const char* name;
+  nbtx_node* (*build)(size_t nodes, uint64_t* seed, char** path);
+} shapes[] = {
+  { "deep", build_deep },
+  { "wide", build_wide },
+  { "lists", build_lists },
+  { "byte_arrays", build_byte_arrays },
+};
+
+static const struct size {
+  const char* name;
+  size_t nodes;
+} sizes[] = {
+  { "small", 100 },
+  { "medium", 10000 },
+  { "large", 200000 },
+};
+
+/***** Operations *****/
+
+/* Files loaded by the nbtx_parse_path* benchmarks. */
+#define FILES_PER_RUN 64
+
+struct context {
+  nbtx_node* tree;       /* The tree of the workload. */
+  nbtx_node* copy;       /* An equal tree which shares no nodes with it. */
+  struct buffer raw;     /* The tree, dumped. */
+  struct buffer indexed; /* The same, with an index at the end. */
+  struct buffer compressed;
+  const char* path;      /* Of the last node of the tree. */
+  nbtx_parse_ctx* ctx;   /* Shared by the iterations, so it warms up. */
+  nbtx_query* query;     /* Finds the same node as `path'. */
+  nbtx_writer* writer;   /* Writes into `out'. */
+
+  /* FILES_PER_RUN copies of `compressed', written the first time they're needed. */
+  char dir[32];
+  char files[FILES_PER_RUN][48];
+  const char* file_list[FILES_PER_RUN];
+  nbtx_node* loaded[FILES_PER_RUN];
+  char save_path[48];    /* In the same directory. */
+  nbtx_save* save;
+
+  nbtx_node* scratch;    /* Made or consumed by an iteration. */
+  struct buffer out;
+};
+
+static void parse_scratch(struct context* c) {
+  if ((c->scratch = nbtx_parse(c->raw.data, c->raw.len)) == NULL)
+    die_with_err(errno);
+}
+
+static void free_scratch(struct context* c) {
+  nbtx_free(c->scratch);
+  c->scratch = NULL;
+}
+
+static void free_out(struct context* c) {
+  if (c->out.data == NULL) die_with_err(errno);
+  buffer_free(&c->out);
+}
+
+static void run_parse(struct context* c) {
+  parse_scratch(c);
+}
+
+static void run_parse_compressed(struct context* c) {
+  if ((c->scratch = nbtx_parse_compressed(c->compressed.data, c->compressed.len)) == NULL)
+    die_with_err(errno);
+}
+
+static void run_ctx_parse_compressed(struct context* c) {
+  if ((c->scratch = nbtx_ctx_parse_compressed(c->ctx, c->compressed.data, c->compressed.len)) == NULL)
+    die_with_err(errno);
+}
+
+static void recycle_scratch(struct context* c) {
+  nbtx_ctx_recycle(c->ctx, c->scratch);
+  c->scratch = NULL;
+}
+
+static void run_dump_binary(struct context* c) {
+  c->out = nbtx_dump_binary(c->tree);
+}
+
+/* On a freshly parsed tree, so this is the dump that fills the caches. */
+static void run_dump_binary_cached(struct context* c) {
+  c->out = nbtx_dump_binary_cached(c->scratch);
+}
+
+static void free_scratch_out(struct context* c) {
+  free_out(c);
+  free_scratch(c);
+}
+
+static void run_dump_canonical(struct context* c) {
+  c->out = nbtx_dump_canonical(c->tree);
+}
+
+static void run_dump_compressed(struct context* c) {
+  c->out = nbtx_dump_compressed(c->tree, NBTX_STRATEGY_GZIP);
+}
+
+static void run_clone(struct context* c) {
+  if ((c->scratch = nbtx_clone(c->tree)) == NULL)
+    die_with_err(errno);
+}
+
+static void run_clone_shared(struct context* c) {
+  if ((c->scratch = nbtx_clone_shared(c->tree)) == NULL)
+    die_with_err(errno);
+}
+
+static void run_eq(struct context* c) {
+  if (!nbtx_eq(c->tree, c->copy))
+    die("The trees are supposed to be equal.");
+}
+
+/* On a freshly parsed tree, so nothing is cached yet. */
+static void run_hash(struct context* c) {
+  if (nbtx_hash(c->scratch) == 0)
+    die("The hash is supposed to be nonzero.");
+}
+
+static void run_size(struct context* c) {
+  if (nbtx_size(c->tree) == 0)
+    die("The tree is supposed to have nodes.");
+}
+
+static bool count_node(nbtx_node* node, void* aux) {
+  (void)node;
+  ++*(size_t*)aux;
+  return true;
+}
+
+static void run_map(struct context* c) {
+  size_t nodes = 0;
+
+  if (!nbtx_map(c->tree, count_node, &nodes) || nodes == 0)
+    die("The tree is supposed to have nodes.");
+}
+
+static void run_cursor(struct context* c) {
+  nbtx_cursor cursor;
+  nbtx_cursor_event e;
+  size_t nodes = 0;
+
+  nbtx_cursor_init(&cursor, c->tree);
+  while ((e = nbtx_cursor_next(&cursor)) > NBTX_CURSOR_END)
+    nodes += e != NBTX_CURSOR_LEAVE;
+  nbtx_cursor_free(&cursor);
+
+  if (e != NBTX_CURSOR_END || nodes == 0)
+    die("The tree is supposed to have nodes.");
+}
+
+static bool count_node_atomically(nbtx_node* node, void* aux) {
+  (void)node;
+  atomic_fetch_add_explicit((atomic_size_t*)aux, 1, memory_order_relaxed);
+  return true;
+}
+
+static void run_map_parallel(struct context* c) {
+  atomic_size_t nodes = 0;
+
+  if (!nbtx_map_parallel(c->tree, count_node_atomically, &nodes, 0) || nodes == 0)
+    die("The tree is supposed to have nodes.");
+}
+
+/* Keeps about half of the leaves. */
+static bool is_kept(const nbtx_node* node, void* aux) {
+  (void)aux;
+  return node->type == NBTX_TAG_LIST || node->type == NBTX_TAG_COMPOUND ||
+         node->name == NULL || strlen(node->name) % 2 == 0;
+}
+
+static void run_filter(struct context* c) {
+  if ((c->scratch = nbtx_filter(c->tree, is_kept, NULL)) == NULL)
+    die_with_err(errno);
+}
+
+static void run_filter_parallel(struct context* c) {
+  if ((c->scratch = nbtx_filter_parallel(c->tree, is_kept, NULL, 0)) == NULL)
+    die_with_err(errno);
+}
+
+static void run_find_by_path(struct context* c) {
+  if (nbtx_find_by_path(c->tree, c->path) == NULL)
+    die("The path is supposed to exist.");
+}
+
+/* Queries don't start with the name of the root. */
+static void compile_query(struct context* c) {
+  if ((c->query = nbtx_query_compile(strchr(c->path, '.') + 1)) == NULL)
+    die_with_err(errno);
+}
+
+static void free_query(struct context* c) {
+  nbtx_query_free(c->query);
+  c->query = NULL;
+}
+
+static bool count_match(const nbtx_value* value, void* aux) {
+  (void)value;
+  ++*(size_t*)aux;
+  return true;
+}
+
+static void run_query(struct context* c) {
+  size_t matches = 0;
+  nbtx_status err;
+
+  if ((err = nbtx_query_run(c->query, c->tree, count_match, &matches)) != NBTX_OK)
+    die_with_err(err);
+  if (matches != 1)
+    die("The query is supposed to match once.");
+}
+
+static void run_query_raw(struct context* c) {
+  size_t matches = 0;
+  nbtx_status err;
+
+  if ((err = nbtx_query_run_raw(c->query, c->raw.data, c->raw.len, count_match, &matches)) != NBTX_OK)
+    die_with_err(err);
+  if (matches != 1)
+    die("The query is supposed to match once.");
+}
+
+static void run_peek_path(struct context* c) {
+  nbtx_value value;
+  nbtx_status err;
+
+  if ((err = nbtx_peek_path(c->raw.data, c->raw.len, c->path, &value)) != NBTX_OK)
+    die_with_err(err);
+}
+
+static void run_query_indexed(struct context* c) {
+  size_t matches = 0;
+  nbtx_status err;
+
+  if ((err = nbtx_query_run_raw(c->query, c->indexed.data, c->indexed.len, count_match, &matches)) != NBTX_OK)
+    die_with_err(err);
+  if (matches != 1)
+    die("The query is supposed to match once.");
+}
+
+static void run_peek_indexed(struct context* c) {
+  nbtx_value value;
+  nbtx_status err;
+
+  if ((err = nbtx_peek_path(c->indexed.data, c->indexed.len, c->path, &value)) != NBTX_OK)
+    die_with_err(err);
+}
+
+/* Writes the last node back over itself. */
+static void run_poke_path(struct context* c) {
+  nbtx_value value;
+  nbtx_status err;
+
+  if ((err = nbtx_peek_path(c->raw.data, c->raw.len, c->path, &value)) != NBTX_OK ||
+      (err = nbtx_poke_path(c->raw.data, c->raw.len, c->path, &value)) != NBTX_OK)
+    die_with_err(err);
+}
+
+#define PUTS_PER_RUN 64
+
+static void run_put(struct context* c) {
+  static char names[PUTS_PER_RUN][16];
+
+  if (names[0][0] == '\0')
+    for (int i = 0; i < PUTS_PER_RUN; ++i)
+      snprintf(names[i], sizeof names[i], "put%d", i);
+
+  for (int i = 0; i < PUTS_PER_RUN; ++i)
+    checked(nbtx_put_int(c->scratch, names[i], i));
+}
+
+/* A fresh compound with this many members, with puts or a builder. */
+#define MEMBERS_PER_RUN 1000
+
+static const char* member_name(const int i) {
+  static char names[MEMBERS_PER_RUN][16];
+
+  if (names[i][0] == '\0')
+    snprintf(names[i], sizeof names[i], "field%d", i);
+  return names[i];
+}
+
+static void run_put_members(struct context* c) {
+  if ((c->scratch = nbtx_new_compound("root")) == NULL)
+    die_with_err(errno);
+
+  for (int i = 0; i < MEMBERS_PER_RUN; ++i)
+    checked(nbtx_put_int(c->scratch, member_name(i), i));
+}
+
+static void run_builder(struct context* c) {
+  nbtx_compound_builder* b = nbtx_compound_builder_new("root", MEMBERS_PER_RUN);
+  if (b == NULL) die_with_err(errno);
+
+  for (int i = 0; i < MEMBERS_PER_RUN; ++i)
+    checked(nbtx_compound_builder_put_int(b, member_name(i), i));
+
+  c->scratch = nbtx_compound_builder_finish(b);
+}
+
+/* As big as the voxel arrays of a chunk get. */
+#define ARRAY_BYTES (1 << 20)
+
+static void run_put_byte_array(struct context* c) {
+  static unsigned char voxels[ARRAY_BYTES];
+
+  checked(nbtx_put_byte_array(c->scratch, "voxels", voxels, ARRAY_BYTES));
+}
+
+static void run_put_byte_array_take(struct context* c) {
+  unsigned char* voxels = nbtx_alloc_memory(ARRAY_BYTES);
+  if (voxels == NULL) die_with_err(NBTX_EMEM);
+
+  checked(nbtx_put_byte_array_take(c->scratch, "voxels", voxels, ARRAY_BYTES));
+}
+
+/*
+ * Network messages: an entity, built into a tree and dumped, or written
+ * straight away. Both give the same bytes.
+ */
+#define MSGS_PER_RUN 64
+
+static const double message_pos[3] = { 128.5, 64, -32.25 };
+
+static void run_build_message(struct context* c) {
+  for (int i = 0; i < MSGS_PER_RUN; ++i) {
+    nbtx_node* entity = nbtx_new_compound("entity");
+    if (entity == NULL) die_with_err(errno);
+
+    checked(nbtx_put_string(entity, "id", "zombie"));
+    checked(nbtx_put_long(entity, "UUID", i));
+    checked(nbtx_put_float(entity, "Health", 20));
+    checked(nbtx_put_byte(entity, "OnGround", 1));
+
+    nbtx_node* pos = checked(nbtx_put_list(entity, "Pos", nbtx_new_tag_list_payload(NBTX_TAG_DOUBLE)));
+    for (int j = 0; j < 3; ++j)
+      checked(nbtx_put_double(pos, NULL, message_pos[j]));
+
+    c->out = nbtx_dump_binary(entity);
+    if (c->out.data == NULL) die_with_err(errno);
+
+    buffer_free(&c->out);
+    nbtx_free(entity);
+  }
+}
+
+static void new_writer(struct context* c) {
+  if ((c->writer = nbtx_writer_new(&c->out)) == NULL)
+    die_with_err(errno);
+}
+
+static void free_writer(struct context* c) {
+  nbtx_writer_free(c->writer);
+  buffer_free(&c->out);
+}
+
+static void run_write_message(struct context* c) {
+  nbtx_writer* w = c->writer;
+
+  for (int i = 0; i < MSGS_PER_RUN; ++i) {
+    c->out.len = 0;
+
+    nbtx_writer_begin_compound(w, "entity");
+    nbtx_writer_write_string(w, "id", "zombie");
+    nbtx_writer_write_long(w, "UUID", i);
+    nbtx_writer_write_float(w, "Health", 20);
+    nbtx_writer_write_byte(w, "OnGround", 1);
+    nbtx_writer_write_list(w, "Pos", NBTX_TAG_DOUBLE, message_pos, 3);
+    nbtx_writer_end(w);
+
+    nbtx_status err;
+    if ((err = nbtx_writer_finish(w, NULL)) != NBTX_OK)
+      die_with_err(err);
+  }
+}
+
+static void write_files(struct context* c) {
+  if (c->dir[0] != '\0') return;
+
+  strcpy(c->dir, "/tmp/nbtx-bench-XXXXXX");
+  if (mkdtemp(c->dir) == NULL) die("Could not make a temporary directory.");
+  snprintf(c->save_path, sizeof c->save_path, "%s/save.nbtx", c->dir);
+
+  for (int i = 0; i < FILES_PER_RUN; ++i) {
+    snprintf(c->files[i], sizeof c->files[i], "%s/%d.nbtx", c->dir, i);
+    c->file_list[i] = c->files[i];
+
+    FILE* fp = fopen(c->files[i], "wb");
+    if (fp == NULL || fwrite(c->compressed.data, 1, c->compressed.len, fp) != c->compressed.len)
+      die("Could not write a temporary file.");
+    fclose(fp);
+  }
+}
+
+static void remove_files(struct context* c) {
+  if (c->dir[0] == '\0') return;
+
+  for (int i = 0; i < FILES_PER_RUN; ++i)
+    remove(c->files[i]);
+  remove(c->save_path);
+  remove(c->dir);
+}
+
+static void free_loaded(struct context* c) {
+  for (int i = 0; i < FILES_PER_RUN; ++i) {
+    nbtx_free(c->loaded[i]);
+    c->loaded[i] = NULL;
+  }
+}
+
+static void run_parse_path(struct context* c) {
+  for (int i = 0; i < FILES_PER_RUN; ++i)
+    if ((c->loaded[i] = nbtx_parse_path(c->file_list[i])) == NULL)
+      die_with_err(errno);
+}
+
+static void run_parse_paths(struct context* c) {
+  if (nbtx_parse_paths(c->file_list, FILES_PER_RUN, c->loaded, NULL, 0, NBTX_IO_AUTO) != FILES_PER_RUN)
+    die_with_err(errno);
+}
+
+static void run_parse_paths_threads(struct context* c) {
+  if (nbtx_parse_paths(c->file_list, FILES_PER_RUN, c->loaded, NULL, 0, NBTX_IO_THREADS) != FILES_PER_RUN)
+    die_with_err(errno);
+}
+
+static void run_dump_file(struct context* c) {
+  FILE* fp = fopen(c->save_path, "wb");
+  if (fp == NULL) die("Could not write a temporary file.");
+
+  nbtx_status err;
+  if ((err = nbtx_dump_file(c->tree, fp, NBTX_STRATEGY_GZIP)) != NBTX_OK)
+    die_with_err(err);
+
+  fclose(fp);
+}
+
+/* Only the pause of the caller is timed; the save finishes in the teardown. */
+static void run_dump_file_async(struct context* c) {
+  if ((c->save = nbtx_dump_file_async(c->tree, c->save_path, NBTX_STRATEGY_GZIP)) == NULL)
+    die_with_err(errno);
+}
+
+static void wait_save(struct context* c) {
+  nbtx_status err;
+  if ((err = nbtx_save_wait(c->save)) != NBTX_OK)
+    die_with_err(err);
+}
+
+static void run_free(struct context* c) {
+  free_scratch(c);
+}
+
+static const struct operation {
+  const char* name;
+  void (*setup)(struct context*);
+  void (*run)(struct context*);
+  void (*teardown)(struct context*);
+  size_t ops_per_run;
+  bool throughput; /* Does MB/s of the dumped tree mean anything? */
+} operations[] = {
+  { "nbtx_parse",                NULL,          run_parse,                free_scratch,    1,            true  },
+  { "nbtx_parse_compressed",     NULL,          run_parse_compressed,     free_scratch,    1,            true  },
+  { "nbtx_ctx_parse_compressed", NULL,          run_ctx_parse_compressed, recycle_scratch, 1,            true  },
+  { "nbtx_dump_binary",          NULL,          run_dump_binary,          free_out,        1,            true  },
+  { "nbtx_dump_binary_cached",   parse_scratch, run_dump_binary_cached,   free_scratch_out, 1,           true  },
+  { "nbtx_dump_canonical",       NULL,          run_dump_canonical,       free_out,        1,            true  },
+  { "nbtx_dump_compressed",      NULL,          run_dump_compressed,      free_out,        1,            true  },
+  { "nbtx_clone",                NULL,          run_clone,                free_scratch,    1,            false },
+  { "nbtx_clone_shared",         NULL,          run_clone_shared,         free_scratch,    1,            false },
+  { "nbtx_eq",                   NULL,          run_eq,                   NULL,            1,            true  },
+  { "nbtx_hash",                 parse_scratch, run_hash,                 free_scratch,    1,            true  },
+  { "nbtx_size",                 NULL,          run_size,                 NULL,            1,            false },
+  { "nbtx_map",                  NULL,          run_map,                  NULL,            1,            false },
+  { "nbtx_cursor_next",          NULL,          run_cursor,               NULL,            1,            false },
+  { "nbtx_map_parallel",         NULL,          run_map_parallel,         NULL,            1,            false },
+  { "nbtx_filter",               NULL,          run_filter,               free_scratch,    1,            false },
+  { "nbtx_filter_parallel",      NULL,          run_filter_parallel,      free_scratch,    1,            false },
+  { "nbtx_find_by_path",         NULL,          run_find_by_path,         NULL,            1,            false },
+  { "nbtx_query_run",            compile_query, run_query,                free_query,      1,            false },
+  { "nbtx_query_run_raw",        compile_query, run_query_raw,            free_query,      1,            true  },
+  { "nbtx_query_run_indexed",    compile_query, run_query_indexed,        free_query,      1,            true  },
+  { "nbtx_peek_path",            NULL,          run_peek_path,            NULL,            1,            true  },
+  { "nbtx_peek_path_indexed",    NULL,          run_peek_indexed,         NULL,            1,            true  },
+  { "nbtx_poke_path",            NULL,          run_poke_path,            NULL,            1,            true  },
+  { "nbtx_put_int",              parse_scratch, run_put,                  free_scratch,    PUTS_PER_RUN, false },
+  { "nbtx_put_int_fresh",        NULL,          run_put_members,          free_scratch,    MEMBERS_PER_RUN, false },
+  { "nbtx_compound_builder",     NULL,          run_builder,              free_scratch,    MEMBERS_PER_RUN, false },
+  { "nbtx_put_byte_array",       parse_scratch, run_put_byte_array,       free_scratch,    1,            false },
+  { "nbtx_put_byte_array_take",  parse_scratch, run_put_byte_array_take,  free_scratch,    1,            false },
+  { "message_build_and_dump",    NULL,          run_build_message,        NULL,            MSGS_PER_RUN, false },
+  { "message_nbtx_writer",       new_writer,    run_write_message,        free_writer,     MSGS_PER_RUN, false },
+  { "nbtx_parse_path",           write_files,   run_parse_path,           free_loaded,     FILES_PER_RUN, false },
+  { "nbtx_parse_paths",          write_files,   run_parse_paths,          free_loaded,     FILES_PER_RUN, false },
+  { "nbtx_parse_paths_threads",  write_files,   run_parse_paths_threads,  free_loaded,     FILES_PER_RUN, false },
+  { "nbtx_dump_file",            write_files,   run_dump_file,            NULL,            1,            true  },
+  { "nbtx_dump_file_async",      write_files,   run_dump_file_async,      wait_save,       1,            false },
+  { "nbtx_free",                 parse_scratch, run_free,                 NULL,            1,            true  },
+};
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+struct result {
+  size_t iterations;
+  double ns_per_op;
+  double mb_per_s;
+  double allocs_per_op; /* Negative if allocations aren't counted. */
+};
+
+/*
+ * Runs an operation until it took at least `min_time' seconds, and at least
+ * `min_iterations' times.
+ */
+static struct result measure(const struct operation* op, struct context* c,
+                             const double min_time, const size_t min_iterations) {
+  double elapsed = 0;
+  size_t iterations = 0;
+  size_t allocated = 0;
+
+  while (iterations < min_iterations || elapsed < min_time) {
+    if (op->setup) op->setup(c);
+
+#ifdef NBTX_BENCH_COUNT_ALLOCATIONS
+    const size_t allocations_before = allocations;
+#endif
+    const double start = now();
+
+    op->run(c);
+
+    elapsed += now() - start;
+#ifdef NBTX_BENCH_COUNT_ALLOCATIONS
+    allocated += allocations - allocations_before;
+#endif
+
+    if (op->teardown) op->teardown(c);
+    ++iterations;
+  }
+
+  const double ops = (double)iterations * (double)op->ops_per_run;
+
+  struct result ret;
+  ret.iterations = iterations;
+  ret.ns_per_op = elapsed * 1e9 / ops;
+  ret.mb_per_s = op->throughput && elapsed > 0 ? (double)c->raw.len * (double)iterations / elapsed / 1e6 : -1;
+#ifdef NBTX_BENCH_COUNT_ALLOCATIONS
+  ret.allocs_per_op = (double)allocated / ops;
+#else
+  (void)allocated;
+  ret.allocs_per_op = -1;
+#endif
+
+  return ret;
+}
+
+/***** Main *****/
+
+static void usage(const char* argv0) {
+  fprintf(stderr,
+          "Usage: %s [--json] [--quick] [--min-time seconds] [--filter text]\n"
+          "\n"
+          "  --json       Print the results as JSON.\n"
+          "  --quick      Run everything once, on the small trees only.\n"
+          "  --min-time   Time each operation for at least this long (default 0.2).\n"
+          "  --filter     Only run benchmarks whose \"shape/size/operation\" contains this.\n",
+          argv0);
+  exit(1);
+}
+
+/* Prints a number, or null if it's negative. */
+static void print_json_number(const char* key, const double value, const bool last) {
+  if (value < 0)
+    printf("\"%s\": null%s", key, last ? "" : ", ");
+  else
+    printf("\"%s\": %.3f%s", key, value, last ? "" : ", ");
+}
+
+int main(int argc, char** argv) {
+  bool json = false;
+  bool quick = false;
+  double min_time = 0.2;
+  const char* filter = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--json") == 0)
+      json = true;
+    else if (strcmp(argv[i], "--quick") == 0)
+      quick = true;
+    else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc)
+      min_time = atof(argv[++i]);
+    else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+      filter = argv[++i];
+    else
+      usage(argv[0]);
+  }
+
+  if (quick) min_time = 0;
+
+  const size_t size_count = quick ? 1 : sizeof sizes / sizeof sizes[0];
+  bool first = true;
+
+  if (json)
+    printf("{\n  \"allocations_counted\": %s,\n  \"results\": [\n",
+#ifdef NBTX_BENCH_COUNT_ALLOCATIONS
+           "true"
+#else
+           "false"
+#endif
+          );
+  else
+    printf("%-11s %-6s %-25s %8s %12s %10s %10s\n",
+           "shape", "size", "operation", "nodes", "ns/op", "MB/s", "allocs/op");
+
+  for (size_t s = 0; s < sizeof shapes / sizeof shapes[0]; ++s) {
+    for (size_t z = 0; z < size_count; ++z) {
+      char label[128];
+      bool any = false;
+
+      for (size_t o = 0; o < sizeof operations / sizeof operations[0]; ++o) {
+        snprintf(label, sizeof label, "%s/%s/%s", shapes[s].name, sizes[z].name, operations[o].name);
+        any |= filter == NULL || strstr(label, filter) != NULL;
+      }
+
+      if (!any) continue;
+
+      struct context c = { NULL };
+      char* path = NULL;
+      uint64_t seed = 0x6e627478u + s; /* The same trees every time. */
+
+      c.tree = shapes[s].build(sizes[z].nodes, &seed, &path);
+      c.path = path;
+
+      c.raw = nbtx_dump_binary(c.tree);
+      if (c.raw.data == NULL) die_with_err(errno);
+
+      c.indexed = nbtx_dump_binary_indexed(c.tree);
+      if (c.indexed.data == NULL) die_with_err(errno);
+
+      c.compressed = nbtx_dump_compressed(c.tree, NBTX_STRATEGY_GZIP);
+      if (c.compressed.data == NULL) die_with_err(errno);
+
+      if ((c.copy = nbtx_parse(c.raw.data, c.raw.len)) == NULL)
+        die_with_err(errno);
+
+      if ((c.ctx = nbtx_ctx_new()) == NULL)
+        die_with_err(errno);
+
+      const size_t nodes = nbtx_size(c.tree);
+
+      for (size_t o = 0; o < sizeof operations / sizeof operations[0]; ++o) {
+        const struct operation* op = &operations[o];
+
+        snprintf(label, sizeof label, "%s/%s/%s", shapes[s].name, sizes[z].name, op->name);
+        if (filter && strstr(label, filter) == NULL) continue;
+
+        const struct result r = measure(op, &c, min_time, quick ? 1 : 3);
+
+        if (json) {
+          printf("%s    { \"shape\": \"%s\", \"size\": \"%s\", \"operation\": \"%s\", "
+                 "\"nodes\": %zu, \"bytes\": %zu, \"iterations\": %zu, ",
+                 first ? "" : ",\n", shapes[s].name, sizes[z].name, op->name,
+                 nodes, c.raw.len, r.iterations);
+          print_json_number("ns_per_op", r.ns_per_op, false);
+          print_json_number("mb_per_s", r.mb_per_s, false);
+          print_json_number("allocs_per_op", r.allocs_per_op, true);
+          printf(" }");
+        } else {
+          printf("%-11s %-6s %-25s %8zu %12.1f ", shapes[s].name, sizes[z].name, op->name, nodes, r.ns_per_op);
+
+          if (r.mb_per_s < 0) printf("%10s ", "-");
+          else printf("%10.1f ", r.mb_per_s);
+
+          if (r.allocs_per_op < 0) printf("%10s\n", "-");
+          else printf("%10.1f\n", r.allocs_per_op);
+        }
+
+        fflush(stdout);
+        first = false;
+      }
+
+      remove_files(&c);
+      nbtx_ctx_free(c.ctx);
+      nbtx_free(c.tree);
+      nbtx_free(c.copy);
+      buffer_free(&c.raw);
+      buffer_free(&c.indexed);
+      buffer_free(&c.compressed);
+      free(path);
+    }
+  }
+
+  if (json)
+    printf("\n  ]\n}\n");
+
+  return 0;
+}
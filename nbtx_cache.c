@@ -0,0 +1,320 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbtx.h"
+#include "nbtx_internal.h"
+
+#include "buffer.h"
+#include "list.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/* The stamp of the last change made to any list or compound. */
+static atomic_uint_fast64_t current_stamp = 1;
+
+/* Caches made before this stamp can't be trusted. See nbtx_touch_. */
+static atomic_uint_fast64_t oldest_valid_stamp = 0;
+
+/* The number of the last cached dump. */
+static atomic_uint_fast64_t last_dump = 0;
+
+/* Until the first cache is made, there's nothing to keep up to date. */
+static atomic_bool caching = false;
+
+uint64_t nbtx_cache_stamp_(void) {
+  return atomic_load(&current_stamp);
+}
+
+uint64_t nbtx_cache_new_dump_(void) {
+  return atomic_fetch_add(&last_dump, 1) + 1;
+}
+
+void nbtx_cache_enable_(void) {
+  atomic_store(&caching, true);
+}
+
+/* Real caches are aligned, so only stamps kept in their place have the lowest bit set. */
+static bool is_stamp(const struct nbtx_node_cache* cache) {
+  return ((uintptr_t)cache & 1) != 0;
+}
+
+/* Returns the stamp of the last change to a node, or 0 if it never changed. */
+static uint64_t stamp_of(const nbtx_node* node) {
+  if (node->cache == NULL)  return 0;
+  if (is_stamp(node->cache)) return (uint64_t)((uintptr_t)node->cache >> 1);
+
+  return node->cache->modified;
+}
+
+struct nbtx_node_cache* nbtx_cache_of_(const nbtx_node* node) {
+  return node->cache == NULL || is_stamp(node->cache) ? NULL : node->cache;
+}
+
+struct nbtx_node_cache* nbtx_cache_get_(nbtx_node* node) {
+  struct nbtx_node_cache* cache = nbtx_cache_of_(node);
+  if (cache) return cache;
+
+  if ((cache = nbtx_calloc_(1, sizeof(*cache))) == NULL)
+    return NULL;
+
+  cache->modified = stamp_of(node);
+  node->cache = cache;
+  return cache;
+}
+
+void nbtx_cache_free_(struct nbtx_node_cache* cache) {
+  if (cache == NULL || is_stamp(cache)) return;
+
+  buffer_free(&cache->bytes);
+  nbtx_free_(cache);
+}
+
+void nbtx_touch_(nbtx_node* node) {
+  if (!atomic_load_explicit(&caching, memory_order_relaxed))
+    return;
+
+  const uint64_t now = atomic_fetch_add(&current_stamp, 1) + 1;
+
+  struct nbtx_node_cache* cache = nbtx_cache_of_(node);
+
+  /* Where pointers are too small for the stamp, it takes a cache after all. */
+  if (cache == NULL && now <= UINTPTR_MAX >> 1) {
+    node->cache = (struct nbtx_node_cache*)(((uintptr_t)now << 1) | 1);
+    return;
+  }
+
+  /* We can't remember that this node changed, so forget about every cache instead. */
+  if (cache == NULL && (cache = nbtx_cache_get_(node)) == NULL) {
+    atomic_store(&oldest_valid_stamp, now);
+    return;
+  }
+
+  cache->modified = now;
+}
+
+void nbtx_mark_dirty(nbtx_node* list_or_compound) {
+  assert(list_or_compound);
+
+  nbtx_touch_(list_or_compound);
+}
+
+static bool is_list_or_compound(const nbtx_node* node) {
+  return node->type == NBTX_TAG_LIST || node->type == NBTX_TAG_COMPOUND;
+}
+
+/* Lists of numbers can only change through their own stamp. */
+static bool has_stamped_children(const nbtx_node* node) {
+  const struct nbtx_list* list = node->payload.tag_list;
+
+  return node->type == NBTX_TAG_COMPOUND || list->data == NULL || list->data->type >= NBTX_TAG_BYTE_ARRAY;
+}
+
+/* A list or compound whose newest stamp is being looked for. */
+struct stamp_frame {
+  nbtx_node* node;
+  const struct list_head* head;
+  const struct list_head* pos; /* The member last looked at. */
+  uint64_t newest;
+};
+
+#define STAMP_LOCAL_FRAMES 64
+
+static uint64_t newer(const uint64_t a, const uint64_t b) {
+  return a > b ? a : b;
+}
+
+/*
+ * Returns the newest stamp in `tree', walking it with a stack. With `record'
+ * set, every cache under it remembers the newest stamp under its own node;
+ * otherwise the walk stops at the first stamp newer than `since'. Returns
+ * UINT64_MAX if the stack can't grow.
+ */
+static uint64_t walk_stamps(nbtx_node* tree, const bool record, const uint64_t since) {
+  struct nbtx_node_cache* cache;
+
+  if (!is_list_or_compound(tree) || !has_stamped_children(tree)) {
+    if (record && (cache = nbtx_cache_of_(tree)) != NULL)
+      cache->newest = stamp_of(tree);
+
+    return stamp_of(tree);
+  }
+
+  struct stamp_frame local[STAMP_LOCAL_FRAMES];
+  struct stamp_frame* frames = local;
+  size_t capacity = STAMP_LOCAL_FRAMES;
+  size_t depth = 0;
+  uint64_t ret = 0;
+
+  const struct list_head* head = &tree->payload.tag_list->entry;
+  frames[depth++] = (struct stamp_frame) { tree, head, head, stamp_of(tree) };
+
+  while (depth > 0) {
+    struct stamp_frame* top = &frames[depth - 1];
+    const struct list_head* pos;
+    nbtx_node* next = NULL;
+
+    /* Byte arrays and strings carry their own stamp once extracted from. */
+    for (pos = top->pos->flink; pos != top->head; pos = pos->flink) {
+      nbtx_node* node = list_entry(pos, const struct nbtx_list, entry)->data;
+
+      if (node->type < NBTX_TAG_BYTE_ARRAY) continue;
+
+      if (is_list_or_compound(node) && has_stamped_children(node)) {
+        next = node;
+        break;
+      }
+
+      if (record && (cache = nbtx_cache_of_(node)) != NULL)
+        cache->newest = stamp_of(node);
+
+      top->newest = newer(top->newest, stamp_of(node));
+    }
+
+    if (!record && top->newest > since) {
+      ret = top->newest;
+      break;
+    }
+
+    if (next) {
+      top->pos = pos;
+
+      if (depth == capacity) {
+        struct stamp_frame* grown = nbtx_grow_stack_(frames, &capacity, sizeof(*frames), frames != local);
+
+        if (grown == NULL) {
+          ret = UINT64_MAX;
+          break;
+        }
+
+        frames = grown;
+      }
+
+      head = &next->payload.tag_list->entry;
+      frames[depth++] = (struct stamp_frame) { next, head, head, stamp_of(next) };
+      continue;
+    }
+
+    /* Done with `top', so hand its newest stamp up. */
+    const struct stamp_frame done = frames[--depth];
+
+    if (record && (cache = nbtx_cache_of_(done.node)) != NULL)
+      cache->newest = done.newest;
+
+    if (depth == 0) ret = done.newest;
+    else            frames[depth - 1].newest = newer(frames[depth - 1].newest, done.newest);
+  }
+
+  if (frames != local) nbtx_free_(frames);
+  return ret;
+}
+
+/* A list or compound whose members' spans are being moved. */
+struct span_frame {
+  const struct list_head* head;
+  const struct list_head* pos;
+};
+
+#define SPAN_LOCAL_FRAMES 64
+
+/* Moves the span of `node' if it lies in the old span of the node being copied. */
+static bool move_span(const nbtx_node* node, const uint64_t old_id, const uint64_t new_id,
+                      const size_t old_offset, const size_t old_length, const size_t new_offset) {
+  struct nbtx_node_cache* cache = nbtx_cache_of_(node);
+
+  if (cache == NULL || cache->span_id != old_id
+      || cache->span_offset < old_offset
+      || cache->span_offset - old_offset + cache->span_length > old_length)
+    return false;
+
+  cache->span_id = new_id;
+  cache->span_offset = cache->span_offset - old_offset + new_offset;
+  return true;
+}
+
+void nbtx_cache_move_spans_(const nbtx_node* tree, const uint64_t old_id, const uint64_t new_id, const size_t offset) {
+  const struct nbtx_node_cache* cache = nbtx_cache_of_(tree);
+
+  if (cache == NULL || cache->span_id != old_id || !has_stamped_children(tree))
+    return;
+
+  const size_t old_offset = cache->span_offset;
+  const size_t old_length = cache->span_length;
+
+  struct span_frame local[SPAN_LOCAL_FRAMES];
+  struct span_frame* frames = local;
+  size_t capacity = SPAN_LOCAL_FRAMES;
+  size_t depth = 0;
+
+  const struct list_head* head = &tree->payload.tag_list->entry;
+  frames[depth++] = (struct span_frame) { head, head };
+
+  while (depth > 0) {
+    struct span_frame* top = &frames[depth - 1];
+    const struct list_head* pos;
+    const nbtx_node* next = NULL;
+
+    for (pos = top->pos->flink; pos != top->head; pos = pos->flink) {
+      const nbtx_node* node = list_entry(pos, const struct nbtx_list, entry)->data;
+
+      if (!is_list_or_compound(node) || !move_span(node, old_id, new_id, old_offset, old_length, offset))
+        continue;
+
+      if (has_stamped_children(node)) {
+        next = node;
+        break;
+      }
+    }
+
+    if (next == NULL) {
+      depth--;
+      continue;
+    }
+
+    top->pos = pos;
+
+    if (depth == capacity) {
+      struct span_frame* grown = nbtx_grow_stack_(frames, &capacity, sizeof(*frames), frames != local);
+
+      /* Spans left behind just won't be copied next time. */
+      if (grown == NULL) break;
+
+      frames = grown;
+    }
+
+    head = &next->payload.tag_list->entry;
+    frames[depth++] = (struct span_frame) { head, head };
+  }
+
+  if (frames != local) nbtx_free_(frames);
+}
+
+bool nbtx_cache_changed_since_(const nbtx_node* tree, const uint64_t since) {
+  if (since < atomic_load(&oldest_valid_stamp))
+    return true;
+
+  /* Nothing changed anywhere, so there's no need to look. */
+  if (since >= atomic_load(&current_stamp))
+    return false;
+
+  /* Without `record', the walk only reads the tree. */
+  return walk_stamps((nbtx_node*)tree, false, since) > since;
+}
+
+uint64_t nbtx_cache_newest_(nbtx_node* tree, const uint64_t since) {
+  if (since < atomic_load(&oldest_valid_stamp))
+    return UINT64_MAX;
+
+  if (since >= atomic_load(&current_stamp))
+    return since;
+
+  return walk_stamps(tree, true, since);
+}
@@ -0,0 +1,306 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbtx.h"
+#include "nbtx_internal.h"
+
+#include "buffer.h"
+#include "list.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+/*
+ * Recycled memory is kept by exact size: the parser asks for exactly the sizes
+ * the library allocates (strlen + 1 for names and strings, the length of byte
+ * arrays, the size of nodes and list entries), so a tree of the same shape
+ * finds everything it needs. Every block comes from the allocator, so trees
+ * made from them can still be freed with nbtx_free.
+ */
+struct bucket {
+  size_t size; /* SIZE_MAX if the bucket is unused. */
+  void** blocks;
+  size_t count;
+  size_t capacity;
+};
+
+struct nbtx_parse_ctx {
+  /* Where the memory of the trees comes from, if not from the library's allocator. */
+  nbtx_allocator allocator;
+  bool own_allocator;
+
+  struct bucket* buckets; /* Open addressing, keyed by size. */
+  size_t bucket_capacity; /* A power of two, or 0. */
+  size_t bucket_count;
+  size_t kept;  /* Bytes in the buckets, counting a pointer per block. */
+  size_t limit; /* How many bytes may be kept at most, or 0 for no limit. */
+
+  z_stream stream;
+  bool inflating; /* Whether `stream' was initialized. */
+  struct buffer inflated;
+
+  struct nbtx_parse_stack_ stack;
+};
+
+nbtx_parse_ctx* nbtx_ctx_new(void) {
+  nbtx_parse_ctx* ctx = nbtx_calloc_(1, sizeof(*ctx));
+  if (ctx == NULL) return (errno = NBTX_EMEM), NULL;
+
+  ctx->limit = NBTX_CTX_DEFAULT_LIMIT;
+  return ctx;
+}
+
+nbtx_parse_ctx* nbtx_ctx_new_with_allocator(const nbtx_allocator* allocator) {
+  if (allocator == NULL)
+    return nbtx_ctx_new();
+
+  if (!allocator->malloc || !allocator->realloc || !allocator->free)
+    return (errno = NBTX_ERR), NULL;
+
+  nbtx_parse_ctx* ctx = nbtx_ctx_new();
+  if (ctx == NULL) return NULL;
+
+  ctx->allocator = *allocator;
+  ctx->own_allocator = true;
+  return ctx;
+}
+
+size_t nbtx_ctx_set_limit(nbtx_parse_ctx* ctx, const size_t bytes) {
+  const size_t previous = ctx->limit;
+  ctx->limit = bytes;
+  return previous;
+}
+
+void nbtx_ctx_free_(nbtx_parse_ctx* ctx, void* ptr) {
+  if (ptr == NULL) return;
+
+  if (ctx->own_allocator) ctx->allocator.free(ptr, ctx->allocator.user);
+  else                    nbtx_free_(ptr);
+}
+
+void nbtx_ctx_free(nbtx_parse_ctx* ctx) {
+  if (ctx == NULL) return;
+
+  for (size_t i = 0; i < ctx->bucket_capacity; ++i) {
+    struct bucket* b = &ctx->buckets[i];
+
+    for (size_t j = 0; j < b->count; ++j)
+      nbtx_ctx_free_(ctx, b->blocks[j]);
+    nbtx_free_(b->blocks);
+  }
+
+  if (ctx->inflating) (void)inflateEnd(&ctx->stream);
+
+  nbtx_free_(ctx->buckets);
+  nbtx_free_(ctx->stack.frames);
+  buffer_free(&ctx->inflated);
+  nbtx_free_(ctx);
+}
+
+static size_t slot_of(const size_t size, const size_t capacity) {
+  return (size_t)(((uint64_t)size * 0x9e3779b97f4a7c15u) >> 32) & (capacity - 1);
+}
+
+static struct bucket* find_bucket(const nbtx_parse_ctx* ctx, const size_t size) {
+  if (ctx->bucket_capacity == 0) return NULL;
+
+  for (size_t i = slot_of(size, ctx->bucket_capacity);; i = (i + 1) & (ctx->bucket_capacity - 1)) {
+    struct bucket* b = &ctx->buckets[i];
+
+    if (b->size == size)     return b;
+    if (b->size == SIZE_MAX) return NULL;
+  }
+}
+
+/* Doubles the bucket table. Returns false on memory errors. */
+static bool grow_buckets(nbtx_parse_ctx* ctx) {
+  const size_t capacity = ctx->bucket_capacity ? 2 * ctx->bucket_capacity : 64;
+
+  struct bucket* buckets = nbtx_malloc_(capacity * sizeof(*buckets));
+  if (buckets == NULL) return false;
+
+  for (size_t i = 0; i < capacity; ++i)
+    buckets[i] = (struct bucket) { SIZE_MAX, NULL, 0, 0 };
+
+  for (size_t i = 0; i < ctx->bucket_capacity; ++i) {
+    const struct bucket* b = &ctx->buckets[i];
+    if (b->size == SIZE_MAX) continue;
+
+    size_t j = slot_of(b->size, capacity);
+    while (buckets[j].size != SIZE_MAX)
+      j = (j + 1) & (capacity - 1);
+
+    buckets[j] = *b;
+  }
+
+  nbtx_free_(ctx->buckets);
+  ctx->buckets = buckets;
+  ctx->bucket_capacity = capacity;
+  return true;
+}
+
+/* Returns the bucket for `size', adding it if needed. NULL on memory errors. */
+static struct bucket* add_bucket(nbtx_parse_ctx* ctx, const size_t size) {
+  struct bucket* b = find_bucket(ctx, size);
+  if (b) return b;
+
+  /* Keep the table at most half full. */
+  if (2 * (ctx->bucket_count + 1) > ctx->bucket_capacity && !grow_buckets(ctx))
+    return NULL;
+
+  size_t i = slot_of(size, ctx->bucket_capacity);
+  while (ctx->buckets[i].size != SIZE_MAX)
+    i = (i + 1) & (ctx->bucket_capacity - 1);
+
+  ctx->bucket_count++;
+  ctx->buckets[i].size = size;
+  return &ctx->buckets[i];
+}
+
+void* nbtx_ctx_alloc_(nbtx_parse_ctx* ctx, const size_t size) {
+  struct bucket* b = find_bucket(ctx, size);
+
+  if (b && b->count > 0) {
+    ctx->kept -= size + sizeof(void*);
+    return b->blocks[--b->count];
+  }
+
+  if (!ctx->own_allocator)
+    return nbtx_malloc_(size);
+
+  NBTX_STATS_ALLOC(size);
+  return ctx->allocator.malloc(size, ctx->allocator.user);
+}
+
+/*
+ * Keeps the block `ptr' of `size' bytes for later, or frees it if that fails
+ * or the context already keeps as much as it may.
+ */
+static void keep(nbtx_parse_ctx* ctx, void* ptr, const size_t size) {
+  if (ptr == NULL) return;
+
+  /* Empty blocks aren't free to keep either. Lowering the limit may have left
+   * more kept than it allows. */
+  const size_t cost = size + sizeof(void*);
+  if (ctx->limit != 0 && (ctx->kept >= ctx->limit || cost > ctx->limit - ctx->kept))
+    goto no_room;
+
+  struct bucket* b = add_bucket(ctx, size);
+  if (b == NULL) goto no_room;
+
+  if (b->count == b->capacity) {
+    const size_t capacity = b->capacity ? 2 * b->capacity : 16;
+
+    void** blocks = nbtx_realloc_(b->blocks, capacity * sizeof(*blocks));
+    if (blocks == NULL) goto no_room;
+
+    b->blocks = blocks;
+    b->capacity = capacity;
+  }
+
+  b->blocks[b->count++] = ptr;
+  ctx->kept += cost;
+  return;
+
+no_room:
+  nbtx_ctx_free_(ctx, ptr);
+}
+
+/* Keeps a list or compound payload, moving its members to `pending'. */
+static void recycle_list(nbtx_parse_ctx* ctx, struct nbtx_list* list, struct list_head* pending) {
+  if (list == NULL) return;
+
+  list_splice_head(&list->entry, pending);
+
+  keep(ctx, list->data, sizeof(*list->data));
+  keep(ctx, list, sizeof(*list));
+}
+
+/* Drops a reference to `tree', keeping its memory if it was the last one. */
+static void recycle(nbtx_parse_ctx* ctx, nbtx_node* tree, struct list_head* pending) {
+  if (tree == NULL) return;
+
+  /* Somebody else is still using this node. */
+  if (nbtx_unref_(tree) > 0) return;
+
+  if (tree->type == NBTX_TAG_LIST)
+    recycle_list(ctx, tree->payload.tag_list, pending);
+
+  else if (tree->type == NBTX_TAG_COMPOUND)
+    recycle_list(ctx, tree->payload.tag_compound, pending);
+
+  else if (tree->type == NBTX_TAG_BYTE_ARRAY)
+    keep(ctx, tree->payload.tag_byte_array.data, tree->payload.tag_byte_array.length);
+
+  else if (tree->type == NBTX_TAG_STRING)
+    keep(ctx, tree->payload.tag_string, strlen(tree->payload.tag_string) + 1);
+
+  nbtx_cache_free_(tree->cache);
+  if (tree->name) keep(ctx, tree->name, strlen(tree->name) + 1);
+  keep(ctx, tree, sizeof(*tree));
+
+  NBTX_STATS_ADD(nodes_freed, 1);
+}
+
+/* Like nbtx_free, this goes through the members in `pending' instead of recursing. */
+void nbtx_ctx_recycle(nbtx_parse_ctx* ctx, nbtx_node* tree) {
+  struct list_head pending;
+  INIT_LIST_HEAD(&pending);
+
+  recycle(ctx, tree, &pending);
+
+  while (!list_empty(&pending)) {
+    struct nbtx_list* entry = list_entry(pending.flink, struct nbtx_list, entry);
+    list_del(&entry->entry);
+
+    recycle(ctx, entry->data, &pending);
+    keep(ctx, entry, sizeof(*entry));
+  }
+}
+
+struct nbtx_parse_stack_* nbtx_ctx_stack_(nbtx_parse_ctx* ctx) {
+  return &ctx->stack;
+}
+
+nbtx_node* nbtx_ctx_parse(nbtx_parse_ctx* ctx, const void* memory, const size_t length) {
+  return nbtx_parse_with_(ctx, memory, length);
+}
+
+nbtx_node* nbtx_ctx_parse_compressed(nbtx_parse_ctx* ctx, const void* chunk_start, const size_t length) {
+  errno = NBTX_OK;
+
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_COMPRESS);
+
+  /* The stream and its window are set up once, then only reset. */
+  if (ctx->inflating) {
+    if (inflateReset(&ctx->stream) != Z_OK) errno = NBTX_EZ;
+  } else {
+    ctx->stream = (z_stream) { .zalloc = nbtx_zalloc_, .zfree = nbtx_zfree_, .opaque = Z_NULL };
+
+    if (inflateInit2(&ctx->stream, 15 + 32) == Z_OK)
+      ctx->inflating = true;
+    else
+      errno = NBTX_EZ;
+  }
+
+  ctx->inflated.len = 0;
+  if (errno == NBTX_OK)
+    nbtx_inflate_(&ctx->stream, chunk_start, length, &ctx->inflated);
+
+  NBTX_STATS_LEAVE();
+
+  if (errno != NBTX_OK) return NULL;
+
+  NBTX_STATS_ADD(bytes_inflated, ctx->inflated.len);
+  return nbtx_parse_with_(ctx, ctx->inflated.data, ctx->inflated.len);
+}
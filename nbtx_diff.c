@@ -0,0 +1,719 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbtx.h"
+#include "nbtx_internal.h"
+
+#include "buffer.h"
+#include "list.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Patch format. Everything is little endian, just like NBTx itself.
+ *
+ *   patch     := op* 0x00
+ *   op        := 0x01 path value                        (set)
+ *              | 0x02 path                              (remove)
+ *              | 0x03 path uint index uint removed
+ *                 uint inserted payload*                (list splice)
+ *   path      := ushort count component*
+ *   component := 0x00 TAG_String name                   (compound member)
+ *              | 0x01 uint index                        (list element)
+ *   value     := ubyte has_name ubyte type [TAG_String name] payload
+ *
+ * A set replaces the node at `path', or appends it to the compound if no
+ * member by that name exists yet. An empty path means the root itself. A
+ * remove deletes the node at `path'. A splice removes `removed' elements from
+ * the list at `path', starting at `index', and inserts `inserted' payloads of
+ * the list's type in their place.
+ */
+
+enum {
+  OP_END,
+  OP_SET,
+  OP_REMOVE,
+  OP_SPLICE
+};
+
+enum {
+  COMPONENT_NAME,
+  COMPONENT_INDEX
+};
+
+#define CHECKED_MALLOC(var, n, on_error) do { \
+    if(((var) = nbtx_malloc_(n)) == NULL) \
+    { \
+        errno = NBTX_EMEM; \
+        on_error; \
+    } \
+} while(0)
+
+#define CHECKED_APPEND(b, ptr, len) do { \
+    if(buffer_append((b), (ptr), (len))) \
+        return NBTX_EMEM;                 \
+} while(0)
+
+/* Returns true if only one of the names is NULL, or if they're different. */
+static bool names_differ(const char* a, const char* b) {
+  if (a == NULL || b == NULL)
+    return a != b;
+
+  return strcmp(a, b) != 0;
+}
+
+/* Gets the children of a list or compound into a freshly allocated array. */
+static const nbtx_node** children_of(const struct nbtx_list* list, size_t* count) {
+  *count = list_length(&list->entry);
+
+  const nbtx_node** ret;
+  CHECKED_MALLOC(ret, (*count ? *count : 1) * sizeof(*ret), return NULL);
+
+  size_t i = 0;
+  const struct list_head* pos;
+  list_for_each(pos, &list->entry)
+    ret[i++] = list_entry(pos, const struct nbtx_list, entry)->data;
+
+  return ret;
+}
+
+struct diff_state {
+  struct buffer* out;
+  struct buffer path; /* The components of the current path, already encoded. */
+  uint16_t depth;
+};
+
+static nbtx_status push_name(struct diff_state* d, const char* name) {
+  const size_t len = strlen(name);
+
+  if (len > UINT16_MAX || d->depth == UINT16_MAX)
+    return NBTX_ERR;
+
+  const uint8_t kind = COMPONENT_NAME;
+  const uint16_t dumped_len = (uint16_t)len;
+
+  CHECKED_APPEND(&d->path, &kind, sizeof kind);
+  CHECKED_APPEND(&d->path, &dumped_len, sizeof dumped_len);
+  CHECKED_APPEND(&d->path, name, len);
+
+  d->depth++;
+  return NBTX_OK;
+}
+
+static nbtx_status push_index(struct diff_state* d, const uint32_t index) {
+  if (d->depth == UINT16_MAX)
+    return NBTX_ERR;
+
+  const uint8_t kind = COMPONENT_INDEX;
+
+  CHECKED_APPEND(&d->path, &kind, sizeof kind);
+  CHECKED_APPEND(&d->path, &index, sizeof index);
+
+  d->depth++;
+  return NBTX_OK;
+}
+
+static nbtx_status emit_op(struct diff_state* d, const uint8_t op) {
+  CHECKED_APPEND(d->out, &op, sizeof op);
+  CHECKED_APPEND(d->out, &d->depth, sizeof d->depth);
+
+  if (d->path.len)
+    CHECKED_APPEND(d->out, d->path.data, d->path.len);
+
+  return NBTX_OK;
+}
+
+static nbtx_status emit_set(struct diff_state* d, const nbtx_node* node) {
+  nbtx_status err;
+
+  if ((err = emit_op(d, OP_SET)) != NBTX_OK)
+    return err;
+
+  const uint8_t has_name = node->name != NULL;
+  CHECKED_APPEND(d->out, &has_name, sizeof has_name);
+
+  return nbtx_dump_binary_(node, true, d->out);
+}
+
+static nbtx_status emit_remove(struct diff_state* d) {
+  return emit_op(d, OP_REMOVE);
+}
+
+static nbtx_status emit_splice(struct diff_state* d, const uint32_t index, const uint32_t removed,
+                               const nbtx_node** inserted, const uint32_t count) {
+  nbtx_status err;
+
+  if ((err = emit_op(d, OP_SPLICE)) != NBTX_OK)
+    return err;
+
+  CHECKED_APPEND(d->out, &index, sizeof index);
+  CHECKED_APPEND(d->out, &removed, sizeof removed);
+  CHECKED_APPEND(d->out, &count, sizeof count);
+
+  for (uint32_t i = 0; i < count; i++)
+    if ((err = nbtx_dump_binary_(inserted[i], false, d->out)) != NBTX_OK)
+      return err;
+
+  return NBTX_OK;
+}
+
+/* Writes the ops turning `a' into `b'. The nodes must not be equal already. */
+static nbtx_status diff_node(struct diff_state* d, const nbtx_node* a, const nbtx_node* b);
+
+struct member {
+  const nbtx_node* node;
+  size_t index; /* Position in the compound. */
+};
+
+static int compare_members(const void* a, const void* b) {
+  return strcmp(((const struct member*)a)->node->name, ((const struct member*)b)->node->name);
+}
+
+/*
+ * Sorts the members of a compound by name, so they can be looked up with
+ * bsearch. Returns NULL if some member has no name or if a name is repeated,
+ * since those can't be addressed by a path; errno tells both cases apart.
+ */
+static struct member* sorted_members(const nbtx_node** children, const size_t count) {
+  struct member* ret;
+  CHECKED_MALLOC(ret, (count ? count : 1) * sizeof(*ret), return NULL);
+
+  for (size_t i = 0; i < count; i++) {
+    if (children[i]->name == NULL)
+      return nbtx_free_(ret), NULL;
+
+    ret[i] = (struct member) { children[i], i };
+  }
+
+  qsort(ret, count, sizeof(*ret), compare_members);
+
+  for (size_t i = 1; i < count; i++)
+    if (strcmp(ret[i - 1].node->name, ret[i].node->name) == 0)
+      return nbtx_free_(ret), NULL;
+
+  return ret;
+}
+
+static nbtx_status diff_compound(struct diff_state* d, const nbtx_node* a, const nbtx_node* b) {
+  nbtx_status err = NBTX_EMEM;
+  size_t na, nb;
+
+  const nbtx_node** as = children_of(a->payload.tag_compound, &na);
+  const nbtx_node** bs = children_of(b->payload.tag_compound, &nb);
+  struct member* sorted_b = NULL;
+  size_t* match = NULL;
+  bool* matched = NULL;
+
+  if (as == NULL || bs == NULL) goto cleanup;
+
+  CHECKED_MALLOC(match, (na ? na : 1) * sizeof(*match), goto cleanup);
+  CHECKED_MALLOC(matched, (nb ? nb : 1) * sizeof(*matched), goto cleanup);
+  memset(matched, false, nb);
+
+  errno = NBTX_OK;
+  sorted_b = sorted_members(bs, nb);
+
+  if (sorted_b == NULL) {
+    if (errno != NBTX_OK) goto cleanup;
+    goto replace; /* Members can't be told apart by name. */
+  }
+
+  /*
+   * Members of `a' still in `b' must keep their relative order, and new ones
+   * must come after all of them, since sets append to the compound. Otherwise
+   * the patched tree wouldn't be nbtx_eq to `b', so just replace the whole
+   * thing.
+   */
+  size_t last = SIZE_MAX;
+
+  for (size_t i = 0; i < na; i++) {
+    if (as[i]->name == NULL) goto replace;
+
+    const struct member key = { as[i], 0 };
+    const struct member* found = bsearch(&key, sorted_b, nb, sizeof(*sorted_b), compare_members);
+
+    match[i] = found ? found->index : SIZE_MAX;
+    if (found == NULL) continue;
+
+    if (matched[found->index]) goto replace; /* a has a repeated name */
+    if (last != SIZE_MAX && found->index < last) goto replace;
+
+    matched[found->index] = true;
+    last = found->index;
+  }
+
+  for (size_t j = 0; last != SIZE_MAX && j < last; j++)
+    if (!matched[j]) goto replace;
+
+  for (size_t i = 0; i < na; i++) {
+    if (match[i] != SIZE_MAX && nbtx_eq(as[i], bs[match[i]]))
+      continue;
+
+    const size_t saved_len = d->path.len;
+    const uint16_t saved_depth = d->depth;
+
+    if ((err = push_name(d, as[i]->name)) != NBTX_OK) goto cleanup;
+
+    err = match[i] == SIZE_MAX ? emit_remove(d) : diff_node(d, as[i], bs[match[i]]);
+
+    d->path.len = saved_len;
+    d->depth = saved_depth;
+
+    if (err != NBTX_OK) goto cleanup;
+  }
+
+  for (size_t j = 0; j < nb; j++) {
+    if (matched[j]) continue;
+
+    const size_t saved_len = d->path.len;
+    const uint16_t saved_depth = d->depth;
+
+    if ((err = push_name(d, bs[j]->name)) != NBTX_OK) goto cleanup;
+
+    err = emit_set(d, bs[j]);
+
+    d->path.len = saved_len;
+    d->depth = saved_depth;
+
+    if (err != NBTX_OK) goto cleanup;
+  }
+
+  err = NBTX_OK;
+  goto cleanup;
+
+replace:
+  err = emit_set(d, b);
+
+cleanup:
+  nbtx_free_(as);
+  nbtx_free_(bs);
+  nbtx_free_(sorted_b);
+  nbtx_free_(match);
+  nbtx_free_(matched);
+  return err;
+}
+
+static nbtx_status diff_list(struct diff_state* d, const nbtx_node* a, const nbtx_node* b) {
+  const struct nbtx_list* alist = a->payload.tag_list;
+  const struct nbtx_list* blist = b->payload.tag_list;
+
+  const nbtx_type atype = alist->data ? alist->data->type : NBTX_TAG_INVALID;
+  const nbtx_type btype = blist->data ? blist->data->type : NBTX_TAG_INVALID;
+
+  if (atype != btype || atype == NBTX_TAG_INVALID)
+    return emit_set(d, b);
+
+  nbtx_status err = NBTX_EMEM;
+  size_t na, nb;
+
+  const nbtx_node** as = children_of(alist, &na);
+  const nbtx_node** bs = children_of(blist, &nb);
+
+  if (as == NULL || bs == NULL) goto cleanup;
+
+  if (na > UINT32_MAX || nb > UINT32_MAX) {
+    err = NBTX_ERR;
+    goto cleanup;
+  }
+
+  /* Skip the common head and tail, only the middle changed. */
+  const size_t shortest = na < nb ? na : nb;
+  size_t head = 0, tail = 0;
+
+  while (head < shortest && nbtx_eq(as[head], bs[head]))
+    head++;
+
+  while (tail < shortest - head && nbtx_eq(as[na - 1 - tail], bs[nb - 1 - tail]))
+    tail++;
+
+  const size_t ma = na - head - tail;
+  const size_t mb = nb - head - tail;
+
+  /*
+   * Lists and compounds which only changed a bit get their own ops. Anything
+   * else is small enough to just send the new elements again.
+   */
+  if (ma != mb || (atype != NBTX_TAG_LIST && atype != NBTX_TAG_COMPOUND)) {
+    err = emit_splice(d, (uint32_t)head, (uint32_t)ma, bs + head, (uint32_t)mb);
+    goto cleanup;
+  }
+
+  for (size_t i = head; i < head + ma; i++) {
+    if (nbtx_eq(as[i], bs[i]))
+      continue;
+
+    const size_t saved_len = d->path.len;
+    const uint16_t saved_depth = d->depth;
+
+    if ((err = push_index(d, (uint32_t)i)) != NBTX_OK) goto cleanup;
+
+    err = diff_node(d, as[i], bs[i]);
+
+    d->path.len = saved_len;
+    d->depth = saved_depth;
+
+    if (err != NBTX_OK) goto cleanup;
+  }
+
+  err = NBTX_OK;
+
+cleanup:
+  nbtx_free_(as);
+  nbtx_free_(bs);
+  return err;
+}
+
+static nbtx_status diff_node(struct diff_state* d, const nbtx_node* a, const nbtx_node* b) {
+  if (a->type != b->type || names_differ(a->name, b->name))
+    return emit_set(d, b);
+
+  if (a->type == NBTX_TAG_COMPOUND)
+    return diff_compound(d, a, b);
+
+  if (a->type == NBTX_TAG_LIST)
+    return diff_list(d, a, b);
+
+  return emit_set(d, b);
+}
+
+struct buffer nbtx_diff(const nbtx_node* a, const nbtx_node* b) {
+  assert(a);
+  assert(b);
+
+  errno = NBTX_OK;
+
+  struct buffer ret = NBTX_BUFFER_INIT;
+  struct diff_state d = { &ret, NBTX_BUFFER_INIT, 0 };
+  nbtx_status err = NBTX_OK;
+
+  if (!nbtx_eq(a, b))
+    err = diff_node(&d, a, b);
+
+  if (err == NBTX_OK) {
+    const uint8_t end = OP_END;
+
+    if (buffer_append(&ret, &end, sizeof end))
+      err = NBTX_EMEM;
+  }
+
+  buffer_free(&d.path);
+
+  if (err != NBTX_OK) {
+    errno = err;
+    buffer_free(&ret);
+  }
+
+  return ret;
+}
+
+/*
+ * Reads some bytes from the patch. If there aren't enough of them, the patch is
+ * corrupt.
+ */
+#define READ_GENERIC(dest, n) do { \
+    if(*length < (n)) return NBTX_ERR; \
+    memcpy((dest), *memory, (n)); \
+    *memory += (n); \
+    *length -= (n); \
+} while(0)
+
+struct component {
+  uint8_t kind;
+  uint32_t index;
+  const char* name; /* Not NULL-terminated! */
+  uint16_t name_length;
+};
+
+static nbtx_status read_component(struct component* c, const char** memory, size_t* length) {
+  READ_GENERIC(&c->kind, sizeof c->kind);
+
+  if (c->kind == COMPONENT_INDEX) {
+    READ_GENERIC(&c->index, sizeof c->index);
+    return NBTX_OK;
+  }
+
+  if (c->kind != COMPONENT_NAME)
+    return NBTX_ERR;
+
+  READ_GENERIC(&c->name_length, sizeof c->name_length);
+
+  if (*length < c->name_length)
+    return NBTX_ERR;
+
+  c->name = *memory;
+  *memory += c->name_length;
+  *length -= c->name_length;
+
+  return NBTX_OK;
+}
+
+/* Finds the entry a path component refers to in a list or compound. */
+static struct nbtx_list* find_entry(const nbtx_node* container, const struct component* c) {
+  const bool is_compound = container->type == NBTX_TAG_COMPOUND;
+
+  if (!is_compound && container->type != NBTX_TAG_LIST)
+    return NULL;
+
+  /* Compound members are looked up by name, list elements by index. */
+  if (is_compound != (c->kind == COMPONENT_NAME))
+    return NULL;
+
+  uint32_t i = 0;
+  struct list_head* pos;
+  list_for_each(pos, &container->payload.tag_list->entry) {
+    struct nbtx_list* entry = list_entry(pos, struct nbtx_list, entry);
+
+    if (!is_compound) {
+      if (i++ == c->index) return entry;
+      continue;
+    }
+
+    const char* name = entry->data->name;
+
+    if (name && strlen(name) == c->name_length && memcmp(name, c->name, c->name_length) == 0)
+      return entry;
+  }
+
+  return NULL;
+}
+
+/* Makes the node in `entry' private to our tree, see nbtx_clone_shared. */
+static nbtx_status unshare(struct nbtx_list* entry) {
+  if (!nbtx_shared_(entry->data))
+    return NBTX_OK;
+
+  nbtx_node* copy = nbtx_clone_shared(entry->data);
+  if (copy == NULL) return NBTX_EMEM;
+
+  nbtx_free(entry->data);
+  entry->data = copy;
+
+  return NBTX_OK;
+}
+
+static nbtx_status read_value(nbtx_node** ret, const char** memory, size_t* length) {
+  uint8_t has_name;
+  READ_GENERIC(&has_name, sizeof has_name);
+
+  if (has_name) {
+    *ret = nbtx_parse_named_tag_(memory, length);
+  } else {
+    uint8_t type;
+    READ_GENERIC(&type, sizeof type);
+
+    *ret = nbtx_parse_unnamed_tag_((nbtx_type)type, NULL, memory, length);
+  }
+
+  return *ret ? NBTX_OK : (nbtx_status)errno;
+}
+
+/* Moves the contents of `new' into `tree', and frees what used to be there. */
+static void replace_contents(nbtx_node* tree, nbtx_node* new) {
+  const nbtx_node old = *tree;
+
+  tree->type = new->type;
+  tree->name = new->name;
+  tree->payload = new->payload;
+  tree->cache = new->cache;
+
+  new->type = old.type;
+  new->name = old.name;
+  new->payload = old.payload;
+  new->cache = old.cache;
+
+  nbtx_free(new);
+}
+
+static nbtx_status apply_set(nbtx_node* tree, nbtx_node* parent, const struct component* last,
+                             const char** memory, size_t* length) {
+  nbtx_node* value;
+  nbtx_status err;
+
+  if ((err = read_value(&value, memory, length)) != NBTX_OK)
+    return err;
+
+  if (parent == NULL)
+    return replace_contents(tree, value), NBTX_OK;
+
+  struct nbtx_list* entry = find_entry(parent, last);
+
+  if (entry) {
+    const struct nbtx_list* list = parent->payload.tag_list;
+
+    if (parent->type == NBTX_TAG_LIST && list->data && value->type != list->data->type)
+      return nbtx_free(value), NBTX_ERR;
+
+    nbtx_free(entry->data);
+    entry->data = value;
+    nbtx_touch_(parent);
+
+    return NBTX_OK;
+  }
+
+  /* Only compounds can grow through a set. */
+  if (parent->type != NBTX_TAG_COMPOUND || last->kind != COMPONENT_NAME)
+    return nbtx_free(value), NBTX_ERR;
+
+  CHECKED_MALLOC(entry, sizeof(*entry), { nbtx_free(value); return NBTX_EMEM; });
+
+  entry->data = value;
+  list_add_tail(&entry->entry, &parent->payload.tag_compound->entry);
+  nbtx_touch_(parent);
+
+  return NBTX_OK;
+}
+
+static nbtx_status apply_remove(nbtx_node* parent, const struct component* last) {
+  if (parent == NULL)
+    return NBTX_ERR; /* Can't remove the root. */
+
+  struct nbtx_list* entry = find_entry(parent, last);
+
+  if (entry == NULL)
+    return NBTX_ERR;
+
+  list_del(&entry->entry);
+  nbtx_free(entry->data);
+  nbtx_free_(entry);
+  nbtx_touch_(parent);
+
+  return NBTX_OK;
+}
+
+static nbtx_status apply_splice(nbtx_node* list, const char** memory, size_t* length) {
+  uint32_t index, removed, inserted;
+
+  READ_GENERIC(&index, sizeof index);
+  READ_GENERIC(&removed, sizeof removed);
+  READ_GENERIC(&inserted, sizeof inserted);
+
+  if (list->type != NBTX_TAG_LIST || list->payload.tag_list->data == NULL)
+    return NBTX_ERR;
+
+  struct list_head* head = &list->payload.tag_list->entry;
+  const nbtx_type type = list->payload.tag_list->data->type;
+
+  nbtx_touch_(list);
+
+  /* Find the first element to remove, or the end of the list. */
+  struct list_head* pos = head->flink;
+
+  for (uint32_t i = 0; i < index; i++, pos = pos->flink)
+    if (pos == head) return NBTX_ERR;
+
+  for (uint32_t i = 0; i < removed; i++) {
+    if (pos == head) return NBTX_ERR;
+
+    struct list_head* next = pos->flink;
+    struct nbtx_list* entry = list_entry(pos, struct nbtx_list, entry);
+
+    list_del(pos);
+    nbtx_free(entry->data);
+    nbtx_free_(entry);
+
+    pos = next;
+  }
+
+  for (uint32_t i = 0; i < inserted; i++) {
+    struct nbtx_list* entry;
+    CHECKED_MALLOC(entry, sizeof(*entry), return NBTX_EMEM);
+
+    entry->data = nbtx_parse_unnamed_tag_(type, NULL, memory, length);
+
+    if (entry->data == NULL)
+      return nbtx_free_(entry), (nbtx_status)errno;
+
+    /* Adding to the "tail" of `pos' puts the new element right before it. */
+    list_add_tail(&entry->entry, pos);
+  }
+
+  return NBTX_OK;
+}
+
+static nbtx_status apply_op(nbtx_node* tree, const uint8_t op, const char** memory, size_t* length) {
+  uint16_t depth;
+  READ_GENERIC(&depth, sizeof depth);
+
+  nbtx_node* node = tree;
+  nbtx_node* parent = NULL;
+  struct component c = { 0 };
+  nbtx_status err;
+
+  /*
+   * Walk down the path. Sets and removes stop right before the last component,
+   * since they act on the parent, while splices act on the node at the path.
+   */
+  for (uint16_t i = 0; i < depth; i++) {
+    if ((err = read_component(&c, memory, length)) != NBTX_OK)
+      return err;
+
+    if (i == depth - 1 && op != OP_SPLICE) {
+      parent = node;
+      break;
+    }
+
+    struct nbtx_list* entry = find_entry(node, &c);
+
+    if (entry == NULL)
+      return NBTX_ERR;
+
+    if ((err = unshare(entry)) != NBTX_OK)
+      return err;
+
+    node = entry->data;
+  }
+
+  switch (op) {
+    case OP_SET:
+      return apply_set(tree, parent, &c, memory, length);
+    case OP_REMOVE:
+      return apply_remove(parent, &c);
+    case OP_SPLICE:
+      return apply_splice(node, memory, length);
+    default:
+      return NBTX_ERR;
+  }
+}
+
+nbtx_status nbtx_patch(nbtx_node* tree, const void* patch, size_t length) {
+  assert(tree);
+  assert(patch);
+
+  /* Patching a shared root would change every tree that has it. */
+  if (nbtx_shared_(tree))
+    return NBTX_ERR;
+
+  const char* memory = patch;
+
+  for (;;) {
+    uint8_t op;
+
+    if (length < sizeof op)
+      return NBTX_ERR;
+
+    op = (uint8_t)*memory;
+    memory++;
+    length--;
+
+    if (op == OP_END)
+      return NBTX_OK;
+
+    errno = NBTX_OK;
+
+    const nbtx_status err = apply_op(tree, op, &memory, &length);
+
+    if (err != NBTX_OK)
+      return err;
+  }
+}
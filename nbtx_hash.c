@@ -0,0 +1,283 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbtx.h"
+#include "nbtx_internal.h"
+
+#include "list.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Hashes are built by folding 64-bit words into a running value, and finished
+ * with the SplitMix64 finalizer. Multi-byte values are read as little-endian
+ * words, so the hashes don't depend on the platform.
+ */
+static uint64_t fold(const uint64_t h, const uint64_t word) {
+  return (((h << 23) | (h >> 41)) ^ word) * 0x9e3779b97f4a7c15u;
+}
+
+static uint64_t finish(uint64_t h) {
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9u;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebu;
+  h ^= h >> 31;
+  return h;
+}
+
+static uint64_t load_le(const unsigned char* p, const size_t n) {
+  uint64_t ret = 0;
+
+  for (size_t i = 0; i < n; ++i)
+    ret |= (uint64_t)p[i] << (8 * i);
+
+  return ret;
+}
+
+static uint64_t fold_bytes(uint64_t h, const void* data, const size_t n) {
+  const unsigned char* p = data;
+  size_t left = n;
+
+  for (; left >= 8; p += 8, left -= 8)
+    h = fold(h, load_le(p, 8));
+
+  if (left > 0)
+    h = fold(h, load_le(p, left));
+
+  return fold(h, n);
+}
+
+/*
+ * The second half of a digest, folded with a different rotation and
+ * multiplier so that it doesn't collide along with the first one.
+ */
+static uint64_t fold2(const uint64_t h, const uint64_t word) {
+  return (((h << 31) | (h >> 33)) ^ word) * 0xc2b2ae3d27d4eb4fu;
+}
+
+nbtx_digest nbtx_digest_bytes_(const void* data, const size_t length) {
+  const unsigned char* p = data;
+  size_t left = length;
+  uint64_t a = 0, b = 0x243f6a8885a308d3u;
+
+  for (; left >= 8; p += 8, left -= 8) {
+    const uint64_t word = load_le(p, 8);
+
+    a = fold(a, word);
+    b = fold2(b, word);
+  }
+
+  const uint64_t word = load_le(p, left);
+  a = fold(fold(a, word), length);
+  b = fold2(fold2(b, word), length);
+
+  return (nbtx_digest) { finish(a), finish(b ^ a) };
+}
+
+/* Folds in the type and name of a node. Unnamed nodes differ from ones named "". */
+static uint64_t begin(const nbtx_node* node) {
+  const uint64_t h = fold(0, (uint64_t)node->type);
+
+  if (node->name == NULL)
+    return fold(h, 0);
+
+  return fold_bytes(fold(h, 1), node->name, strlen(node->name));
+}
+
+/*
+ * The bits of a float or double as nbtx_dump_canonical writes them: every NaN
+ * is the same one, and -0.0 is 0.0.
+ */
+static uint64_t float_bits(const float x) {
+  uint32_t bits = UINT32_C(0x7fc00000);
+
+  if (!isnan(x)) {
+    const float y = x + 0.0f;
+    memcpy(&bits, &y, sizeof bits);
+  }
+
+  return bits;
+}
+
+static uint64_t double_bits(const double x) {
+  uint64_t bits = UINT64_C(0x7ff8000000000000);
+
+  if (!isnan(x)) {
+    const double y = x + 0.0;
+    memcpy(&bits, &y, sizeof bits);
+  }
+
+  return bits;
+}
+
+/*
+ * Returns the hash of anything but a list or compound, adding how many bytes
+ * it took to `bytes'.
+ */
+static uint64_t hash_leaf(const nbtx_node* node, size_t* bytes) {
+  uint64_t h = begin(node);
+
+  switch (node->type) {
+    case NBTX_TAG_BYTE:           h = fold(h, (uint64_t)node->payload.tag_byte);   break;
+    case NBTX_TAG_UNSIGNED_BYTE:  h = fold(h, (uint64_t)node->payload.tag_ubyte);  break;
+    case NBTX_TAG_SHORT:          h = fold(h, (uint64_t)node->payload.tag_short);  break;
+    case NBTX_TAG_UNSIGNED_SHORT: h = fold(h, (uint64_t)node->payload.tag_ushort); break;
+    case NBTX_TAG_INT:            h = fold(h, (uint64_t)node->payload.tag_int);    break;
+    case NBTX_TAG_UNSIGNED_INT:   h = fold(h, (uint64_t)node->payload.tag_uint);   break;
+    case NBTX_TAG_LONG:           h = fold(h, (uint64_t)node->payload.tag_long);   break;
+    case NBTX_TAG_UNSIGNED_LONG:  h = fold(h, (uint64_t)node->payload.tag_ulong);  break;
+    case NBTX_TAG_FLOAT:          h = fold(h, float_bits(node->payload.tag_float));   break;
+    case NBTX_TAG_DOUBLE:         h = fold(h, double_bits(node->payload.tag_double)); break;
+
+    case NBTX_TAG_BYTE_ARRAY:
+      h = fold_bytes(h, node->payload.tag_byte_array.data, (size_t)node->payload.tag_byte_array.length);
+      *bytes += (size_t)node->payload.tag_byte_array.length;
+      break;
+
+    case NBTX_TAG_STRING: {
+      const size_t length = strlen(node->payload.tag_string);
+
+      h = fold_bytes(h, node->payload.tag_string, length);
+      *bytes += length;
+      break;
+    }
+
+    default:
+      break;
+  }
+
+  *bytes += 8;
+  return finish(h);
+}
+
+bool nbtx_cached_hash_(const nbtx_node* node, const bool quick, uint64_t* hash) {
+  const struct nbtx_node_cache* cache = nbtx_cache_of_(node);
+
+  if (cache == NULL || cache->hashed == 0)
+    return false;
+
+  if (quick ? cache->hashed < nbtx_cache_stamp_() : nbtx_cache_changed_since_(node, cache->hashed))
+    return false;
+
+  *hash = cache->hash;
+  return true;
+}
+
+/* A list or compound being hashed. */
+struct hash_frame {
+  nbtx_node* node;
+  struct list_head* head;
+  struct list_head* pos;  /* The member last hashed. */
+  uint64_t h;             /* The type, name, and members so far. */
+  uint64_t members;
+  size_t bytes;           /* Roughly how many bytes went into `h'. */
+};
+
+static bool is_list_or_compound(const nbtx_node* node) {
+  return node->type == NBTX_TAG_LIST || node->type == NBTX_TAG_COMPOUND;
+}
+
+/* Returns false if the stack can't grow. */
+static bool push(struct hash_frame** frames, size_t* capacity, size_t* depth,
+                 const struct hash_frame* local, nbtx_node* node) {
+  if (*depth == *capacity) {
+    struct hash_frame* grown = nbtx_grow_stack_(*frames, capacity, sizeof(**frames), *frames != local);
+    if (grown == NULL) return false;
+
+    *frames = grown;
+  }
+
+  /* tag_list and tag_compound share their representation. */
+  struct list_head* head = &node->payload.tag_list->entry;
+  (*frames)[(*depth)++] = (struct hash_frame) { node, head, head, begin(node), 0, 0 };
+  return true;
+}
+
+uint64_t nbtx_hash(nbtx_node* tree) {
+  if (tree == NULL)
+    return 0;
+
+  size_t bytes = 0;
+  uint64_t ret = 0;
+
+  if (!is_list_or_compound(tree))
+    return hash_leaf(tree, &bytes);
+
+  if (nbtx_cached_hash_(tree, false, &ret))
+    return ret;
+
+  /* Changes are only tracked once there's a cache to keep up to date. */
+  nbtx_cache_enable_();
+  const uint64_t now = nbtx_cache_stamp_();
+
+  struct hash_frame local[64];
+  struct hash_frame* frames = local;
+  size_t capacity = sizeof local / sizeof local[0];
+  size_t depth = 0;
+
+  push(&frames, &capacity, &depth, local, tree);
+
+  while (depth > 0) {
+    struct hash_frame* top = &frames[depth - 1];
+    struct list_head* const head = top->head;
+    struct list_head* pos;
+
+    for (pos = top->pos->flink; pos != head; pos = pos->flink) {
+      nbtx_node* node = list_entry(pos, struct nbtx_list, entry)->data;
+      uint64_t h;
+
+      top->members++;
+
+      if (!is_list_or_compound(node)) {
+        top->h = fold(top->h, hash_leaf(node, &top->bytes));
+        continue;
+      }
+
+      /* Only big subtrees keep their hash, so assume this one is. */
+      if (nbtx_cached_hash_(node, false, &h)) {
+        top->h = fold(top->h, h);
+        top->bytes += NBTX_CACHE_MIN_SIZE;
+        continue;
+      }
+
+      top->pos = pos;
+      if (push(&frames, &capacity, &depth, local, node)) break;
+
+      top->h = fold(top->h, nbtx_hash(node));
+    }
+
+    /* Pushing may have moved the frames, so don't touch `top' here. */
+    if (pos != head) continue;
+
+    const struct hash_frame done = frames[--depth];
+    const uint64_t h = finish(fold(done.h, done.members));
+
+    /* Failing to cache isn't an error, it just means we'll have to hash it again. */
+    struct nbtx_node_cache* cache;
+    if (done.bytes >= NBTX_CACHE_MIN_SIZE && (cache = nbtx_cache_get_(done.node)) != NULL) {
+      cache->hash = h;
+      cache->hashed = now;
+    }
+
+    if (depth == 0) {
+      ret = h;
+    } else {
+      frames[depth - 1].h = fold(frames[depth - 1].h, h);
+      frames[depth - 1].bytes += done.bytes;
+    }
+  }
+
+  if (frames != local) nbtx_free_(frames);
+  return ret;
+}
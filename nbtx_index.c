@@ -0,0 +1,387 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbtx.h"
+#include "nbtx_internal.h"
+
+#include "buffer.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * An index follows the tree it describes, in host byte order like the tree:
+ *
+ *   uint64_t containers, entries;    how many of each follow
+ *   uint32_t stride, reserved;       NBTX_INDEX_STRIDE when it was written
+ *   struct index_container[]         sorted by `payload'
+ *   struct index_entry[]             grouped by container
+ *   uint64_t start;                  where the index starts, i.e. the size of the tree
+ *   char magic[8];                   "NBTXIDX1"
+ *
+ * Offsets count from the start of the tree. The entries of a compound are its
+ * members, sorted by the hash of their name and then by offset; those of a
+ * list are every `stride'th element, keyed by its position. Lists of numbers
+ * don't need any, since their elements can be found by arithmetic.
+ */
+struct index_container {
+  uint64_t payload;
+  uint64_t first; /* Its first entry. */
+  uint32_t count; /* Of its entries. */
+  uint32_t type;
+};
+
+struct index_entry {
+  uint64_t key;
+  uint64_t offset; /* Of the tag of members, and the payload of elements. */
+};
+
+static const char magic[8] = { 'N', 'B', 'T', 'X', 'I', 'D', 'X', '1' };
+
+#define HEADER_SIZE  (2 * sizeof(uint64_t) + 2 * sizeof(uint32_t))
+#define TRAILER_SIZE (sizeof(uint64_t) + sizeof magic)
+
+uint64_t nbtx_index_hash_(const void* name, const size_t length) {
+  return nbtx_digest_bytes_(name, length).lo;
+}
+
+bool nbtx_index_open_(const void* memory, const size_t length, struct nbtx_index_* index) {
+  const char* base = memory;
+  uint64_t start, containers, entries;
+  uint32_t stride;
+
+  if (memory == NULL || length < HEADER_SIZE + TRAILER_SIZE) return false;
+  if (memcmp(base + length - sizeof magic, magic, sizeof magic) != 0) return false;
+
+  memcpy(&start, base + length - TRAILER_SIZE, sizeof start);
+  if (start > length - HEADER_SIZE - TRAILER_SIZE) return false;
+
+  memcpy(&containers, base + start, sizeof containers);
+  memcpy(&entries, base + start + sizeof containers, sizeof entries);
+  memcpy(&stride, base + start + 2 * sizeof(uint64_t), sizeof stride);
+
+  /* The sizes have to add up exactly, which plain trees won't do by accident. */
+  const size_t room = (size_t)(length - start - HEADER_SIZE - TRAILER_SIZE);
+  if (containers > room / sizeof(struct index_container) ||
+      entries > room / sizeof(struct index_entry) ||
+      containers * sizeof(struct index_container) + entries * sizeof(struct index_entry) != room ||
+      stride == 0)
+    return false;
+
+  index->tree = base;
+  index->tree_length = (size_t)start;
+  index->containers = base + start + HEADER_SIZE;
+  index->container_count = (size_t)containers;
+  index->entries = index->containers + containers * sizeof(struct index_container);
+  index->entry_count = (size_t)entries;
+  index->stride = stride;
+  return true;
+}
+
+static struct index_container container_at(const struct nbtx_index_* index, const size_t i) {
+  struct index_container ret;
+  memcpy(&ret, index->containers + i * sizeof ret, sizeof ret);
+  return ret;
+}
+
+bool nbtx_index_find_(const struct nbtx_index_* index, const char* payload,
+                      struct nbtx_index_entries_* out) {
+  const uint64_t offset = (uint64_t)(payload - index->tree);
+  size_t lo = 0, hi = index->container_count;
+
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const struct index_container c = container_at(index, mid);
+
+    if (c.payload == offset) {
+      if (c.first > index->entry_count || c.count > index->entry_count - c.first)
+        return false;
+
+      out->entries = index->entries + c.first * sizeof(struct index_entry);
+      out->count = c.count;
+      return true;
+    }
+
+    if (c.payload < offset) lo = mid + 1;
+    else                    hi = mid;
+  }
+
+  return false;
+}
+
+void nbtx_index_entry_(const struct nbtx_index_entries_* entries, const size_t i,
+                       uint64_t* key, uint64_t* offset) {
+  struct index_entry e;
+  memcpy(&e, entries->entries + i * sizeof e, sizeof e);
+
+  *key = e.key;
+  *offset = e.offset;
+}
+
+size_t nbtx_index_lower_bound_(const struct nbtx_index_entries_* entries, const uint64_t key) {
+  size_t lo = 0, hi = entries->count;
+
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    uint64_t k, offset;
+
+    nbtx_index_entry_(entries, mid, &k, &offset);
+
+    if (k < key) lo = mid + 1;
+    else         hi = mid;
+  }
+
+  return lo;
+}
+
+/***** Building *****/
+
+/*
+ * Moves past `n' bytes of the memory stream. If there aren't enough of them,
+ * the tree is corrupt.
+ */
+#define SKIP(n) do { \
+    if(left < (n)) goto corrupt; \
+    p += (n); \
+    left -= (n); \
+} while(0)
+
+#define READ_GENERIC(dest, n) do { \
+    if(left < (n)) goto corrupt; \
+    memcpy((dest), p, (n)); \
+    p += (n); \
+    left -= (n); \
+} while(0)
+
+/* A list or compound whose members are being indexed. */
+struct build_frame {
+  uint64_t payload;
+  nbtx_type type;
+  nbtx_type elem_type; /* For lists. */
+  uint32_t left;       /* Elements, for lists. */
+  uint32_t count;      /* Members so far. */
+  size_t first;        /* Its first entry among the pending ones. */
+};
+
+/* A growing array of `size'-byte records. */
+struct records {
+  char* data;
+  size_t count;
+  size_t capacity;
+};
+
+static bool add_record(struct records* r, const void* record, const size_t size) {
+  if (r->count == r->capacity) {
+    const size_t capacity = r->capacity ? 2 * r->capacity : 64;
+
+    char* data = nbtx_realloc_(r->data, capacity * size);
+    if (data == NULL) return false;
+
+    r->data = data;
+    r->capacity = capacity;
+  }
+
+  memcpy(r->data + r->count++ * size, record, size);
+  return true;
+}
+
+static int compare_entries(const void* a, const void* b) {
+  const struct index_entry* x = a;
+  const struct index_entry* y = b;
+
+  if (x->key != y->key) return x->key < y->key ? -1 : 1;
+  return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static int compare_containers(const void* a, const void* b) {
+  const struct index_container* x = a;
+  const struct index_container* y = b;
+
+  return (x->payload > y->payload) - (x->payload < y->payload);
+}
+
+/*
+ * Moves the pending entries of a list or compound that ends at `end' to
+ * `done', if it is big enough to be worth indexing. Compounds with a few big
+ * members are, since finding the last one means skipping all the others.
+ */
+static bool finish(const struct build_frame* f, const uint64_t end, struct records* pending,
+                   struct records* containers, struct records* done) {
+  const size_t count = pending->count - f->first;
+  struct index_entry* entries = (struct index_entry*)pending->data + f->first;
+
+  pending->count = f->first;
+
+  if (f->count < NBTX_INDEX_STRIDE &&
+      (f->type != NBTX_TAG_COMPOUND || f->count < 2 || end - f->payload < NBTX_INDEX_MIN_BYTES))
+    return true;
+
+  if (f->type == NBTX_TAG_COMPOUND)
+    qsort(entries, count, sizeof(*entries), compare_entries);
+
+  const struct index_container c = { f->payload, done->count, (uint32_t)count, (uint32_t)f->type };
+  if (!add_record(containers, &c, sizeof c)) return false;
+
+  for (size_t i = 0; i < count; ++i)
+    if (!add_record(done, &entries[i], sizeof(*entries))) return false;
+
+  return true;
+}
+
+nbtx_status nbtx_index_build_(const void* memory, const size_t length, struct buffer* out) {
+  const char* const base = memory;
+  const char* p = memory;
+  size_t left = length;
+
+  struct build_frame local[32];
+  struct build_frame* frames = local;
+  size_t capacity = sizeof local / sizeof local[0];
+  size_t depth = 0;
+
+  struct records pending = { NULL, 0, 0 };
+  struct records containers = { NULL, 0, 0 };
+  struct records entries = { NULL, 0, 0 };
+  nbtx_status err = NBTX_OK;
+
+  uint8_t type;
+  uint16_t name_length;
+  uint32_t elems;
+
+  READ_GENERIC(&type, sizeof type);
+  READ_GENERIC(&name_length, sizeof name_length);
+  SKIP(name_length);
+
+  for (;;) {
+    /* `type' is that of the tag whose payload is at `p'. */
+    if (type == NBTX_TAG_COMPOUND || type == NBTX_TAG_LIST) {
+      struct build_frame f = { (uint64_t)(p - base), (nbtx_type)type, NBTX_TAG_INVALID, 0, 0, pending.count };
+
+      if (type == NBTX_TAG_LIST) {
+        uint8_t elem_type;
+        READ_GENERIC(&elem_type, sizeof elem_type);
+        READ_GENERIC(&elems, sizeof elems);
+
+        f.elem_type = (nbtx_type)elem_type;
+        f.left = elems;
+
+        /* Lists of numbers are skipped in one go. */
+        const size_t elem_size = nbtx_scalar_size_(f.elem_type);
+        if (elem_size) {
+          if (elems > left / elem_size) goto corrupt;
+          SKIP(elems * elem_size);
+          goto next;
+        }
+      }
+
+      if (depth == capacity) {
+        struct build_frame* grown = nbtx_grow_stack_(frames, &capacity, sizeof(*frames), frames != local);
+        if (grown == NULL) goto no_memory;
+
+        frames = grown;
+      }
+
+      frames[depth++] = f;
+    } else {
+      const nbtx_type t = (nbtx_type)type;
+      if (nbtx_skip_payload_(t, &p, &left) != NBTX_OK) goto corrupt;
+    }
+
+next:
+    /* Find the next tag, closing the lists and compounds that ended. */
+    for (;;) {
+      if (depth == 0) goto done;
+
+      struct build_frame* top = &frames[depth - 1];
+      struct index_entry e;
+
+      if (top->type == NBTX_TAG_LIST) {
+        if (top->left > 0) {
+          if (top->elem_type == NBTX_TAG_INVALID) goto corrupt;
+
+          e = (struct index_entry) { top->count, (uint64_t)(p - base) };
+          if (top->count % NBTX_INDEX_STRIDE == 0 && !add_record(&pending, &e, sizeof e))
+            goto no_memory;
+
+          top->left--;
+          top->count++;
+          type = (uint8_t)top->elem_type;
+          break;
+        }
+      } else {
+        const char* tag = p;
+        READ_GENERIC(&type, sizeof type);
+
+        if (type != 0) {
+          READ_GENERIC(&name_length, sizeof name_length);
+
+          const char* name = p;
+          SKIP(name_length);
+          e = (struct index_entry) { nbtx_index_hash_(name, name_length), (uint64_t)(tag - base) };
+
+          if (!add_record(&pending, &e, sizeof e)) goto no_memory;
+          top->count++;
+          break;
+        }
+      }
+
+      if (!finish(top, (uint64_t)(p - base), &pending, &containers, &entries)) goto no_memory;
+      depth--;
+    }
+  }
+
+done:
+  if (containers.count)
+    qsort(containers.data, containers.count, sizeof(struct index_container), compare_containers);
+
+  {
+    const uint64_t start = (uint64_t)length;
+    const uint64_t counts[2] = { containers.count, entries.count };
+    const uint32_t stride[2] = { NBTX_INDEX_STRIDE, 0 };
+
+    if (buffer_append(out, counts, sizeof counts) ||
+        buffer_append(out, stride, sizeof stride) ||
+        (containers.count && buffer_append(out, containers.data, containers.count * sizeof(struct index_container))) ||
+        (entries.count && buffer_append(out, entries.data, entries.count * sizeof(struct index_entry))) ||
+        buffer_append(out, &start, sizeof start) ||
+        buffer_append(out, magic, sizeof magic))
+      goto no_memory;
+  }
+
+  goto cleanup;
+
+corrupt:
+  err = NBTX_ERR;
+  goto cleanup;
+
+no_memory:
+  err = NBTX_EMEM;
+
+cleanup:
+  if (frames != local) nbtx_free_(frames);
+  nbtx_free_(pending.data);
+  nbtx_free_(containers.data);
+  nbtx_free_(entries.data);
+  return err;
+}
+
+struct buffer nbtx_dump_binary_indexed(const nbtx_node* tree) {
+  struct buffer ret = nbtx_dump_binary(tree);
+  if (ret.data == NULL) return ret;
+
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_DUMP);
+  errno = nbtx_index_build_(ret.data, ret.len, &ret);
+  NBTX_STATS_LEAVE();
+
+  if (errno != NBTX_OK) buffer_free(&ret);
+  return ret;
+}
@@ -0,0 +1,356 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#ifndef NBTX_INTERNAL_H_
+#define NBTX_INTERNAL_H_
+
+/*
+ * Library-private helpers shared between the translation units. Nothing in
+ * here is part of the public API, so don't include this from user code.
+ */
+
+#include "nbtx.h"
+
+#include "buffer.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Lists and compounds smaller than this aren't worth caching. */
+#ifndef NBTX_CACHE_MIN_SIZE
+#define NBTX_CACHE_MIN_SIZE 1024
+#endif
+
+/*
+ * Parses a named tag (type, name and payload) from the memory stream, moving
+ * the pointer and updating the length. Returns NULL and sets errno on failure.
+ */
+nbtx_node* nbtx_parse_named_tag_(const char** memory, size_t* length);
+
+/*
+ * Parses the payload of a tag whose type is already known. `name' (may be
+ * NULL) is adopted by the new node, or freed on failure. Returns NULL and sets
+ * errno on failure.
+ */
+nbtx_node* nbtx_parse_unnamed_tag_(nbtx_type type, char* name, const char** memory, size_t* length);
+
+/*
+ * A list or compound whose members are still being parsed. The parser keeps
+ * these on a stack of its own instead of recursing.
+ */
+struct nbtx_parse_frame_ {
+  nbtx_node* node;
+  uint32_t remaining;  /* Elements left to parse, for lists. */
+  nbtx_type elem_type; /* The type of the elements, for lists. */
+};
+
+struct nbtx_parse_stack_ {
+  struct nbtx_parse_frame_* frames;
+  size_t capacity;
+  bool on_heap; /* Whether `frames' came from the allocator. */
+};
+
+/* Returns the parse stack `ctx' keeps between parses. */
+struct nbtx_parse_stack_* nbtx_ctx_stack_(nbtx_parse_ctx* ctx);
+
+/* Parses like nbtx_parse, taking memory from `ctx' if it isn't NULL. */
+nbtx_node* nbtx_parse_with_(nbtx_parse_ctx* ctx, const void* memory, size_t length);
+
+/*
+ * Returns `size' bytes from the blocks `ctx' kept, or from the allocator if it
+ * has none of that size. NULL on memory errors.
+ */
+void* nbtx_ctx_alloc_(nbtx_parse_ctx* ctx, size_t size);
+
+/* Frees memory from nbtx_ctx_alloc_ with the allocator of `ctx', without keeping it. */
+void nbtx_ctx_free_(nbtx_parse_ctx* ctx, void* ptr);
+
+struct z_stream_s;
+
+/*
+ * Decompresses `len' bytes at `mem' with an initialized inflate stream,
+ * appending to `out'. Sets errno and returns it.
+ */
+nbtx_status nbtx_inflate_(struct z_stream_s* stream, const void* mem, size_t len, struct buffer* out);
+
+/*
+ * Appends the binary form of `tree' to `b': its type if `dump_type' is set,
+ * its name if it has one, and its payload.
+ */
+nbtx_status nbtx_dump_binary_(const nbtx_node* tree, bool dump_type, struct buffer* b);
+
+/* Appends the canonical form of `tree' to `b', see nbtx_dump_canonical. */
+nbtx_status nbtx_dump_canonical_(const nbtx_node* tree, struct buffer* b);
+
+/*
+ * Returns the size of the payload of a number type in binary form, or 0 if
+ * `type' isn't a number type.
+ */
+size_t nbtx_scalar_size_(nbtx_type type);
+
+/*
+ * Moves the memory stream past the payload of a tag of type `type', without
+ * parsing it. Returns NBTX_ERR if the payload is corrupt or truncated, and
+ * NBTX_EDEPTH if it nests deeper than nbtx_get_max_depth() counting from the
+ * payload itself.
+ */
+nbtx_status nbtx_skip_payload_(nbtx_type type, const char** memory, size_t* length);
+
+/*
+ * Changes to lists and compounds are ordered by "stamps", which grow every
+ * time a list or compound is modified. Until a node needs a cache, the stamp
+ * of its last change is kept in its `cache' pointer instead, shifted left and
+ * with the lowest bit set, so touching small nodes doesn't allocate.
+ *
+ * nbtx_dump_binary_cached keeps the payload of the tree it dumps in the
+ * root's `bytes', and gives every list and compound in it that is big enough
+ * a span into those bytes. A span is good as long as the root's bytes are
+ * from the same dump and nothing under the node changed since.
+ */
+struct nbtx_node_cache {
+  uint64_t modified;   /* Stamp of the last change to the node's children. */
+  uint64_t newest;     /* Newest stamp under the node, as of the last cached dump. */
+  struct buffer bytes; /* The payload in binary form, if the node was dumped as a root. */
+  uint64_t dumped;     /* Stamp at which `bytes' was dumped. */
+  uint64_t bytes_id;   /* Which dump `bytes' came from. */
+  uint64_t span_id;    /* Which dump the span points into, 0 if none. */
+  size_t span_offset;  /* Where the payload starts in that dump's bytes. */
+  size_t span_length;
+  uint64_t hashed;     /* Stamp at which `hash' was computed, 0 if it wasn't. */
+  uint64_t hash;       /* See nbtx_hash. */
+};
+
+/* Returns the current stamp. */
+uint64_t nbtx_cache_stamp_(void);
+
+/* Returns a number no other cached dump had. */
+uint64_t nbtx_cache_new_dump_(void);
+
+/* Starts keeping track of changes. Called before the first cache is made. */
+void nbtx_cache_enable_(void);
+
+/* Returns the cache of a node, or NULL if it has none yet. */
+struct nbtx_node_cache* nbtx_cache_of_(const nbtx_node* node);
+
+/* Returns the cache of a node, allocating it if needed. Returns NULL on memory errors. */
+struct nbtx_node_cache* nbtx_cache_get_(nbtx_node* node);
+
+/* Frees the `cache' of a node. NULL and inline stamps are fine. */
+void nbtx_cache_free_(struct nbtx_node_cache* cache);
+
+/*
+ * Records that the children of a list or compound, or the payload of a byte
+ * array or string, changed. Every function that modifies a list or compound,
+ * or replaces an array payload in place, must call this.
+ */
+void nbtx_touch_(nbtx_node* node);
+
+/* Returns true if something in the tree changed after stamp `since'. */
+bool nbtx_cache_changed_since_(const nbtx_node* tree, uint64_t since);
+
+/*
+ * Returns the newest stamp in `tree', for a cached dump made at stamp `since'.
+ * If nothing changed anywhere since, that's `since' itself. Otherwise the
+ * whole tree is walked once, and every cache under it gets its `newest' stamp.
+ * Returns UINT64_MAX if caches that old can't be trusted, or on memory errors.
+ */
+uint64_t nbtx_cache_newest_(nbtx_node* tree, uint64_t since);
+
+/*
+ * Moves the spans under `tree', copied from the cached dump `old_id' to
+ * `offset' in the dump `new_id', along with it. Reads the old span of `tree',
+ * so call this before giving it its new one.
+ */
+void nbtx_cache_move_spans_(const nbtx_node* tree, uint64_t old_id, uint64_t new_id, size_t offset);
+
+/*
+ * Sets `hash' to the cached hash of a list or compound, if it's still good.
+ * Checking that walks the lists and compounds under `node' unless nothing at
+ * all changed since; with `quick' set, it gives up instead.
+ */
+bool nbtx_cached_hash_(const nbtx_node* node, bool quick, uint64_t* hash);
+
+/* Returns a 128-bit hash of a block of memory. Not meant to resist attacks. */
+nbtx_digest nbtx_digest_bytes_(const void* data, size_t length);
+
+/*
+ * The index written by nbtx_dump_binary_indexed. Compounds with at least
+ * NBTX_INDEX_STRIDE members, or spanning at least NBTX_INDEX_MIN_BYTES, have
+ * all of them indexed by name, and lists with at least NBTX_INDEX_STRIDE
+ * elements every NBTX_INDEX_STRIDE'th one.
+ */
+#define NBTX_INDEX_STRIDE 32
+#define NBTX_INDEX_MIN_BYTES 4096
+
+struct nbtx_index_ {
+  const char* tree;
+  size_t tree_length; /* Up to the index. */
+  const char* containers;
+  size_t container_count;
+  const char* entries;
+  size_t entry_count;
+  uint32_t stride;
+};
+
+/* The index entries of a list or compound. */
+struct nbtx_index_entries_ {
+  const char* entries;
+  size_t count;
+};
+
+/* Appends an index of the tree in `memory' to `out', which may hold the tree. */
+nbtx_status nbtx_index_build_(const void* memory, size_t length, struct buffer* out);
+
+/* Looks for an index at the end of `memory'. Returns false if there's none. */
+bool nbtx_index_open_(const void* memory, size_t length, struct nbtx_index_* index);
+
+/*
+ * Finds the entries of the list or compound whose payload is at `payload'.
+ * Returns false if it isn't indexed.
+ */
+bool nbtx_index_find_(const struct nbtx_index_* index, const char* payload,
+                      struct nbtx_index_entries_* out);
+
+/*
+ * Reads the `i'th entry: the hash of its name and the offset of its tag for
+ * members of compounds, the position and offset of its payload for elements
+ * of lists.
+ */
+void nbtx_index_entry_(const struct nbtx_index_entries_* entries, size_t i,
+                       uint64_t* key, uint64_t* offset);
+
+/* Returns the first entry whose key is at least `key'. */
+size_t nbtx_index_lower_bound_(const struct nbtx_index_entries_* entries, uint64_t key);
+
+/* The hash of names in indexes. */
+uint64_t nbtx_index_hash_(const void* name, size_t length);
+
+/*
+ * Statistics. Each thread counts into a block of its own, which is only ever
+ * written by that thread, so counting is a plain load and store. Without
+ * NBTX_STATS the macros expand to nothing.
+ *
+ * NBTX_STATS_ENTER and NBTX_STATS_LEAVE bracket a public function to charge
+ * the allocations in between to a subsystem. They nest.
+ */
+#ifdef NBTX_STATS
+
+#include <stdatomic.h>
+
+#define NBTX_STATS_COUNTERS (sizeof(nbtx_stats) / sizeof(uint64_t))
+
+struct nbtx_thread_stats_ {
+  _Atomic uint64_t counters[NBTX_STATS_COUNTERS];
+  _Atomic uint64_t baseline[NBTX_STATS_COUNTERS]; /* The counters at the last reset. */
+  struct nbtx_thread_stats_* next;
+};
+
+extern _Thread_local struct nbtx_thread_stats_* nbtx_thread_stats_;
+extern _Thread_local nbtx_subsystem nbtx_subsystem_;
+
+/* Returns the block of the calling thread, making it on first use. NULL on memory errors. */
+struct nbtx_thread_stats_* nbtx_stats_register_(void);
+
+static inline void nbtx_stats_add_(const size_t counter, const uint64_t n) {
+  struct nbtx_thread_stats_* stats = nbtx_thread_stats_;
+  if (stats == NULL && (stats = nbtx_stats_register_()) == NULL) return;
+
+  _Atomic uint64_t* c = &stats->counters[counter];
+  atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+#define NBTX_STATS_ADD(field, n) \
+  nbtx_stats_add_(offsetof(nbtx_stats, field) / sizeof(uint64_t), (n))
+
+#define NBTX_STATS_ALLOC(size) do { \
+    NBTX_STATS_ADD(allocations[nbtx_subsystem_], 1); \
+    NBTX_STATS_ADD(bytes_allocated[nbtx_subsystem_], (size)); \
+  } while (0)
+
+#define NBTX_STATS_ENTER(subsystem) \
+  const nbtx_subsystem nbtx_saved_subsystem_ = nbtx_subsystem_; \
+  nbtx_subsystem_ = (subsystem)
+
+#define NBTX_STATS_LEAVE() (nbtx_subsystem_ = nbtx_saved_subsystem_)
+
+#else
+
+#define NBTX_STATS_ADD(field, n)    ((void)0)
+#define NBTX_STATS_ALLOC(size)      ((void)0)
+#define NBTX_STATS_ENTER(subsystem) ((void)0)
+#define NBTX_STATS_LEAVE()          ((void)0)
+
+#endif
+
+/*
+ * The library allocates and frees through these, so the allocations can be
+ * counted and go to the allocator set with nbtx_set_allocator.
+ */
+extern nbtx_allocator nbtx_allocator_;
+
+static inline void* nbtx_malloc_(const size_t size) {
+  NBTX_STATS_ALLOC(size);
+  return nbtx_allocator_.malloc(size, nbtx_allocator_.user);
+}
+
+static inline void* nbtx_calloc_(const size_t count, const size_t size) {
+  NBTX_STATS_ALLOC(count * size);
+
+  if (size != 0 && count > SIZE_MAX / size) return NULL;
+
+  void* ret = nbtx_allocator_.malloc(count * size, nbtx_allocator_.user);
+  if (ret) memset(ret, 0, count * size);
+  return ret;
+}
+
+static inline void* nbtx_realloc_(void* ptr, const size_t size) {
+  NBTX_STATS_ALLOC(size);
+  return nbtx_allocator_.realloc(ptr, size, nbtx_allocator_.user);
+}
+
+static inline void nbtx_free_(void* ptr) {
+  if (ptr) nbtx_allocator_.free(ptr, nbtx_allocator_.user);
+}
+
+/*
+ * Refcounts change atomically, because trees that share nodes may be freed on
+ * different threads: nbtx_dump_file_async frees its snapshot on its own. The
+ * owner that drops the last reference sees everything the others did first.
+ */
+static inline void nbtx_ref_(nbtx_node* node) {
+  __atomic_fetch_add(&node->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/* Drops a reference to `node' and returns how many are left. */
+static inline uint32_t nbtx_unref_(nbtx_node* node) {
+  return __atomic_sub_fetch(&node->refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+/* Whether others own `node' too, so it mustn't change in place. */
+static inline bool nbtx_shared_(const nbtx_node* node) {
+  return __atomic_load_n(&node->refcount, __ATOMIC_ACQUIRE) > 1;
+}
+
+/*
+ * Doubles the capacity of a stack of `size'-byte frames, which functions walk
+ * trees with instead of recursing. Stacks start out in a local array and move
+ * to the heap when it fills up, so `on_heap' tells where `frames' is. Returns
+ * the new frames, or NULL on memory errors with the old ones left alone.
+ */
+void* nbtx_grow_stack_(void* frames, size_t* capacity, size_t size, bool on_heap);
+
+/* zalloc and zfree for z_streams, with `opaque' set to NULL. */
+void* nbtx_zalloc_(void* opaque, unsigned items, unsigned size);
+void nbtx_zfree_(void* opaque, void* ptr);
+
+#endif
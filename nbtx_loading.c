@@ -9,6 +9,7 @@
  * -----------------------------------------------------------------------------
  */
 #include "nbtx.h"
+#include "nbtx_internal.h"
 
 #include "buffer.h"
 #include "list.h"
@@ -80,8 +81,8 @@ static struct buffer nbtx_compress(void* mem,
   errno = NBTX_OK;
 
   z_stream stream = {
-      .zalloc = Z_NULL,
-      .zfree = Z_NULL,
+      .zalloc = nbtx_zalloc_,
+      .zfree = nbtx_zfree_,
       .opaque = Z_NULL,
       .next_in = (void*)mem,
       .avail_in = len
@@ -136,73 +137,73 @@ compression_error:
   return NBTX_BUFFER_INIT;
 }
 
-/*
- * Reads in zlib-compressed data, and returns a buffer with the decompressed
- * data within. Returns a NULL buffer on failure, and sets errno appropriately.
- */
-static struct buffer nbtx_decompress(const void* mem, size_t len) {
-  struct buffer ret = NBTX_BUFFER_INIT;
-
+nbtx_status nbtx_inflate_(z_stream* stream, const void* mem, const size_t len, struct buffer* out) {
   errno = NBTX_OK;
 
-  z_stream stream = {
-      .zalloc = Z_NULL,
-      .zfree = Z_NULL,
-      .opaque = Z_NULL,
-      .next_in = (void*)mem,
-      .avail_in = len
-  };
-
-  /* "Add 32 to windowBits to enable zlib and gzip decoding with automatic
-   * header detection" */
-  if (inflateInit2(&stream, 15 + 32) != Z_OK) {
-    errno = NBTX_EZ;
-    return NBTX_BUFFER_INIT;
-  }
+  stream->next_in = (void*)mem;
+  stream->avail_in = len;
 
   int zlib_ret;
 
   do {
-    if (buffer_reserve(&ret, ret.len + NBTX_CHUNK_SIZE)) {
-      errno = NBTX_EMEM;
-      goto decompression_error;
-    }
+    if (buffer_reserve(out, out->len + NBTX_CHUNK_SIZE))
+      return errno = NBTX_EMEM;
 
-    stream.avail_out = NBTX_CHUNK_SIZE;
-    stream.next_out = (unsigned char*)ret.data + ret.len;
+    stream->avail_out = NBTX_CHUNK_SIZE;
+    stream->next_out = (unsigned char*)out->data + out->len;
 
-    switch (zlib_ret = inflate(&stream, Z_NO_FLUSH)) {
+    switch (zlib_ret = inflate(stream, Z_NO_FLUSH)) {
       case Z_MEM_ERROR:
-        errno = NBTX_EMEM;
-        /* fall through */
+        return errno = NBTX_EMEM;
 
       case Z_DATA_ERROR: case Z_NEED_DICT:
-        goto decompression_error;
+        return errno = NBTX_EZ;
 
       default:
         /* update our buffer length to reflect the new data */
-        ret.len += NBTX_CHUNK_SIZE - stream.avail_out;
+        out->len += NBTX_CHUNK_SIZE - stream->avail_out;
     }
 
-  } while (stream.avail_out == 0);
+  } while (stream->avail_out == 0);
 
   /*
    * If we're at the end of the input data, we'd sure as hell be at the end
    * of the zlib stream.
    */
-  if (zlib_ret != Z_STREAM_END) goto decompression_error;
-  (void)inflateEnd(&stream);
+  if (zlib_ret != Z_STREAM_END) return errno = NBTX_EZ;
 
-  return ret;
+  return NBTX_OK;
+}
 
-decompression_error:
-  if (errno == NBTX_OK)
+/*
+ * Reads in zlib-compressed data, and returns a buffer with the decompressed
+ * data within. Returns a NULL buffer on failure, and sets errno appropriately.
+ */
+static struct buffer nbtx_decompress(const void* mem, size_t len) {
+  struct buffer ret = NBTX_BUFFER_INIT;
+
+  errno = NBTX_OK;
+
+  z_stream stream = {
+      .zalloc = nbtx_zalloc_,
+      .zfree = nbtx_zfree_,
+      .opaque = Z_NULL,
+      .next_in = Z_NULL,
+      .avail_in = 0
+  };
+
+  /* "Add 32 to windowBits to enable zlib and gzip decoding with automatic
+   * header detection" */
+  if (inflateInit2(&stream, 15 + 32) != Z_OK) {
     errno = NBTX_EZ;
+    return NBTX_BUFFER_INIT;
+  }
 
-  (void)inflateEnd(&stream);
+  if (nbtx_inflate_(&stream, mem, len, &ret) != NBTX_OK)
+    buffer_free(&ret);
 
-  buffer_free(&ret);
-  return NBTX_BUFFER_INIT;
+  (void)inflateEnd(&stream);
+  return ret;
 }
 
 /*
@@ -237,11 +238,15 @@ nbtx_node* nbtx_parse_path(const char* filename) {
 }
 
 nbtx_node* nbtx_parse_compressed(const void* chunk_start, const size_t length) {
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_COMPRESS);
   struct buffer decompressed = nbtx_decompress(chunk_start, length);
+  NBTX_STATS_LEAVE();
 
   if (decompressed.data == NULL)
     return NULL;
 
+  NBTX_STATS_ADD(bytes_inflated, decompressed.len);
+
   nbtx_node* ret = nbtx_parse(decompressed.data, decompressed.len);
 
   buffer_free(&decompressed);
@@ -270,7 +275,12 @@ struct buffer nbtx_dump_compressed(const nbtx_node* tree, nbtx_compression_strat
   if (uncompressed.data == NULL)
     return NBTX_BUFFER_INIT;
 
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_COMPRESS);
   const struct buffer compressed = nbtx_compress(uncompressed.data, uncompressed.len, strat);
+  NBTX_STATS_LEAVE();
+
+  if (compressed.data != NULL)
+    NBTX_STATS_ADD(bytes_deflated, compressed.len);
 
   buffer_free(&uncompressed);
   return compressed;
@@ -0,0 +1,553 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbtx.h"
+#include "nbtx_internal.h"
+
+#include "list.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+/* More threads than this are more likely a bug than a big machine. */
+#define MAX_THREADS 256
+
+/*
+ * The work is handed out as the members of a list or compound, from some
+ * member on. A worker goes through them and, when it meets another list or
+ * compound, leaves the rest of the members as a task of its own and goes
+ * down into it. Its stack then holds what's left to do at each level, the
+ * shallowest (and biggest) first.
+ *
+ * The stack is private, so it takes no locks. Only when some worker runs out
+ * of work are the shallowest tasks moved to the worker's deque, for it to
+ * steal.
+ *
+ * nbtx_filter_parallel appends the members it keeps to `out'. Only whoever
+ * holds the task for a list appends to its copy, in order, so siblings keep
+ * their order without any joining.
+ */
+struct task {
+  const struct list_head* head;
+  const struct list_head* pos;
+  struct nbtx_list* out;
+};
+
+/* The owner takes from the end, thieves from `first'. */
+struct deque {
+  pthread_mutex_t lock;
+  struct task* tasks;
+  size_t first, end, capacity;
+};
+
+struct worker;
+
+/* One call's worth of work, which helpers join as they become free. */
+struct pool {
+  struct deque* deques;
+  struct worker* workers;
+  unsigned count;
+
+  atomic_size_t pending; /* Tasks in deques, plus workers that have work. */
+  atomic_size_t queued;  /* Tasks in deques. */
+  atomic_uint hungry;    /* Workers looking for something to steal. */
+  atomic_bool stop;      /* A visitor said stop, or we ran out of memory. */
+  atomic_bool failed;    /* We ran out of memory. */
+
+  /* Hungry workers sleep on `wake' until there's something to steal or nothing is left. */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+
+  /* Guarded by `helpers.lock'. */
+  struct pool* next;     /* In `helpers.pools' while it's taking helpers. */
+  unsigned wanted;       /* Helpers it can still take. */
+  unsigned joined;       /* Helpers working on it right now. */
+
+  nbtx_visitor_t visit;  /* For nbtx_map_parallel. */
+  nbtx_predicate_t keep; /* For nbtx_filter_parallel. */
+  void* aux;
+};
+
+/*
+ * Helper threads are started as calls need them and then kept, waiting for
+ * the next call. Each call runs on the calling thread plus whichever helpers
+ * are free, so calls from several threads at once, or from visitors, still
+ * make progress when all helpers are busy.
+ */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work; /* A pool wants helpers. */
+  pthread_cond_t left; /* A helper left a pool. */
+  struct pool* pools;  /* Taking helpers, newest first. */
+  unsigned busy, total;
+} helpers = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0 };
+
+struct worker {
+  struct pool* pool;
+  unsigned index;
+
+  struct task* stack; /* Oldest at `first', newest at `end'. */
+  size_t first, end, capacity;
+};
+
+static bool push(struct deque* d, const struct task t) {
+  bool ret = true;
+
+  pthread_mutex_lock(&d->lock);
+
+  if (d->end == d->capacity) {
+    if (d->first > 0) {
+      memmove(d->tasks, d->tasks + d->first, (d->end - d->first) * sizeof(*d->tasks));
+      d->end -= d->first;
+      d->first = 0;
+    } else {
+      const size_t capacity = d->capacity ? 2 * d->capacity : 64;
+      struct task* tasks = nbtx_realloc_(d->tasks, capacity * sizeof(*tasks));
+
+      if (tasks == NULL) {
+        ret = false;
+        goto out;
+      }
+
+      d->tasks = tasks;
+      d->capacity = capacity;
+    }
+  }
+
+  d->tasks[d->end++] = t;
+
+out:
+  pthread_mutex_unlock(&d->lock);
+  return ret;
+}
+
+static bool take(struct deque* d, struct task* t, const bool oldest) {
+  bool ret = false;
+
+  pthread_mutex_lock(&d->lock);
+
+  if (d->first < d->end) {
+    *t = oldest ? d->tasks[d->first++] : d->tasks[--d->end];
+    if (d->first == d->end) d->first = d->end = 0;
+    ret = true;
+  }
+
+  pthread_mutex_unlock(&d->lock);
+  return ret;
+}
+
+/* Pushes onto the private stack of `w'. Returns false on memory errors. */
+static bool stack_push(struct worker* w, const struct task t) {
+  if (w->end == w->capacity) {
+    if (w->first > 0) {
+      memmove(w->stack, w->stack + w->first, (w->end - w->first) * sizeof(*w->stack));
+      w->end -= w->first;
+      w->first = 0;
+    } else {
+      const size_t capacity = w->capacity ? 2 * w->capacity : 64;
+      struct task* stack = nbtx_realloc_(w->stack, capacity * sizeof(*stack));
+      if (stack == NULL) return false;
+
+      w->stack = stack;
+      w->capacity = capacity;
+    }
+  }
+
+  w->stack[w->end++] = t;
+  return true;
+}
+
+/* Moves the oldest task of `w' where others can steal it, if any of them wants to. */
+static void share(struct worker* w) {
+  struct pool* pool = w->pool;
+
+  if (w->first == w->end || atomic_load_explicit(&pool->hungry, memory_order_relaxed) == 0)
+    return;
+
+  atomic_fetch_add(&pool->pending, 1);
+  atomic_fetch_add(&pool->queued, 1);
+
+  if (!push(&pool->deques[w->index], w->stack[w->first])) {
+    atomic_fetch_sub(&pool->queued, 1);
+    atomic_fetch_sub(&pool->pending, 1);
+    return;
+  }
+
+  if (++w->first == w->end) w->first = w->end = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Marks a worker's work as done, waking everybody up if it was the last. */
+static void finish(struct pool* pool) {
+  if (atomic_fetch_sub(&pool->pending, 1) != 1)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Sleeps until some task is shared, or all the work is done. */
+static void wait_for_work(struct pool* pool) {
+  pthread_mutex_lock(&pool->lock);
+
+  while (atomic_load(&pool->queued) == 0 && atomic_load(&pool->pending) != 0)
+    pthread_cond_wait(&pool->wake, &pool->lock);
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void fail(struct pool* pool) {
+  atomic_store(&pool->failed, true);
+  atomic_store(&pool->stop, true);
+}
+
+/* Copies a node as nbtx_filter would, except lists and compounds come out empty. */
+static nbtx_node* copy_node(const nbtx_node* node) {
+  nbtx_node* ret = nbtx_malloc_(sizeof(*ret));
+  if (ret == NULL) return NULL;
+
+  *ret = (nbtx_node) { .type = node->type, .refcount = 1, .name = NULL, .payload = node->payload, .cache = NULL };
+
+  if (node->name && (ret->name = nbtx_malloc_(strlen(node->name) + 1)) == NULL)
+    goto copy_error;
+  if (node->name)
+    strcpy(ret->name, node->name);
+
+  if (node->type == NBTX_TAG_STRING) {
+    if ((ret->payload.tag_string = nbtx_malloc_(strlen(node->payload.tag_string) + 1)) == NULL)
+      goto copy_error;
+
+    strcpy(ret->payload.tag_string, node->payload.tag_string);
+  }
+
+  else if (node->type == NBTX_TAG_BYTE_ARRAY) {
+    const uint32_t length = node->payload.tag_byte_array.length;
+
+    if ((ret->payload.tag_byte_array.data = nbtx_malloc_(length)) == NULL && length > 0)
+      goto copy_error;
+
+    if (length > 0)
+      memcpy(ret->payload.tag_byte_array.data, node->payload.tag_byte_array.data, length);
+  }
+
+  else if (node->type == NBTX_TAG_LIST || node->type == NBTX_TAG_COMPOUND) {
+    /* Like nbtx_filter, the copy doesn't keep the type of empty lists. */
+    if ((ret->payload.tag_list = nbtx_malloc_(sizeof(*ret->payload.tag_list))) == NULL)
+      goto copy_error;
+
+    ret->payload.tag_list->data = NULL;
+    INIT_LIST_HEAD(&ret->payload.tag_list->entry);
+  }
+
+  NBTX_STATS_ADD(nodes_created, 1);
+  return ret;
+
+copy_error:
+  nbtx_free_(ret->name);
+  nbtx_free_(ret);
+  return NULL;
+}
+
+/* Appends a copy of `node' to `out'. Returns NULL on memory errors. */
+static nbtx_node* append_copy(struct nbtx_list* out, const nbtx_node* node) {
+  struct nbtx_list* entry = nbtx_malloc_(sizeof(*entry));
+  if (entry == NULL) return NULL;
+
+  if ((entry->data = copy_node(node)) == NULL) {
+    nbtx_free_(entry);
+    return NULL;
+  }
+
+  list_add_tail(&entry->entry, &out->entry);
+  return entry->data;
+}
+
+static void run_task(struct worker* w, struct task t) {
+  struct pool* pool = w->pool;
+
+  while (t.pos != t.head) {
+    if (atomic_load_explicit(&pool->stop, memory_order_relaxed))
+      return;
+
+    nbtx_node* node = list_entry(t.pos, struct nbtx_list, entry)->data;
+    struct nbtx_list* out = NULL;
+
+    t.pos = t.pos->flink;
+
+    if (pool->keep) {
+      if (!pool->keep(node, pool->aux)) continue;
+
+      nbtx_node* copy = append_copy(t.out, node);
+      if (copy == NULL) {
+        fail(pool);
+        return;
+      }
+
+      out = copy->payload.tag_list;
+    } else if (!pool->visit(node, pool->aux)) {
+      atomic_store(&pool->stop, true);
+      return;
+    }
+
+    if (node->type != NBTX_TAG_LIST && node->type != NBTX_TAG_COMPOUND)
+      continue;
+
+    /* tag_list and tag_compound share their representation. */
+    const struct list_head* head = &node->payload.tag_list->entry;
+    if (list_empty(head)) continue;
+
+    if (t.pos != t.head) {
+      if (!stack_push(w, t)) {
+        fail(pool);
+        return;
+      }
+
+      share(w);
+    }
+
+    t = (struct task) { head, head->flink, out };
+  }
+}
+
+static void* run_worker(void* arg) {
+  struct worker* w = arg;
+  struct pool* pool = w->pool;
+  bool hungry = false;
+  struct task t;
+
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_CLONE);
+
+  /* The first worker starts with the root on its stack. */
+  bool working = w->first < w->end;
+
+  for (;;) {
+    if (working) {
+      while (w->first < w->end)
+        run_task(w, w->stack[--w->end]);
+
+      finish(pool);
+      working = false;
+    }
+
+    if (atomic_load(&pool->pending) == 0)
+      break;
+
+    bool found = take(&pool->deques[w->index], &t, false);
+
+    for (unsigned i = 1; !found && i < pool->count; ++i)
+      found = take(&pool->deques[(w->index + i) % pool->count], &t, true);
+
+    if (hungry == found) {
+      hungry = !found;
+
+      if (hungry) atomic_fetch_add(&pool->hungry, 1);
+      else        atomic_fetch_sub(&pool->hungry, 1);
+    }
+
+    if (!found) {
+      wait_for_work(pool);
+      continue;
+    }
+
+    atomic_fetch_sub(&pool->queued, 1);
+    run_task(w, t);
+    working = true;
+  }
+
+  if (hungry) atomic_fetch_sub(&pool->hungry, 1);
+
+  NBTX_STATS_LEAVE();
+  return NULL;
+}
+
+/* Joins pools that want helpers, one after another, for as long as the process runs. */
+static void* run_helper(void* arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&helpers.lock);
+
+  for (;;) {
+    while (helpers.pools == NULL)
+      pthread_cond_wait(&helpers.work, &helpers.lock);
+
+    struct pool* pool = helpers.pools;
+    struct worker* w = &pool->workers[pool->count - pool->wanted];
+
+    if (--pool->wanted == 0) helpers.pools = pool->next;
+    pool->joined++;
+    helpers.busy++;
+
+    pthread_mutex_unlock(&helpers.lock);
+    run_worker(w);
+    pthread_mutex_lock(&helpers.lock);
+
+    helpers.busy--;
+    if (--pool->joined == 0) pthread_cond_broadcast(&helpers.left);
+  }
+
+  return NULL;
+}
+
+/* Offers `pool' to the helpers, starting more of them if too few are free. */
+static void call_helpers(struct pool* pool) {
+  pthread_mutex_lock(&helpers.lock);
+
+  pool->wanted = pool->count - 1;
+  pool->joined = 0;
+
+  if (pool->wanted > 0) {
+    pool->next = helpers.pools;
+    helpers.pools = pool;
+  }
+
+  /* Helpers that fail to start just leave more work to the others. */
+  const unsigned available = helpers.total - helpers.busy;
+
+  for (unsigned missing = pool->wanted > available ? pool->wanted - available : 0;
+       missing > 0 && helpers.total < MAX_THREADS - 1; --missing) {
+    pthread_t id;
+    if (pthread_create(&id, NULL, run_helper, NULL) != 0) break;
+
+    pthread_detach(id);
+    helpers.total++;
+  }
+
+  pthread_cond_broadcast(&helpers.work);
+  pthread_mutex_unlock(&helpers.lock);
+}
+
+/* Stops offering `pool' to the helpers, and waits for those that joined it to leave. */
+static void dismiss_helpers(struct pool* pool) {
+  pthread_mutex_lock(&helpers.lock);
+
+  if (pool->wanted > 0) {
+    struct pool** link = &helpers.pools;
+    while (*link != pool) link = &(*link)->next;
+    *link = pool->next;
+    pool->wanted = 0;
+  }
+
+  while (pool->joined > 0)
+    pthread_cond_wait(&helpers.left, &helpers.lock);
+
+  pthread_mutex_unlock(&helpers.lock);
+}
+
+/* Runs `root' to completion on up to `threads' threads, the calling one included. */
+static void run_pool(struct pool* pool, const struct task root, unsigned threads) {
+  if (threads == 0) {
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online > 0 ? (unsigned)online : 1;
+  }
+  if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+  struct deque deques[MAX_THREADS];
+  struct worker workers[MAX_THREADS];
+
+  for (unsigned i = 0; i < threads; ++i) {
+    deques[i] = (struct deque) { .tasks = NULL, .first = 0, .end = 0, .capacity = 0 };
+    pthread_mutex_init(&deques[i].lock, NULL);
+    workers[i] = (struct worker) { .pool = pool, .index = i, .stack = NULL };
+  }
+
+  pool->deques = deques;
+  pool->workers = workers;
+  pool->count = threads;
+  atomic_init(&pool->pending, 1);
+  atomic_init(&pool->queued, 0);
+  atomic_init(&pool->hungry, 0);
+  atomic_init(&pool->stop, false);
+  atomic_init(&pool->failed, false);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+
+  if (!stack_push(&workers[0], root)) {
+    atomic_store(&pool->pending, 0);
+    fail(pool);
+  }
+
+  call_helpers(pool);
+  run_worker(&workers[0]);
+  dismiss_helpers(pool);
+
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+
+  for (unsigned i = 0; i < threads; ++i) {
+    pthread_mutex_destroy(&deques[i].lock);
+    nbtx_free_(deques[i].tasks);
+    nbtx_free_(workers[i].stack);
+  }
+}
+
+bool nbtx_map_parallel(nbtx_node* tree, const nbtx_visitor_t v, void* aux, const unsigned threads) {
+  assert(v);
+
+  if (tree == NULL)  return true;
+  if (!v(tree, aux)) return false;
+
+  if ((tree->type != NBTX_TAG_LIST && tree->type != NBTX_TAG_COMPOUND) ||
+      list_empty(&tree->payload.tag_list->entry))
+    return true;
+
+  struct pool pool = { .visit = v, .keep = NULL, .aux = aux };
+  const struct list_head* head = &tree->payload.tag_list->entry;
+
+  run_pool(&pool, (struct task) { head, head->flink, NULL }, threads);
+
+  if (atomic_load(&pool.failed)) errno = NBTX_EMEM;
+  return !atomic_load(&pool.stop);
+}
+
+nbtx_node* nbtx_filter_parallel(const nbtx_node* tree, const nbtx_predicate_t filter, void* aux,
+                                const unsigned threads) {
+  assert(filter);
+
+  errno = NBTX_OK;
+
+  if (tree == NULL)       return NULL;
+  if (!filter(tree, aux)) return NULL;
+
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_CLONE);
+  nbtx_node* ret = copy_node(tree);
+  NBTX_STATS_LEAVE();
+
+  if (ret == NULL) {
+    errno = NBTX_EMEM;
+    return NULL;
+  }
+
+  if ((tree->type != NBTX_TAG_LIST && tree->type != NBTX_TAG_COMPOUND) ||
+      list_empty(&tree->payload.tag_list->entry))
+    return ret;
+
+  struct pool pool = { .visit = NULL, .keep = filter, .aux = aux };
+  const struct list_head* head = &tree->payload.tag_list->entry;
+
+  run_pool(&pool, (struct task) { head, head->flink, ret->payload.tag_list }, threads);
+
+  /* Whatever was copied is linked into `ret', so it all goes with it. */
+  if (atomic_load(&pool.failed)) {
+    nbtx_free(ret);
+    errno = NBTX_EMEM;
+    return NULL;
+  }
+
+  return ret;
+}
@@ -9,6 +9,7 @@
  * -----------------------------------------------------------------------------
  */
 #include "nbtx.h"
+#include "nbtx_internal.h"
 
 #include "buffer.h"
 #include "list.h"
@@ -16,7 +17,9 @@
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,8 +32,9 @@ static const void* memscan(void* dest, const void* src, const size_t n) {
   return (const char*)src + n;
 }
 
+/* Takes memory from the parse context `ctx', if there's one. */
 #define CHECKED_MALLOC(var, n, on_error) do { \
-    if(((var) = malloc(n)) == NULL)             \
+    if(((var) = parse_alloc(ctx, n)) == NULL) \
     {                                         \
         errno = NBTX_EMEM;                     \
         on_error;                             \
@@ -42,8 +46,15 @@ static const void* memscan(void* dest, const void* src, const size_t n) {
         return NBTX_EMEM;                 \
 } while(0)
 
-/* Parses a tag, given a name (may be NULL) and a type. Fills in the payload. */
-static nbtx_node* parse_unnamed_tag(nbtx_type type, char* name, const char** memory, size_t* length);
+static inline void* parse_alloc(nbtx_parse_ctx* ctx, const size_t size) {
+  return ctx ? nbtx_ctx_alloc_(ctx, size) : nbtx_malloc_(size);
+}
+
+/* Contexts may have an allocator of their own, so what they gave back goes to them. */
+static inline void parse_free(nbtx_parse_ctx* ctx, void* ptr) {
+  if (ctx) nbtx_ctx_free_(ctx, ptr);
+  else     nbtx_free_(ptr);
+}
 
 /*
  * Reads some bytes from the memory stream. This macro will read `n'
@@ -77,7 +88,7 @@ static void bprintf(struct buffer* b, const char* restrict format, ...) {
  * Reads a string from memory, moving the pointer and updating the length
  * appropriately. Returns NULL on failure.
  */
-static char* read_string(const char** memory, size_t* length) {
+static char* read_string(nbtx_parse_ctx* ctx, const char** memory, size_t* length) {
   uint16_t string_length;
   char* ret = NULL;
 
@@ -96,32 +107,11 @@ parse_error:
   if (errno == NBTX_OK)
     errno = NBTX_ERR;
 
-  free(ret);
-  return NULL;
-}
-
-static nbtx_node* parse_named_tag(const char** memory, size_t* length) {
-  char* name = NULL;
-
-  uint8_t type;
-  READ_GENERIC(&type, sizeof type, goto parse_error);
-
-  name = read_string(memory, length);
-
-  nbtx_node* ret = parse_unnamed_tag((nbtx_type)type, name, memory, length);
-  if (ret == NULL) goto parse_error;
-
-  return ret;
-
-parse_error:
-  if (errno == NBTX_OK)
-    errno = NBTX_ERR;
-
-  free(name);
+  parse_free(ctx, ret);
   return NULL;
 }
 
-static struct nbtx_byte_array read_byte_array(const char** memory, size_t* length) {
+static struct nbtx_byte_array read_byte_array(nbtx_parse_ctx* ctx, const char** memory, size_t* length) {
   struct nbtx_byte_array ret;
   ret.data = NULL;
 
@@ -137,7 +127,7 @@ parse_error:
   if (errno == NBTX_OK)
     errno = NBTX_ERR;
 
-  free(ret.data);
+  parse_free(ctx, ret.data);
   ret.data = NULL;
   return ret;
 }
@@ -173,104 +163,35 @@ static nbtx_type list_is_homogenous(const struct nbtx_list* list) {
   return type;
 }
 
-static struct nbtx_list* read_list(const char** memory, size_t* length) {
-  uint8_t type;
-  uint32_t elems;
-  struct nbtx_list* ret;
-
-  CHECKED_MALLOC(ret, sizeof(*ret), goto parse_error);
-
-  /* we allocate the data pointer to store the type of the list in the first
-   * sentinel element */
-  CHECKED_MALLOC(ret->data, sizeof(*ret->data), goto parse_error);
+/* Frames parse_tag keeps on the C stack before it moves its stack to the heap. */
+#define PARSE_LOCAL_FRAMES 32
 
-  INIT_LIST_HEAD(&ret->entry);
+/* Parsers on other threads may read it while it's set. */
+static atomic_size_t max_depth = NBTX_DEFAULT_MAX_DEPTH;
 
-  READ_GENERIC(&type, sizeof type, goto parse_error);
-  READ_GENERIC(&elems, sizeof elems, goto parse_error);
-
-  ret->data->type = type == NBTX_TAG_INVALID ? NBTX_TAG_COMPOUND : (nbtx_type)type;
-
-  for (uint32_t i = 0; i < elems; i++) {
-    struct nbtx_list* new;
-
-    CHECKED_MALLOC(new, sizeof(*new), goto parse_error);
-
-    new->data = parse_unnamed_tag((nbtx_type)type, NULL, memory, length);
-
-    if (new->data == NULL) {
-      free(new);
-      goto parse_error;
-    }
-
-    list_add_tail(&new->entry, &ret->entry);
-  }
-
-  return ret;
-
-parse_error:
-  if (errno == NBTX_OK)
-    errno = NBTX_ERR;
-
-  nbtx_free_list(ret);
-  return NULL;
+size_t nbtx_set_max_depth(const size_t depth) {
+  return atomic_exchange_explicit(&max_depth, depth, memory_order_relaxed);
 }
 
-static struct nbtx_list* read_compound(const char** memory, size_t* length) {
-  struct nbtx_list* ret;
-
-  CHECKED_MALLOC(ret, sizeof(*ret), goto parse_error);
-
-  ret->data = NULL;
-  INIT_LIST_HEAD(&ret->entry);
-
-  for (;;) {
-    uint8_t type;
-    char* name = NULL;
-    struct nbtx_list* new_entry;
-
-    READ_GENERIC(&type, sizeof type, goto parse_error);
-
-    if (type == 0) break; /* TAG_END == 0. We've hit the end of the list when type == TAG_END. */
-
-    name = read_string(memory, length);
-    if (name == NULL) goto parse_error;
-
-    CHECKED_MALLOC(new_entry, sizeof(*new_entry),
-                   free(name);
-    goto parse_error;
-    );
-
-    new_entry->data = parse_unnamed_tag((nbtx_type)type, name, memory, length);
-
-    if (new_entry->data == NULL) {
-      free(new_entry);
-      free(name);
-      goto parse_error;
-    }
-
-    list_add_tail(&new_entry->entry, &ret->entry);
-  }
-
-  return ret;
-
-parse_error:
-  if (errno == NBTX_OK)
-    errno = NBTX_ERR;
-  nbtx_free_list(ret);
-
-  return NULL;
+size_t nbtx_get_max_depth(void) {
+  return atomic_load_explicit(&max_depth, memory_order_relaxed);
 }
 
 /*
- * Parses a tag, given a name (may be NULL) and a type. Fills in the payload.
+ * Makes a node of type `type' and reads its payload. `name' (may be NULL) is
+ * adopted by the node, or freed on failure. Lists and compounds come out
+ * empty, and lists set `elems' to the number of elements that follow; parsing
+ * those is up to the caller. Returns NULL and sets errno on failure.
  */
-static nbtx_node* parse_unnamed_tag(const nbtx_type type, char* name, const char** memory, size_t* length) {
+static nbtx_node* begin_tag(nbtx_parse_ctx* ctx, const nbtx_type type, char* name,
+                            uint32_t* elems, const char** memory, size_t* length) {
   nbtx_node* node;
 
   CHECKED_MALLOC(node, sizeof(*node), goto parse_error);
 
   node->type = type;
+  node->refcount = 1;
+  node->cache = NULL;
   node->name = name;
 
   #define COPY_INTO_PAYLOAD(payload_name) \
@@ -308,16 +229,45 @@ static nbtx_node* parse_unnamed_tag(const nbtx_type type, char* name, const char
       COPY_INTO_PAYLOAD(tag_double);
       break;
     case NBTX_TAG_BYTE_ARRAY:
-      node->payload.tag_byte_array = read_byte_array(memory, length);
+      node->payload.tag_byte_array = read_byte_array(ctx, memory, length);
+      if (errno != NBTX_OK) goto parse_error;
       break;
     case NBTX_TAG_STRING:
-      node->payload.tag_string = read_string(memory, length);
+      node->payload.tag_string = read_string(ctx, memory, length);
+      if (node->payload.tag_string == NULL) goto parse_error;
       break;
-    case NBTX_TAG_LIST:
-      node->payload.tag_list = read_list(memory, length);
+
+    case NBTX_TAG_LIST: {
+      uint8_t elem_type;
+      struct nbtx_list* list;
+
+      READ_GENERIC(&elem_type, sizeof elem_type, goto parse_error);
+      READ_GENERIC(elems, sizeof *elems, goto parse_error);
+
+      /* Every element takes at least a byte, so don't bother with impossible lengths. */
+      if (*elems > *length) goto parse_error;
+
+      /* Only empty lists may leave out the type. */
+      if (elem_type == NBTX_TAG_INVALID && *elems > 0) goto parse_error;
+
+      CHECKED_MALLOC(list, sizeof(*list), goto parse_error);
+
+      /* we allocate the data pointer to store the type of the list in the first
+       * sentinel element */
+      CHECKED_MALLOC(list->data, sizeof(*list->data), parse_free(ctx, list); goto parse_error);
+
+      list->data->type = elem_type == NBTX_TAG_INVALID ? NBTX_TAG_COMPOUND : (nbtx_type)elem_type;
+      INIT_LIST_HEAD(&list->entry);
+
+      node->payload.tag_list = list;
       break;
+    }
+
     case NBTX_TAG_COMPOUND:
-      node->payload.tag_compound = read_compound(memory, length);
+      CHECKED_MALLOC(node->payload.tag_compound, sizeof(*node->payload.tag_compound), goto parse_error);
+
+      node->payload.tag_compound->data = NULL;
+      INIT_LIST_HEAD(&node->payload.tag_compound->entry);
       break;
 
     case NBTX_TAG_INVALID:
@@ -327,22 +277,153 @@ static nbtx_node* parse_unnamed_tag(const nbtx_type type, char* name, const char
 
   #undef COPY_INTO_PAYLOAD
 
-  if (errno != NBTX_OK) goto parse_error;
-
+  NBTX_STATS_ADD(nodes_created, 1);
   return node;
 
 parse_error:
   if (errno == NBTX_OK)
     errno = NBTX_ERR;
 
-  free(node);
+  parse_free(ctx, node);
+  parse_free(ctx, name);
+  return NULL;
+}
+
+/* Pushes a list or compound onto the stack. Returns false and sets errno on failure. */
+static bool push(struct nbtx_parse_stack_* stack, size_t* depth, const size_t limit,
+                 nbtx_node* node, const uint32_t elems) {
+  if (limit != 0 && *depth >= limit)
+    return (errno = NBTX_EDEPTH), false;
+
+  if (*depth == stack->capacity) {
+    struct nbtx_parse_frame_* frames =
+      nbtx_grow_stack_(stack->frames, &stack->capacity, sizeof(*frames), stack->on_heap);
+
+    if (frames == NULL)
+      return (errno = NBTX_EMEM), false;
+
+    stack->frames = frames;
+    stack->on_heap = true;
+  }
+
+  struct nbtx_parse_frame_* frame = &stack->frames[(*depth)++];
+  frame->node = node;
+  frame->remaining = elems;
+  frame->elem_type = node->type == NBTX_TAG_LIST ? node->payload.tag_list->data->type : NBTX_TAG_INVALID;
+  return true;
+}
+
+/*
+ * Parses a tag, given a name (which is adopted, or freed on failure) and a
+ * type. Lists and compounds that are still being filled in are kept on a
+ * stack, so nesting costs heap instead of C stack. The stack starts out
+ * small on the C stack, and moves to the heap for deeper trees.
+ */
+static nbtx_node* parse_tag(nbtx_parse_ctx* ctx, const nbtx_type type, char* name,
+                            const char** memory, size_t* length) {
+  struct nbtx_parse_frame_ local[PARSE_LOCAL_FRAMES];
+  struct nbtx_parse_stack_ own = { local, PARSE_LOCAL_FRAMES, false };
+  struct nbtx_parse_stack_* stack = ctx ? nbtx_ctx_stack_(ctx) : &own;
+  const size_t limit = atomic_load_explicit(&max_depth, memory_order_relaxed);
+  size_t depth = 0;
+
+  uint32_t elems = 0;
+  nbtx_node* root = begin_tag(ctx, type, name, &elems, memory, length);
+  if (root == NULL) return NULL;
+
+  if ((root->type == NBTX_TAG_LIST || root->type == NBTX_TAG_COMPOUND) &&
+      !push(stack, &depth, limit, root, elems))
+    goto parse_error;
+
+  while (depth > 0) {
+    struct nbtx_parse_frame_* top = &stack->frames[depth - 1];
+    nbtx_type child_type;
+    char* child_name = NULL;
+
+    if (top->node->type == NBTX_TAG_LIST) {
+      if (top->remaining == 0) { --depth; continue; }
+
+      top->remaining--;
+      child_type = top->elem_type;
+    } else {
+      uint8_t t;
+      READ_GENERIC(&t, sizeof t, goto parse_error);
+
+      if (t == 0) { --depth; continue; } /* TAG_END == 0. We've hit the end of the compound. */
+
+      child_type = (nbtx_type)t;
+      child_name = read_string(ctx, memory, length);
+      if (child_name == NULL) goto parse_error;
+    }
+
+    struct nbtx_list* entry;
+    CHECKED_MALLOC(entry, sizeof(*entry), parse_free(ctx, child_name); goto parse_error);
+
+    entry->data = begin_tag(ctx, child_type, child_name, &elems, memory, length);
+    if (entry->data == NULL) {
+      parse_free(ctx, entry);
+      goto parse_error;
+    }
+
+    /* tag_list and tag_compound share their representation. */
+    list_add_tail(&entry->entry, &top->node->payload.tag_list->entry);
+
+    if ((child_type == NBTX_TAG_LIST || child_type == NBTX_TAG_COMPOUND) &&
+        !push(stack, &depth, limit, entry->data, elems))
+      goto parse_error;
+  }
+
+  if (stack == &own && own.on_heap) nbtx_free_(own.frames);
+  return root;
+
+parse_error:
+  if (errno == NBTX_OK)
+    errno = NBTX_ERR;
+
+  if (stack == &own && own.on_heap) nbtx_free_(own.frames);
+
+  /* Everything parsed so far is linked into the tree, so this frees it all. */
+  if (ctx) nbtx_ctx_recycle(ctx, root);
+  else     nbtx_free(root);
+  return NULL;
+}
+
+static nbtx_node* parse_named_tag(nbtx_parse_ctx* ctx, const char** memory, size_t* length) {
+  uint8_t type;
+  READ_GENERIC(&type, sizeof type, goto parse_error);
+
+  char* name = read_string(ctx, memory, length);
+  if (name == NULL) goto parse_error;
+
+  return parse_tag(ctx, (nbtx_type)type, name, memory, length);
+
+parse_error:
+  if (errno == NBTX_OK)
+    errno = NBTX_ERR;
+
   return NULL;
 }
 
 nbtx_node* nbtx_parse(const void* memory, size_t length) {
+  return nbtx_parse_with_(NULL, memory, length);
+}
+
+nbtx_node* nbtx_parse_with_(nbtx_parse_ctx* ctx, const void* memory, size_t length) {
   errno = NBTX_OK;
 
-  return parse_named_tag((const char**)&memory, &length);
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_PARSE);
+  nbtx_node* ret = parse_named_tag(ctx, (const char**)&memory, &length);
+  NBTX_STATS_LEAVE();
+
+  return ret;
+}
+
+nbtx_node* nbtx_parse_named_tag_(const char** memory, size_t* length) {
+  return parse_named_tag(NULL, memory, length);
+}
+
+nbtx_node* nbtx_parse_unnamed_tag_(const nbtx_type type, char* name, const char** memory, size_t* length) {
+  return parse_tag(NULL, type, name, memory, length);
 }
 
 /* spaces, not tabs ;) */
@@ -491,18 +572,22 @@ char* nbtx_dump_ascii(const nbtx_node* tree, const nbtx_style style) {
 
   struct buffer b = NBTX_BUFFER_INIT;
 
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_DUMP);
+
   if ((errno = dump_ascii(tree, &b, 0, style, true)) != NBTX_OK) goto OOM;
   if (buffer_reserve(&b, b.len + 1))            goto OOM;
 
   b.data[b.len] = '\0'; /* null-terminate that biatch, since bprintf doesn't
                            do that for us. */
 
+  NBTX_STATS_LEAVE();
   return (char*)b.data;
 
 OOM:
   if (errno != NBTX_OK)
     errno = NBTX_EMEM;
 
+  NBTX_STATS_LEAVE();
   buffer_free(&b);
   return NULL;
 }
@@ -538,9 +623,29 @@ static nbtx_status dump_string_binary(const char* name, struct buffer* b) {
   return NBTX_OK;
 }
 
-static nbtx_status dump_binary_(const nbtx_node*, bool, struct buffer*);
+enum dump_mode {
+  DUMP_PLAIN,
+  DUMP_CACHED,   /* Use and refresh the caches of lists and compounds, see nbtx_dump_binary_cached. */
+  DUMP_CANONICAL /* Sort compounds and normalize floats, see nbtx_dump_canonical. */
+};
 
-static nbtx_status dump_list_binary(const struct nbtx_list* list, struct buffer* b) {
+/*
+ * What a cached dump copies from and writes to: the bytes of the last one, if
+ * anything in them can be reused, and where the payload of the root starts in
+ * the new one. Spans in the caches of the nodes are relative to that.
+ */
+struct cached_dump {
+  const unsigned char* old; /* NULL if nothing can be copied. */
+  uint64_t old_id;
+  uint64_t old_dumped;      /* The stamp `old' was dumped at. */
+  uint64_t id;
+  size_t base;
+};
+
+static nbtx_status dump_binary_(const nbtx_node*, bool, enum dump_mode, struct cached_dump*, struct buffer*);
+
+static nbtx_status dump_list_binary(const struct nbtx_list* list, const enum dump_mode mode,
+                                    struct cached_dump* d, struct buffer* b) {
   const nbtx_type type = list_is_homogenous(list);
 
   const size_t len = list_length(&list->entry);
@@ -568,21 +673,76 @@ static nbtx_status dump_list_binary(const struct nbtx_list* list, struct buffer*
     const struct nbtx_list* entry = list_entry(pos, const struct nbtx_list, entry);
     nbtx_status ret;
 
-    if ((ret = dump_binary_(entry->data, false, b)) != NBTX_OK)
+    if ((ret = dump_binary_(entry->data, false, mode, d, b)) != NBTX_OK)
       return ret;
   }
 
   return NBTX_OK;
 }
 
-static nbtx_status dump_compound_binary(const struct nbtx_list* list, struct buffer* b) {
+/* Orders compound members by name, unnamed ones first. Equal names keep their order. */
+static int compare_members(const void* a, const void* b) {
+  const nbtx_node* const* x = a;
+  const nbtx_node* const* y = b;
+
+  if ((*x)->name == NULL || (*y)->name == NULL) {
+    if ((*x)->name != (*y)->name)
+      return (*x)->name == NULL ? -1 : 1;
+  } else {
+    const int ret = strcmp((*x)->name, (*y)->name);
+    if (ret != 0) return ret;
+  }
+
+  return x < y ? -1 : x > y;
+}
+
+/* Dumps the members of a compound sorted by name. */
+static nbtx_status dump_sorted_members(const struct nbtx_list* list, struct buffer* b) {
+  const nbtx_node* local[32];
+  const nbtx_node** members = local;
+  size_t count = list_length(&list->entry);
+
+  if (count > sizeof local / sizeof local[0] &&
+      (members = nbtx_malloc_(count * sizeof(*members))) == NULL)
+    return NBTX_EMEM;
+
+  count = 0;
+
   const struct list_head* pos;
-  list_for_each(pos, &list->entry) {
-    const struct nbtx_list* entry = list_entry(pos, const struct nbtx_list, entry);
-    nbtx_status ret;
+  list_for_each(pos, &list->entry)
+    members[count++] = list_entry(pos, const struct nbtx_list, entry)->data;
 
-    if ((ret = dump_binary_(entry->data, true, b)) != NBTX_OK)
-      return ret;
+  /* Trees parsed from canonical dumps are in order already. */
+  for (size_t i = 1; i < count; ++i) {
+    if (compare_members(&members[i - 1], &members[i]) > 0) {
+      qsort(members, count, sizeof(*members), compare_members);
+      break;
+    }
+  }
+
+  nbtx_status ret = NBTX_OK;
+
+  for (size_t i = 0; i < count && ret == NBTX_OK; ++i)
+    ret = dump_binary_(members[i], true, DUMP_CANONICAL, NULL, b);
+
+  if (members != local) nbtx_free_(members);
+  return ret;
+}
+
+static nbtx_status dump_compound_binary(const struct nbtx_list* list, const enum dump_mode mode,
+                                        struct cached_dump* d, struct buffer* b) {
+  if (mode == DUMP_CANONICAL) {
+    const nbtx_status ret = dump_sorted_members(list, b);
+    if (ret != NBTX_OK) return ret;
+  } else {
+    const struct list_head* pos;
+    list_for_each(pos, &list->entry) {
+      const struct nbtx_list* entry = list_entry(pos, const struct nbtx_list, entry);
+      nbtx_status ret;
+
+      if ((ret = dump_binary_(entry->data, true, mode, d, b)) != NBTX_OK)
+        return ret;
+    }
   }
 
   /* write out TAG_End */
@@ -593,23 +753,111 @@ static nbtx_status dump_compound_binary(const struct nbtx_list* list, struct buf
 }
 
 /*
- * @param dump_type   Should we dump the type, or just skip it? We need to skip
- *                    when dumping lists, because the list header already says
- *                    the type.
+ * Dumps the payload of a list or compound, copying it from the last dump if
+ * nothing under it changed since. Big enough payloads get a span into the new
+ * dump, so the next one can do the same.
  */
-static nbtx_status dump_binary_(const nbtx_node* tree, const bool dump_type, struct buffer* b) {
-  if (dump_type) { /* write out the type */
+static nbtx_status dump_cached(nbtx_node* tree, struct cached_dump* d, struct buffer* b) {
+  struct nbtx_node_cache* cache = nbtx_cache_of_(tree);
+  const size_t start = b->len;
+
+  if (d->old && cache && cache->span_id == d->old_id && cache->newest <= d->old_dumped) {
+    CHECKED_APPEND(b, d->old + cache->span_offset, cache->span_length);
+    nbtx_cache_move_spans_(tree, d->old_id, d->id, start - d->base);
+  } else {
+    const nbtx_status err = tree->type == NBTX_TAG_LIST
+      ? dump_list_binary(tree->payload.tag_list, DUMP_CACHED, d, b)
+      : dump_compound_binary(tree->payload.tag_compound, DUMP_CACHED, d, b);
+
+    if (err != NBTX_OK)
+      return err;
+  }
+
+  if (b->len - start < NBTX_CACHE_MIN_SIZE)
+    return NBTX_OK;
+
+  /* Failing to cache isn't an error, it just means we'll have to dump it again. */
+  if ((cache = nbtx_cache_get_(tree)) == NULL)
+    return NBTX_OK;
+
+  cache->span_id = d->id;
+  cache->span_offset = start - d->base;
+  cache->span_length = b->len - start;
+
+  return NBTX_OK;
+}
+
+/* Dumps the payload of the root of a cached dump, and keeps it for the next one. */
+static nbtx_status dump_cached_root(nbtx_node* tree, struct buffer* b) {
+  struct nbtx_node_cache* cache = nbtx_cache_of_(tree);
+  const uint64_t now = nbtx_cache_stamp_();
+  struct cached_dump d = { NULL, 0, 0, nbtx_cache_new_dump_(), b->len };
+
+  if (cache && cache->bytes.data) {
+    const uint64_t newest = nbtx_cache_newest_(tree, cache->dumped);
+
+    if (newest <= cache->dumped) {
+      CHECKED_APPEND(b, cache->bytes.data, cache->bytes.len);
+      return NBTX_OK;
+    }
+
+    if (newest != UINT64_MAX) {
+      d.old = cache->bytes.data;
+      d.old_id = cache->bytes_id;
+      d.old_dumped = cache->dumped;
+    }
+  }
+
+  const nbtx_status err = dump_cached(tree, &d, b);
+  if (err != NBTX_OK)
+    return err;
+
+  /* Big enough payloads got a cache already. */
+  if ((cache = nbtx_cache_of_(tree)) == NULL)
+    return NBTX_OK;
+
+  if (b->len - d.base < NBTX_CACHE_MIN_SIZE) {
+    buffer_free(&cache->bytes);
+    return NBTX_OK;
+  }
+
+  cache->bytes.len = 0;
+
+  if (buffer_append(&cache->bytes, b->data + d.base, b->len - d.base)) {
+    buffer_free(&cache->bytes);
+  } else {
+    cache->dumped = now;
+    cache->bytes_id = d.id;
+  }
+
+  return NBTX_OK;
+}
+
+/* Writes out the type of `tree' if `dump_type' is set, and its name if it has one. */
+static nbtx_status dump_header(const nbtx_node* tree, const bool dump_type, struct buffer* b) {
+  if (dump_type) {
     int8_t type = (int8_t)tree->type;
 
     CHECKED_APPEND(b, &type, sizeof type);
   }
 
-  if (tree->name) {
-    nbtx_status err;
+  if (tree->name)
+    return dump_string_binary(tree->name, b);
 
-    if ((err = dump_string_binary(tree->name, b)) != NBTX_OK)
-      return err;
-  }
+  return NBTX_OK;
+}
+
+/*
+ * @param dump_type   Should we dump the type, or just skip it? We need to skip
+ *                    when dumping lists, because the list header already says
+ *                    the type.
+ */
+static nbtx_status dump_binary_(const nbtx_node* tree, const bool dump_type, const enum dump_mode mode,
+                                struct cached_dump* d, struct buffer* b) {
+  nbtx_status err;
+
+  if ((err = dump_header(tree, dump_type, b)) != NBTX_OK)
+    return err;
 
   #define DUMP_NUM(type, x) do { \
     type temp = x; \
@@ -632,18 +880,24 @@ static nbtx_status dump_binary_(const nbtx_node* tree, const bool dump_type, str
     DUMP_NUM(int64_t, tree->payload.tag_long);
   else if (tree->type == NBTX_TAG_UNSIGNED_LONG)
     DUMP_NUM(uint64_t, tree->payload.tag_ulong);
+  else if (tree->type == NBTX_TAG_FLOAT && mode == DUMP_CANONICAL)
+    DUMP_NUM(float, isnan(tree->payload.tag_float) ? NAN : tree->payload.tag_float + 0.0f);
   else if (tree->type == NBTX_TAG_FLOAT)
     DUMP_NUM(float, tree->payload.tag_float);
+  else if (tree->type == NBTX_TAG_DOUBLE && mode == DUMP_CANONICAL)
+    DUMP_NUM(double, isnan(tree->payload.tag_double) ? (double)NAN : tree->payload.tag_double + 0.0);
   else if (tree->type == NBTX_TAG_DOUBLE)
     DUMP_NUM(double, tree->payload.tag_double);
   else if (tree->type == NBTX_TAG_BYTE_ARRAY)
     return dump_byte_array_binary(tree->payload.tag_byte_array, b);
   else if (tree->type == NBTX_TAG_STRING)
     return dump_string_binary(tree->payload.tag_string, b);
+  else if (mode == DUMP_CACHED && (tree->type == NBTX_TAG_LIST || tree->type == NBTX_TAG_COMPOUND))
+    return dump_cached((nbtx_node*)tree, d, b);
   else if (tree->type == NBTX_TAG_LIST)
-    return dump_list_binary(tree->payload.tag_list, b);
+    return dump_list_binary(tree->payload.tag_list, mode, d, b);
   else if (tree->type == NBTX_TAG_COMPOUND)
-    return dump_compound_binary(tree->payload.tag_compound, b);
+    return dump_compound_binary(tree->payload.tag_compound, mode, d, b);
 
   else
     return NBTX_ERR;
@@ -660,7 +914,52 @@ struct buffer nbtx_dump_binary(const nbtx_node* tree) {
 
   struct buffer ret = NBTX_BUFFER_INIT;
 
-  errno = dump_binary_(tree, true, &ret);
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_DUMP);
+  errno = dump_binary_(tree, true, DUMP_PLAIN, NULL, &ret);
+  NBTX_STATS_LEAVE();
+
+  return ret;
+}
+
+struct buffer nbtx_dump_binary_cached(nbtx_node* tree) {
+  errno = NBTX_OK;
+
+  if (tree == NULL) return NBTX_BUFFER_INIT;
+
+  nbtx_cache_enable_();
+
+  struct buffer ret = NBTX_BUFFER_INIT;
+
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_DUMP);
+  if (tree->type != NBTX_TAG_LIST && tree->type != NBTX_TAG_COMPOUND)
+    errno = dump_binary_(tree, true, DUMP_PLAIN, NULL, &ret);
+  else if ((errno = dump_header(tree, true, &ret)) == NBTX_OK)
+    errno = dump_cached_root(tree, &ret);
+  NBTX_STATS_LEAVE();
 
   return ret;
 }
+
+struct buffer nbtx_dump_canonical(const nbtx_node* tree) {
+  errno = NBTX_OK;
+
+  if (tree == NULL) return NBTX_BUFFER_INIT;
+
+  struct buffer ret = NBTX_BUFFER_INIT;
+
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_DUMP);
+  errno = nbtx_dump_canonical_(tree, &ret);
+  NBTX_STATS_LEAVE();
+
+  if (errno != NBTX_OK) buffer_free(&ret);
+
+  return ret;
+}
+
+nbtx_status nbtx_dump_canonical_(const nbtx_node* tree, struct buffer* b) {
+  return dump_binary_(tree, true, DUMP_CANONICAL, NULL, b);
+}
+
+nbtx_status nbtx_dump_binary_(const nbtx_node* tree, const bool dump_type, struct buffer* b) {
+  return dump_binary_(tree, dump_type, DUMP_PLAIN, NULL, b);
+}
@@ -0,0 +1,1251 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbtx.h"
+#include "nbtx_internal.h"
+
+#include "list.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A query is compiled into a program of one instruction per step. Running it
+ * on a value executes the first instruction, which runs the rest of the
+ * program on every value it picks; whatever comes out of the last one is a
+ * match. Only recursive descent walks more than one level, and it does so
+ * with a stack, so running never recurses deeper than the program is long.
+ */
+enum opcode {
+  OP_MEMBER,      /* The member `name'. */
+  OP_ALL,         /* Every member or element. */
+  OP_INDEX,       /* The element `index'. */
+  OP_HAS,         /* Itself, if it has a member `name'. */
+  OP_COMPARE,     /* Itself, if its member `name' compares true to the literal. */
+  OP_DESCEND,     /* Every member named `name' below. */
+  OP_DESCEND_ALL  /* Everything below. */
+};
+
+enum comparison { CMP_EQ, CMP_NE, CMP_LT, CMP_LE, CMP_GT, CMP_GE };
+
+enum literal { LITERAL_INTEGER, LITERAL_REAL, LITERAL_STRING };
+
+struct instruction {
+  enum opcode op;
+  char* name;
+  size_t name_length;
+  int64_t index;
+
+  enum comparison cmp;
+  enum literal kind;
+  int64_t integer;
+  double real;
+  char* string;
+  size_t string_length;
+};
+
+struct nbtx_query {
+  struct instruction* code;
+  size_t count;
+  size_t capacity;
+};
+
+/***** Compiling *****/
+
+void nbtx_query_free(nbtx_query* query) {
+  if (query == NULL) return;
+
+  for (size_t i = 0; i < query->count; ++i) {
+    nbtx_free_(query->code[i].name);
+    nbtx_free_(query->code[i].string);
+  }
+
+  nbtx_free_(query->code);
+  nbtx_free_(query);
+}
+
+static bool is_space(const char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static const char* skip_spaces(const char* p) {
+  while (is_space(*p)) ++p;
+  return p;
+}
+
+/* Whether `c' can be part of a name without quotes. */
+static bool is_name_char(const char c) {
+  return c != '\0' && !is_space(c) && strchr(".[]\"=!<>*", c) == NULL;
+}
+
+/*
+ * Reads a name, quoted or not, into a new string. Returns NULL on syntax
+ * errors, with errno set to NBTX_ERR, and on memory errors.
+ */
+static char* read_name(const char** text, size_t* length) {
+  const char* p = *text;
+  size_t n = 0;
+
+  if (*p == '"') {
+    for (++p; *p != '"'; ++p, ++n) {
+      if (*p == '\\' && (p[1] == '"' || p[1] == '\\')) ++p;
+      else if (*p == '\0' || *p == '\\') goto syntax_error;
+    }
+  } else {
+    while (is_name_char(p[n])) ++n;
+    if (n == 0) goto syntax_error;
+  }
+
+  char* ret = nbtx_malloc_(n + 1);
+  if (ret == NULL) {
+    errno = NBTX_EMEM;
+    return NULL;
+  }
+
+  p = *text;
+
+  if (*p == '"') {
+    size_t i = 0;
+
+    for (++p; *p != '"'; ++p) {
+      if (*p == '\\') ++p;
+      ret[i++] = *p;
+    }
+
+    ++p;
+  } else {
+    memcpy(ret, p, n);
+    p += n;
+  }
+
+  ret[n] = '\0';
+  *length = n;
+  *text = p;
+  return ret;
+
+syntax_error:
+  errno = NBTX_ERR;
+  return NULL;
+}
+
+/* Reads a comparison operator. Returns false if there is none. */
+static bool read_comparison(const char** text, enum comparison* cmp) {
+  static const struct { const char* token; enum comparison cmp; } ops[] = {
+    { "==", CMP_EQ }, { "!=", CMP_NE }, { "<=", CMP_LE },
+    { ">=", CMP_GE }, { "<",  CMP_LT }, { ">",  CMP_GT }
+  };
+
+  for (size_t i = 0; i < sizeof ops / sizeof ops[0]; ++i) {
+    const size_t n = strlen(ops[i].token);
+
+    if (strncmp(*text, ops[i].token, n) == 0) {
+      *text += n;
+      *cmp = ops[i].cmp;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Reads a number into `in'. Numbers which look like integers and fit in an
+ * int64_t stay integers, so that longs compare exactly.
+ */
+static bool read_number(const char** text, struct instruction* in) {
+  const char* p = *text;
+  char* end;
+
+  errno = 0;
+  const long long integer = strtoll(p, &end, 10);
+
+  if (end != p && errno == 0 && (*end == '\0' || strchr(".eEnNiI", *end) == NULL)) {
+    in->kind = LITERAL_INTEGER;
+    in->integer = (int64_t)integer;
+    *text = end;
+    return true;
+  }
+
+  const double real = strtod(p, &end);
+  if (end == p) return false;
+
+  in->kind = LITERAL_REAL;
+  in->real = real;
+  *text = end;
+  return true;
+}
+
+/* Reads what's between the brackets of a step. */
+static nbtx_status read_bracket(const char** text, struct instruction* in) {
+  const char* p = skip_spaces(*text);
+
+  if (*p == '*') {
+    in->op = OP_ALL;
+    ++p;
+  } else if (*p == '-' || (*p >= '0' && *p <= '9')) {
+    char* end;
+
+    errno = 0;
+    in->op = OP_INDEX;
+    in->index = (int64_t)strtoll(p, &end, 10);
+    if (end == p || errno != 0) return NBTX_ERR;
+
+    p = end;
+  } else {
+    if ((in->name = read_name(&p, &in->name_length)) == NULL)
+      return (nbtx_status)errno;
+
+    p = skip_spaces(p);
+    in->op = OP_HAS;
+
+    if (*p != ']') {
+      in->op = OP_COMPARE;
+      if (!read_comparison(&p, &in->cmp)) return NBTX_ERR;
+
+      p = skip_spaces(p);
+
+      if (*p == '"') {
+        if ((in->string = read_name(&p, &in->string_length)) == NULL)
+          return (nbtx_status)errno;
+
+        in->kind = LITERAL_STRING;
+      } else if (!read_number(&p, in)) {
+        return NBTX_ERR;
+      }
+    }
+  }
+
+  p = skip_spaces(p);
+  if (*p != ']') return NBTX_ERR;
+
+  *text = p + 1;
+  return NBTX_OK;
+}
+
+/* Reads one step. */
+static nbtx_status read_step(const char** text, const bool first, struct instruction* in) {
+  const char* p = *text;
+
+  if (p[0] == '.' && p[1] == '.') {
+    p += 2;
+
+    if (*p == '*') {
+      in->op = OP_DESCEND_ALL;
+      ++p;
+    } else {
+      in->op = OP_DESCEND;
+      if ((in->name = read_name(&p, &in->name_length)) == NULL)
+        return (nbtx_status)errno;
+    }
+  } else if (*p == '[') {
+    ++p;
+
+    nbtx_status err;
+    if ((err = read_bracket(&p, in)) != NBTX_OK)
+      return err;
+  } else {
+    /* The first step may leave out the dot. */
+    if (*p == '.') ++p;
+    else if (!first) return NBTX_ERR;
+
+    if (*p == '*') {
+      in->op = OP_ALL;
+      ++p;
+    } else {
+      in->op = OP_MEMBER;
+      if ((in->name = read_name(&p, &in->name_length)) == NULL)
+        return (nbtx_status)errno;
+    }
+  }
+
+  *text = p;
+  return NBTX_OK;
+}
+
+nbtx_query* nbtx_query_compile(const char* text) {
+  nbtx_query* query = nbtx_calloc_(1, sizeof(*query));
+  if (query == NULL) goto no_memory;
+
+  if (text == NULL) goto syntax_error;
+
+  for (const char* p = text; *p != '\0';) {
+    if (query->count == query->capacity) {
+      const size_t capacity = query->capacity ? 2 * query->capacity : 8;
+
+      struct instruction* code = nbtx_realloc_(query->code, capacity * sizeof(*code));
+      if (code == NULL) goto no_memory;
+
+      query->code = code;
+      query->capacity = capacity;
+    }
+
+    struct instruction* in = &query->code[query->count++];
+    memset(in, 0, sizeof(*in));
+
+    const nbtx_status err = read_step(&p, p == text, in);
+    if (err == NBTX_EMEM) goto no_memory;
+    if (err != NBTX_OK) goto syntax_error;
+  }
+
+  errno = NBTX_OK;
+  return query;
+
+syntax_error:
+  nbtx_query_free(query);
+  errno = NBTX_ERR;
+  return NULL;
+
+no_memory:
+  nbtx_query_free(query);
+  errno = NBTX_EMEM;
+  return NULL;
+}
+
+/***** Comparing *****/
+
+enum number { NOT_A_NUMBER, SIGNED, UNSIGNED, REAL };
+
+/* Reads the number in `v' into `s', `u' or `d', depending on what it returns. */
+static enum number number_of(const nbtx_value* v, int64_t* s, uint64_t* u, double* d) {
+  int8_t i8; int16_t i16; int32_t i32;
+  uint8_t u8; uint16_t u16; uint32_t u32;
+  float f;
+
+  switch (v->type) {
+    case NBTX_TAG_BYTE:           memcpy(&i8, v->data, sizeof i8);   *s = i8;  return SIGNED;
+    case NBTX_TAG_SHORT:          memcpy(&i16, v->data, sizeof i16); *s = i16; return SIGNED;
+    case NBTX_TAG_INT:            memcpy(&i32, v->data, sizeof i32); *s = i32; return SIGNED;
+    case NBTX_TAG_LONG:           memcpy(s, v->data, sizeof *s);                return SIGNED;
+    case NBTX_TAG_UNSIGNED_BYTE:  memcpy(&u8, v->data, sizeof u8);   *u = u8;  return UNSIGNED;
+    case NBTX_TAG_UNSIGNED_SHORT: memcpy(&u16, v->data, sizeof u16); *u = u16; return UNSIGNED;
+    case NBTX_TAG_UNSIGNED_INT:   memcpy(&u32, v->data, sizeof u32); *u = u32; return UNSIGNED;
+    case NBTX_TAG_UNSIGNED_LONG:  memcpy(u, v->data, sizeof *u);                return UNSIGNED;
+    case NBTX_TAG_FLOAT:          memcpy(&f, v->data, sizeof f);     *d = f;   return REAL;
+    case NBTX_TAG_DOUBLE:         memcpy(d, v->data, sizeof *d);                return REAL;
+    default:                                                                    return NOT_A_NUMBER;
+  }
+}
+
+bool nbtx_value_to_long(const nbtx_value* value, int64_t* out) {
+  int64_t s; uint64_t u; double d;
+
+  switch (number_of(value, &s, &u, &d)) {
+    case SIGNED:   *out = s; return true;
+    case UNSIGNED: *out = u > INT64_MAX ? INT64_MAX : (int64_t)u; return true;
+    case REAL:
+      if (d != d)                          *out = 0;
+      else if (d >= 9223372036854775807.0) *out = INT64_MAX;
+      else if (d <= -9223372036854775808.0) *out = INT64_MIN;
+      else                                 *out = (int64_t)d;
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool nbtx_value_to_double(const nbtx_value* value, double* out) {
+  int64_t s; uint64_t u; double d;
+
+  switch (number_of(value, &s, &u, &d)) {
+    case SIGNED:   *out = (double)s; return true;
+    case UNSIGNED: *out = (double)u; return true;
+    case REAL:     *out = d;         return true;
+    default:       return false;
+  }
+}
+
+static int order_of(const double a, const double b) {
+  if (a < b) return -1;
+  if (a > b) return 1;
+  return a == b ? 0 : 2; /* NaN */
+}
+
+/* Whether `v' compares true to the literal of `in'. */
+static bool compare(const struct instruction* in, const nbtx_value* v) {
+  int order = 2; /* Unordered, unless we find out otherwise. */
+  int64_t s; uint64_t u; double d;
+
+  switch (number_of(v, &s, &u, &d)) {
+    case SIGNED:
+      if (in->kind == LITERAL_INTEGER)
+        order = (s > in->integer) - (s < in->integer);
+      else if (in->kind == LITERAL_REAL)
+        order = order_of((double)s, in->real);
+      break;
+
+    case UNSIGNED:
+      if (in->kind == LITERAL_INTEGER)
+        order = in->integer < 0 ? 1 : (u > (uint64_t)in->integer) - (u < (uint64_t)in->integer);
+      else if (in->kind == LITERAL_REAL)
+        order = order_of((double)u, in->real);
+      break;
+
+    case REAL:
+      if (in->kind == LITERAL_INTEGER)
+        order = order_of(d, (double)in->integer);
+      else if (in->kind == LITERAL_REAL)
+        order = order_of(d, in->real);
+      break;
+
+    case NOT_A_NUMBER:
+      break;
+  }
+
+  switch (v->type) {
+    case NBTX_TAG_STRING:
+      if (in->kind == LITERAL_STRING) {
+        const size_t n = v->length < in->string_length ? v->length : in->string_length;
+        const int c = n ? memcmp(v->data, in->string, n) : 0;
+
+        order = c ? (c > 0) - (c < 0) : (v->length > in->string_length) - (v->length < in->string_length);
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  if (order == 2)
+    return in->cmp == CMP_NE;
+
+  switch (in->cmp) {
+    case CMP_EQ: return order == 0;
+    case CMP_NE: return order != 0;
+    case CMP_LT: return order < 0;
+    case CMP_LE: return order <= 0;
+    case CMP_GT: return order > 0;
+    case CMP_GE: return order >= 0;
+  }
+
+  return false;
+}
+
+/***** Running on Trees *****/
+
+struct run {
+  const nbtx_query* query;
+  nbtx_match_t match;
+  void* aux;
+  nbtx_status err;
+  const struct nbtx_index_* index; /* Of the buffer, if it has one. */
+};
+
+static bool is_list_or_compound(const nbtx_type type) {
+  return type == NBTX_TAG_LIST || type == NBTX_TAG_COMPOUND;
+}
+
+static bool has_name(const nbtx_node* node, const struct instruction* in) {
+  return node->name != NULL &&
+         strncmp(node->name, in->name, in->name_length) == 0 &&
+         node->name[in->name_length] == '\0';
+}
+
+static nbtx_value value_of(const nbtx_node* node) {
+  nbtx_value v = { node->type, node->name, node->name ? strlen(node->name) : 0, NULL, 0, node };
+
+  if ((v.length = nbtx_scalar_size_(node->type)) != 0) {
+    v.data = &node->payload; /* Every number sits at the start of the union. */
+  } else if (node->type == NBTX_TAG_STRING) {
+    v.data = node->payload.tag_string;
+    v.length = strlen(node->payload.tag_string);
+  } else if (node->type == NBTX_TAG_BYTE_ARRAY) {
+    v.data = node->payload.tag_byte_array.data;
+    v.length = (size_t)node->payload.tag_byte_array.length;
+  }
+
+  return v;
+}
+
+/* Returns the first member of a compound named `in->name', if any. */
+static const nbtx_node* member_of(const nbtx_node* node, const struct instruction* in) {
+  if (node->type != NBTX_TAG_COMPOUND) return NULL;
+
+  const struct list_head* pos;
+  list_for_each(pos, &node->payload.tag_compound->entry) {
+    const nbtx_node* child = list_entry(pos, const struct nbtx_list, entry)->data;
+    if (has_name(child, in)) return child;
+  }
+
+  return NULL;
+}
+
+/* Runs the program from `pc' on `node'. Returns false to stop. */
+static bool run_tree(struct run* r, const size_t pc, const nbtx_node* node) {
+  if (pc == r->query->count) {
+    const nbtx_value v = value_of(node);
+    return r->match(&v, r->aux);
+  }
+
+  const struct instruction* in = &r->query->code[pc];
+  const struct list_head* pos;
+
+  switch (in->op) {
+    case OP_MEMBER: {
+      const nbtx_node* child = member_of(node, in);
+      return child ? run_tree(r, pc + 1, child) : true;
+    }
+
+    case OP_ALL:
+      if (!is_list_or_compound(node->type)) return true;
+
+      /* tag_list and tag_compound share their representation. */
+      list_for_each(pos, &node->payload.tag_list->entry)
+        if (!run_tree(r, pc + 1, list_entry(pos, const struct nbtx_list, entry)->data))
+          return false;
+
+      return true;
+
+    case OP_INDEX: {
+      if (node->type != NBTX_TAG_LIST) return true;
+
+      const struct list_head* head = &node->payload.tag_list->entry;
+      int64_t i = in->index;
+
+      /* Walk from whichever end is closer to the element. */
+      if (i >= 0) {
+        for (pos = head->flink; pos != head && i > 0; pos = pos->flink) --i;
+      } else {
+        for (pos = head->blink; pos != head && i < -1; pos = pos->blink) ++i;
+      }
+
+      return pos != head ? run_tree(r, pc + 1, list_entry(pos, const struct nbtx_list, entry)->data) : true;
+    }
+
+    case OP_HAS:
+    case OP_COMPARE: {
+      const nbtx_node* child = member_of(node, in);
+      if (child == NULL) return true;
+
+      if (in->op == OP_COMPARE) {
+        const nbtx_value v = value_of(child);
+        if (!compare(in, &v)) return true;
+      }
+
+      return run_tree(r, pc + 1, node);
+    }
+
+    case OP_DESCEND:
+    case OP_DESCEND_ALL: {
+      nbtx_cursor c;
+      nbtx_cursor_event e;
+      bool ret = true;
+
+      nbtx_cursor_init(&c, (nbtx_node*)node);
+      (void)nbtx_cursor_next(&c); /* `node' itself. */
+
+      while (ret && (e = nbtx_cursor_next(&c)) > NBTX_CURSOR_END) {
+        if (e == NBTX_CURSOR_LEAVE) continue;
+
+        if (in->op == OP_DESCEND_ALL || has_name(c.node, in))
+          ret = run_tree(r, pc + 1, c.node);
+      }
+
+      if (ret && e == NBTX_CURSOR_ERROR) {
+        r->err = NBTX_EMEM;
+        ret = false;
+      }
+
+      nbtx_cursor_free(&c);
+      return ret;
+    }
+  }
+
+  return true;
+}
+
+nbtx_status nbtx_query_run(const nbtx_query* query, const nbtx_node* tree,
+                           nbtx_match_t match, void* aux) {
+  if (query == NULL || tree == NULL || match == NULL)
+    return NBTX_ERR;
+
+  struct run r = { query, match, aux, NBTX_OK, NULL };
+  (void)run_tree(&r, 0, tree);
+
+  return r.err;
+}
+
+/***** Running on Buffers *****/
+
+/*
+ * Moves past `n' bytes of the memory stream. If there aren't enough of them,
+ * the tree is corrupt.
+ */
+#define SKIP(n) do { \
+    if(*length < (n)) return NBTX_ERR; \
+    *memory += (n); \
+    *length -= (n); \
+} while(0)
+
+#define READ_GENERIC(dest, n) do { \
+    if(*length < (n)) return NBTX_ERR; \
+    memcpy((dest), *memory, (n)); \
+    *memory += (n); \
+    *length -= (n); \
+} while(0)
+
+/* A tag in a buffer. */
+struct raw_node {
+  nbtx_type type;
+  const char* name;     /* NULL for list elements. */
+  size_t name_length;
+  const char* payload;
+  size_t length;        /* Left in the buffer from `payload' on. */
+};
+
+/* Reads the type and name of a tag, and points `node' at its payload. */
+static nbtx_status read_tag(const char** memory, size_t* length, struct raw_node* node) {
+  uint8_t type;
+  uint16_t name_length;
+
+  READ_GENERIC(&type, sizeof type);
+  node->type = (nbtx_type)type;
+  if (type == 0) return NBTX_OK; /* TAG_End */
+
+  READ_GENERIC(&name_length, sizeof name_length);
+  node->name = *memory;
+  node->name_length = name_length;
+  SKIP(name_length);
+
+  node->payload = *memory;
+  node->length = *length;
+  return NBTX_OK;
+}
+
+/* The members of a list or compound in a buffer, one after the other. */
+struct children {
+  const char* memory;
+  size_t length;
+  bool list;
+  nbtx_type elem_type;
+  uint32_t left; /* Elements, for lists. */
+};
+
+static nbtx_status first_child(const struct raw_node* node, struct children* it) {
+  const char** memory = &it->memory;
+  size_t* length = &it->length;
+
+  it->memory = node->payload;
+  it->length = node->length;
+  it->list = node->type == NBTX_TAG_LIST;
+
+  if (it->list) {
+    uint8_t elem_type;
+    READ_GENERIC(&elem_type, sizeof elem_type);
+    READ_GENERIC(&it->left, sizeof it->left);
+    it->elem_type = (nbtx_type)elem_type;
+  }
+
+  return NBTX_OK;
+}
+
+/*
+ * Sets `child' to the next member, whose payload then has to be gone past with
+ * skip_child. At the end, `child->type' is TAG_End.
+ */
+static nbtx_status next_child(struct children* it, struct raw_node* child) {
+  if (!it->list)
+    return read_tag(&it->memory, &it->length, child);
+
+  if (it->left == 0) {
+    child->type = NBTX_TAG_INVALID;
+    return NBTX_OK;
+  }
+
+  if (it->elem_type == NBTX_TAG_INVALID) return NBTX_ERR;
+
+  it->left--;
+  *child = (struct raw_node) { it->elem_type, NULL, 0, it->memory, it->length };
+  return NBTX_OK;
+}
+
+static nbtx_status skip_child(struct children* it, const struct raw_node* child) {
+  return nbtx_skip_payload_(child->type, &it->memory, &it->length);
+}
+
+static bool has_raw_name(const struct raw_node* node, const struct instruction* in) {
+  return node->name != NULL && node->name_length == in->name_length &&
+         memcmp(node->name, in->name, in->name_length) == 0;
+}
+
+static nbtx_status raw_value_of(const struct raw_node* node, nbtx_value* v) {
+  const char* p = node->payload;
+  size_t left = node->length;
+  const char** memory = &p;
+  size_t* length = &left;
+
+  *v = (nbtx_value) { node->type, node->name, node->name_length, NULL, 0, NULL };
+
+  if ((v->length = nbtx_scalar_size_(node->type)) != 0) {
+    if (left < v->length) return NBTX_ERR;
+    v->data = p;
+    return NBTX_OK;
+  }
+
+  switch (node->type) {
+    case NBTX_TAG_STRING: {
+      uint16_t n;
+      READ_GENERIC(&n, sizeof n);
+      v->length = n;
+      break;
+    }
+
+    case NBTX_TAG_BYTE_ARRAY: {
+      uint32_t n;
+      READ_GENERIC(&n, sizeof n);
+      v->length = n;
+      break;
+    }
+
+    case NBTX_TAG_LIST:
+    case NBTX_TAG_COMPOUND: {
+      nbtx_status err;
+      if ((err = nbtx_skip_payload_(node->type, memory, length)) != NBTX_OK)
+        return err;
+
+      v->data = node->payload;
+      v->length = node->length - left;
+      return NBTX_OK;
+    }
+
+    default:
+      return NBTX_ERR;
+  }
+
+  if (left < v->length) return NBTX_ERR;
+  v->data = p;
+  return NBTX_OK;
+}
+
+/*
+ * The members of a compound with a given name, in order. If the tree has an
+ * index, they're looked up there instead of going through all the members.
+ */
+struct named_members {
+  const char* name;
+  size_t name_length;
+
+  const struct nbtx_index_* index;
+  struct nbtx_index_entries_ entries;
+  size_t next; /* The next entry, if `index' isn't NULL. */
+  uint64_t hash;
+
+  struct children it;
+  struct raw_node last; /* To skip before going on, if it's a member. */
+};
+
+static nbtx_status first_named(const struct nbtx_index_* index, const struct raw_node* node,
+                               const char* name, const size_t name_length, struct named_members* m) {
+  m->name = name;
+  m->name_length = name_length;
+  m->last.type = NBTX_TAG_INVALID;
+
+  /* Lists are only indexed by position. */
+  if (index && node->type == NBTX_TAG_COMPOUND && nbtx_index_find_(index, node->payload, &m->entries)) {
+    m->index = index;
+    m->hash = nbtx_index_hash_(name, name_length);
+    m->next = nbtx_index_lower_bound_(&m->entries, m->hash);
+    return NBTX_OK;
+  }
+
+  m->index = NULL;
+  return first_child(node, &m->it);
+}
+
+/* Sets `member' to the next member with the name, or its type to TAG_End if there's none left. */
+static nbtx_status next_named(struct named_members* m, struct raw_node* member) {
+  nbtx_status err;
+
+  if (m->index) {
+    const struct nbtx_index_* index = m->index;
+    uint64_t key, offset;
+
+    for (; m->next < m->entries.count; ++m->next) {
+      nbtx_index_entry_(&m->entries, m->next, &key, &offset);
+      if (key != m->hash) break;
+      if (offset >= index->tree_length) return NBTX_ERR;
+
+      const char* p = index->tree + offset;
+      size_t left = index->tree_length - offset;
+
+      if ((err = read_tag(&p, &left, member)) != NBTX_OK) return err;
+      if (member->type == NBTX_TAG_INVALID) return NBTX_ERR;
+
+      if (member->name_length == m->name_length && memcmp(member->name, m->name, m->name_length) == 0) {
+        m->next++;
+        return NBTX_OK;
+      }
+    }
+
+    member->type = NBTX_TAG_INVALID;
+    return NBTX_OK;
+  }
+
+  if (m->last.type != NBTX_TAG_INVALID && (err = skip_child(&m->it, &m->last)) != NBTX_OK)
+    return err;
+
+  for (;;) {
+    if ((err = next_child(&m->it, member)) != NBTX_OK) return err;
+    if (member->type == NBTX_TAG_INVALID) return NBTX_OK;
+
+    if (member->name_length == m->name_length &&
+        (m->name_length == 0 || memcmp(member->name, m->name, m->name_length) == 0)) {
+      m->last = *member;
+      return NBTX_OK;
+    }
+
+    if ((err = skip_child(&m->it, member)) != NBTX_OK) return err;
+  }
+}
+
+/* Finds the first member of a compound named `in->name'. Sets `found' if there is one. */
+static nbtx_status raw_member_of(const struct run* r, const struct raw_node* node,
+                                 const struct instruction* in, struct raw_node* child, bool* found) {
+  struct named_members m;
+  nbtx_status err;
+
+  *found = false;
+  if (node->type != NBTX_TAG_COMPOUND) return NBTX_OK;
+
+  if ((err = first_named(r->index, node, in->name, in->name_length, &m)) != NBTX_OK ||
+      (err = next_named(&m, child)) != NBTX_OK)
+    return err;
+
+  *found = child->type != NBTX_TAG_INVALID;
+  return NBTX_OK;
+}
+
+static bool fail(struct run* r, const nbtx_status err) {
+  r->err = err;
+  return false;
+}
+
+static bool run_raw(struct run* r, size_t pc, const struct raw_node* node);
+
+/* Whether descending into `node' may find anything for `in'. */
+static bool worth_entering(const struct raw_node* node, const struct instruction* in) {
+  if (!is_list_or_compound(node->type)) return false;
+  if (in->op == OP_DESCEND_ALL || node->type == NBTX_TAG_COMPOUND) return true;
+
+  /* List elements have no names, so only their own members can match. */
+  uint8_t elem_type;
+  if (node->length < 1) return true; /* Let first_child complain. */
+  memcpy(&elem_type, node->payload, sizeof elem_type);
+
+  return is_list_or_compound((nbtx_type)elem_type);
+}
+
+/* Runs the program from `pc + 1' on everything below `node' that `in' picks. */
+static bool descend_raw(struct run* r, const size_t pc, const struct raw_node* node) {
+  const struct instruction* in = &r->query->code[pc];
+
+  struct children local[32];
+  struct children* frames = local;
+  size_t capacity = sizeof local / sizeof local[0];
+  size_t depth = 0;
+  bool ret = true;
+  nbtx_status err;
+
+  if ((err = first_child(node, &frames[depth++])) != NBTX_OK)
+    return fail(r, err);
+
+  while (ret && depth > 0) {
+    struct children* top = &frames[depth - 1];
+    struct raw_node child;
+
+    if ((err = next_child(top, &child)) != NBTX_OK) {
+      ret = fail(r, err);
+      break;
+    }
+
+    /* Done with this one, so carry on after it in its parent. */
+    if (child.type == NBTX_TAG_INVALID) {
+      if (--depth > 0) {
+        frames[depth - 1].memory = top->memory;
+        frames[depth - 1].length = top->length;
+      }
+
+      continue;
+    }
+
+    if ((in->op == OP_DESCEND_ALL || has_raw_name(&child, in)) && !run_raw(r, pc + 1, &child)) {
+      ret = false;
+      break;
+    }
+
+    if (!worth_entering(&child, in)) {
+      if ((err = skip_child(top, &child)) != NBTX_OK) ret = fail(r, err);
+      continue;
+    }
+
+    if (depth == capacity) {
+      struct children* grown = nbtx_grow_stack_(frames, &capacity, sizeof(*frames), frames != local);
+
+      if (grown == NULL) {
+        ret = fail(r, NBTX_EMEM);
+        break;
+      }
+
+      frames = grown;
+    }
+
+    if ((err = first_child(&child, &frames[depth++])) != NBTX_OK)
+      ret = fail(r, err);
+  }
+
+  if (frames != local) nbtx_free_(frames);
+  return ret;
+}
+
+/* Runs the program from `pc' on `node'. Returns false to stop. */
+static bool run_raw(struct run* r, const size_t pc, const struct raw_node* node) {
+  nbtx_status err;
+
+  if (pc == r->query->count) {
+    nbtx_value v;
+    if ((err = raw_value_of(node, &v)) != NBTX_OK) return fail(r, err);
+
+    return r->match(&v, r->aux);
+  }
+
+  const struct instruction* in = &r->query->code[pc];
+  struct children it;
+  struct raw_node child;
+
+  switch (in->op) {
+    case OP_MEMBER: {
+      bool found;
+      if ((err = raw_member_of(r, node, in, &child, &found)) != NBTX_OK) return fail(r, err);
+
+      return found ? run_raw(r, pc + 1, &child) : true;
+    }
+
+    case OP_ALL:
+      if (!is_list_or_compound(node->type)) return true;
+      if ((err = first_child(node, &it)) != NBTX_OK) return fail(r, err);
+
+      for (;;) {
+        if ((err = next_child(&it, &child)) != NBTX_OK) return fail(r, err);
+        if (child.type == NBTX_TAG_INVALID) return true;
+
+        if (!run_raw(r, pc + 1, &child)) return false;
+        if ((err = skip_child(&it, &child)) != NBTX_OK) return fail(r, err);
+      }
+
+    case OP_INDEX: {
+      if (node->type != NBTX_TAG_LIST) return true;
+      if ((err = first_child(node, &it)) != NBTX_OK) return fail(r, err);
+
+      const int64_t i = in->index < 0 ? (int64_t)it.left + in->index : in->index;
+      if (i < 0 || i >= (int64_t)it.left) return true;
+
+      /* Numbers all have the same size, so jump straight to the element. */
+      const size_t elem_size = nbtx_scalar_size_(it.elem_type);
+      if (elem_size) {
+        if ((size_t)i >= it.length / elem_size) return fail(r, NBTX_ERR);
+
+        child = (struct raw_node) { it.elem_type, NULL, 0, it.memory + i * elem_size, it.length - i * elem_size };
+        return run_raw(r, pc + 1, &child);
+      }
+
+      /* Start from the closest element the index knows, if there's one. */
+      int64_t j = 0;
+      struct nbtx_index_entries_ entries;
+      uint64_t key, offset;
+
+      if (r->index && nbtx_index_find_(r->index, node->payload, &entries) &&
+          (uint64_t)i / r->index->stride < entries.count) {
+        nbtx_index_entry_(&entries, (size_t)((uint64_t)i / r->index->stride), &key, &offset);
+        if (key > (uint64_t)i || offset >= r->index->tree_length) return fail(r, NBTX_ERR);
+
+        j = (int64_t)key;
+        it.memory = r->index->tree + offset;
+        it.length = r->index->tree_length - offset;
+        it.left -= (uint32_t)key;
+      }
+
+      for (;; ++j) {
+        if ((err = next_child(&it, &child)) != NBTX_OK) return fail(r, err);
+        if (j == i) return run_raw(r, pc + 1, &child);
+        if ((err = skip_child(&it, &child)) != NBTX_OK) return fail(r, err);
+      }
+    }
+
+    case OP_HAS:
+    case OP_COMPARE: {
+      bool found;
+      if ((err = raw_member_of(r, node, in, &child, &found)) != NBTX_OK) return fail(r, err);
+      if (!found) return true;
+
+      if (in->op == OP_COMPARE) {
+        nbtx_value v;
+        if ((err = raw_value_of(&child, &v)) != NBTX_OK) return fail(r, err);
+        if (!compare(in, &v)) return true;
+      }
+
+      return run_raw(r, pc + 1, node);
+    }
+
+    case OP_DESCEND:
+    case OP_DESCEND_ALL:
+      if (!is_list_or_compound(node->type)) return true;
+      return descend_raw(r, pc, node);
+  }
+
+  return true;
+}
+
+nbtx_status nbtx_query_run_raw(const nbtx_query* query, const void* memory, const size_t length,
+                               nbtx_match_t match, void* aux) {
+  if (query == NULL || memory == NULL || match == NULL)
+    return NBTX_ERR;
+
+  struct nbtx_index_ index;
+  const bool indexed = nbtx_index_open_(memory, length, &index);
+
+  const char* p = memory;
+  size_t left = indexed ? index.tree_length : length;
+  struct raw_node root;
+  nbtx_status err;
+
+  if ((err = read_tag(&p, &left, &root)) != NBTX_OK) return err;
+  if (root.type == 0) return NBTX_ERR;
+
+  struct run r = { query, match, aux, NBTX_OK, indexed ? &index : NULL };
+  (void)run_raw(&r, 0, &root);
+
+  return r.err;
+}
+
+/***** Peeking and Poking *****/
+
+/* Whether `node' is named the first `n' bytes of `path'. Unnamed nodes are named "". */
+static bool has_path_name(const struct raw_node* node, const char* path, const size_t n) {
+  return node->name_length == n && (n == 0 || memcmp(node->name, path, n) == 0);
+}
+
+/*
+ * Looks for `path' among the members of `node', and sets `found' to it. Like
+ * nbtx_find_by_path, this goes on with the next member if the path isn't
+ * below the first one that matches, so it recurses once per component of the
+ * path at most.
+ */
+static nbtx_status find_below(const struct nbtx_index_* index, const struct raw_node* node,
+                              const char* path, struct raw_node* found) {
+  const size_t n = strcspn(path, ".");
+  struct named_members m;
+  nbtx_status err;
+
+  if (!is_list_or_compound(node->type)) return NBTX_ENOTFOUND;
+
+  /* List elements are unnamed, so there's no need to look at them. */
+  if (node->type == NBTX_TAG_LIST && n != 0) return NBTX_ENOTFOUND;
+
+  if ((err = first_named(index, node, path, n, &m)) != NBTX_OK) return err;
+
+  for (;;) {
+    if ((err = next_named(&m, found)) != NBTX_OK) return err;
+    if (found->type == NBTX_TAG_INVALID) return NBTX_ENOTFOUND;
+    if (path[n] == '\0') return NBTX_OK;
+
+    const struct raw_node child = *found;
+    if ((err = find_below(index, &child, path + n + 1, found)) != NBTX_ENOTFOUND)
+      return err;
+  }
+}
+
+/*
+ * Finds `path' in a tree in binary form, as nbtx_find_by_path would. Sets
+ * `tree_length' to the size of the tree, without its index.
+ */
+static nbtx_status find_path(const void* memory, const size_t length, const char* path,
+                             struct raw_node* found, size_t* tree_length) {
+  if (memory == NULL || path == NULL)
+    return NBTX_ERR;
+
+  struct nbtx_index_ index;
+  const bool indexed = nbtx_index_open_(memory, length, &index);
+
+  const char* p = memory;
+  size_t left = indexed ? index.tree_length : length;
+  struct raw_node root;
+  nbtx_status err;
+
+  *tree_length = left;
+
+  if ((err = read_tag(&p, &left, &root)) != NBTX_OK) return err;
+  if (root.type == 0) return NBTX_ERR;
+
+  const size_t n = strcspn(path, ".");
+
+  if (!has_path_name(&root, path, n)) return NBTX_ENOTFOUND;
+
+  if (path[n] == '\0') {
+    *found = root;
+    return NBTX_OK;
+  }
+
+  return find_below(indexed ? &index : NULL, &root, path + n + 1, found);
+}
+
+nbtx_status nbtx_peek_path(const void* memory, const size_t length, const char* path, nbtx_value* out) {
+  struct raw_node node;
+  size_t tree_length;
+  nbtx_status err;
+
+  if (out == NULL) return NBTX_ERR;
+  if ((err = find_path(memory, length, path, &node, &tree_length)) != NBTX_OK) return err;
+
+  return raw_value_of(&node, out);
+}
+
+/* How `value' is dumped: a length prefix for strings and byte arrays, then its data. */
+struct encoding {
+  unsigned char prefix[4];
+  size_t prefix_length;
+  const void* data;
+  size_t length;
+};
+
+static nbtx_status encode(const nbtx_value* value, struct encoding* e) {
+  e->prefix_length = 0;
+  e->data = value->data;
+  e->length = value->length;
+
+  if (value->data == NULL && value->length != 0)
+    return NBTX_ERR;
+
+  const size_t scalar_size = nbtx_scalar_size_(value->type);
+  if (scalar_size)
+    return value->length == scalar_size ? NBTX_OK : NBTX_ERR;
+
+  switch (value->type) {
+    case NBTX_TAG_STRING: {
+      if (value->length > UINT16_MAX) return NBTX_ERR;
+
+      const uint16_t n = (uint16_t)value->length;
+      memcpy(e->prefix, &n, sizeof n);
+      e->prefix_length = sizeof n;
+      return NBTX_OK;
+    }
+
+    case NBTX_TAG_BYTE_ARRAY: {
+      if (value->length > UINT32_MAX) return NBTX_ERR;
+
+      const uint32_t n = (uint32_t)value->length;
+      memcpy(e->prefix, &n, sizeof n);
+      e->prefix_length = sizeof n;
+      return NBTX_OK;
+    }
+
+    case NBTX_TAG_LIST:
+    case NBTX_TAG_COMPOUND: {
+      /* Make sure the payload is whole, and nothing more. */
+      const char* p = value->data;
+      size_t left = value->length;
+      nbtx_status err;
+
+      if ((err = nbtx_skip_payload_(value->type, &p, &left)) != NBTX_OK) return err;
+      return left == 0 ? NBTX_OK : NBTX_ERR;
+    }
+
+    default:
+      return NBTX_ERR;
+  }
+}
+
+/* Sets `size' to how many bytes the payload of `node' takes. */
+static nbtx_status payload_size(const struct raw_node* node, size_t* size) {
+  const char* p = node->payload;
+  size_t left = node->length;
+  nbtx_status err;
+
+  if ((err = nbtx_skip_payload_(node->type, &p, &left)) != NBTX_OK)
+    return err;
+
+  *size = node->length - left;
+  return NBTX_OK;
+}
+
+static void write_encoding(unsigned char* at, const struct encoding* e) {
+  memcpy(at, e->prefix, e->prefix_length);
+  if (e->length) memmove(at + e->prefix_length, e->data, e->length);
+}
+
+nbtx_status nbtx_poke_path(void* memory, const size_t length, const char* path, const nbtx_value* value) {
+  struct raw_node node;
+  struct encoding e;
+  nbtx_status err;
+
+  size_t tree_length;
+
+  if (value == NULL) return NBTX_ERR;
+  if ((err = find_path(memory, length, path, &node, &tree_length)) != NBTX_OK) return err;
+  if ((err = encode(value, &e)) != NBTX_OK) return err;
+
+  if (node.type != value->type) return NBTX_ERR;
+
+  size_t size;
+  if ((err = payload_size(&node, &size)) != NBTX_OK) return err;
+  if (size != e.prefix_length + e.length) return NBTX_ERR;
+
+  write_encoding((unsigned char*)memory + (node.payload - (const char*)memory), &e);
+  return NBTX_OK;
+}
+
+nbtx_status nbtx_splice_path(struct buffer* b, const char* path, const nbtx_value* value) {
+  struct raw_node node;
+  struct encoding e;
+  nbtx_status err;
+
+  size_t tree_length;
+
+  if (b == NULL || value == NULL) return NBTX_ERR;
+  if ((err = find_path(b->data, b->len, path, &node, &tree_length)) != NBTX_OK) return err;
+  if ((err = encode(value, &e)) != NBTX_OK) return err;
+
+  /* The type of list elements is the list's. */
+  if (node.name == NULL && node.type != value->type)
+    return NBTX_ERR;
+
+  size_t old_size;
+  if ((err = payload_size(&node, &old_size)) != NBTX_OK) return err;
+
+  /* Named tags start with their type, then the length of their name. */
+  const size_t type_at = node.name ? (size_t)(node.name - (const char*)b->data) - 3 : SIZE_MAX;
+
+  /* Offsets after the value move, so the index has to go. */
+  const size_t new_size = e.prefix_length + e.length;
+  const size_t at = (size_t)(node.payload - (const char*)b->data);
+  const size_t len = tree_length - old_size + new_size;
+
+  /* Grow by hand, since a failing buffer_reserve would free the tree. */
+  if (len > b->cap) {
+    size_t cap = b->cap ? b->cap : 1024;
+    while (cap < len) cap *= 2;
+
+    unsigned char* data = nbtx_realloc_(b->data, cap);
+    if (data == NULL) return NBTX_EMEM;
+
+    b->data = data;
+    b->cap = cap;
+  }
+
+  memmove(b->data + at + new_size, b->data + at + old_size, tree_length - at - old_size);
+  write_encoding(b->data + at, &e);
+  b->len = len;
+
+  if (type_at != SIZE_MAX)
+    b->data[type_at] = (unsigned char)value->type;
+
+  return NBTX_OK;
+}
@@ -0,0 +1,214 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbtx.h"
+#include "nbtx_internal.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Routines that walk trees in their binary form, without building nodes. They
+ * take the same (memory, length) pair as the parser, and move it past what
+ * they read.
+ */
+
+/*
+ * Moves past `n' bytes of the memory stream. If there aren't enough of them,
+ * the tree is corrupt.
+ */
+#define SKIP(n) do { \
+    if(*length < (n)) return NBTX_ERR; \
+    *memory += (n); \
+    *length -= (n); \
+} while(0)
+
+#define READ_GENERIC(dest, n) do { \
+    if(*length < (n)) return NBTX_ERR; \
+    memcpy((dest), *memory, (n)); \
+    *memory += (n); \
+    *length -= (n); \
+} while(0)
+
+size_t nbtx_scalar_size_(const nbtx_type type) {
+  switch (type) {
+    case NBTX_TAG_BYTE:
+    case NBTX_TAG_UNSIGNED_BYTE:
+      return 1;
+    case NBTX_TAG_SHORT:
+    case NBTX_TAG_UNSIGNED_SHORT:
+      return 2;
+    case NBTX_TAG_INT:
+    case NBTX_TAG_UNSIGNED_INT:
+    case NBTX_TAG_FLOAT:
+      return 4;
+    case NBTX_TAG_LONG:
+    case NBTX_TAG_UNSIGNED_LONG:
+    case NBTX_TAG_DOUBLE:
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+/* Skips a payload that holds no other tags. */
+static nbtx_status skip_leaf(const nbtx_type type, const char** memory, size_t* length) {
+  const size_t scalar_size = nbtx_scalar_size_(type);
+
+  if (scalar_size) {
+    SKIP(scalar_size);
+    return NBTX_OK;
+  }
+
+  switch (type) {
+    case NBTX_TAG_BYTE_ARRAY: {
+      uint32_t array_length;
+      READ_GENERIC(&array_length, sizeof array_length);
+      SKIP(array_length);
+      return NBTX_OK;
+    }
+
+    case NBTX_TAG_STRING: {
+      uint16_t string_length;
+      READ_GENERIC(&string_length, sizeof string_length);
+      SKIP(string_length);
+      return NBTX_OK;
+    }
+
+    case NBTX_TAG_INVALID:
+    default:
+      return NBTX_ERR;
+  }
+}
+
+/*
+ * A list or compound being skipped. Compounds have `elem_type' set to
+ * TAG_INVALID, since their members say their own types.
+ */
+struct skip_frame {
+  nbtx_type elem_type;
+  uint32_t left;
+};
+
+#define SKIP_LOCAL_FRAMES 32
+
+/*
+ * Opens the list or compound whose header `memory' is at, or skips all of it if
+ * it's a list of numbers. Sets `*open' if a frame has to be pushed.
+ */
+static nbtx_status open_container(const nbtx_type type, const char** memory, size_t* length,
+                                  struct skip_frame* frame, bool* open) {
+  *open = true;
+
+  if (type == NBTX_TAG_COMPOUND) {
+    *frame = (struct skip_frame) { NBTX_TAG_INVALID, 0 };
+    return NBTX_OK;
+  }
+
+  uint8_t elem_type;
+  uint32_t elems;
+  READ_GENERIC(&elem_type, sizeof elem_type);
+  READ_GENERIC(&elems, sizeof elems);
+
+  /* Lists of numbers are skipped in one go. */
+  const size_t elem_size = nbtx_scalar_size_((nbtx_type)elem_type);
+  if (elem_size) {
+    if (elems > *length / elem_size) return NBTX_ERR;
+    SKIP(elems * elem_size);
+    *open = false;
+    return NBTX_OK;
+  }
+
+  if (elems == 0) {
+    *open = false;
+    return NBTX_OK;
+  }
+
+  /* Every other element takes at least a byte, and TAG_End none at all. */
+  if (elems > *length || elem_type == NBTX_TAG_INVALID) return NBTX_ERR;
+
+  *frame = (struct skip_frame) { (nbtx_type)elem_type, elems };
+  return NBTX_OK;
+}
+
+nbtx_status nbtx_skip_payload_(nbtx_type type, const char** memory, size_t* length) {
+  /* Untrusted input nests as deep as it likes, so walk it with a stack. */
+  struct skip_frame local[SKIP_LOCAL_FRAMES];
+  struct skip_frame* frames = local;
+  size_t capacity = SKIP_LOCAL_FRAMES;
+  size_t depth = 0;
+
+  const size_t max = nbtx_get_max_depth();
+  nbtx_status err = NBTX_OK;
+
+  for (;;) {
+    if (type == NBTX_TAG_LIST || type == NBTX_TAG_COMPOUND) {
+      if (max != 0 && depth >= max) {
+        err = NBTX_EDEPTH;
+        break;
+      }
+
+      if (depth == capacity) {
+        struct skip_frame* grown = nbtx_grow_stack_(frames, &capacity, sizeof(*frames), frames != local);
+        if (grown == NULL) {
+          err = NBTX_EMEM;
+          break;
+        }
+
+        frames = grown;
+      }
+
+      bool open;
+      if ((err = open_container(type, memory, length, &frames[depth], &open)) != NBTX_OK)
+        break;
+      if (open) ++depth;
+    } else if ((err = skip_leaf(type, memory, length)) != NBTX_OK) {
+      break;
+    }
+
+    /* Find the next tag to skip, closing whatever ran out on the way. */
+    for (type = NBTX_TAG_INVALID; depth > 0 && type == NBTX_TAG_INVALID;) {
+      struct skip_frame* top = &frames[depth - 1];
+
+      if (top->elem_type != NBTX_TAG_INVALID) {
+        if (top->left == 0) {
+          --depth;
+        } else {
+          --top->left;
+          type = top->elem_type;
+        }
+
+        continue;
+      }
+
+      if (*length < 1) {
+        err = NBTX_ERR;
+        break;
+      }
+
+      const uint8_t member_type = (uint8_t)**memory;
+      ++*memory;
+      --*length;
+
+      if (member_type == 0) { /* TAG_End */
+        --depth;
+      } else if ((err = skip_leaf(NBTX_TAG_STRING, memory, length)) != NBTX_OK) {
+        break;
+      } else {
+        type = (nbtx_type)member_type;
+      }
+    }
+
+    if (err != NBTX_OK || type == NBTX_TAG_INVALID) break;
+  }
+
+  if (frames != local) nbtx_free_(frames);
+  return err;
+}
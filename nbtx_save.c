@@ -0,0 +1,193 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#define _DEFAULT_SOURCE /* For O_CLOEXEC and O_DIRECTORY with -std=c11. */
+
+#include "nbtx.h"
+#include "nbtx_internal.h"
+
+#include "buffer.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Temporary names tried before giving up, in case some are left over. */
+#define TEMP_ATTEMPTS 16
+
+struct nbtx_save {
+  pthread_t thread;
+  nbtx_node* snapshot; /* Freed by the thread once it's serialized. */
+  char* path;
+  nbtx_compression_strategy strategy;
+
+  nbtx_status status;
+  atomic_bool done; /* Then `status' is set and `snapshot' is gone. */
+};
+
+static nbtx_status write_all(const int fd, const unsigned char* data, size_t len) {
+  while (len > 0) {
+    const ssize_t n = write(fd, data, len);
+
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return NBTX_EIO;
+
+    data += n;
+    len -= (size_t)n;
+  }
+
+  return NBTX_OK;
+}
+
+/* Syncs the directory of `path', so the rename is on disk too. */
+static void sync_directory(char* path) {
+  char* slash = strrchr(path, '/');
+  int fd;
+
+  if (slash == NULL) {
+    fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  } else if (slash == path) {
+    fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  } else {
+    *slash = '\0';
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    *slash = '/';
+  }
+
+  /* Some file systems can't sync directories. The file is still in place. */
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+/* Writes `data' to a temporary file, syncs it and renames it over `path'. */
+static nbtx_status replace_file(char* path, const struct buffer data) {
+  static atomic_uint saves;
+
+  const size_t temp_size = strlen(path) + 64;
+  char* temp = nbtx_malloc_(temp_size);
+  if (temp == NULL) return NBTX_EMEM;
+
+  /* O_EXCL, unlike mkstemp, leaves the permissions to the umask as fopen does. */
+  int fd = -1;
+
+  for (int i = 0; fd < 0 && i < TEMP_ATTEMPTS; ++i) {
+    snprintf(temp, temp_size, "%s.%ld.%u.tmp", path, (long)getpid(), atomic_fetch_add(&saves, 1));
+    fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+
+    if (fd < 0 && errno != EEXIST) break;
+  }
+
+  if (fd < 0) {
+    nbtx_free_(temp);
+    return NBTX_EIO;
+  }
+
+  nbtx_status ret = write_all(fd, data.data, data.len);
+
+  if (ret == NBTX_OK && fsync(fd) != 0) ret = NBTX_EIO;
+  if (close(fd) != 0 && ret == NBTX_OK) ret = NBTX_EIO;
+  if (ret == NBTX_OK && rename(temp, path) != 0) ret = NBTX_EIO;
+
+  if (ret == NBTX_OK) sync_directory(path);
+  else                unlink(temp);
+
+  nbtx_free_(temp);
+  return ret;
+}
+
+static void* run_save(void* arg) {
+  nbtx_save* s = arg;
+
+  struct buffer data = nbtx_dump_compressed(s->snapshot, s->strategy);
+  const nbtx_status err = errno;
+
+  /*
+   * Frees whatever the tree stopped sharing with the snapshot in the meantime,
+   * so the rest of it can be put into again while the file is written.
+   */
+  nbtx_free(s->snapshot);
+  s->snapshot = NULL;
+
+  if (data.data == NULL) {
+    s->status = err != NBTX_OK ? err : NBTX_ERR;
+  } else {
+    s->status = replace_file(s->path, data);
+    buffer_free(&data);
+  }
+
+  atomic_store_explicit(&s->done, true, memory_order_release);
+  return NULL;
+}
+
+nbtx_save* nbtx_dump_file_async(nbtx_node* tree, const char* path,
+                                const nbtx_compression_strategy strategy) {
+  assert(tree);
+  assert(path);
+
+  nbtx_save* s = nbtx_malloc_(sizeof(*s));
+  if (s == NULL) return (errno = NBTX_EMEM), NULL;
+
+  const size_t path_size = strlen(path) + 1;
+
+  *s = (nbtx_save) { .snapshot = NULL, .path = nbtx_malloc_(path_size), .strategy = strategy,
+                     .status = NBTX_OK };
+  atomic_init(&s->done, false);
+
+  if (s->path == NULL) {
+    errno = NBTX_EMEM;
+    goto save_error;
+  }
+
+  memcpy(s->path, path, path_size);
+
+  /* Shares everything under the root, which later changes unshare. */
+  if ((s->snapshot = nbtx_clone_shared(tree)) == NULL) {
+    errno = NBTX_EMEM;
+    goto save_error;
+  }
+
+  if (pthread_create(&s->thread, NULL, run_save, s) != 0) {
+    errno = NBTX_EMEM;
+    goto save_error;
+  }
+
+  return s;
+
+save_error:
+  nbtx_free(s->snapshot);
+  nbtx_free_(s->path);
+  nbtx_free_(s);
+  return NULL;
+}
+
+bool nbtx_save_done(const nbtx_save* s) {
+  assert(s);
+  return atomic_load_explicit(&s->done, memory_order_acquire);
+}
+
+nbtx_status nbtx_save_wait(nbtx_save* s) {
+  assert(s);
+
+  pthread_join(s->thread, NULL);
+
+  const nbtx_status ret = s->status;
+
+  nbtx_free_(s->path);
+  nbtx_free_(s);
+  return ret;
+}
@@ -0,0 +1,438 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbtx.h"
+#include "nbtx_internal.h"
+
+#include "buffer.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Member names are looked up in a perfect hash table, built when the schema is
+ * registered ("hash and displace"): every name first hashes into a bucket, and
+ * every bucket gets a displacement which sends all of its names to distinct
+ * free slots of the table. A lookup is then two hashes of the name, one slot
+ * and one memcmp, whatever the size of the schema.
+ */
+
+/* Gives up on a table size after trying this many displacements for a bucket. */
+#define MAX_DISPLACEMENT 4096
+
+/* Gives up on the schema after this many table sizes. */
+#define MAX_ATTEMPTS 8
+
+#define CHECKED_MALLOC(var, n, on_error) do { \
+    if(((var) = nbtx_malloc_(n)) == NULL) \
+    { \
+        errno = NBTX_EMEM; \
+        on_error; \
+    } \
+} while(0)
+
+#define CHECKED_APPEND(b, ptr, len) do { \
+    if(buffer_append((b), (ptr), (len))) \
+        return NBTX_EMEM;                 \
+} while(0)
+
+struct field {
+  nbtx_field desc;
+  uint16_t name_length;
+  uint64_t hash; /* Of the name, with the schema's seed. */
+};
+
+struct nbtx_schema {
+  struct field* fields;
+  size_t count;
+
+  uint64_t seed;
+  size_t bucket_mask;
+  uint32_t* displacements; /* One per bucket. */
+  size_t slot_mask;
+  uint32_t* slots; /* Index of the field in each slot, plus one. 0 means empty. */
+};
+
+static uint64_t hash_name(const uint64_t seed, const char* name, const size_t length) {
+  uint64_t h = 0xcbf29ce484222325u ^ seed; /* FNV-1a */
+
+  for (size_t i = 0; i < length; ++i) {
+    h ^= (unsigned char)name[i];
+    h *= 0x100000001b3u;
+  }
+
+  return h;
+}
+
+/* Mixes the displacement into the name's hash and scatters the bits. */
+static uint64_t displace(uint64_t h, const uint32_t displacement) {
+  h += displacement * 0x9e3779b97f4a7c15u;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdu;
+  h ^= h >> 33;
+  return h;
+}
+
+static size_t round_up_pow2(const size_t n) {
+  size_t ret = 1;
+  while (ret < n) ret <<= 1;
+  return ret;
+}
+
+struct bucket {
+  uint32_t index;
+  uint32_t size;
+};
+
+static int compare_buckets(const void* a, const void* b) {
+  const struct bucket* x = a;
+  const struct bucket* y = b;
+
+  if (x->size != y->size)
+    return x->size < y->size ? 1 : -1; /* Biggest first, they're the hardest to place. */
+
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/*
+ * Tries to build the table with the schema's current seed and sizes. Returns
+ * NBTX_ERR if some bucket couldn't be placed.
+ */
+static nbtx_status build_table(nbtx_schema* s) {
+  const size_t buckets = s->bucket_mask + 1;
+  const size_t slots = s->slot_mask + 1;
+
+  nbtx_status ret = NBTX_EMEM;
+  struct bucket* order = NULL;
+  uint32_t* candidates = NULL;
+
+  CHECKED_MALLOC(order, buckets * sizeof(*order), goto cleanup);
+  CHECKED_MALLOC(candidates, (s->count ? s->count : 1) * sizeof(*candidates), goto cleanup);
+
+  for (size_t i = 0; i < buckets; ++i) {
+    order[i].index = (uint32_t)i;
+    order[i].size = 0;
+    s->displacements[i] = 0;
+  }
+
+  for (size_t i = 0; i < slots; ++i)
+    s->slots[i] = 0;
+
+  for (size_t i = 0; i < s->count; ++i) {
+    s->fields[i].hash = hash_name(s->seed, s->fields[i].desc.name, s->fields[i].name_length);
+    order[s->fields[i].hash & s->bucket_mask].size++;
+  }
+
+  qsort(order, buckets, sizeof(*order), compare_buckets);
+
+  ret = NBTX_ERR;
+
+  for (size_t b = 0; b < buckets && order[b].size > 0; ++b) {
+    uint32_t displacement;
+
+    for (displacement = 0; displacement < MAX_DISPLACEMENT; ++displacement) {
+      size_t placed = 0;
+
+      for (size_t i = 0; i < s->count; ++i) {
+        if ((s->fields[i].hash & s->bucket_mask) != order[b].index)
+          continue;
+
+        const size_t slot = displace(s->fields[i].hash, displacement) & s->slot_mask;
+
+        bool taken = s->slots[slot] != 0;
+        for (size_t j = 0; j < placed && !taken; ++j)
+          taken = candidates[j] == slot;
+
+        if (taken) break;
+
+        candidates[placed++] = (uint32_t)slot;
+      }
+
+      if (placed == order[b].size) break;
+    }
+
+    if (displacement == MAX_DISPLACEMENT)
+      goto cleanup;
+
+    s->displacements[order[b].index] = displacement;
+
+    for (size_t i = 0; i < s->count; ++i)
+      if ((s->fields[i].hash & s->bucket_mask) == order[b].index)
+        s->slots[displace(s->fields[i].hash, displacement) & s->slot_mask] = (uint32_t)i + 1;
+  }
+
+  ret = NBTX_OK;
+
+cleanup:
+  nbtx_free_(order);
+  nbtx_free_(candidates);
+  return ret;
+}
+
+static bool field_is_valid(const nbtx_field* f) {
+  if (f->name == NULL || strlen(f->name) > UINT16_MAX)
+    return false;
+
+  if (nbtx_scalar_size_(f->type))
+    return true;
+
+  switch (f->type) {
+    case NBTX_TAG_BYTE_ARRAY:
+    case NBTX_TAG_STRING:
+      return true;
+    case NBTX_TAG_COMPOUND:
+      return f->schema != NULL;
+    default:
+      return false;
+  }
+}
+
+nbtx_schema* nbtx_schema_new(const nbtx_field* fields, const size_t count) {
+  errno = NBTX_OK;
+
+  if (count >= UINT32_MAX) {
+    errno = NBTX_ERR;
+    return NULL;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    if (!field_is_valid(&fields[i]))
+      goto invalid;
+
+    for (size_t j = 0; j < i; ++j)
+      if (strcmp(fields[i].name, fields[j].name) == 0)
+        goto invalid;
+  }
+
+  nbtx_schema* ret;
+  CHECKED_MALLOC(ret, sizeof(*ret), return NULL);
+
+  ret->count = count;
+  ret->seed = 0;
+  ret->bucket_mask = round_up_pow2(count / 2 + 1) - 1;
+  ret->slot_mask = round_up_pow2(count + count / 4 + 1) - 1;
+  ret->displacements = NULL;
+  ret->slots = NULL;
+
+  CHECKED_MALLOC(ret->fields, (count ? count : 1) * sizeof(*ret->fields), goto oom);
+
+  for (size_t i = 0; i < count; ++i) {
+    ret->fields[i].desc = fields[i];
+    ret->fields[i].name_length = (uint16_t)strlen(fields[i].name);
+  }
+
+  for (int attempt = 0; attempt < MAX_ATTEMPTS; ++attempt) {
+    nbtx_free_(ret->displacements);
+    nbtx_free_(ret->slots);
+    ret->displacements = NULL;
+    ret->slots = NULL;
+
+    CHECKED_MALLOC(ret->displacements, (ret->bucket_mask + 1) * sizeof(*ret->displacements), goto oom);
+    CHECKED_MALLOC(ret->slots, (ret->slot_mask + 1) * sizeof(*ret->slots), goto oom);
+
+    const nbtx_status err = build_table(ret);
+
+    if (err == NBTX_OK) return ret;
+    if (err == NBTX_EMEM) goto oom;
+
+    /* Unlucky. Try again with another seed and more room. */
+    ret->seed = displace(ret->seed, (uint32_t)attempt + 1);
+    ret->slot_mask = ret->slot_mask * 2 + 1;
+  }
+
+  nbtx_schema_free(ret);
+  goto invalid;
+
+oom:
+  nbtx_schema_free(ret);
+  errno = NBTX_EMEM;
+  return NULL;
+
+invalid:
+  errno = NBTX_ERR;
+  return NULL;
+}
+
+void nbtx_schema_free(nbtx_schema* schema) {
+  if (schema == NULL) return;
+
+  nbtx_free_(schema->fields);
+  nbtx_free_(schema->displacements);
+  nbtx_free_(schema->slots);
+  nbtx_free_(schema);
+}
+
+/* Returns the field called `name', or NULL if the schema has none. */
+static const struct field* lookup(const nbtx_schema* s, const char* name, const uint16_t name_length) {
+  const uint64_t h = hash_name(s->seed, name, name_length);
+  const uint32_t slot = s->slots[displace(h, s->displacements[h & s->bucket_mask]) & s->slot_mask];
+
+  if (slot == 0) return NULL;
+
+  const struct field* f = &s->fields[slot - 1];
+
+  if (f->name_length != name_length || memcmp(f->desc.name, name, name_length) != 0)
+    return NULL;
+
+  return f;
+}
+
+#define READ_GENERIC(dest, n) do { \
+    if(*length < (n)) return NBTX_ERR; \
+    memcpy((dest), *memory, (n)); \
+    *memory += (n); \
+    *length -= (n); \
+} while(0)
+
+/* Points `span' at the next `n' bytes of the memory stream. */
+#define READ_SPAN(span, n) do { \
+    if(*length < (n)) return NBTX_ERR; \
+    (span)->data = *memory; \
+    (span)->length = (n); \
+    *memory += (n); \
+    *length -= (n); \
+} while(0)
+
+static nbtx_status decode_compound(const nbtx_schema* s, char* out, const char** memory, size_t* length) {
+  for (;;) {
+    uint8_t type;
+    READ_GENERIC(&type, sizeof type);
+
+    if (type == 0) return NBTX_OK; /* TAG_End */
+
+    uint16_t name_length;
+    READ_GENERIC(&name_length, sizeof name_length);
+    if (*length < name_length) return NBTX_ERR;
+
+    const struct field* f = lookup(s, *memory, name_length);
+    *memory += name_length;
+    *length -= name_length;
+
+    nbtx_status err;
+
+    if (f == NULL) {
+      if ((err = nbtx_skip_payload_((nbtx_type)type, memory, length)) != NBTX_OK)
+        return err;
+      continue;
+    }
+
+    if (f->desc.type != (nbtx_type)type)
+      return NBTX_ERR;
+
+    char* member = out + f->desc.offset;
+    const size_t scalar_size = nbtx_scalar_size_(f->desc.type);
+
+    if (scalar_size) {
+      READ_GENERIC(member, scalar_size);
+    } else if (f->desc.type == NBTX_TAG_STRING) {
+      uint16_t string_length;
+      READ_GENERIC(&string_length, sizeof string_length);
+      READ_SPAN((nbtx_span*)member, string_length);
+    } else if (f->desc.type == NBTX_TAG_BYTE_ARRAY) {
+      uint32_t array_length;
+      READ_GENERIC(&array_length, sizeof array_length);
+      READ_SPAN((nbtx_span*)member, array_length);
+    } else if ((err = decode_compound(f->desc.schema, member, memory, length)) != NBTX_OK) {
+      return err;
+    }
+  }
+}
+
+nbtx_status nbtx_decode_struct(const void* memory, size_t length, const nbtx_schema* schema, void* out) {
+  const char** m = (const char**)&memory;
+
+  uint8_t type;
+  if (length < sizeof type) return NBTX_ERR;
+  memcpy(&type, memory, sizeof type);
+  *m += sizeof type;
+  length -= sizeof type;
+
+  if (type != NBTX_TAG_COMPOUND) return NBTX_ERR;
+
+  nbtx_status err;
+
+  if ((err = nbtx_skip_payload_(NBTX_TAG_STRING, m, &length)) != NBTX_OK) /* the root's name */
+    return err;
+
+  return decode_compound(schema, out, m, &length);
+}
+
+static nbtx_status encode_name(const char* name, const size_t name_length, struct buffer* b) {
+  const uint16_t dumped_length = (uint16_t)name_length;
+
+  CHECKED_APPEND(b, &dumped_length, sizeof dumped_length);
+  if (name_length) CHECKED_APPEND(b, name, name_length);
+
+  return NBTX_OK;
+}
+
+static nbtx_status encode_compound(const nbtx_schema* s, const char* in, struct buffer* b) {
+  for (size_t i = 0; i < s->count; ++i) {
+    const struct field* f = &s->fields[i];
+    const char* member = in + f->desc.offset;
+    nbtx_status err;
+
+    const uint8_t type = (uint8_t)f->desc.type;
+    CHECKED_APPEND(b, &type, sizeof type);
+
+    if ((err = encode_name(f->desc.name, f->name_length, b)) != NBTX_OK)
+      return err;
+
+    const size_t scalar_size = nbtx_scalar_size_(f->desc.type);
+
+    if (scalar_size) {
+      CHECKED_APPEND(b, member, scalar_size);
+    } else if (f->desc.type == NBTX_TAG_STRING) {
+      const nbtx_span* span = (const nbtx_span*)member;
+      if (span->length > UINT16_MAX) return NBTX_ERR;
+
+      if ((err = encode_name(span->data, span->length, b)) != NBTX_OK)
+        return err;
+    } else if (f->desc.type == NBTX_TAG_BYTE_ARRAY) {
+      const nbtx_span* span = (const nbtx_span*)member;
+
+      CHECKED_APPEND(b, &span->length, sizeof span->length);
+      if (span->length) CHECKED_APPEND(b, span->data, span->length);
+    } else if ((err = encode_compound(f->desc.schema, member, b)) != NBTX_OK) {
+      return err;
+    }
+  }
+
+  /* write out TAG_End */
+  const uint8_t zero = 0;
+  CHECKED_APPEND(b, &zero, sizeof zero);
+
+  return NBTX_OK;
+}
+
+struct buffer nbtx_encode_struct(const void* in, const nbtx_schema* schema, const char* name) {
+  errno = NBTX_OK;
+
+  struct buffer ret = NBTX_BUFFER_INIT;
+
+  if (name == NULL) name = "";
+
+  const size_t name_length = strlen(name);
+  const uint8_t type = NBTX_TAG_COMPOUND;
+
+  if (name_length > UINT16_MAX)
+    errno = NBTX_ERR;
+  else if (buffer_append(&ret, &type, sizeof type))
+    errno = NBTX_EMEM;
+  else if ((errno = encode_name(name, name_length, &ret)) == NBTX_OK)
+    errno = encode_compound(schema, in, &ret);
+
+  if (errno != NBTX_OK)
+    buffer_free(&ret);
+
+  return ret;
+}
@@ -0,0 +1,141 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbtx.h"
+#include "nbtx_internal.h"
+
+#include <string.h>
+
+#ifdef NBTX_STATS
+
+#include <pthread.h>
+#include <stdbool.h>
+
+_Thread_local struct nbtx_thread_stats_* nbtx_thread_stats_ = NULL;
+_Thread_local nbtx_subsystem nbtx_subsystem_ = NBTX_SUBSYSTEM_OTHER;
+
+/*
+ * The blocks of the threads alive, newest first. A thread's block is folded
+ * into `retired' and freed when it exits, so threads that come and go don't
+ * pile up.
+ */
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct nbtx_thread_stats_* all_threads = NULL;
+static nbtx_stats retired;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static bool have_key;
+
+/* Adds what `stats' counted since its last reset to `out'. */
+static void sum(const struct nbtx_thread_stats_* stats, nbtx_stats* out) {
+  uint64_t* counters = (uint64_t*)out;
+
+  for (size_t i = 0; i < NBTX_STATS_COUNTERS; ++i)
+    counters[i] += atomic_load_explicit(&stats->counters[i], memory_order_relaxed)
+                 - atomic_load_explicit(&stats->baseline[i], memory_order_relaxed);
+}
+
+static void reset(struct nbtx_thread_stats_* stats) {
+  for (size_t i = 0; i < NBTX_STATS_COUNTERS; ++i)
+    atomic_store_explicit(&stats->baseline[i],
+                          atomic_load_explicit(&stats->counters[i], memory_order_relaxed),
+                          memory_order_relaxed);
+}
+
+/* Runs as a thread exits, keeping what it counted but not its block. */
+static void retire(void* arg) {
+  struct nbtx_thread_stats_* stats = arg;
+
+  pthread_mutex_lock(&threads_lock);
+
+  sum(stats, &retired);
+
+  struct nbtx_thread_stats_** link = &all_threads;
+  while (*link != stats) link = &(*link)->next;
+  *link = stats->next;
+
+  pthread_mutex_unlock(&threads_lock);
+
+  if (nbtx_thread_stats_ == stats) nbtx_thread_stats_ = NULL;
+  free(stats);
+}
+
+static void make_key(void) {
+  have_key = pthread_key_create(&key, retire) == 0;
+}
+
+struct nbtx_thread_stats_* nbtx_stats_register_(void) {
+  pthread_once(&key_once, make_key);
+
+  /* Not counted: it would recurse. */
+  struct nbtx_thread_stats_* stats = calloc(1, sizeof(*stats));
+  if (stats == NULL) return NULL;
+
+  /* Without a destructor the block just stays around, as it's still counted. */
+  if (have_key) pthread_setspecific(key, stats);
+
+  pthread_mutex_lock(&threads_lock);
+  stats->next = all_threads;
+  all_threads = stats;
+  pthread_mutex_unlock(&threads_lock);
+
+  return nbtx_thread_stats_ = stats;
+}
+
+nbtx_stats nbtx_stats_get(const nbtx_stats_scope scope) {
+  nbtx_stats ret;
+  memset(&ret, 0, sizeof ret);
+
+  if (scope == NBTX_STATS_THREAD) {
+    if (nbtx_thread_stats_) sum(nbtx_thread_stats_, &ret);
+    return ret;
+  }
+
+  pthread_mutex_lock(&threads_lock);
+
+  ret = retired;
+  for (const struct nbtx_thread_stats_* stats = all_threads; stats != NULL; stats = stats->next)
+    sum(stats, &ret);
+
+  pthread_mutex_unlock(&threads_lock);
+  return ret;
+}
+
+void nbtx_stats_reset(const nbtx_stats_scope scope) {
+  if (scope == NBTX_STATS_THREAD) {
+    if (nbtx_thread_stats_) reset(nbtx_thread_stats_);
+    return;
+  }
+
+  pthread_mutex_lock(&threads_lock);
+
+  memset(&retired, 0, sizeof retired);
+  for (struct nbtx_thread_stats_* stats = all_threads; stats != NULL; stats = stats->next)
+    reset(stats);
+
+  pthread_mutex_unlock(&threads_lock);
+}
+
+#else
+
+nbtx_stats nbtx_stats_get(const nbtx_stats_scope scope) {
+  (void)scope;
+
+  nbtx_stats ret;
+  memset(&ret, 0, sizeof ret);
+  return ret;
+}
+
+void nbtx_stats_reset(const nbtx_stats_scope scope) {
+  (void)scope;
+}
+
+#endif
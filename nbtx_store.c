@@ -0,0 +1,186 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbtx.h"
+#include "nbtx_internal.h"
+
+#include "buffer.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* A stored canonical form. Slots with a NULL `data' are free. */
+struct slot {
+  nbtx_digest key;
+  unsigned char* data;
+  size_t length;
+  size_t refs;
+};
+
+struct nbtx_store {
+  struct slot* slots; /* Open addressing, keyed by digest. */
+  size_t capacity;    /* A power of two, or 0. */
+  size_t count;
+  size_t bytes;
+
+  struct buffer scratch; /* Canonical forms are dumped here before looking them up. */
+};
+
+nbtx_store* nbtx_store_new(void) {
+  nbtx_store* store = nbtx_calloc_(1, sizeof(*store));
+  if (store == NULL) errno = NBTX_EMEM;
+
+  return store;
+}
+
+void nbtx_store_free(nbtx_store* store) {
+  if (store == NULL) return;
+
+  for (size_t i = 0; i < store->capacity; ++i)
+    nbtx_free_(store->slots[i].data);
+
+  nbtx_free_(store->slots);
+  buffer_free(&store->scratch);
+  nbtx_free_(store);
+}
+
+static bool same_key(const nbtx_digest a, const nbtx_digest b) {
+  return a.hi == b.hi && a.lo == b.lo;
+}
+
+/* Digests are hashes already, so their bits are good enough to pick slots. */
+static size_t home_of(const nbtx_digest key, const size_t capacity) {
+  return (size_t)key.lo & (capacity - 1);
+}
+
+/* Returns the slot holding `key', or the free slot where it would go. */
+static struct slot* find_slot(const struct slot* slots, const size_t capacity, const nbtx_digest key) {
+  for (size_t i = home_of(key, capacity);; i = (i + 1) & (capacity - 1)) {
+    const struct slot* s = &slots[i];
+
+    if (s->data == NULL || same_key(s->key, key))
+      return (struct slot*)s;
+  }
+}
+
+/* Doubles the table. Returns false on memory errors. */
+static bool grow(nbtx_store* store) {
+  const size_t capacity = store->capacity ? 2 * store->capacity : 64;
+
+  struct slot* slots = nbtx_calloc_(capacity, sizeof(*slots));
+  if (slots == NULL) return false;
+
+  for (size_t i = 0; i < store->capacity; ++i)
+    if (store->slots[i].data)
+      *find_slot(slots, capacity, store->slots[i].key) = store->slots[i];
+
+  nbtx_free_(store->slots);
+  store->slots = slots;
+  store->capacity = capacity;
+  return true;
+}
+
+nbtx_status nbtx_store_put(nbtx_store* store, const nbtx_node* tree, nbtx_digest* key) {
+  if (store == NULL || tree == NULL || key == NULL)
+    return NBTX_ERR;
+
+  store->scratch.len = 0;
+
+  nbtx_status err;
+  if ((err = nbtx_dump_canonical_(tree, &store->scratch)) != NBTX_OK)
+    return err;
+
+  const unsigned char* bytes = store->scratch.data;
+  const size_t length = store->scratch.len;
+  const nbtx_digest digest = nbtx_digest_bytes_(bytes, length);
+
+  /* Keep the table at most half full. */
+  if (2 * (store->count + 1) > store->capacity && !grow(store))
+    return NBTX_EMEM;
+
+  struct slot* s = find_slot(store->slots, store->capacity, digest);
+
+  if (s->data) {
+    if (s->length != length || memcmp(s->data, bytes, length) != 0)
+      return NBTX_ERR;
+
+    s->refs++;
+    *key = digest;
+    return NBTX_OK;
+  }
+
+  unsigned char* copy = nbtx_malloc_(length);
+  if (copy == NULL) return NBTX_EMEM;
+
+  memcpy(copy, bytes, length);
+  *s = (struct slot) { digest, copy, length, 1 };
+
+  store->count++;
+  store->bytes += length;
+
+  *key = digest;
+  return NBTX_OK;
+}
+
+const void* nbtx_store_get(const nbtx_store* store, const nbtx_digest key, size_t* length) {
+  if (store == NULL || store->capacity == 0)
+    return NULL;
+
+  const struct slot* s = find_slot(store->slots, store->capacity, key);
+  if (s->data == NULL)
+    return NULL;
+
+  if (length) *length = s->length;
+  return s->data;
+}
+
+nbtx_status nbtx_store_release(nbtx_store* store, const nbtx_digest key) {
+  if (store == NULL || store->capacity == 0)
+    return NBTX_ERR;
+
+  struct slot* s = find_slot(store->slots, store->capacity, key);
+  if (s->data == NULL)
+    return NBTX_ERR;
+
+  if (--s->refs > 0)
+    return NBTX_OK;
+
+  store->count--;
+  store->bytes -= s->length;
+  nbtx_free_(s->data);
+
+  /*
+   * Move back the slots after this one that would have to probe past the
+   * hole, so that lookups never stop there too early. No tombstones needed.
+   */
+  const size_t mask = store->capacity - 1;
+  size_t hole = (size_t)(s - store->slots);
+
+  for (size_t i = (hole + 1) & mask; store->slots[i].data; i = (i + 1) & mask) {
+    const size_t home = home_of(store->slots[i].key, store->capacity);
+
+    /* Whether `home' lies cyclically in (hole, i], in which case it stays. */
+    if (((i - home) & mask) < ((i - hole) & mask))
+      continue;
+
+    store->slots[hole] = store->slots[i];
+    hole = i;
+  }
+
+  store->slots[hole] = (struct slot) { { 0, 0 }, NULL, 0, 0 };
+  return NBTX_OK;
+}
+
+void nbtx_store_usage(const nbtx_store* store, size_t* entries, size_t* bytes) {
+  if (entries) *entries = store ? store->count : 0;
+  if (bytes)   *bytes   = store ? store->bytes : 0;
+}
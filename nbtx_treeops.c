@@ -9,6 +9,7 @@
  * -----------------------------------------------------------------------------
  */
 #include "nbtx.h"
+#include "nbtx_internal.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -17,7 +18,7 @@
 
  /* strdup isn't standard. GNU extension. */
 static char* nbtx_strdup(const char* s) {
-  char* r = malloc(strlen(s) + 1);
+  char* r = nbtx_malloc_(strlen(s) + 1);
   if (r == NULL) return NULL;
 
   strcpy(r, s);
@@ -25,50 +26,91 @@ static char* nbtx_strdup(const char* s) {
 }
 
 #define CHECKED_MALLOC(var, n, on_error) do { \
-    if(((var) = malloc(n)) == NULL) \
+    if(((var) = nbtx_malloc_(n)) == NULL) \
     { \
         errno = NBTX_EMEM; \
         on_error; \
     } \
 } while(0)
 
-void nbtx_free_list(struct nbtx_list* list) {
+/*
+ * Frees a list or compound payload, moving its members to `pending' instead of
+ * freeing them right away.
+ */
+static void release_list(struct nbtx_list* list, struct list_head* pending) {
   if (!list)
     return;
 
-  struct list_head* current;
-  struct list_head* temp;
-  list_for_each_safe(current, temp, &list->entry) {
-    struct nbtx_list* entry = list_entry(current, struct nbtx_list, entry);
-
-    nbtx_free(entry->data);
-    free(entry);
-  }
+  list_splice_head(&list->entry, pending);
 
-  free(list->data);
-  free(list);
+  nbtx_free_(list->data);
+  nbtx_free_(list);
 }
 
-void nbtx_free(nbtx_node* tree) {
+/* Drops a reference to `tree', freeing it if it was the last one. */
+static void release(nbtx_node* tree, struct list_head* pending) {
   if (tree == NULL) return;
 
+  /* Somebody else is still using this node. */
+  if (nbtx_unref_(tree) > 0) return;
+
   if (tree->type == NBTX_TAG_LIST)
-    nbtx_free_list(tree->payload.tag_list);
+    release_list(tree->payload.tag_list, pending);
 
   else if (tree->type == NBTX_TAG_COMPOUND)
-    nbtx_free_list(tree->payload.tag_compound);
+    release_list(tree->payload.tag_compound, pending);
 
   else if (tree->type == NBTX_TAG_BYTE_ARRAY)
-    free(tree->payload.tag_byte_array.data);
+    nbtx_free_(tree->payload.tag_byte_array.data);
 
   else if (tree->type == NBTX_TAG_STRING)
-    free(tree->payload.tag_string);
+    nbtx_free_(tree->payload.tag_string);
+
+  nbtx_cache_free_(tree->cache);
+  nbtx_free_(tree->name);
+  nbtx_free_(tree);
+
+  NBTX_STATS_ADD(nodes_freed, 1);
+}
+
+/*
+ * Releases the members waiting in `pending'. The members of the lists and
+ * compounds among them go to the front, so the tree is freed depth-first, in
+ * the order the recursive version used, without recursing or needing memory.
+ */
+static void release_pending(struct list_head* pending) {
+  while (!list_empty(pending)) {
+    struct nbtx_list* entry = list_entry(pending->flink, struct nbtx_list, entry);
+    list_del(&entry->entry);
+
+    release(entry->data, pending);
+    nbtx_free_(entry);
+  }
+}
 
-  free(tree->name);
-  free(tree);
+void nbtx_free_list(struct nbtx_list* list) {
+  struct list_head pending;
+  INIT_LIST_HEAD(&pending);
+
+  release_list(list, &pending);
+  release_pending(&pending);
+}
+
+void nbtx_free(nbtx_node* tree) {
+  struct list_head pending;
+  INIT_LIST_HEAD(&pending);
+
+  release(tree, &pending);
+  release_pending(&pending);
 }
 
-static struct nbtx_list* clone_list(struct nbtx_list* list) {
+static nbtx_node* clone(nbtx_node* tree, bool deep);
+
+/*
+ * Copies the list itself, and its elements too if `deep' is set. Otherwise
+ * the new list points to the same nodes, which become shared.
+ */
+static struct nbtx_list* clone_list(struct nbtx_list* list, const bool deep) {
   /* even empty lists are valid pointers! */
   assert(list);
 
@@ -91,11 +133,16 @@ static struct nbtx_list* clone_list(struct nbtx_list* list) {
 
     CHECKED_MALLOC(new, sizeof(*new), goto clone_error);
 
-    new->data = nbtx_clone(current->data);
+    if (deep) {
+      new->data = clone(current->data, true);
 
-    if (new->data == NULL) {
-      free(new);
-      goto clone_error;
+      if (new->data == NULL) {
+        nbtx_free_(new);
+        goto clone_error;
+      }
+    } else {
+      new->data = current->data;
+      nbtx_ref_(new->data);
     }
 
     list_add_tail(&new->entry, &ret->entry);
@@ -113,14 +160,18 @@ static char* safe_strdup(const char* s) {
   return s ? nbtx_strdup(s) : NULL;
 }
 
-nbtx_node* nbtx_clone(nbtx_node* tree) {
+static nbtx_node* clone(nbtx_node* tree, const bool deep) {
   if (tree == NULL) return NULL;
   assert(tree->type != NBTX_TAG_INVALID);
 
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_CLONE);
+
   nbtx_node* ret;
-  CHECKED_MALLOC(ret, sizeof(*ret), return NULL);
+  CHECKED_MALLOC(ret, sizeof(*ret), goto clone_error);
 
   ret->type = tree->type;
+  ret->refcount = 1;
+  ret->cache = NULL;
   ret->name = safe_strdup(tree->name);
 
   if (tree->name && ret->name == NULL) goto clone_error;
@@ -143,50 +194,138 @@ nbtx_node* nbtx_clone(nbtx_node* tree) {
   }
 
   else if (tree->type == NBTX_TAG_LIST) {
-    ret->payload.tag_list = clone_list(tree->payload.tag_list);
+    ret->payload.tag_list = clone_list(tree->payload.tag_list, deep);
     if (ret->payload.tag_list == NULL) goto clone_error;
   } else if (tree->type == NBTX_TAG_COMPOUND) {
-    ret->payload.tag_compound = clone_list(tree->payload.tag_compound);
+    ret->payload.tag_compound = clone_list(tree->payload.tag_compound, deep);
     if (ret->payload.tag_compound == NULL) goto clone_error;
   } else {
     ret->payload = tree->payload;
   }
 
+  NBTX_STATS_LEAVE();
+  NBTX_STATS_ADD(nodes_created, 1);
   return ret;
 
 clone_error:
-  if (ret) free(ret->name);
+  NBTX_STATS_LEAVE();
+  if (ret) nbtx_free_(ret->name);
 
-  free(ret);
+  nbtx_free_(ret);
   return NULL;
 }
 
+nbtx_node* nbtx_clone(nbtx_node* tree) {
+  return clone(tree, true);
+}
+
+nbtx_node* nbtx_clone_shared(nbtx_node* tree) {
+  return clone(tree, false);
+}
+
+/*
+ * nbtx_map and nbtx_size walk trees with a stack of these instead of
+ * recursing: one per list or compound being walked, `pos' being the member
+ * last visited.
+ */
+struct walk_frame {
+  struct list_head* head;
+  struct list_head* pos;
+};
+
+#define WALK_LOCAL_FRAMES 64
+
+static bool is_list_or_compound(const nbtx_node* node) {
+  return node->type == NBTX_TAG_LIST || node->type == NBTX_TAG_COMPOUND;
+}
+
+/*
+ * Pushes the members of a list or compound. Returns false if the stack can't
+ * grow, so the caller has to recurse instead.
+ */
+static bool walk_push(struct walk_frame** frames, size_t* capacity, size_t* depth,
+                      const struct walk_frame* local, const nbtx_node* node) {
+  if (*depth == *capacity) {
+    struct walk_frame* grown = nbtx_grow_stack_(*frames, capacity, sizeof(**frames), *frames != local);
+    if (grown == NULL) return false;
+
+    *frames = grown;
+  }
+
+  /* tag_list and tag_compound share their representation. */
+  struct list_head* head = &node->payload.tag_list->entry;
+  (*frames)[(*depth)++] = (struct walk_frame) { head, head };
+  return true;
+}
+
 bool nbtx_map(nbtx_node* tree, const nbtx_visitor_t v, void* aux) {
   assert(v);
 
   if (tree == NULL)  return true;
   if (!v(tree, aux)) return false;
 
-  /* And if the item is a list or compound, recurse through each of their elements. */
-  if (tree->type == NBTX_TAG_COMPOUND) {
+  if (!is_list_or_compound(tree)) return true;
+
+  struct walk_frame local[WALK_LOCAL_FRAMES];
+  struct walk_frame* frames = local;
+  size_t capacity = WALK_LOCAL_FRAMES;
+  size_t depth = 0;
+  bool ret = true;
+
+  walk_push(&frames, &capacity, &depth, local, tree);
+
+  while (ret && depth > 0) {
+    struct walk_frame* top = &frames[depth - 1];
+    struct list_head* const head = top->head;
     struct list_head* pos;
 
-    list_for_each(pos, &tree->payload.tag_compound->entry)
-      if (!nbtx_map(list_entry(pos, struct nbtx_list, entry)->data, v, aux))
-        return false;
+    /* Members are read one at a time, in case the visitor changes the list. */
+    for (pos = top->pos->flink; pos != head; pos = pos->flink) {
+      nbtx_node* node = list_entry(pos, struct nbtx_list, entry)->data;
+
+      if (!v(node, aux)) { ret = false; break; }
+      if (!is_list_or_compound(node)) continue;
+
+      top->pos = pos;
+      if (walk_push(&frames, &capacity, &depth, local, node)) break;
+
+      struct list_head* child;
+      list_for_each(child, &node->payload.tag_list->entry)
+        if (!nbtx_map(list_entry(child, struct nbtx_list, entry)->data, v, aux)) {
+          ret = false;
+          break;
+        }
+
+      if (!ret) break;
+    }
+
+    /* Pushing may have moved the frames, so don't touch `top' here. */
+    if (pos == head) --depth;
   }
 
-  if (tree->type == NBTX_TAG_LIST) {
-    struct list_head* pos;
+  if (frames != local) nbtx_free_(frames);
+  return ret;
+}
 
-    list_for_each(pos, &tree->payload.tag_list->entry)
-      if (!nbtx_map(list_entry(pos, struct nbtx_list, entry)->data, v, aux))
-        return false;
+bool nbtx_cursor_grow_(nbtx_cursor* c) {
+  struct nbtx_cursor_frame* grown = nbtx_grow_stack_(c->frames, &c->capacity, sizeof(*c->frames), c->frames != c->local);
+
+  if (grown == NULL) {
+    errno = NBTX_EMEM;
+    return false;
   }
 
+  c->frames = grown;
   return true;
 }
 
+void nbtx_cursor_free(nbtx_cursor* c) {
+  if (c->frames != c->local) nbtx_free_(c->frames);
+  c->frames = c->local;
+  c->capacity = NBTX_CURSOR_LOCAL_FRAMES;
+  c->count = 0;
+}
+
 /* Only returns NULL on error. An empty list is still a valid pointer */
 static struct nbtx_list* filter_list(const struct nbtx_list* list, const nbtx_predicate_t predicate, void* aux) {
   assert(list);
@@ -231,10 +370,14 @@ nbtx_node* nbtx_filter(const nbtx_node* tree, const nbtx_predicate_t filter, voi
   if (tree == NULL)       return NULL;
   if (!filter(tree, aux)) return NULL;
 
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_CLONE);
+
   nbtx_node* ret = NULL;
   CHECKED_MALLOC(ret, sizeof(*ret), goto filter_error);
 
   ret->type = tree->type;
+  ret->refcount = 1;
+  ret->cache = NULL;
   ret->name = safe_strdup(tree->name);
 
   if (tree->name && ret->name == NULL) goto filter_error;
@@ -267,26 +410,36 @@ nbtx_node* nbtx_filter(const nbtx_node* tree, const nbtx_predicate_t filter, voi
     ret->payload = tree->payload;
   }
 
+  NBTX_STATS_LEAVE();
+  NBTX_STATS_ADD(nodes_created, 1);
   return ret;
 
 filter_error:
+  NBTX_STATS_LEAVE();
   if (errno == NBTX_OK)
     errno = NBTX_EMEM;
 
-  if (ret) free(ret->name);
+  if (ret) nbtx_free_(ret->name);
 
-  free(ret);
+  nbtx_free_(ret);
   return NULL;
 }
 
-nbtx_node* nbtx_filter_inplace(nbtx_node* tree, const nbtx_predicate_t filter, void* aux) {
-  assert(filter);
-
+static nbtx_node* filter_inplace(nbtx_node* tree, const nbtx_predicate_t filter, void* aux) {
   if (tree == NULL)               return                 NULL;
   if (!filter(tree, aux))         return nbtx_free(tree), NULL;
   if (tree->type != NBTX_TAG_LIST &&
       tree->type != NBTX_TAG_COMPOUND) return tree;
 
+  /* Don't filter a list someone else is looking at, filter our own copy. */
+  if (nbtx_shared_(tree)) {
+    nbtx_node* copy = nbtx_clone_shared(tree);
+    if (copy == NULL) return (errno = NBTX_EMEM), tree;
+
+    nbtx_free(tree);
+    tree = copy;
+  }
+
   struct list_head* pos;
   struct list_head* n;
   struct nbtx_list* list = tree->type == NBTX_TAG_LIST ? tree->payload.tag_list : tree->payload.tag_compound;
@@ -294,17 +447,26 @@ nbtx_node* nbtx_filter_inplace(nbtx_node* tree, const nbtx_predicate_t filter, v
   list_for_each_safe(pos, n, &list->entry) {
     struct nbtx_list* cur = list_entry(pos, struct nbtx_list, entry);
 
-    cur->data = nbtx_filter_inplace(cur->data, filter, aux);
+    cur->data = filter_inplace(cur->data, filter, aux);
 
     if (cur->data == NULL) {
       list_del(pos);
-      free(cur);
+      nbtx_free_(cur);
+      nbtx_touch_(tree);
     }
   }
 
   return tree;
 }
 
+nbtx_node* nbtx_filter_inplace(nbtx_node* tree, const nbtx_predicate_t filter, void* aux) {
+  assert(filter);
+
+  errno = NBTX_OK;
+
+  return filter_inplace(tree, filter, aux);
+}
+
 nbtx_node* nbtx_find(nbtx_node* tree, const nbtx_predicate_t predicate, void* aux) {
   if (tree == NULL)
     return NULL;
@@ -422,27 +584,100 @@ nbtx_node* nbtx_find_by_path(nbtx_node* tree, const char* path) {
   return NULL;
 }
 
-/* Gets the length of the list, plus the length of all its children. */
-static size_t nbtx_full_list_length(struct nbtx_list* list) {
-  size_t accum = 0;
+static nbtx_node* find_by_path_mut(nbtx_node* tree, const char* path) {
+  const size_t e = index_of(path, '.');
+
+  if (partial_strcmp(path, e, tree->name) != 0)                   return NULL;
+  if (path[e] == '\0')                                            return tree;
+  if (tree->type != NBTX_TAG_LIST && tree->type != NBTX_TAG_COMPOUND) return NULL;
 
   struct list_head* pos;
-  list_for_each(pos, &list->entry)
-    accum += nbtx_size(list_entry(pos, const struct nbtx_list, entry)->data);
+  struct nbtx_list* list = tree->type == NBTX_TAG_LIST ? tree->payload.tag_list : tree->payload.tag_compound;
+  list_for_each(pos, &list->entry) {
+    struct nbtx_list* elem = list_entry(pos, struct nbtx_list, entry);
+
+    /* Look before copying anything, so that only the path to the node gets copied. */
+    if (nbtx_find_by_path(elem->data, path + e + 1) == NULL)
+      continue;
+
+    if (nbtx_shared_(elem->data)) {
+      nbtx_node* copy = nbtx_clone_shared(elem->data);
+      if (copy == NULL) return NULL;
 
-  return accum;
+      nbtx_free(elem->data);
+      elem->data = copy;
+    }
+
+    return find_by_path_mut(elem->data, path + e + 1);
+  }
+
+  return NULL;
 }
 
+nbtx_node* nbtx_find_by_path_mut(nbtx_node* tree, const char* path) {
+  assert(tree);
+  assert(path);
+  assert(!nbtx_shared_(tree));
+
+  errno = NBTX_OK;
+
+  return find_by_path_mut(tree, path);
+}
+
+/* Gets the length of the list, plus the length of all its children. */
 size_t nbtx_size(const nbtx_node* tree) {
   if (tree == NULL)
     return 0;
 
-  if (tree->type == NBTX_TAG_LIST)
-    return nbtx_full_list_length(tree->payload.tag_list) + 1;
-  if (tree->type == NBTX_TAG_COMPOUND)
-    return nbtx_full_list_length(tree->payload.tag_compound) + 1;
+  if (!is_list_or_compound(tree))
+    return 1;
+
+  struct walk_frame local[WALK_LOCAL_FRAMES];
+  struct walk_frame* frames = local;
+  size_t capacity = WALK_LOCAL_FRAMES;
+  size_t depth = 0;
+  size_t ret = 1;
+
+  walk_push(&frames, &capacity, &depth, local, tree);
+
+  while (depth > 0) {
+    struct walk_frame* top = &frames[depth - 1];
+    struct list_head* const head = top->head;
+    struct list_head* pos;
+
+    for (pos = top->pos->flink; pos != head; pos = pos->flink) {
+      const nbtx_node* node = list_entry(pos, struct nbtx_list, entry)->data;
+      ret += 1;
+
+      if (!is_list_or_compound(node)) continue;
+
+      /* Count the members right away, until one needs a frame of its own. */
+      struct list_head* const child_head = &node->payload.tag_list->entry;
+      struct list_head* child;
+
+      for (child = child_head->flink; child != child_head; child = child->flink) {
+        if (is_list_or_compound(list_entry(child, struct nbtx_list, entry)->data)) break;
+        ret += 1;
+      }
+
+      if (child == child_head) continue;
+
+      top->pos = pos;
+      if (walk_push(&frames, &capacity, &depth, local, node)) {
+        frames[depth - 1].pos = child->blink;
+        break;
+      }
 
-  return 1;
+      for (; child != child_head; child = child->flink)
+        ret += nbtx_size(list_entry(child, struct nbtx_list, entry)->data);
+    }
+
+    /* Pushing may have moved the frames, so don't touch `top' here. */
+    if (pos == head) --depth;
+  }
+
+  if (frames != local) nbtx_free_(frames);
+  return ret;
 }
 
 nbtx_node* nbtx_list_item(nbtx_node* list, const int n) {
@@ -461,62 +696,90 @@ nbtx_node* nbtx_list_item(nbtx_node* list, const int n) {
 }
 
 nbtx_node* nbtx_new_list(const char* name, const nbtx_type type) {
-  nbtx_node* node;
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_PUT);
 
-  CHECKED_MALLOC(node, sizeof(*node), return NULL);
+  nbtx_node* node;
+  CHECKED_MALLOC(node, sizeof(*node), goto new_error);
 
   node->type = NBTX_TAG_LIST;
+  node->refcount = 1;
+  node->cache = NULL;
   node->name = safe_strdup(name);
 
   node->payload.tag_list = nbtx_new_tag_list_payload(type);
   if (!node->payload.tag_list) {
-    nbtx_free(node);
-    return NULL;
+    nbtx_free_(node->name);
+    nbtx_free_(node);
+    goto new_error;
   }
 
+  NBTX_STATS_LEAVE();
+  NBTX_STATS_ADD(nodes_created, 1);
   return node;
+
+new_error:
+  NBTX_STATS_LEAVE();
+  return NULL;
 }
 
 nbtx_node* nbtx_new_compound(const char* name) {
-  nbtx_node* node;
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_PUT);
 
-  CHECKED_MALLOC(node, sizeof(*node), return NULL);
+  nbtx_node* node;
+  CHECKED_MALLOC(node, sizeof(*node), goto new_error);
 
   node->type = NBTX_TAG_COMPOUND;
+  node->refcount = 1;
+  node->cache = NULL;
   node->name = safe_strdup(name);
 
   node->payload.tag_compound = nbtx_new_tag_compound_payload();
   if (!node->payload.tag_compound) {
-    nbtx_free(node);
-    return NULL;
+    nbtx_free_(node->name);
+    nbtx_free_(node);
+    goto new_error;
   }
 
+  NBTX_STATS_LEAVE();
+  NBTX_STATS_ADD(nodes_created, 1);
   return node;
+
+new_error:
+  NBTX_STATS_LEAVE();
+  return NULL;
 }
 
 struct nbtx_list* nbtx_new_tag_list_payload(const nbtx_type type) {
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_PUT);
+
   struct nbtx_list* ret;
 
-  CHECKED_MALLOC(ret, sizeof(*ret), return NULL);
+  CHECKED_MALLOC(ret, sizeof(*ret), goto new_error);
 
   /* we allocate the data pointer to store the type of the list in the first
    * sentinel element */
-  CHECKED_MALLOC(ret->data, sizeof(*ret->data), free(ret); return NULL);
+  CHECKED_MALLOC(ret->data, sizeof(*ret->data), nbtx_free_(ret); ret = NULL; goto new_error);
   ret->data->type = type;
 
   INIT_LIST_HEAD(&ret->entry);
 
+new_error:
+  NBTX_STATS_LEAVE();
   return ret;
 }
 
 struct nbtx_list* nbtx_new_tag_compound_payload() {
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_PUT);
+
   struct nbtx_list* ret;
 
-  CHECKED_MALLOC(ret, sizeof(*ret), return NULL);
+  CHECKED_MALLOC(ret, sizeof(*ret), goto new_error);
 
   ret->data = NULL;
   INIT_LIST_HEAD(&ret->entry);
 
+new_error:
+  NBTX_STATS_LEAVE();
   return ret;
 }
 
@@ -524,10 +787,20 @@ struct nbtx_list* nbtx_extract_tag_list_payload(nbtx_node* list) {
   if (list->type != NBTX_TAG_LIST)
     return NULL;
 
+  /* Other trees still need the payload, so give out a copy. */
+  if (nbtx_shared_(list)) {
+    struct nbtx_list* ret = clone_list(list->payload.tag_list, false);
+    if (ret) nbtx_free(list);
+
+    return ret;
+  }
+
   struct nbtx_list* ret = list->payload.tag_list;
 
-  free(list->name);
-  free(list);
+  nbtx_cache_free_(list->cache);
+  nbtx_free_(list->name);
+  nbtx_free_(list);
+  NBTX_STATS_ADD(nodes_freed, 1);
 
   return ret;
 }
@@ -536,35 +809,52 @@ struct nbtx_list* nbtx_extract_tag_compound_payload(nbtx_node* compound) {
   if (compound->type != NBTX_TAG_COMPOUND)
     return NULL;
 
+  /* Other trees still need the payload, so give out a copy. */
+  if (nbtx_shared_(compound)) {
+    struct nbtx_list* ret = clone_list(compound->payload.tag_compound, false);
+    if (ret) nbtx_free(compound);
+
+    return ret;
+  }
+
   struct nbtx_list* ret = compound->payload.tag_list;
 
-  free(compound->name);
-  free(compound);
+  nbtx_cache_free_(compound->cache);
+  nbtx_free_(compound->name);
+  nbtx_free_(compound);
+  NBTX_STATS_ADD(nodes_freed, 1);
 
   return ret;
 }
 
 #define NBTX_PAYLOAD_SET_SIMPLE(datatype) list->data->payload.tag_##datatype = tag_##datatype;
 
-#define NBTX_PAYLOAD_SET_BYTE_ARRAY \
-  list->data->payload.tag_byte_array.data = malloc(length); \
-  memcpy(list->data->payload.tag_byte_array.data, tag_byte_array, length); \
-  list->data->payload.tag_byte_array.length = length;
+/* The _take puts adopt the caller's storage. The copying puts are built on them. */
+#define NBTX_PAYLOAD_SET_BYTE_ARRAY list->data->payload.tag_byte_array = tag_byte_array;
+#define NBTX_PAYLOAD_SET_STRING     list->data->payload.tag_string = tag_string;
 
-#define NBTX_PAYLOAD_SET_STRING \
-  const size_t length = strlen(tag_string); \
-  list->data->payload.tag_string = malloc(length + 1); \
-  memcpy(list->data->payload.tag_string, tag_string, length + 1);
-
-#define NBTX_SPAWN_PUT_FUNCTION_DEFINITION(c_type, datatype, type_enum, setter, ...) \
-nbtx_result nbtx_put_##datatype(nbtx_node* list_or_compound, const char* name, c_type tag_##datatype __VA_ARGS__) { \
+/*
+ * Without `lookup', members of compounds are appended without looking for
+ * others by the same name, for nbtx_compound_builder.
+ */
+#define NBTX_SPAWN_PUT_FUNCTION_DEFINITION(c_type, datatype, type_enum, setter) \
+static nbtx_result put_##datatype(nbtx_node* list_or_compound, const bool lookup, \
+                                  const char* name, c_type tag_##datatype) { \
   const bool is_compound = list_or_compound->type == NBTX_TAG_COMPOUND; \
  \
   if (!is_compound && list_or_compound->type != NBTX_TAG_LIST) \
     return (nbtx_result) { NULL, false }; \
  \
+  /* Writing into a shared node would change every tree that has it. */ \
+  if (nbtx_shared_(list_or_compound)) \
+    return (errno = NBTX_ERR), (nbtx_result) { NULL, false }; \
+ \
+  nbtx_touch_(list_or_compound); \
+ \
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_PUT); \
+  nbtx_result ret = { NULL, false }; \
   struct nbtx_list* list = NULL; \
-  if (is_compound) { \
+  if (is_compound && lookup) { \
     struct list_head* element; \
     list_for_each(element, &list_or_compound->payload.tag_compound->entry) { \
       struct nbtx_list* p = list_entry(element, struct nbtx_list, entry); \
@@ -577,28 +867,43 @@ nbtx_result nbtx_put_##datatype(nbtx_node* list_or_compound, const char* name, c
  \
   if (list) { \
     /* Those types don't require freeing of resources.*/ \
-    if (list->data->type <= NBTX_TAG_DOUBLE) { \
+    if (list->data->type <= NBTX_TAG_DOUBLE && !nbtx_shared_(list->data)) { \
       list->data->type = type_enum; \
       setter \
  \
-      return (nbtx_result) { list->data, false }; \
+      ret = (nbtx_result) { list->data, false }; \
+      goto done; \
     } \
     nbtx_free(list->data); \
   } else { \
-    CHECKED_MALLOC(list, sizeof(*list), return (nbtx_result) { 0 }); \
+    CHECKED_MALLOC(list, sizeof(*list), goto done); \
     list_add_tail(&list->entry, &list_or_compound->payload.tag_compound->entry); \
   } \
  \
   CHECKED_MALLOC( \
     list->data, \
     sizeof(*list->data), \
-    free(list); return (nbtx_result) { 0 } \
+    list_del(&list->entry); nbtx_free_(list); goto done \
   ); \
   list->data->name = is_compound ? nbtx_strdup(name) : NULL; \
+  if (is_compound && list->data->name == NULL) { \
+    errno = NBTX_EMEM; \
+    nbtx_free_(list->data); \
+    list_del(&list->entry); \
+    nbtx_free_(list); \
+    goto done; \
+  } \
   list->data->type = type_enum; \
+  list->data->refcount = 1; \
+  list->data->cache = NULL; \
   setter \
  \
-  return (nbtx_result) { list->data, true }; \
+  NBTX_STATS_ADD(nodes_created, 1); \
+  ret = (nbtx_result) { list->data, true }; \
+ \
+done: \
+  NBTX_STATS_LEAVE(); \
+  return ret; \
 }
 
 NBTX_SPAWN_PUT_FUNCTION_DEFINITION(int8_t, byte, NBTX_TAG_BYTE, NBTX_PAYLOAD_SET_SIMPLE(byte));
@@ -611,8 +916,8 @@ NBTX_SPAWN_PUT_FUNCTION_DEFINITION(int64_t, long, NBTX_TAG_LONG, NBTX_PAYLOAD_SE
 NBTX_SPAWN_PUT_FUNCTION_DEFINITION(uint64_t, ulong, NBTX_TAG_UNSIGNED_LONG, NBTX_PAYLOAD_SET_SIMPLE(ulong));
 NBTX_SPAWN_PUT_FUNCTION_DEFINITION(float, float, NBTX_TAG_FLOAT, NBTX_PAYLOAD_SET_SIMPLE(float));
 NBTX_SPAWN_PUT_FUNCTION_DEFINITION(double, double, NBTX_TAG_DOUBLE, NBTX_PAYLOAD_SET_SIMPLE(double));
-NBTX_SPAWN_PUT_FUNCTION_DEFINITION(unsigned char*, byte_array, NBTX_TAG_BYTE_ARRAY, NBTX_PAYLOAD_SET_BYTE_ARRAY, , uint32_t length);
-NBTX_SPAWN_PUT_FUNCTION_DEFINITION(const char*, string, NBTX_TAG_STRING, NBTX_PAYLOAD_SET_STRING);
+NBTX_SPAWN_PUT_FUNCTION_DEFINITION(struct nbtx_byte_array, byte_array, NBTX_TAG_BYTE_ARRAY, NBTX_PAYLOAD_SET_BYTE_ARRAY);
+NBTX_SPAWN_PUT_FUNCTION_DEFINITION(char*, string, NBTX_TAG_STRING, NBTX_PAYLOAD_SET_STRING);
 NBTX_SPAWN_PUT_FUNCTION_DEFINITION(struct nbtx_list*, list, NBTX_TAG_LIST, NBTX_PAYLOAD_SET_SIMPLE(list));
 NBTX_SPAWN_PUT_FUNCTION_DEFINITION(struct nbtx_list*, compound, NBTX_TAG_COMPOUND, NBTX_PAYLOAD_SET_SIMPLE(compound));
 
@@ -620,3 +925,331 @@ NBTX_SPAWN_PUT_FUNCTION_DEFINITION(struct nbtx_list*, compound, NBTX_TAG_COMPOUN
 #undef NBTX_PAYLOAD_SET_STRING
 #undef NBTX_PAYLOAD_SET_BYTE_ARRAY
 #undef NBTX_PAYLOAD_SET_SIMPLE
+
+static nbtx_result put_byte_array_copy(nbtx_node* list_or_compound, const bool lookup, const char* name,
+                                       const unsigned char* data, const uint32_t length) {
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_PUT);
+  nbtx_result ret = { NULL, false };
+
+  /* Some allocators give nothing for nothing, and an array must point somewhere. */
+  unsigned char* copy;
+  CHECKED_MALLOC(copy, length ? length : 1, goto done);
+  if (length) memcpy(copy, data, length);
+
+  ret = put_byte_array(list_or_compound, lookup, name, (struct nbtx_byte_array) { copy, length });
+  if (ret.reference == NULL) nbtx_free_(copy);
+
+done:
+  NBTX_STATS_LEAVE();
+  return ret;
+}
+
+static nbtx_result put_string_copy(nbtx_node* list_or_compound, const bool lookup, const char* name,
+                                   const char* value) {
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_PUT);
+  nbtx_result ret = { NULL, false };
+
+  char* copy = nbtx_strdup(value);
+  if (copy == NULL) {
+    errno = NBTX_EMEM;
+    goto done;
+  }
+
+  ret = put_string(list_or_compound, lookup, name, copy);
+  if (ret.reference == NULL) nbtx_free_(copy);
+
+done:
+  NBTX_STATS_LEAVE();
+  return ret;
+}
+
+#define NBTX_SPAWN_PUT_WRAPPER_DEFINITION(c_type, datatype) \
+nbtx_result nbtx_put_##datatype(nbtx_node* list_or_compound, const char* name, c_type tag_##datatype) { \
+  return put_##datatype(list_or_compound, true, name, tag_##datatype); \
+}
+
+NBTX_SPAWN_PUT_WRAPPER_DEFINITION(int8_t, byte)
+NBTX_SPAWN_PUT_WRAPPER_DEFINITION(uint8_t, ubyte)
+NBTX_SPAWN_PUT_WRAPPER_DEFINITION(int16_t, short)
+NBTX_SPAWN_PUT_WRAPPER_DEFINITION(uint16_t, ushort)
+NBTX_SPAWN_PUT_WRAPPER_DEFINITION(int32_t, int)
+NBTX_SPAWN_PUT_WRAPPER_DEFINITION(uint32_t, uint)
+NBTX_SPAWN_PUT_WRAPPER_DEFINITION(int64_t, long)
+NBTX_SPAWN_PUT_WRAPPER_DEFINITION(uint64_t, ulong)
+NBTX_SPAWN_PUT_WRAPPER_DEFINITION(float, float)
+NBTX_SPAWN_PUT_WRAPPER_DEFINITION(double, double)
+NBTX_SPAWN_PUT_WRAPPER_DEFINITION(struct nbtx_list*, list)
+NBTX_SPAWN_PUT_WRAPPER_DEFINITION(struct nbtx_list*, compound)
+
+#undef NBTX_SPAWN_PUT_WRAPPER_DEFINITION
+
+nbtx_result nbtx_put_byte_array(nbtx_node* list_or_compound, const char* name,
+                                unsigned char* tag_byte_array, const uint32_t length) {
+  return put_byte_array_copy(list_or_compound, true, name, tag_byte_array, length);
+}
+
+nbtx_result nbtx_put_byte_array_take(nbtx_node* list_or_compound, const char* name,
+                                     unsigned char* tag_byte_array_take, const uint32_t length) {
+  return put_byte_array(list_or_compound, true, name, (struct nbtx_byte_array) { tag_byte_array_take, length });
+}
+
+nbtx_result nbtx_put_string(nbtx_node* list_or_compound, const char* name, const char* tag_string) {
+  return put_string_copy(list_or_compound, true, name, tag_string);
+}
+
+nbtx_result nbtx_put_string_take(nbtx_node* list_or_compound, const char* name, char* tag_string_take) {
+  return put_string(list_or_compound, true, name, tag_string_take);
+}
+
+unsigned char* nbtx_extract_byte_array(nbtx_node* node, uint32_t* length) {
+  if (node == NULL || node->type != NBTX_TAG_BYTE_ARRAY)
+    return (errno = NBTX_ERR), NULL;
+
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_PUT);
+
+  struct nbtx_byte_array* array = &node->payload.tag_byte_array;
+  const uint32_t n = array->length;
+  const bool shared = nbtx_shared_(node);
+
+  /* Either the copy for the caller, or what's left in the node. */
+  unsigned char* ret;
+  CHECKED_MALLOC(ret, shared && n ? n : 1, goto done);
+
+  if (shared) {
+    if (n) memcpy(ret, array->data, n);
+  } else {
+    unsigned char* taken = array->data;
+    array->data = ret;
+    array->length = 0;
+    nbtx_touch_(node);
+    ret = taken;
+  }
+
+  if (length) *length = n;
+
+done:
+  NBTX_STATS_LEAVE();
+  return ret;
+}
+
+char* nbtx_extract_string(nbtx_node* node) {
+  if (node == NULL || node->type != NBTX_TAG_STRING)
+    return (errno = NBTX_ERR), NULL;
+
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_PUT);
+
+  char* ret;
+
+  if (nbtx_shared_(node)) {
+    ret = nbtx_strdup(node->payload.tag_string);
+    if (ret == NULL) errno = NBTX_EMEM;
+  } else {
+    CHECKED_MALLOC(ret, 1, goto done);
+
+    char* taken = node->payload.tag_string;
+    node->payload.tag_string = ret;
+    ret[0] = '\0';
+    nbtx_touch_(node);
+    ret = taken;
+  }
+
+done:
+  NBTX_STATS_LEAVE();
+  return ret;
+}
+
+/***** Compound Builders *****/
+
+/* A member, by the hash of its name. Empty slots have no `entry'. */
+struct builder_slot {
+  uint64_t hash;
+  struct nbtx_list* entry;
+};
+
+struct nbtx_compound_builder {
+  nbtx_node* compound;
+  size_t count; /* Members put, duplicates included. */
+
+  struct builder_slot* slots; /* For finding duplicates. A power of two of them, or none. */
+  size_t capacity;
+};
+
+/* Makes room for `count' names in the table of duplicates, keeping it at most half full. */
+static bool reserve_slots(nbtx_compound_builder* b, const size_t count) {
+  if (count <= b->capacity / 2) return true;
+  if (count > SIZE_MAX / 2 / sizeof(*b->slots)) return false;
+
+  size_t capacity = 64;
+  while (capacity / 2 < count) capacity *= 2;
+
+  struct builder_slot* slots = nbtx_malloc_(capacity * sizeof(*slots));
+  if (slots == NULL) return false;
+
+  nbtx_free_(b->slots);
+  b->slots = slots;
+  b->capacity = capacity;
+  return true;
+}
+
+nbtx_compound_builder* nbtx_compound_builder_new(const char* name, const size_t size_hint) {
+  nbtx_compound_builder* b = nbtx_calloc_(1, sizeof(*b));
+  if (b == NULL) {
+    errno = NBTX_EMEM;
+    return NULL;
+  }
+
+  if ((b->compound = nbtx_new_compound(name)) == NULL) {
+    nbtx_free_(b);
+    return NULL;
+  }
+
+  /* Only a hint: nbtx_compound_builder_finish tries again if this fails. */
+  (void)reserve_slots(b, size_hint);
+  return b;
+}
+
+void nbtx_compound_builder_free(nbtx_compound_builder* b) {
+  if (b == NULL) return;
+
+  nbtx_free(b->compound);
+  nbtx_free_(b->slots);
+  nbtx_free_(b);
+}
+
+/* Replaces the node of `first' with that of `later', which goes away, like a put would. */
+static void replace_member(struct nbtx_list* first, struct nbtx_list* later) {
+  nbtx_free(first->data);
+  first->data = later->data;
+
+  list_del(&later->entry);
+  nbtx_free_(later);
+}
+
+/* Finds duplicates by hashing their names, in one pass. */
+static void merge_hashed(nbtx_compound_builder* b) {
+  const size_t mask = b->capacity - 1;
+  struct list_head* const head = &b->compound->payload.tag_compound->entry;
+  struct list_head* pos;
+  struct list_head* next;
+
+  memset(b->slots, 0, b->capacity * sizeof(*b->slots));
+
+  for (pos = head->flink; pos != head; pos = next) {
+    struct nbtx_list* entry = list_entry(pos, struct nbtx_list, entry);
+    const char* name = entry->data->name;
+    const uint64_t hash = nbtx_digest_bytes_(name, strlen(name)).lo;
+
+    next = pos->flink;
+
+    for (size_t i = (size_t)hash & mask;; i = (i + 1) & mask) {
+      struct builder_slot* s = &b->slots[i];
+
+      if (s->entry == NULL) {
+        *s = (struct builder_slot) { hash, entry };
+        break;
+      }
+
+      if (s->hash == hash && strcmp(s->entry->data->name, name) == 0) {
+        replace_member(s->entry, entry);
+        break;
+      }
+    }
+  }
+}
+
+/* Finds duplicates the way puts do, for when there's no memory for the table. */
+static void merge_scanning(nbtx_compound_builder* b) {
+  struct list_head* const head = &b->compound->payload.tag_compound->entry;
+  struct list_head* pos;
+  struct list_head* next;
+
+  for (pos = head->flink; pos != head; pos = next) {
+    struct nbtx_list* entry = list_entry(pos, struct nbtx_list, entry);
+    next = pos->flink;
+
+    for (struct list_head* before = head->flink; before != pos; before = before->flink) {
+      struct nbtx_list* first = list_entry(before, struct nbtx_list, entry);
+
+      if (strcmp(first->data->name, entry->data->name) == 0) {
+        replace_member(first, entry);
+        break;
+      }
+    }
+  }
+}
+
+nbtx_node* nbtx_compound_builder_finish(nbtx_compound_builder* b) {
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_PUT);
+
+  if (b->count > 1) {
+    if (reserve_slots(b, b->count))
+      merge_hashed(b);
+    else
+      merge_scanning(b);
+  }
+
+  NBTX_STATS_LEAVE();
+
+  nbtx_node* ret = b->compound;
+  nbtx_free_(b->slots);
+  nbtx_free_(b);
+  return ret;
+}
+
+/* Every member needs a name to be told apart by. */
+#define NBTX_BUILDER_CHECK(b, name) \
+  if ((b) == NULL || (name) == NULL) \
+    return (errno = NBTX_ERR), (nbtx_result) { NULL, false }
+
+/* Counts what was put, since duplicates aren't known until the end. */
+static nbtx_result counted(nbtx_compound_builder* b, const nbtx_result r) {
+  if (r.reference) b->count++;
+  return r;
+}
+
+#define NBTX_SPAWN_BUILDER_PUT_DEFINITION(c_type, datatype) \
+nbtx_result nbtx_compound_builder_put_##datatype(nbtx_compound_builder* b, const char* name, c_type tag_##datatype) { \
+  NBTX_BUILDER_CHECK(b, name); \
+  return counted(b, put_##datatype(b->compound, false, name, tag_##datatype)); \
+}
+
+NBTX_SPAWN_BUILDER_PUT_DEFINITION(int8_t, byte)
+NBTX_SPAWN_BUILDER_PUT_DEFINITION(uint8_t, ubyte)
+NBTX_SPAWN_BUILDER_PUT_DEFINITION(int16_t, short)
+NBTX_SPAWN_BUILDER_PUT_DEFINITION(uint16_t, ushort)
+NBTX_SPAWN_BUILDER_PUT_DEFINITION(int32_t, int)
+NBTX_SPAWN_BUILDER_PUT_DEFINITION(uint32_t, uint)
+NBTX_SPAWN_BUILDER_PUT_DEFINITION(int64_t, long)
+NBTX_SPAWN_BUILDER_PUT_DEFINITION(uint64_t, ulong)
+NBTX_SPAWN_BUILDER_PUT_DEFINITION(float, float)
+NBTX_SPAWN_BUILDER_PUT_DEFINITION(double, double)
+NBTX_SPAWN_BUILDER_PUT_DEFINITION(struct nbtx_list*, list)
+NBTX_SPAWN_BUILDER_PUT_DEFINITION(struct nbtx_list*, compound)
+
+#undef NBTX_SPAWN_BUILDER_PUT_DEFINITION
+
+nbtx_result nbtx_compound_builder_put_byte_array(nbtx_compound_builder* b, const char* name,
+                                                 unsigned char* tag_byte_array, const uint32_t length) {
+  NBTX_BUILDER_CHECK(b, name);
+  return counted(b, put_byte_array_copy(b->compound, false, name, tag_byte_array, length));
+}
+
+nbtx_result nbtx_compound_builder_put_byte_array_take(nbtx_compound_builder* b, const char* name,
+                                                      unsigned char* tag_byte_array_take, const uint32_t length) {
+  NBTX_BUILDER_CHECK(b, name);
+  return counted(b, put_byte_array(b->compound, false, name,
+                                   (struct nbtx_byte_array) { tag_byte_array_take, length }));
+}
+
+nbtx_result nbtx_compound_builder_put_string(nbtx_compound_builder* b, const char* name, const char* tag_string) {
+  NBTX_BUILDER_CHECK(b, name);
+  return counted(b, put_string_copy(b->compound, false, name, tag_string));
+}
+
+nbtx_result nbtx_compound_builder_put_string_take(nbtx_compound_builder* b, const char* name,
+                                                  char* tag_string_take) {
+  NBTX_BUILDER_CHECK(b, name);
+  return counted(b, put_string(b->compound, false, name, tag_string_take));
+}
+
+#undef NBTX_BUILDER_CHECK
@@ -9,8 +9,10 @@
  * -----------------------------------------------------------------------------
  */
 #include "nbtx.h"
+#include "nbtx_internal.h"
 
 #include <assert.h>
+#include <math.h>
 #include <string.h>
 
 const char* nbtx_type_to_string(const nbtx_type t) {
@@ -49,6 +51,10 @@ const char* nbtx_error_to_string(const nbtx_status s) {
       return "IO Error. Nonexistent/corrupt file?";
     case NBTX_EZ:
       return "Fatal zlib error. Corrupt file?";
+    case NBTX_EDEPTH:
+      return "NBT tree is nested too deeply.";
+    case NBTX_ENOTFOUND:
+      return "Nothing found at that path.";
     default:
       return "Unknown error.";
   }
@@ -78,7 +84,16 @@ static bool floats_are_close(const double a, const double b) {
   return (min(a, b) + epsilon) >= max(a, b);
 }
 
-bool nbtx_eq(const nbtx_node* restrict a, const nbtx_node* restrict b) {
+/* Compares floats the way they hash: NaNs are all equal, and so are 0.0 and -0.0. */
+static bool floats_are_same(const double a, const double b) {
+  return (isnan(a) && isnan(b)) || a == b;
+}
+
+/*
+ * Compares two nodes, but not the members of lists and compounds. Floats and
+ * doubles only have to be close unless `exact' is set.
+ */
+static bool shallow_eq(const nbtx_node* a, const nbtx_node* b, const bool exact) {
   if (a->type != b->type)
     return false;
 
@@ -103,8 +118,10 @@ bool nbtx_eq(const nbtx_node* restrict a, const nbtx_node* restrict b) {
     case NBTX_TAG_UNSIGNED_LONG:
       return a->payload.tag_ulong == b->payload.tag_ulong;
     case NBTX_TAG_FLOAT:
+      if (exact) return floats_are_same((double)a->payload.tag_float, (double)b->payload.tag_float);
       return floats_are_close((double)a->payload.tag_float, (double)b->payload.tag_float);
     case NBTX_TAG_DOUBLE:
+      if (exact) return floats_are_same(a->payload.tag_double, b->payload.tag_double);
       return floats_are_close(a->payload.tag_double, b->payload.tag_double);
     case NBTX_TAG_BYTE_ARRAY:
       if (a->payload.tag_byte_array.length != b->payload.tag_byte_array.length) return false;
@@ -115,27 +132,7 @@ bool nbtx_eq(const nbtx_node* restrict a, const nbtx_node* restrict b) {
       return strcmp(a->payload.tag_string, b->payload.tag_string) == 0;
     case NBTX_TAG_LIST:
     case NBTX_TAG_COMPOUND:
-    {
-      struct list_head* ai, * bi;
-      struct nbtx_list* alist = a->type == NBTX_TAG_LIST ? a->payload.tag_list : a->payload.tag_compound;
-      struct nbtx_list* blist = b->type == NBTX_TAG_LIST ? b->payload.tag_list : b->payload.tag_compound;
-
-      for (ai = alist->entry.flink, bi = blist->entry.flink;
-           ai != &alist->entry && bi != &blist->entry;
-           ai = ai->flink, bi = bi->flink) {
-        struct nbtx_list* ae = list_entry(ai, struct nbtx_list, entry);
-        struct nbtx_list* be = list_entry(bi, struct nbtx_list, entry);
-
-        if (!nbtx_eq(ae->data, be->data))
-          return false;
-      }
-
-      /* if there are still elements left in either list... */
-      if (ai != &alist->entry || bi != &blist->entry)
-        return false;
-
       return true;
-    }
 
     case NBTX_TAG_INVALID:
     default: /* wtf invalid type */
@@ -144,3 +141,126 @@ bool nbtx_eq(const nbtx_node* restrict a, const nbtx_node* restrict b) {
   }
 }
 
+/*
+ * Returns true if both lists or compounds have hashes cached and they differ.
+ * Equal hashes don't tell anything, since they might collide. Floats hash by
+ * their exact value, so only nbtx_eq_hashed can trust them. Making sure a hash is still good can take a walk, so
+ * nested lists and compounds only trust theirs if nothing changed at all.
+ */
+static bool hashes_differ(const nbtx_node* a, const nbtx_node* b, const bool quick) {
+  uint64_t ha, hb;
+
+  if (a->cache == NULL || b->cache == NULL)
+    return false;
+
+  return nbtx_cached_hash_(a, quick, &ha) && nbtx_cached_hash_(b, quick, &hb) && ha != hb;
+}
+
+/* A pair of lists or compounds being compared, and the members last compared. */
+struct eq_frame {
+  const struct list_head* ahead, * apos;
+  const struct list_head* bhead, * bpos;
+};
+
+/*
+ * Pushes the members of two lists or compounds. Returns false if the stack
+ * can't grow, so the caller has to recurse instead.
+ */
+static bool eq_push(struct eq_frame** frames, size_t* capacity, size_t* depth,
+                    const struct eq_frame* local, const nbtx_node* a, const nbtx_node* b) {
+  if (*depth == *capacity) {
+    struct eq_frame* grown = nbtx_grow_stack_(*frames, capacity, sizeof(**frames), *frames != local);
+    if (grown == NULL) return false;
+
+    *frames = grown;
+  }
+
+  /* tag_list and tag_compound share their representation. */
+  const struct list_head* ahead = &a->payload.tag_list->entry;
+  const struct list_head* bhead = &b->payload.tag_list->entry;
+
+  (*frames)[(*depth)++] = (struct eq_frame) { ahead, ahead, bhead, bhead };
+  return true;
+}
+
+/*
+ * Trusts cached hashes to tell lists and compounds apart if `hashed' is set,
+ * which also makes floats compare exactly, the way they hash.
+ */
+static bool eq(const nbtx_node* restrict a, const nbtx_node* restrict b, const bool hashed) {
+  /* Copy-on-write clones share whole subtrees, which are equal without a look. */
+  if (a == b)
+    return true;
+
+  if (!shallow_eq(a, b, hashed))
+    return false;
+
+  if (a->type != NBTX_TAG_LIST && a->type != NBTX_TAG_COMPOUND)
+    return true;
+
+  if (hashed && hashes_differ(a, b, false))
+    return false;
+
+  /* Walk both trees at once, with a stack instead of recursion. */
+  struct eq_frame local[64];
+  struct eq_frame* frames = local;
+  size_t capacity = sizeof local / sizeof local[0];
+  size_t depth = 0;
+  bool ret = true;
+
+  eq_push(&frames, &capacity, &depth, local, a, b);
+
+  while (depth > 0) {
+    struct eq_frame* top = &frames[depth - 1];
+
+    top->apos = top->apos->flink;
+    top->bpos = top->bpos->flink;
+
+    if (top->apos == top->ahead || top->bpos == top->bhead) {
+      /* if there are still elements left in either list... */
+      if (top->apos != top->ahead || top->bpos != top->bhead) {
+        ret = false;
+        break;
+      }
+
+      --depth;
+      continue;
+    }
+
+    const nbtx_node* ae = list_entry(top->apos, struct nbtx_list, entry)->data;
+    const nbtx_node* be = list_entry(top->bpos, struct nbtx_list, entry)->data;
+
+    if (ae == be)
+      continue;
+
+    if (!shallow_eq(ae, be, hashed)) {
+      ret = false;
+      break;
+    }
+
+    if (ae->type != NBTX_TAG_LIST && ae->type != NBTX_TAG_COMPOUND)
+      continue;
+
+    if (hashed && hashes_differ(ae, be, true)) {
+      ret = false;
+      break;
+    }
+
+    if (!eq_push(&frames, &capacity, &depth, local, ae, be) && !eq(ae, be, hashed)) {
+      ret = false;
+      break;
+    }
+  }
+
+  if (frames != local) nbtx_free_(frames);
+  return ret;
+}
+
+bool nbtx_eq(const nbtx_node* restrict a, const nbtx_node* restrict b) {
+  return eq(a, b, false);
+}
+
+bool nbtx_eq_hashed(const nbtx_node* restrict a, const nbtx_node* restrict b) {
+  return eq(a, b, true);
+}
+
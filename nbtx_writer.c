@@ -0,0 +1,401 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbtx.h"
+#include "nbtx_internal.h"
+
+#include "buffer.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+/* Compressed writers deflate this much at a time. */
+#define STAGING_SIZE (64 * 1024)
+
+#define LOCAL_FRAMES 32
+
+enum sink {
+  SINK_BUFFER,    /* Appends to the caller's buffer. */
+  SINK_FIXED,     /* Fills the caller's memory, and fails when it's full. */
+  SINK_COMPRESSED /* Stages the tree, and deflates it into the caller's buffer. */
+};
+
+/* An open list or compound. */
+struct frame {
+  nbtx_type type;
+  nbtx_type elem_type; /* Of lists. */
+  uint32_t left;       /* Elements lists still expect. */
+};
+
+struct nbtx_writer {
+  enum sink sink;
+  struct buffer* out;
+
+  unsigned char* fixed; /* The caller's memory, for SINK_FIXED. */
+  size_t capacity;
+  size_t used;
+
+  struct buffer staging; /* For SINK_COMPRESSED. */
+  z_stream stream;
+
+  size_t start;    /* Where the tree being written began in the output. */
+  bool done;       /* Whether the root has been written, or at least begun. */
+  nbtx_status err; /* The first error since the last nbtx_writer_finish. */
+
+  struct frame* frames;
+  size_t depth;
+  size_t frame_capacity;
+  struct frame local[LOCAL_FRAMES];
+};
+
+static nbtx_writer* new_writer(const enum sink sink) {
+  nbtx_writer* w = nbtx_calloc_(1, sizeof(*w));
+  if (w == NULL) {
+    errno = NBTX_EMEM;
+    return NULL;
+  }
+
+  w->sink = sink;
+  w->frames = w->local;
+  w->frame_capacity = LOCAL_FRAMES;
+  return w;
+}
+
+nbtx_writer* nbtx_writer_new(struct buffer* out) {
+  if (out == NULL) return (errno = NBTX_ERR), NULL;
+
+  nbtx_writer* w = new_writer(SINK_BUFFER);
+  if (w == NULL) return NULL;
+
+  w->out = out;
+  w->start = out->len;
+  return w;
+}
+
+nbtx_writer* nbtx_writer_new_fixed(void* memory, const size_t capacity) {
+  if (memory == NULL && capacity > 0) return (errno = NBTX_ERR), NULL;
+
+  nbtx_writer* w = new_writer(SINK_FIXED);
+  if (w == NULL) return NULL;
+
+  w->fixed = memory;
+  w->capacity = capacity;
+  return w;
+}
+
+nbtx_writer* nbtx_writer_new_compressed(struct buffer* out, const nbtx_compression_strategy strategy) {
+  if (out == NULL) return (errno = NBTX_ERR), NULL;
+
+  nbtx_writer* w = new_writer(SINK_COMPRESSED);
+  if (w == NULL) return NULL;
+
+  w->out = out;
+  w->start = out->len;
+  w->stream.zalloc = nbtx_zalloc_;
+  w->stream.zfree = nbtx_zfree_;
+  w->stream.opaque = Z_NULL;
+
+  /* See nbtx_compress for the window bits. */
+  const int windowbits = strategy == NBTX_STRATEGY_GZIP ? 15 + 16 : 15;
+
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_COMPRESS);
+  const int ret = deflateInit2(&w->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowbits, 8, Z_DEFAULT_STRATEGY);
+  NBTX_STATS_LEAVE();
+
+  if (ret != Z_OK) {
+    errno = ret == Z_MEM_ERROR ? NBTX_EMEM : NBTX_EZ;
+    nbtx_free_(w);
+    return NULL;
+  }
+
+  return w;
+}
+
+void nbtx_writer_free(nbtx_writer* w) {
+  if (w == NULL) return;
+
+  if (w->sink == SINK_COMPRESSED)
+    (void)deflateEnd(&w->stream);
+
+  buffer_free(&w->staging);
+  if (w->frames != w->local) nbtx_free_(w->frames);
+  nbtx_free_(w);
+}
+
+static nbtx_status fail(nbtx_writer* w, const nbtx_status err) {
+  if (w->err == NBTX_OK) w->err = err;
+  return w->err;
+}
+
+/* Deflates what's staged into the output. */
+static nbtx_status deflate_staged(nbtx_writer* w, const int flush) {
+  NBTX_STATS_ENTER(NBTX_SUBSYSTEM_COMPRESS);
+  nbtx_status err = NBTX_OK;
+
+  w->stream.next_in = w->staging.data;
+  w->stream.avail_in = (uInt)w->staging.len;
+
+  int ret;
+  do {
+    if (buffer_reserve(w->out, w->out->len + STAGING_SIZE)) {
+      err = NBTX_EMEM;
+      break;
+    }
+
+    w->stream.next_out = w->out->data + w->out->len;
+    w->stream.avail_out = STAGING_SIZE;
+
+    if ((ret = deflate(&w->stream, flush)) == Z_STREAM_ERROR) {
+      err = NBTX_EZ;
+      break;
+    }
+
+    w->out->len += STAGING_SIZE - w->stream.avail_out;
+  } while (w->stream.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+  w->staging.len = 0;
+
+  NBTX_STATS_LEAVE();
+  return err;
+}
+
+/* Writes `n' bytes to wherever the writer writes. */
+static nbtx_status emit(nbtx_writer* w, const void* data, const size_t n) {
+  switch (w->sink) {
+    case SINK_BUFFER:
+      if (buffer_append(w->out, data, n)) return fail(w, NBTX_EMEM);
+      return NBTX_OK;
+
+    case SINK_FIXED:
+      if (n > w->capacity - w->used) return fail(w, NBTX_EMEM);
+      if (n) memcpy(w->fixed + w->used, data, n);
+      w->used += n;
+      return NBTX_OK;
+
+    case SINK_COMPRESSED:
+      if (buffer_append(&w->staging, data, n)) return fail(w, NBTX_EMEM);
+      if (w->staging.len >= STAGING_SIZE) {
+        const nbtx_status err = deflate_staged(w, Z_NO_FLUSH);
+        if (err != NBTX_OK) return fail(w, err);
+      }
+      return NBTX_OK;
+  }
+
+  return fail(w, NBTX_ERR);
+}
+
+/*
+ * Checks that a tag of type `type' may go where the writer is, and writes
+ * what comes before its payload: its type and name, unless it's in a list.
+ */
+static nbtx_status begin_tag(nbtx_writer* w, const nbtx_type type, const char* name) {
+  if (w->err != NBTX_OK) return w->err;
+
+  if (w->depth > 0) {
+    struct frame* top = &w->frames[w->depth - 1];
+
+    if (top->type == NBTX_TAG_LIST) {
+      if (top->left == 0 || type != top->elem_type) return fail(w, NBTX_ERR);
+
+      top->left--;
+      return NBTX_OK;
+    }
+
+    if (name == NULL) return fail(w, NBTX_ERR);
+  } else {
+    /* One root per tree, which may have no name. */
+    if (w->done) return fail(w, NBTX_ERR);
+
+    w->done = true;
+    if (name == NULL) name = "";
+  }
+
+  const size_t length = strlen(name);
+  if (length > UINT16_MAX) return fail(w, NBTX_ERR);
+
+  unsigned char header[3];
+  const uint16_t name_length = (uint16_t)length;
+
+  header[0] = (unsigned char)type;
+  memcpy(header + 1, &name_length, sizeof name_length);
+
+  nbtx_status err;
+  if ((err = emit(w, header, sizeof header)) != NBTX_OK) return err;
+  return emit(w, name, length);
+}
+
+static nbtx_status push(nbtx_writer* w, const struct frame f) {
+  if (w->depth == w->frame_capacity) {
+    struct frame* grown = nbtx_grow_stack_(w->frames, &w->frame_capacity, sizeof(*w->frames), w->frames != w->local);
+    if (grown == NULL) return fail(w, NBTX_EMEM);
+
+    w->frames = grown;
+  }
+
+  w->frames[w->depth++] = f;
+  return NBTX_OK;
+}
+
+nbtx_status nbtx_writer_begin_compound(nbtx_writer* w, const char* name) {
+  nbtx_status err;
+  if ((err = begin_tag(w, NBTX_TAG_COMPOUND, name)) != NBTX_OK) return err;
+
+  return push(w, (struct frame) { NBTX_TAG_COMPOUND, NBTX_TAG_INVALID, 0 });
+}
+
+nbtx_status nbtx_writer_begin_list(nbtx_writer* w, const char* name, const nbtx_type type, const uint32_t count) {
+  if (w->err != NBTX_OK) return w->err;
+
+  /* Empty lists may leave their type out. */
+  if (type > NBTX_TAG_COMPOUND || (type == NBTX_TAG_INVALID && count > 0))
+    return fail(w, NBTX_ERR);
+
+  nbtx_status err;
+  if ((err = begin_tag(w, NBTX_TAG_LIST, name)) != NBTX_OK) return err;
+
+  const uint8_t elem_type = (uint8_t)type;
+  if ((err = emit(w, &elem_type, sizeof elem_type)) != NBTX_OK ||
+      (err = emit(w, &count, sizeof count)) != NBTX_OK)
+    return err;
+
+  return push(w, (struct frame) { NBTX_TAG_LIST, type, count });
+}
+
+nbtx_status nbtx_writer_end(nbtx_writer* w) {
+  if (w->err != NBTX_OK) return w->err;
+  if (w->depth == 0) return fail(w, NBTX_ERR);
+
+  const struct frame* top = &w->frames[w->depth - 1];
+
+  if (top->type == NBTX_TAG_LIST && top->left > 0)
+    return fail(w, NBTX_ERR);
+
+  if (top->type == NBTX_TAG_COMPOUND) {
+    const uint8_t end = NBTX_TAG_INVALID;
+
+    nbtx_status err;
+    if ((err = emit(w, &end, sizeof end)) != NBTX_OK) return err;
+  }
+
+  w->depth--;
+  return NBTX_OK;
+}
+
+#define NBTX_SPAWN_WRITE_FUNCTION_DEFINITION(c_type, datatype, type_enum) \
+nbtx_status nbtx_writer_write_##datatype(nbtx_writer* w, const char* name, const c_type value) { \
+  nbtx_status err; \
+  if ((err = begin_tag(w, type_enum, name)) != NBTX_OK) return err; \
+ \
+  return emit(w, &value, sizeof value); \
+}
+
+NBTX_SPAWN_WRITE_FUNCTION_DEFINITION(int8_t, byte, NBTX_TAG_BYTE)
+NBTX_SPAWN_WRITE_FUNCTION_DEFINITION(uint8_t, ubyte, NBTX_TAG_UNSIGNED_BYTE)
+NBTX_SPAWN_WRITE_FUNCTION_DEFINITION(int16_t, short, NBTX_TAG_SHORT)
+NBTX_SPAWN_WRITE_FUNCTION_DEFINITION(uint16_t, ushort, NBTX_TAG_UNSIGNED_SHORT)
+NBTX_SPAWN_WRITE_FUNCTION_DEFINITION(int32_t, int, NBTX_TAG_INT)
+NBTX_SPAWN_WRITE_FUNCTION_DEFINITION(uint32_t, uint, NBTX_TAG_UNSIGNED_INT)
+NBTX_SPAWN_WRITE_FUNCTION_DEFINITION(int64_t, long, NBTX_TAG_LONG)
+NBTX_SPAWN_WRITE_FUNCTION_DEFINITION(uint64_t, ulong, NBTX_TAG_UNSIGNED_LONG)
+NBTX_SPAWN_WRITE_FUNCTION_DEFINITION(float, float, NBTX_TAG_FLOAT)
+NBTX_SPAWN_WRITE_FUNCTION_DEFINITION(double, double, NBTX_TAG_DOUBLE)
+
+#undef NBTX_SPAWN_WRITE_FUNCTION_DEFINITION
+
+nbtx_status nbtx_writer_write_byte_array(nbtx_writer* w, const char* name,
+                                         const unsigned char* data, const uint32_t length) {
+  if (length > 0 && data == NULL) return fail(w, NBTX_ERR);
+
+  nbtx_status err;
+  if ((err = begin_tag(w, NBTX_TAG_BYTE_ARRAY, name)) != NBTX_OK ||
+      (err = emit(w, &length, sizeof length)) != NBTX_OK)
+    return err;
+
+  return emit(w, data, length);
+}
+
+nbtx_status nbtx_writer_write_string(nbtx_writer* w, const char* name, const char* value) {
+  if (value == NULL) return fail(w, NBTX_ERR);
+
+  const size_t length = strlen(value);
+  if (length > UINT16_MAX) return fail(w, NBTX_ERR);
+
+  const uint16_t dumped_length = (uint16_t)length;
+
+  nbtx_status err;
+  if ((err = begin_tag(w, NBTX_TAG_STRING, name)) != NBTX_OK ||
+      (err = emit(w, &dumped_length, sizeof dumped_length)) != NBTX_OK)
+    return err;
+
+  return emit(w, value, length);
+}
+
+nbtx_status nbtx_writer_write_list(nbtx_writer* w, const char* name, const nbtx_type type,
+                                   const void* values, const uint32_t count) {
+  const size_t size = nbtx_scalar_size_(type);
+  if (size == 0 || (count > 0 && values == NULL)) return fail(w, NBTX_ERR);
+
+  const uint8_t elem_type = (uint8_t)type;
+
+  nbtx_status err;
+  if ((err = begin_tag(w, NBTX_TAG_LIST, name)) != NBTX_OK ||
+      (err = emit(w, &elem_type, sizeof elem_type)) != NBTX_OK ||
+      (err = emit(w, &count, sizeof count)) != NBTX_OK)
+    return err;
+
+  return emit(w, values, (size_t)count * size);
+}
+
+/* Gets the writer ready for another tree, after the last one. */
+static void restart(nbtx_writer* w) {
+  w->done = false;
+  w->depth = 0;
+  w->err = NBTX_OK;
+  w->staging.len = 0;
+
+  if (w->sink == SINK_FIXED)
+    w->start = w->used;
+  else
+    w->start = w->out->len;
+
+  if (w->sink == SINK_COMPRESSED)
+    (void)deflateReset(&w->stream);
+}
+
+nbtx_status nbtx_writer_finish(nbtx_writer* w, size_t* length) {
+  nbtx_status err = w->err;
+
+  /* Unfinished trees are errors too. */
+  if (err == NBTX_OK && (!w->done || w->depth > 0))
+    err = NBTX_ERR;
+
+  if (err == NBTX_OK && w->sink == SINK_COMPRESSED) {
+    err = deflate_staged(w, Z_FINISH);
+    if (err == NBTX_OK) NBTX_STATS_ADD(bytes_deflated, w->out->len - w->start);
+  }
+
+  const size_t end = w->sink == SINK_FIXED ? w->used : w->out->len;
+
+  if (err == NBTX_OK) {
+    if (length) *length = end - w->start;
+  } else {
+    /* Take back what was written of the tree, so the output ends with whole ones. */
+    if (w->sink == SINK_FIXED)
+      w->used = w->start;
+    else if (w->out->data)
+      w->out->len = w->start;
+  }
+
+  restart(w);
+  return err;
+}
@@ -0,0 +1,1154 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+
+/*
+ * nbtxgen writes C structs for fixed message types, along with encode and
+ * decode functions specialized for them: member names are compared against
+ * constants, there's no switch on the type of a member, and runs of numbers
+ * are read and written in one go when the members come in the usual order.
+ * The generated code reads what nbtx_dump_binary writes and writes what
+ * nbtx_parse reads, byte for byte.
+ *
+ * Schemas look like this:
+ *
+ *   # Comments start with a hash.
+ *   struct position {
+ *     double x
+ *     double y
+ *     double z
+ *   }
+ *
+ *   struct player {
+ *     int health
+ *     string name
+ *     byte_array skin "Skin Data"   # The tag name, if it isn't the C name.
+ *     list<float> motion
+ *     position pos                  # A struct defined above.
+ *   }
+ *
+ * Numbers are byte, ubyte, short, ushort, int, uint, long, ulong, float and
+ * double, with the C types of nbtx_node's payload. Strings, byte arrays and
+ * lists of numbers become nbtx_spans pointing into the decoded memory; for
+ * lists, `length' is the number of elements, which may be unaligned. Other
+ * lists are not supported.
+ *
+ * With --infer, the schema is made up from the samples instead, and unsupported
+ * lists are left out of it.
+ */
+
+#include "nbtx.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void die(const char* format, ...) {
+  va_list args;
+
+  va_start(args, format);
+  fprintf(stderr, "nbtxgen: ");
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+
+  exit(1);
+}
+
+static void* checked_malloc(const size_t n) {
+  void* ret = malloc(n ? n : 1);
+  if (ret == NULL) die("out of memory");
+  return ret;
+}
+
+static char* checked_strdup(const char* s) {
+  char* ret = checked_malloc(strlen(s) + 1);
+  return strcpy(ret, s);
+}
+
+static const struct scalar {
+  const char* name;
+  nbtx_type type;
+  const char* c_type;
+  size_t size;
+} scalars[] = {
+  { "byte",   NBTX_TAG_BYTE,           "int8_t",   1 },
+  { "ubyte",  NBTX_TAG_UNSIGNED_BYTE,  "uint8_t",  1 },
+  { "short",  NBTX_TAG_SHORT,          "int16_t",  2 },
+  { "ushort", NBTX_TAG_UNSIGNED_SHORT, "uint16_t", 2 },
+  { "int",    NBTX_TAG_INT,            "int32_t",  4 },
+  { "uint",   NBTX_TAG_UNSIGNED_INT,   "uint32_t", 4 },
+  { "long",   NBTX_TAG_LONG,           "int64_t",  8 },
+  { "ulong",  NBTX_TAG_UNSIGNED_LONG,  "uint64_t", 8 },
+  { "float",  NBTX_TAG_FLOAT,          "float",    4 },
+  { "double", NBTX_TAG_DOUBLE,         "double",   8 },
+};
+
+#define SCALAR_COUNT (sizeof scalars / sizeof scalars[0])
+
+static const struct scalar* scalar_by_name(const char* name) {
+  for (size_t i = 0; i < SCALAR_COUNT; ++i)
+    if (strcmp(scalars[i].name, name) == 0)
+      return &scalars[i];
+
+  return NULL;
+}
+
+static const struct scalar* scalar_by_type(const nbtx_type type) {
+  for (size_t i = 0; i < SCALAR_COUNT; ++i)
+    if (scalars[i].type == type)
+      return &scalars[i];
+
+  return NULL;
+}
+
+/***** Schemas *****/
+
+struct member {
+  char* c_name;
+  char* tag_name;
+  nbtx_type type;
+  const struct scalar* scalar; /* For numbers, and the elements of lists. */
+  struct record* record;       /* For compounds. */
+};
+
+/* A struct of the schema. */
+struct record {
+  char* name;
+  struct member* members;
+  size_t count;
+  size_t cap;
+  struct record* next;
+};
+
+/* Records are kept in an order where every record comes after those it uses. */
+struct schema {
+  struct record* first;
+};
+
+static struct record* find_record(const struct schema* s, const char* name) {
+  for (struct record* r = s->first; r; r = r->next)
+    if (strcmp(r->name, name) == 0)
+      return r;
+
+  return NULL;
+}
+
+static struct member* find_member(const struct record* r, const char* tag_name) {
+  for (size_t i = 0; i < r->count; ++i)
+    if (strcmp(r->members[i].tag_name, tag_name) == 0)
+      return &r->members[i];
+
+  return NULL;
+}
+
+static bool has_c_name(const struct record* r, const char* c_name) {
+  for (size_t i = 0; i < r->count; ++i)
+    if (strcmp(r->members[i].c_name, c_name) == 0)
+      return true;
+
+  return false;
+}
+
+static struct record* new_record(const char* name) {
+  struct record* ret = checked_malloc(sizeof(*ret));
+
+  ret->name = checked_strdup(name);
+  ret->members = NULL;
+  ret->count = ret->cap = 0;
+  ret->next = NULL;
+
+  return ret;
+}
+
+static struct member* add_member(struct record* r) {
+  if (r->count == r->cap) {
+    r->cap = r->cap ? r->cap * 2 : 8;
+    r->members = realloc(r->members, r->cap * sizeof(*r->members));
+    if (r->members == NULL) die("out of memory");
+  }
+
+  struct member* ret = &r->members[r->count++];
+  memset(ret, 0, sizeof(*ret));
+  return ret;
+}
+
+static void free_schema(struct schema* s) {
+  struct record* r = s->first;
+
+  while (r) {
+    struct record* next = r->next;
+
+    for (size_t i = 0; i < r->count; ++i) {
+      free(r->members[i].c_name);
+      free(r->members[i].tag_name);
+    }
+
+    free(r->members);
+    free(r->name);
+    free(r);
+
+    r = next;
+  }
+}
+
+/* Names the generated code uses for itself, on top of C's keywords. */
+static const char* const reserved[] = {
+  "auto", "break", "case", "char", "const", "continue", "default", "do",
+  "double", "else", "enum", "extern", "float", "for", "goto", "if", "inline",
+  "int", "long", "register", "restrict", "return", "short", "signed",
+  "sizeof", "static", "struct", "switch", "typedef", "union", "unsigned",
+  "void", "volatile", "while", "bool", "buffer", "nbtx_span", "unused_",
+};
+
+static bool is_reserved(const char* name) {
+  for (size_t i = 0; i < sizeof reserved / sizeof reserved[0]; ++i)
+    if (strcmp(reserved[i], name) == 0)
+      return true;
+
+  return strncmp(name, "nbtx_", 5) == 0;
+}
+
+static bool is_identifier(const char* name) {
+  if (!isalpha((unsigned char)*name) && *name != '_')
+    return false;
+
+  for (const char* c = name; *c; ++c)
+    if (!isalnum((unsigned char)*c) && *c != '_')
+      return false;
+
+  return true;
+}
+
+/* Turns a tag name into a C identifier, which must not be `taken' yet. */
+static char* make_identifier(const char* name, const struct record* taken) {
+  const size_t len = strlen(name);
+  char* ret = checked_malloc(len + 16);
+  char* out = ret;
+
+  if (!isalpha((unsigned char)*name) && *name != '_')
+    *out++ = '_';
+
+  for (const char* c = name; *c; ++c)
+    *out++ = isalnum((unsigned char)*c) ? *c : '_';
+  *out = '\0';
+
+  if (is_reserved(ret))
+    strcat(ret, "_");
+
+  if (taken && has_c_name(taken, ret)) {
+    const size_t base = strlen(ret);
+
+    for (int n = 2; has_c_name(taken, ret); ++n)
+      sprintf(ret + base, "_%d", n);
+  }
+
+  return ret;
+}
+
+/***** Schema Files *****/
+
+enum token_kind { TOKEN_END, TOKEN_IDENT, TOKEN_STRING, TOKEN_PUNCT };
+
+struct lexer {
+  const char* filename;
+  const char* pos;
+  int line;
+
+  enum token_kind kind;
+  char text[1024];
+};
+
+static void lex_error(const struct lexer* l, const char* message) {
+  die("%s:%d: %s", l->filename, l->line, message);
+}
+
+static void next_token(struct lexer* l) {
+  for (;;) {
+    while (isspace((unsigned char)*l->pos))
+      if (*l->pos++ == '\n') l->line++;
+
+    if (*l->pos != '#') break;
+
+    while (*l->pos && *l->pos != '\n')
+      l->pos++;
+  }
+
+  size_t n = 0;
+
+  if (*l->pos == '\0') {
+    l->kind = TOKEN_END;
+  } else if (isalnum((unsigned char)*l->pos) || *l->pos == '_') {
+    l->kind = TOKEN_IDENT;
+
+    while (isalnum((unsigned char)*l->pos) || *l->pos == '_') {
+      if (n == sizeof l->text - 1) lex_error(l, "name too long");
+      l->text[n++] = *l->pos++;
+    }
+  } else if (*l->pos == '"') {
+    l->kind = TOKEN_STRING;
+    l->pos++;
+
+    while (*l->pos != '"') {
+      if (*l->pos == '\0' || *l->pos == '\n') lex_error(l, "unterminated string");
+      if (*l->pos == '\\' && l->pos[1] != '\0') l->pos++;
+      if (n == sizeof l->text - 1) lex_error(l, "string too long");
+      l->text[n++] = *l->pos++;
+    }
+
+    l->pos++;
+  } else {
+    l->kind = TOKEN_PUNCT;
+    l->text[n++] = *l->pos++;
+  }
+
+  l->text[n] = '\0';
+}
+
+static bool is_punct(const struct lexer* l, const char c) {
+  return l->kind == TOKEN_PUNCT && l->text[0] == c;
+}
+
+static void expect_punct(struct lexer* l, const char c) {
+  if (!is_punct(l, c)) {
+    char message[32];
+    snprintf(message, sizeof message, "expected '%c'", c);
+    lex_error(l, message);
+  }
+
+  next_token(l);
+}
+
+static char* expect_ident(struct lexer* l, const char* what) {
+  if (l->kind != TOKEN_IDENT || !is_identifier(l->text)) {
+    char message[64];
+    snprintf(message, sizeof message, "expected %s", what);
+    lex_error(l, message);
+  }
+
+  char* ret = checked_strdup(l->text);
+  next_token(l);
+  return ret;
+}
+
+static void parse_member(struct lexer* l, const struct schema* s, struct record* r) {
+  struct member m = { NULL };
+  char* type = expect_ident(l, "a type");
+
+  if (strcmp(type, "list") == 0) {
+    expect_punct(l, '<');
+    char* elem = expect_ident(l, "the type of the elements");
+
+    m.type = NBTX_TAG_LIST;
+    if ((m.scalar = scalar_by_name(elem)) == NULL)
+      lex_error(l, "only lists of numbers are supported");
+
+    free(elem);
+    expect_punct(l, '>');
+  } else if ((m.scalar = scalar_by_name(type)) != NULL) {
+    m.type = m.scalar->type;
+  } else if (strcmp(type, "string") == 0) {
+    m.type = NBTX_TAG_STRING;
+  } else if (strcmp(type, "byte_array") == 0) {
+    m.type = NBTX_TAG_BYTE_ARRAY;
+  } else if ((m.record = find_record(s, type)) != NULL) {
+    m.type = NBTX_TAG_COMPOUND;
+  } else {
+    lex_error(l, "unknown type; structs must be defined before they're used");
+  }
+
+  free(type);
+
+  m.c_name = expect_ident(l, "a member name");
+
+  if (is_reserved(m.c_name)) lex_error(l, "reserved member name");
+  if (has_c_name(r, m.c_name)) lex_error(l, "duplicate member name");
+
+  if (l->kind == TOKEN_STRING) {
+    m.tag_name = checked_strdup(l->text);
+    next_token(l);
+  } else {
+    m.tag_name = checked_strdup(m.c_name);
+  }
+
+  if (strlen(m.tag_name) > UINT16_MAX) lex_error(l, "tag name too long");
+  if (find_member(r, m.tag_name)) lex_error(l, "duplicate tag name");
+
+  *add_member(r) = m;
+
+  if (is_punct(l, ';')) next_token(l);
+}
+
+static void parse_schema(const char* filename, struct schema* s) {
+  FILE* fp = fopen(filename, "rb");
+  if (fp == NULL) die("could not open %s", filename);
+
+  struct buffer text = NBTX_BUFFER_INIT;
+  char chunk[4096];
+  size_t n;
+
+  while ((n = fread(chunk, 1, sizeof chunk, fp)) > 0)
+    if (buffer_append(&text, chunk, n)) die("out of memory");
+
+  if (ferror(fp)) die("could not read %s", filename);
+  fclose(fp);
+
+  if (buffer_append(&text, "", 1)) die("out of memory");
+
+  struct lexer l = { filename, (const char*)text.data, 1, TOKEN_END, "" };
+  struct record** tail = &s->first;
+
+  next_token(&l);
+
+  while (l.kind != TOKEN_END) {
+    if (l.kind != TOKEN_IDENT || strcmp(l.text, "struct") != 0)
+      lex_error(&l, "expected 'struct'");
+    next_token(&l);
+
+    char* name = expect_ident(&l, "a struct name");
+    if (is_reserved(name)) lex_error(&l, "reserved struct name");
+    if (find_record(s, name)) lex_error(&l, "duplicate struct name");
+
+    struct record* r = new_record(name);
+    free(name);
+
+    *tail = r;
+    tail = &r->next;
+
+    expect_punct(&l, '{');
+
+    while (!is_punct(&l, '}')) {
+      if (l.kind == TOKEN_END) lex_error(&l, "expected '}'");
+      parse_member(&l, s, r);
+    }
+
+    next_token(&l);
+  }
+
+  if (s->first == NULL) die("%s has no structs", filename);
+
+  buffer_free(&text);
+}
+
+/***** Inference *****/
+
+static struct record* infer_record(struct schema* s, struct record* r, const nbtx_node* compound) {
+  const struct list_head* pos;
+  list_for_each(pos, &compound->payload.tag_compound->entry) {
+    const nbtx_node* child = list_entry(pos, const struct nbtx_list, entry)->data;
+
+    if (child->name == NULL) continue;
+
+    nbtx_type elem_type = NBTX_TAG_INVALID;
+    if (child->type == NBTX_TAG_LIST) {
+      elem_type = child->payload.tag_list->data->type;
+
+      if (scalar_by_type(elem_type) == NULL) {
+        fprintf(stderr, "nbtxgen: leaving out \"%s\" in %s, lists of %s are not supported\n",
+                child->name, r->name, nbtx_type_to_string(elem_type));
+        continue;
+      }
+    }
+
+    struct member* m = find_member(r, child->name);
+
+    if (m) {
+      if (m->type != child->type || (elem_type != NBTX_TAG_INVALID && m->scalar->type != elem_type))
+        die("\"%s\" in %s has different types in different samples", child->name, r->name);
+    } else {
+      char* c_name = make_identifier(child->name, r);
+
+      m = add_member(r);
+      m->c_name = c_name;
+      m->tag_name = checked_strdup(child->name);
+      m->type = child->type;
+      m->scalar = scalar_by_type(elem_type != NBTX_TAG_INVALID ? elem_type : child->type);
+
+      if (child->type == NBTX_TAG_COMPOUND) {
+        char* name = checked_malloc(strlen(r->name) + strlen(m->c_name) + 2);
+        sprintf(name, "%s_%s", r->name, m->c_name);
+
+        char* unique = make_identifier(name, NULL);
+        while (find_record(s, unique)) {
+          char* longer = checked_malloc(strlen(unique) + 2);
+          sprintf(longer, "%s_", unique);
+          free(unique);
+          unique = longer;
+        }
+
+        /* Children go first, see struct schema. */
+        m->record = new_record(unique);
+        m->record->next = s->first;
+        s->first = m->record;
+
+        free(unique);
+        free(name);
+      }
+    }
+
+    if (m->record)
+      infer_record(s, m->record, child);
+  }
+
+  return r;
+}
+
+static void infer_schema(const char* filename, struct schema* s) {
+  nbtx_node* tree = nbtx_parse_path(filename);
+  if (tree == NULL) die("could not parse %s: %s", filename, nbtx_error_to_string(errno));
+
+  if (tree->type != NBTX_TAG_COMPOUND) die("the root of %s isn't a compound", filename);
+
+  /* The first sample names the root. The rest of the records come before it. */
+  struct record* root = s->first;
+  while (root && root->next) root = root->next;
+
+  if (root == NULL) {
+    char* name = make_identifier(tree->name && *tree->name ? tree->name : "root", NULL);
+    root = s->first = new_record(name);
+    free(name);
+  }
+
+  infer_record(s, root, tree);
+  nbtx_free(tree);
+}
+
+/***** Printing *****/
+
+static void print_schema(const struct schema* s, FILE* out) {
+  for (const struct record* r = s->first; r; r = r->next) {
+    fprintf(out, "struct %s {\n", r->name);
+
+    for (size_t i = 0; i < r->count; ++i) {
+      const struct member* m = &r->members[i];
+
+      if (m->type == NBTX_TAG_LIST)
+        fprintf(out, "  list<%s> %s", m->scalar->name, m->c_name);
+      else if (m->type == NBTX_TAG_COMPOUND)
+        fprintf(out, "  %s %s", m->record->name, m->c_name);
+      else if (m->scalar)
+        fprintf(out, "  %s %s", m->scalar->name, m->c_name);
+      else
+        fprintf(out, "  %s %s", m->type == NBTX_TAG_STRING ? "string" : "byte_array", m->c_name);
+
+      if (strcmp(m->c_name, m->tag_name) != 0) {
+        fputs(" \"", out);
+        for (const char* c = m->tag_name; *c; ++c) {
+          if (*c == '"' || *c == '\\') fputc('\\', out);
+          fputc(*c, out);
+        }
+        fputc('"', out);
+      }
+
+      fputc('\n', out);
+    }
+
+    fprintf(out, "}\n%s", r->next ? "\n" : "");
+  }
+}
+
+/***** Code Generation *****/
+
+/* Size of the type, name and payload of a number member. */
+static size_t scalar_member_size(const struct member* m) {
+  return 3 + strlen(m->tag_name) + m->scalar->size;
+}
+
+static bool is_scalar_member(const struct member* m) {
+  return m->type != NBTX_TAG_LIST && m->scalar != NULL;
+}
+
+static void print_literal(const unsigned char* bytes, const size_t n, FILE* out) {
+  fputc('"', out);
+
+  for (size_t i = 0; i < n; ++i) {
+    if (bytes[i] == '"' || bytes[i] == '\\' || bytes[i] == '?' || !isprint(bytes[i]))
+      fprintf(out, "\\%03o", bytes[i]);
+    else
+      fputc(bytes[i], out);
+  }
+
+  fputc('"', out);
+}
+
+/* Writes the type and name of a member as they appear in binary, as a C string literal. */
+static void print_header_literal(const struct member* m, FILE* out) {
+  const size_t len = strlen(m->tag_name);
+  unsigned char* header = checked_malloc(3 + len);
+
+  header[0] = (unsigned char)m->type;
+  header[1] = (unsigned char)(len & 0xff);
+  header[2] = (unsigned char)(len >> 8);
+  memcpy(header + 3, m->tag_name, len);
+
+  print_literal(header, 3 + len, out);
+  free(header);
+}
+
+static const char* const runtime =
+  "#define READ_GENERIC(dest, n) do { \\\n"
+  "    if(*length < (n)) return NBTX_ERR; \\\n"
+  "    memcpy((dest), *memory, (n)); \\\n"
+  "    *memory += (n); \\\n"
+  "    *length -= (n); \\\n"
+  "} while(0)\n"
+  "\n"
+  "#define SKIP(n) do { \\\n"
+  "    if(*length < (n)) return NBTX_ERR; \\\n"
+  "    *memory += (n); \\\n"
+  "    *length -= (n); \\\n"
+  "} while(0)\n"
+  "\n"
+  "#define CHECKED_APPEND(b, ptr, len) do { \\\n"
+  "    if(buffer_append((b), (ptr), (len))) \\\n"
+  "        return NBTX_EMEM; \\\n"
+  "} while(0)\n"
+  "\n"
+  "/* Moves past the next `n' bytes if they are `header'. */\n"
+  "static bool expect(const char* header, const size_t n, const char** memory, size_t* length) {\n"
+  "  if (*length < n || memcmp(*memory, header, n) != 0)\n"
+  "    return false;\n"
+  "\n"
+  "  *memory += n;\n"
+  "  *length -= n;\n"
+  "  return true;\n"
+  "}\n"
+  "\n"
+  "static size_t scalar_size(const uint8_t type) {\n"
+  "  static const uint8_t sizes[] = { 0, 1, 1, 2, 2, 4, 4, 8, 8, 4, 8 };\n"
+  "  return type < sizeof sizes ? sizes[type] : 0;\n"
+  "}\n"
+  "\n"
+  "/* Skips anything but a list or compound. */\n"
+  "static nbtx_status skip_leaf(const uint8_t type, const char** memory, size_t* length) {\n"
+  "  uint32_t count;\n"
+  "  uint16_t string_length;\n"
+  "\n"
+  "  if (scalar_size(type)) {\n"
+  "    SKIP(scalar_size(type));\n"
+  "  } else if (type == NBTX_TAG_BYTE_ARRAY) {\n"
+  "    READ_GENERIC(&count, sizeof count);\n"
+  "    SKIP(count);\n"
+  "  } else if (type == NBTX_TAG_STRING) {\n"
+  "    READ_GENERIC(&string_length, sizeof string_length);\n"
+  "    SKIP(string_length);\n"
+  "  } else {\n"
+  "    return NBTX_ERR;\n"
+  "  }\n"
+  "\n"
+  "  return NBTX_OK;\n"
+  "}\n"
+  "\n"
+  "/* A list or compound being skipped. Compounds have no `elem_type'. */\n"
+  "struct skip_frame {\n"
+  "  uint8_t elem_type;\n"
+  "  uint32_t left;\n"
+  "};\n"
+  "\n"
+  "#define SKIP_LOCAL_FRAMES 32\n"
+  "\n"
+  "/* Moves the frames to a heap block twice as big. */\n"
+  "static nbtx_status grow_frames(struct skip_frame** frames, size_t* capacity, const struct skip_frame* local) {\n"
+  "  if (*capacity > SIZE_MAX / 2 / sizeof(**frames)) return NBTX_EMEM;\n"
+  "\n"
+  "  struct skip_frame* grown = nbtx_alloc_memory(*capacity * 2 * sizeof(**frames));\n"
+  "  if (grown == NULL) return NBTX_EMEM;\n"
+  "\n"
+  "  memcpy(grown, *frames, *capacity * sizeof(**frames));\n"
+  "  if (*frames != local) nbtx_free_memory(*frames);\n"
+  "\n"
+  "  *frames = grown;\n"
+  "  *capacity *= 2;\n"
+  "  return NBTX_OK;\n"
+  "}\n"
+  "\n"
+  "/*\n"
+  " * Opens the list or compound whose header `memory' is at, or skips all of it if\n"
+  " * nothing can be nested in it. Sets `*open' if `frame' has to be pushed.\n"
+  " */\n"
+  "static nbtx_status open_container(const uint8_t type, const char** memory, size_t* length,\n"
+  "                                  struct skip_frame* frame, bool* open) {\n"
+  "  uint8_t elem_type;\n"
+  "  uint32_t count;\n"
+  "\n"
+  "  *open = false;\n"
+  "\n"
+  "  if (type == NBTX_TAG_COMPOUND) {\n"
+  "    *frame = (struct skip_frame) { 0, 0 };\n"
+  "    *open = true;\n"
+  "    return NBTX_OK;\n"
+  "  }\n"
+  "\n"
+  "  READ_GENERIC(&elem_type, sizeof elem_type);\n"
+  "  READ_GENERIC(&count, sizeof count);\n"
+  "\n"
+  "  if (scalar_size(elem_type)) {\n"
+  "    if (count > *length / scalar_size(elem_type)) return NBTX_ERR;\n"
+  "    SKIP(count * scalar_size(elem_type));\n"
+  "  } else if (count != 0) {\n"
+  "    /* Every other element takes at least a byte, and TAG_End none at all. */\n"
+  "    if (count > *length || elem_type == 0) return NBTX_ERR;\n"
+  "\n"
+  "    *frame = (struct skip_frame) { elem_type, count };\n"
+  "    *open = true;\n"
+  "  }\n"
+  "\n"
+  "  return NBTX_OK;\n"
+  "}\n"
+  "\n"
+  "/* Reads the type of the next member of a compound and skips its name. The type is 0 at the end. */\n"
+  "static nbtx_status next_member(uint8_t* type, const char** memory, size_t* length) {\n"
+  "  READ_GENERIC(type, sizeof *type);\n"
+  "  return *type == 0 ? NBTX_OK : skip_leaf(NBTX_TAG_STRING, memory, length);\n"
+  "}\n"
+  "\n"
+  "/*\n"
+  " * Skips a member, which is at least one level under the root. Lists and\n"
+  " * compounds may nest up to nbtx_get_max_depth() deep, like in the parser, or\n"
+  " * any depth if it's 0, so they're walked with a stack instead of recursion.\n"
+  " */\n"
+  "static nbtx_status skip_payload(uint8_t type, const char** memory, size_t* length) {\n"
+  "  struct skip_frame local[SKIP_LOCAL_FRAMES];\n"
+  "  struct skip_frame* frames = local;\n"
+  "  size_t capacity = SKIP_LOCAL_FRAMES;\n"
+  "  size_t depth = 0;\n"
+  "\n"
+  "  const size_t limit = nbtx_get_max_depth();\n"
+  "  nbtx_status err = NBTX_OK;\n"
+  "\n"
+  "  for (;;) {\n"
+  "    if (type == NBTX_TAG_LIST || type == NBTX_TAG_COMPOUND) {\n"
+  "      bool open;\n"
+  "\n"
+  "      if (limit != 0 && depth + 2 > limit) {\n"
+  "        err = NBTX_EDEPTH;\n"
+  "        break;\n"
+  "      }\n"
+  "\n"
+  "      if (depth == capacity && (err = grow_frames(&frames, &capacity, local)) != NBTX_OK)\n"
+  "        break;\n"
+  "      if ((err = open_container(type, memory, length, &frames[depth], &open)) != NBTX_OK)\n"
+  "        break;\n"
+  "      if (open) ++depth;\n"
+  "    } else if ((err = skip_leaf(type, memory, length)) != NBTX_OK) {\n"
+  "      break;\n"
+  "    }\n"
+  "\n"
+  "    /* Find the next tag to skip, closing whatever ran out on the way. */\n"
+  "    for (type = 0; depth > 0 && type == 0;) {\n"
+  "      struct skip_frame* top = &frames[depth - 1];\n"
+  "\n"
+  "      if (top->elem_type == 0) {\n"
+  "        if ((err = next_member(&type, memory, length)) != NBTX_OK) break;\n"
+  "        if (type == 0) --depth;\n"
+  "      } else if (top->left == 0) {\n"
+  "        --depth;\n"
+  "      } else {\n"
+  "        --top->left;\n"
+  "        type = top->elem_type;\n"
+  "      }\n"
+  "    }\n"
+  "\n"
+  "    if (err != NBTX_OK || type == 0) break;\n"
+  "  }\n"
+  "\n"
+  "  if (frames != local) nbtx_free_memory(frames);\n"
+  "  return err;\n"
+  "}\n"
+  "\n"
+  "/* Reads a string or byte array without copying it. */\n"
+  "static nbtx_status read_span(const uint8_t type, nbtx_span* span, const char** memory, size_t* length) {\n"
+  "  uint32_t n = 0;\n"
+  "\n"
+  "  if (type == NBTX_TAG_STRING) {\n"
+  "    uint16_t string_length;\n"
+  "    READ_GENERIC(&string_length, sizeof string_length);\n"
+  "    n = string_length;\n"
+  "  } else {\n"
+  "    READ_GENERIC(&n, sizeof n);\n"
+  "  }\n"
+  "\n"
+  "  span->data = *memory;\n"
+  "  span->length = n;\n"
+  "  SKIP(n);\n"
+  "  return NBTX_OK;\n"
+  "}\n"
+  "\n"
+  "/* Reads a list of numbers without copying it. */\n"
+  "static nbtx_status read_list(const uint8_t type, const size_t size, nbtx_span* span, const char** memory, size_t* length) {\n"
+  "  uint8_t elem_type;\n"
+  "  uint32_t count;\n"
+  "\n"
+  "  READ_GENERIC(&elem_type, sizeof elem_type);\n"
+  "  READ_GENERIC(&count, sizeof count);\n"
+  "\n"
+  "  if (count == 0) elem_type = type; /* Empty lists may have any type. */\n"
+  "  if (elem_type != type || count > *length / size) return NBTX_ERR;\n"
+  "\n"
+  "  span->data = *memory;\n"
+  "  span->length = count;\n"
+  "  SKIP(count * size);\n"
+  "  return NBTX_OK;\n"
+  "}\n"
+  "\n"
+  "static nbtx_status write_span(const uint8_t type, const nbtx_span* span, struct buffer* b) {\n"
+  "  if (type == NBTX_TAG_STRING) {\n"
+  "    if (span->length > UINT16_MAX) return NBTX_ERR;\n"
+  "\n"
+  "    const uint16_t string_length = (uint16_t)span->length;\n"
+  "    CHECKED_APPEND(b, &string_length, sizeof string_length);\n"
+  "  } else {\n"
+  "    CHECKED_APPEND(b, &span->length, sizeof span->length);\n"
+  "  }\n"
+  "\n"
+  "  if (span->length) CHECKED_APPEND(b, span->data, span->length);\n"
+  "  return NBTX_OK;\n"
+  "}\n"
+  "\n"
+  "static nbtx_status write_list(const uint8_t type, const size_t size, const nbtx_span* span, struct buffer* b) {\n"
+  "  CHECKED_APPEND(b, &type, sizeof type);\n"
+  "  CHECKED_APPEND(b, &span->length, sizeof span->length);\n"
+  "  if (span->length) CHECKED_APPEND(b, span->data, span->length * size);\n"
+  "  return NBTX_OK;\n"
+  "}\n"
+  "\n"
+  "/* Writes the type and name of a compound at the root of a tree. */\n"
+  "static nbtx_status write_root(const char* name, struct buffer* b) {\n"
+  "  const uint8_t type = NBTX_TAG_COMPOUND;\n"
+  "  const nbtx_span span = { name ? name : \"\", (uint32_t)(name ? strlen(name) : 0) };\n"
+  "\n"
+  "  CHECKED_APPEND(b, &type, sizeof type);\n"
+  "  return write_span(NBTX_TAG_STRING, &span, b);\n"
+  "}\n";
+
+static void print_struct(const struct record* r, FILE* out) {
+  fprintf(out, "struct %s {\n", r->name);
+
+  for (size_t i = 0; i < r->count; ++i) {
+    const struct member* m = &r->members[i];
+
+    if (m->type == NBTX_TAG_COMPOUND)
+      fprintf(out, "  struct %s %s;\n", m->record->name, m->c_name);
+    else if (is_scalar_member(m))
+      fprintf(out, "  %s %s;\n", m->scalar->c_type, m->c_name);
+    else
+      fprintf(out, "  nbtx_span %s;\n", m->c_name);
+  }
+
+  if (r->count == 0)
+    fprintf(out, "  char unused_; /* C doesn't allow empty structs. */\n");
+
+  fprintf(out, "};\n\n");
+}
+
+static void print_header(const struct schema* s, const char* source, const char* guard, FILE* out) {
+  fprintf(out, "/* Generated by nbtxgen from %s. Do not edit. */\n", source);
+  fprintf(out, "#ifndef %s\n#define %s\n\n", guard, guard);
+  fprintf(out, "#include \"nbtx.h\"\n\n#include <stdint.h>\n\n");
+
+  for (const struct record* r = s->first; r; r = r->next)
+    print_struct(r, out);
+
+  for (const struct record* r = s->first; r; r = r->next) {
+    fprintf(out, "/*\n");
+    fprintf(out, " * Decodes an uncompressed tree whose root is a compound into `out', like\n");
+    fprintf(out, " * nbtx_decode_struct does.\n");
+    fprintf(out, " */\n");
+    fprintf(out, "nbtx_status %s_decode(const void* memory, size_t length, struct %s* out);\n\n", r->name, r->name);
+    fprintf(out, "/* Dumps `in' as a compound named `name', like nbtx_encode_struct does. */\n");
+    fprintf(out, "struct buffer %s_encode(const struct %s* in, const char* name);\n\n", r->name, r->name);
+  }
+
+  fprintf(out, "#endif\n");
+}
+
+/* Decodes a run of numbers in one go, if they're all there in order. */
+static void print_decode_run(const struct record* r, const size_t first, const size_t end, FILE* out) {
+  size_t total = 0;
+  for (size_t i = first; i < end; ++i)
+    total += scalar_member_size(&r->members[i]);
+
+  fprintf(out, "  if (*length < %zu", total);
+
+  size_t offset = 0;
+  for (size_t i = first; i < end; ++i) {
+    const struct member* m = &r->members[i];
+
+    fprintf(out, "\n      || memcmp(*memory + %zu, ", offset);
+    print_header_literal(m, out);
+    fprintf(out, ", %zu) != 0", 3 + strlen(m->tag_name));
+
+    offset += scalar_member_size(m);
+  }
+
+  fprintf(out, ")\n    goto by_name;\n");
+
+  offset = 0;
+  for (size_t i = first; i < end; ++i) {
+    const struct member* m = &r->members[i];
+    const size_t header = 3 + strlen(m->tag_name);
+
+    fprintf(out, "  memcpy(&out->%s, *memory + %zu, %zu);\n", m->c_name, offset + header, m->scalar->size);
+    offset += scalar_member_size(m);
+  }
+
+  fprintf(out, "  *memory += %zu;\n  *length -= %zu;\n\n", total, total);
+}
+
+/* Reads the payload of `m' into `out', returning on errors. */
+static void print_decode_payload(const struct member* m, const char* indent, FILE* out) {
+  if (m->type == NBTX_TAG_COMPOUND)
+    fprintf(out, "%sif ((err = decode_%s(memory, length, &out->%s)) != NBTX_OK) return err;\n",
+            indent, m->record->name, m->c_name);
+  else if (m->type == NBTX_TAG_LIST)
+    fprintf(out, "%sif ((err = read_list(%s, %zu, &out->%s, memory, length)) != NBTX_OK) return err;\n",
+            indent, nbtx_type_to_string(m->scalar->type), m->scalar->size, m->c_name);
+  else if (m->scalar)
+    fprintf(out, "%sREAD_GENERIC(&out->%s, %zu);\n", indent, m->c_name, m->scalar->size);
+  else
+    fprintf(out, "%sif ((err = read_span(%s, &out->%s, memory, length)) != NBTX_OK) return err;\n",
+            indent, nbtx_type_to_string(m->type), m->c_name);
+}
+
+static void print_decoder(const struct record* r, FILE* out) {
+  fprintf(out, "static nbtx_status decode_%s(const char** memory, size_t* length, struct %s* out) {\n", r->name, r->name);
+  fprintf(out, "  nbtx_status err;\n  (void)err;\n\n");
+  fprintf(out, "  /* Members in the order encode_%s writes them. */\n", r->name);
+
+  for (size_t i = 0; i < r->count;) {
+    const struct member* m = &r->members[i];
+
+    if (is_scalar_member(m)) {
+      size_t end = i + 1;
+      while (end < r->count && is_scalar_member(&r->members[end])) ++end;
+
+      print_decode_run(r, i, end, out);
+      i = end;
+      continue;
+    }
+
+    fprintf(out, "  if (!expect(");
+    print_header_literal(m, out);
+    fprintf(out, ", %zu, memory, length)) goto by_name;\n", 3 + strlen(m->tag_name));
+    print_decode_payload(m, "  ", out);
+    fprintf(out, "\n");
+    ++i;
+  }
+
+  fprintf(out, "  if (expect(\"\", 1, memory, length)) return NBTX_OK; /* TAG_End */\n\n");
+
+  /* Without members, nothing jumps here. */
+  if (r->count) fprintf(out, "by_name:\n");
+  fprintf(out, "  for (;;) {\n");
+  fprintf(out, "    uint8_t type;\n");
+  fprintf(out, "    READ_GENERIC(&type, sizeof type);\n\n");
+  fprintf(out, "    if (type == 0) return NBTX_OK; /* TAG_End */\n\n");
+  fprintf(out, "    uint16_t name_length;\n");
+  fprintf(out, "    READ_GENERIC(&name_length, sizeof name_length);\n");
+  fprintf(out, "    if (*length < name_length) return NBTX_ERR;\n\n");
+  fprintf(out, "    const char* name = *memory;\n");
+  fprintf(out, "    *memory += name_length;\n");
+  fprintf(out, "    *length -= name_length;\n\n");
+
+  for (size_t i = 0; i < r->count; ++i) {
+    const struct member* m = &r->members[i];
+    const size_t len = strlen(m->tag_name);
+
+    fprintf(out, "    %sif (name_length == %zu && memcmp(name, ", i ? "} else " : "", len);
+    print_literal((const unsigned char*)m->tag_name, len, out);
+    fprintf(out, ", %zu) == 0) {\n", len);
+    fprintf(out, "      if (type != %s) return NBTX_ERR;\n", nbtx_type_to_string(m->type));
+    print_decode_payload(m, "      ", out);
+  }
+
+  if (r->count)
+    fprintf(out, "    } else if ((err = skip_payload(type, memory, length)) != NBTX_OK) {\n      return err;\n    }\n");
+  else
+    fprintf(out, "    (void)name;\n    (void)out;\n    if ((err = skip_payload(type, memory, length)) != NBTX_OK) return err;\n");
+
+  fprintf(out, "  }\n}\n\n");
+}
+
+/* Writes a run of numbers with a single reservation. */
+static void print_encode_run(const struct record* r, const size_t first, const size_t end, FILE* out) {
+  size_t total = 0;
+  for (size_t i = first; i < end; ++i)
+    total += scalar_member_size(&r->members[i]);
+
+  fprintf(out, "  if (buffer_reserve(b, b->len + %zu)) return NBTX_EMEM;\n", total);
+
+  size_t offset = 0;
+  for (size_t i = first; i < end; ++i) {
+    const struct member* m = &r->members[i];
+    const size_t header = 3 + strlen(m->tag_name);
+
+    fprintf(out, "  memcpy(b->data + b->len + %zu, ", offset);
+    print_header_literal(m, out);
+    fprintf(out, ", %zu);\n", header);
+    fprintf(out, "  memcpy(b->data + b->len + %zu, &in->%s, %zu);\n", offset + header, m->c_name, m->scalar->size);
+
+    offset += scalar_member_size(m);
+  }
+
+  fprintf(out, "  b->len += %zu;\n\n", total);
+}
+
+static void print_encoder(const struct record* r, FILE* out) {
+  fprintf(out, "static nbtx_status encode_%s(const struct %s* in, struct buffer* b) {\n", r->name, r->name);
+  fprintf(out, "  nbtx_status err;\n  (void)err;\n  (void)in;\n\n");
+
+  for (size_t i = 0; i < r->count;) {
+    const struct member* m = &r->members[i];
+
+    if (is_scalar_member(m)) {
+      size_t end = i + 1;
+      while (end < r->count && is_scalar_member(&r->members[end])) ++end;
+
+      print_encode_run(r, i, end, out);
+      i = end;
+      continue;
+    }
+
+    fprintf(out, "  CHECKED_APPEND(b, ");
+    print_header_literal(m, out);
+    fprintf(out, ", %zu);\n", 3 + strlen(m->tag_name));
+
+    if (m->type == NBTX_TAG_COMPOUND)
+      fprintf(out, "  if ((err = encode_%s(&in->%s, b)) != NBTX_OK) return err;\n\n", m->record->name, m->c_name);
+    else if (m->type == NBTX_TAG_LIST)
+      fprintf(out, "  if ((err = write_list(%s, %zu, &in->%s, b)) != NBTX_OK) return err;\n\n",
+              nbtx_type_to_string(m->scalar->type), m->scalar->size, m->c_name);
+    else
+      fprintf(out, "  if ((err = write_span(%s, &in->%s, b)) != NBTX_OK) return err;\n\n", nbtx_type_to_string(m->type), m->c_name);
+
+    ++i;
+  }
+
+  fprintf(out, "  CHECKED_APPEND(b, \"\", 1); /* TAG_End */\n");
+  fprintf(out, "  return NBTX_OK;\n}\n\n");
+}
+
+static void print_source(const struct schema* s, const char* source, const char* header, FILE* out) {
+  fprintf(out, "/* Generated by nbtxgen from %s. Do not edit. */\n", source);
+  fprintf(out, "#include \"%s\"\n\n", header);
+  fprintf(out, "#include <errno.h>\n#include <stdbool.h>\n#include <stdint.h>\n#include <string.h>\n\n");
+  fprintf(out, "%s\n", runtime);
+
+  for (const struct record* r = s->first; r; r = r->next) {
+    print_decoder(r, out);
+    print_encoder(r, out);
+
+    fprintf(out, "nbtx_status %s_decode(const void* memory, size_t length, struct %s* out) {\n", r->name, r->name);
+    fprintf(out, "  const char* m = memory;\n");
+    fprintf(out, "  nbtx_status err;\n\n");
+    fprintf(out, "  if (length < 1 || *m != NBTX_TAG_COMPOUND) return NBTX_ERR;\n");
+    fprintf(out, "  ++m;\n  --length;\n\n");
+    fprintf(out, "  if ((err = skip_payload(NBTX_TAG_STRING, &m, &length)) != NBTX_OK) /* the root's name */\n");
+    fprintf(out, "    return err;\n\n");
+    fprintf(out, "  return decode_%s(&m, &length, out);\n}\n\n", r->name);
+
+    fprintf(out, "struct buffer %s_encode(const struct %s* in, const char* name) {\n", r->name, r->name);
+    fprintf(out, "  struct buffer ret = NBTX_BUFFER_INIT;\n\n");
+    fprintf(out, "  if ((errno = write_root(name, &ret)) == NBTX_OK)\n");
+    fprintf(out, "    errno = encode_%s(in, &ret);\n\n", r->name);
+    fprintf(out, "  if (errno != NBTX_OK)\n    buffer_free(&ret);\n\n");
+    fprintf(out, "  return ret;\n}\n%s", r->next ? "\n" : "");
+  }
+}
+
+static FILE* open_output(const char* base, const char* extension) {
+  char* filename = checked_malloc(strlen(base) + strlen(extension) + 1);
+  sprintf(filename, "%s%s", base, extension);
+
+  FILE* ret = fopen(filename, "w");
+  if (ret == NULL) die("could not open %s for writing", filename);
+
+  free(filename);
+  return ret;
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr,
+          "Usage: %s -o <output> <schema file>\n"
+          "       %s -o <output> --infer <nbtx file>...\n"
+          "       %s --print-schema --infer <nbtx file>...\n"
+          "\n"
+          "Writes <output>.h and <output>.c with a struct, an encoder and a\n"
+          "decoder for every struct of the schema.\n",
+          argv0, argv0, argv0);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  const char* output = NULL;
+  bool infer = false;
+  bool print_only = false;
+  int first_input = argc;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      output = argv[++i];
+    else if (strcmp(argv[i], "--infer") == 0)
+      infer = true;
+    else if (strcmp(argv[i], "--print-schema") == 0)
+      print_only = true;
+    else if (argv[i][0] == '-')
+      usage(argv[0]);
+    else {
+      first_input = i;
+      break;
+    }
+  }
+
+  if (first_input == argc || (!print_only && output == NULL) || (!infer && argc - first_input != 1))
+    usage(argv[0]);
+
+  struct schema s = { NULL };
+
+  if (infer)
+    for (int i = first_input; i < argc; ++i)
+      infer_schema(argv[i], &s);
+  else
+    parse_schema(argv[first_input], &s);
+
+  if (print_only) {
+    print_schema(&s, stdout);
+    free_schema(&s);
+    return 0;
+  }
+
+  /* The source includes the header by its file name, without the directory. */
+  const char* base = strrchr(output, '/') ? strrchr(output, '/') + 1 : output;
+
+  char* header = checked_malloc(strlen(base) + 3);
+  sprintf(header, "%s.h", base);
+
+  char* guard = make_identifier(base, NULL);
+  for (char* c = guard; *c; ++c) *c = (char)toupper((unsigned char)*c);
+  guard = realloc(guard, strlen(guard) + 4);
+  if (guard == NULL) die("out of memory");
+  strcat(guard, "_H_");
+
+  FILE* h = open_output(output, ".h");
+  print_header(&s, argv[first_input], guard, h);
+  if (fclose(h) != 0) die("could not write %s.h", output);
+
+  FILE* c = open_output(output, ".c");
+  print_source(&s, argv[first_input], header, c);
+  if (fclose(c) != 0) die("could not write %s.c", output);
+
+  free(guard);
+  free(header);
+  free_schema(&s);
+  return 0;
+}
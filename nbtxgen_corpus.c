@@ -0,0 +1,408 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <webmaster@flippeh.de> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return. Lukas Niederbremer.
+ * -----------------------------------------------------------------------------
+ * NBTx modifications by Arnoldo A. Barón.
+ * -----------------------------------------------------------------------------
+ */
+
+/*
+ * nbtxgen-corpus makes big synthetic trees for scaling tests, with the
+ * nbtx_put_* functions. The same seed and options always give the same tree,
+ * byte for byte.
+ *
+ * The root gets one compound after another until the tree takes the requested
+ * size in binary form. Every one of those is a random subtree of the given
+ * depth and fan-out, made of numbers, strings, byte arrays, lists and nested
+ * compounds. The last subtree can overshoot the size by up to one subtree,
+ * which grows like fanout^depth. The whole tree is kept in memory, which takes
+ * several times its binary size.
+ */
+
+#include "nbtx.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void die(const char* message) {
+  fprintf(stderr, "nbtxgen-corpus: %s\n", message);
+  exit(1);
+}
+
+static void die_with_err(int err) {
+  fprintf(stderr, "nbtxgen-corpus: error %i: %s\n", err, nbtx_error_to_string(err));
+  exit(1);
+}
+
+/* Dies if a put failed, otherwise returns the node that was put. */
+static nbtx_node* checked(const nbtx_result r) {
+  if (r.reference == NULL) die_with_err(errno);
+  return r.reference;
+}
+
+struct range {
+  uint32_t min;
+  uint32_t max;
+};
+
+struct options {
+  uint64_t seed;
+  uint64_t size;              /* Of the tree in binary form. */
+  uint32_t depth;             /* Of the subtrees under the root. */
+  uint32_t fanout;            /* Members per compound. */
+  struct range list_length;
+  struct range string_length;
+  bool short_strings;         /* Favor short strings, instead of a uniform distribution. */
+  struct range byte_array_size;
+  double name_reuse;          /* Chance of naming a member from a small pool of names. */
+  const char* output;
+};
+
+struct generator {
+  const struct options* o;
+  uint64_t state;
+  uint64_t bytes;      /* Size of what was generated so far in binary form. */
+  uint64_t next_name;  /* For fresh names. */
+  char* text;          /* Source of string contents. */
+  unsigned char* data; /* Source of byte array contents. */
+};
+
+#define NAME_POOL_SIZE 64
+
+/* SplitMix64, so the corpus doesn't depend on the C library's rand. */
+static uint64_t next_random(struct generator* g) {
+  uint64_t z = (g->state += 0x9e3779b97f4a7c15u);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+
+static uint32_t random_in(struct generator* g, const struct range r) {
+  return r.min + (uint32_t)(next_random(g) % ((uint64_t)r.max - r.min + 1));
+}
+
+static double random_unit(struct generator* g) {
+  return (double)(next_random(g) >> 11) / (double)(UINT64_C(1) << 53);
+}
+
+static uint32_t string_length(struct generator* g) {
+  const struct range r = g->o->string_length;
+
+  if (!g->o->short_strings)
+    return random_in(g, r);
+
+  /* The minimum of three draws: most strings are short, a few are long. */
+  uint32_t ret = random_in(g, r);
+  for (int i = 0; i < 2; ++i) {
+    const uint32_t other = random_in(g, r);
+    if (other < ret) ret = other;
+  }
+
+  return ret;
+}
+
+/* Returns a random string, which stays valid until the next call. */
+static const char* random_string(struct generator* g) {
+  const uint32_t len = string_length(g);
+  const uint32_t start = (uint32_t)(next_random(g) % (g->o->string_length.max + 1));
+
+  static char* ret = NULL;
+  static uint32_t cap = 0;
+
+  if (len + 1 > cap) {
+    cap = len + 1;
+    if ((ret = realloc(ret, cap)) == NULL) die_with_err(NBTX_EMEM);
+  }
+
+  memcpy(ret, g->text + start, len);
+  ret[len] = '\0';
+  return ret;
+}
+
+static bool has_member(const nbtx_node* compound, const char* name) {
+  const struct list_head* pos;
+  list_for_each(pos, &compound->payload.tag_compound->entry) {
+    const nbtx_node* member = list_entry(pos, const struct nbtx_list, entry)->data;
+    if (strcmp(member->name, name) == 0) return true;
+  }
+
+  return false;
+}
+
+/*
+ * Returns a name for a new member of `compound' (NULL for list elements), which
+ * stays valid until the next call. Names from the pool are shared between
+ * compounds, the others are never used twice. Putting a name twice would
+ * replace the first member, so a pool name that's taken becomes a fresh one.
+ */
+static const char* member_name(struct generator* g, const nbtx_node* compound) {
+  static char ret[32];
+
+  if (compound == NULL) return NULL;
+
+  if (random_unit(g) < g->o->name_reuse) {
+    snprintf(ret, sizeof ret, "name%u", (unsigned)(next_random(g) % NAME_POOL_SIZE));
+    if (!has_member(compound, ret)) return ret;
+  }
+
+  snprintf(ret, sizeof ret, "n%llu", (unsigned long long)g->next_name++);
+  return ret;
+}
+
+/* Accounts for the type and name of a compound member, or nothing for list elements. */
+static void count_header(struct generator* g, const char* name) {
+  if (name) g->bytes += 3 + strlen(name);
+}
+
+static void generate_compound(struct generator* g, nbtx_node* compound, uint32_t depth);
+
+static const nbtx_type scalar_types[] = {
+  NBTX_TAG_BYTE, NBTX_TAG_UNSIGNED_BYTE, NBTX_TAG_SHORT, NBTX_TAG_UNSIGNED_SHORT,
+  NBTX_TAG_INT, NBTX_TAG_UNSIGNED_INT, NBTX_TAG_LONG, NBTX_TAG_UNSIGNED_LONG,
+  NBTX_TAG_FLOAT, NBTX_TAG_DOUBLE
+};
+
+#define SCALAR_TYPE_COUNT (sizeof scalar_types / sizeof scalar_types[0])
+
+/*
+ * Puts a value of type `type' into a list or compound. Compounds and lists get
+ * filled in too, if `depth' allows for it.
+ */
+static void generate_value(struct generator* g, nbtx_node* parent, const nbtx_type type, const uint32_t depth) {
+  const char* name = member_name(g, parent->type == NBTX_TAG_COMPOUND ? parent : NULL);
+  const uint64_t r = next_random(g);
+
+  count_header(g, name);
+
+  switch (type) {
+    case NBTX_TAG_BYTE:           checked(nbtx_put_byte(parent, name, (int8_t)r));             g->bytes += 1; break;
+    case NBTX_TAG_UNSIGNED_BYTE:  checked(nbtx_put_ubyte(parent, name, (uint8_t)r));           g->bytes += 1; break;
+    case NBTX_TAG_SHORT:          checked(nbtx_put_short(parent, name, (int16_t)r));           g->bytes += 2; break;
+    case NBTX_TAG_UNSIGNED_SHORT: checked(nbtx_put_ushort(parent, name, (uint16_t)r));         g->bytes += 2; break;
+    case NBTX_TAG_INT:            checked(nbtx_put_int(parent, name, (int32_t)r));             g->bytes += 4; break;
+    case NBTX_TAG_UNSIGNED_INT:   checked(nbtx_put_uint(parent, name, (uint32_t)r));           g->bytes += 4; break;
+    case NBTX_TAG_LONG:           checked(nbtx_put_long(parent, name, (int64_t)r));            g->bytes += 8; break;
+    case NBTX_TAG_UNSIGNED_LONG:  checked(nbtx_put_ulong(parent, name, r));                    g->bytes += 8; break;
+    case NBTX_TAG_FLOAT:          checked(nbtx_put_float(parent, name, (float)random_unit(g))); g->bytes += 4; break;
+    case NBTX_TAG_DOUBLE:         checked(nbtx_put_double(parent, name, random_unit(g) * 1e6)); g->bytes += 8; break;
+
+    case NBTX_TAG_STRING: {
+      const char* s = random_string(g);
+      checked(nbtx_put_string(parent, name, s));
+      g->bytes += 2 + strlen(s);
+      break;
+    }
+
+    case NBTX_TAG_BYTE_ARRAY: {
+      const uint32_t size = random_in(g, g->o->byte_array_size);
+      const uint32_t start = (uint32_t)(r % (g->o->byte_array_size.max + 1));
+
+      checked(nbtx_put_byte_array(parent, name, g->data + start, size));
+      g->bytes += 4 + size;
+      break;
+    }
+
+    case NBTX_TAG_LIST: {
+      /* Lists of numbers, strings or, if there's room left, compounds. */
+      const uint64_t pick = next_random(g) % (SCALAR_TYPE_COUNT + (depth > 1 ? 2 : 1));
+      const nbtx_type elem_type = pick < SCALAR_TYPE_COUNT ? scalar_types[pick]
+                                : pick == SCALAR_TYPE_COUNT ? NBTX_TAG_STRING
+                                : NBTX_TAG_COMPOUND;
+
+      nbtx_node* list = checked(nbtx_put_list(parent, name, nbtx_new_tag_list_payload(elem_type)));
+      g->bytes += 5;
+
+      const uint32_t length = random_in(g, g->o->list_length);
+      for (uint32_t i = 0; i < length; ++i)
+        generate_value(g, list, elem_type, depth - 1);
+      break;
+    }
+
+    case NBTX_TAG_COMPOUND: {
+      nbtx_node* compound = checked(nbtx_put_compound(parent, name, nbtx_new_tag_compound_payload()));
+      generate_compound(g, compound, depth - 1);
+      break;
+    }
+
+    default:
+      die("unexpected type");
+  }
+}
+
+static void generate_compound(struct generator* g, nbtx_node* compound, const uint32_t depth) {
+  for (uint32_t i = 0; i < g->o->fanout; ++i) {
+    /* Mostly numbers, then strings, some nesting, and a few byte arrays. */
+    const uint64_t pick = next_random(g) % 100;
+    nbtx_type type;
+
+    if (depth > 0 && pick < 15)
+      type = NBTX_TAG_COMPOUND;
+    else if (depth > 0 && pick < 25)
+      type = NBTX_TAG_LIST;
+    else if (pick < 30)
+      type = NBTX_TAG_BYTE_ARRAY;
+    else if (pick < 50)
+      type = NBTX_TAG_STRING;
+    else
+      type = scalar_types[next_random(g) % SCALAR_TYPE_COUNT];
+
+    generate_value(g, compound, type, depth);
+  }
+
+  g->bytes += 1; /* TAG_End */
+}
+
+/***** Options *****/
+
+static void usage(const char* argv0) {
+  fprintf(stderr,
+          "Usage: %s -o <output> [options]\n"
+          "\n"
+          "Writes <output>.nbtx (gzip) and <output>.raw (uncompressed).\n"
+          "\n"
+          "  --seed N                 Seed of the tree (default 1).\n"
+          "  --size N[k|m|g]          Size of the tree in binary form (default 1m).\n"
+          "  --depth N                Depth of the subtrees under the root (default 4).\n"
+          "  --fanout N               Members per compound (default 8).\n"
+          "  --list-length MIN:MAX    Elements per list (default 0:32).\n"
+          "  --string-length MIN:MAX  Length of strings (default 0:64).\n"
+          "  --short-strings          Favor short strings over a uniform distribution.\n"
+          "  --byte-array-size MIN:MAX  Size of byte arrays (default 0:4096).\n"
+          "  --name-reuse RATIO       Chance of a member name being shared with other\n"
+          "                           compounds, between 0 and 1 (default 0.5).\n",
+          argv0);
+  exit(1);
+}
+
+static uint64_t parse_size(const char* s, const char* argv0) {
+  char* end;
+  uint64_t ret = strtoull(s, &end, 10);
+
+  switch (*end) {
+    case 'g': case 'G': ret <<= 10; /* fall through */
+    case 'm': case 'M': ret <<= 10; /* fall through */
+    case 'k': case 'K': ret <<= 10; ++end; break;
+    default: break;
+  }
+
+  if (end == s || *end != '\0') usage(argv0);
+  return ret;
+}
+
+static struct range parse_range(const char* s, const char* argv0) {
+  struct range ret;
+  unsigned long min, max;
+  char extra;
+
+  if (sscanf(s, "%lu:%lu%c", &min, &max, &extra) != 2 || min > max || max > UINT16_MAX * 256ul)
+    usage(argv0);
+
+  ret.min = (uint32_t)min;
+  ret.max = (uint32_t)max;
+  return ret;
+}
+
+int main(int argc, char** argv) {
+  struct options o = {
+    .seed = 1,
+    .size = 1 << 20,
+    .depth = 4,
+    .fanout = 8,
+    .list_length = { 0, 32 },
+    .string_length = { 0, 64 },
+    .short_strings = false,
+    .byte_array_size = { 0, 4096 },
+    .name_reuse = 0.5,
+    .output = NULL
+  };
+
+  for (int i = 1; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+
+    if (strcmp(argv[i], "-o") == 0 && has_value)
+      o.output = argv[++i];
+    else if (strcmp(argv[i], "--seed") == 0 && has_value)
+      o.seed = strtoull(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--size") == 0 && has_value)
+      o.size = parse_size(argv[++i], argv[0]);
+    else if (strcmp(argv[i], "--depth") == 0 && has_value)
+      o.depth = (uint32_t)strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--fanout") == 0 && has_value)
+      o.fanout = (uint32_t)strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--list-length") == 0 && has_value)
+      o.list_length = parse_range(argv[++i], argv[0]);
+    else if (strcmp(argv[i], "--string-length") == 0 && has_value)
+      o.string_length = parse_range(argv[++i], argv[0]);
+    else if (strcmp(argv[i], "--short-strings") == 0)
+      o.short_strings = true;
+    else if (strcmp(argv[i], "--byte-array-size") == 0 && has_value)
+      o.byte_array_size = parse_range(argv[++i], argv[0]);
+    else if (strcmp(argv[i], "--name-reuse") == 0 && has_value)
+      o.name_reuse = atof(argv[++i]);
+    else
+      usage(argv[0]);
+  }
+
+  if (o.output == NULL || o.fanout == 0 || o.string_length.max > UINT16_MAX)
+    usage(argv[0]);
+
+  struct generator g = { &o, o.seed, 0, 0, NULL, NULL };
+
+  /* Strings and byte arrays are slices of these, so making them is cheap. */
+  g.text = malloc(2 * (size_t)o.string_length.max + 1);
+  g.data = malloc(2 * (size_t)o.byte_array_size.max + 1);
+  if (g.text == NULL || g.data == NULL) die_with_err(NBTX_EMEM);
+
+  for (size_t i = 0; i < 2 * (size_t)o.string_length.max + 1; ++i)
+    g.text[i] = "abcdefghijklmnopqrstuvwxyz0123456789 "[next_random(&g) % 37];
+  for (size_t i = 0; i < 2 * (size_t)o.byte_array_size.max + 1; ++i)
+    g.data[i] = (unsigned char)next_random(&g);
+
+  nbtx_node* root = nbtx_new_compound("corpus");
+  if (root == NULL) die_with_err(errno);
+  g.bytes = 1 + 2 + strlen(root->name) + 1;
+
+  for (uint64_t chunk = 0; g.bytes < o.size; ++chunk) {
+    char name[32];
+    snprintf(name, sizeof name, "chunk%llu", (unsigned long long)chunk);
+
+    count_header(&g, name);
+    nbtx_node* compound = checked(nbtx_put_compound(root, name, nbtx_new_tag_compound_payload()));
+    generate_compound(&g, compound, o.depth);
+  }
+
+  struct buffer raw = nbtx_dump_binary(root);
+  if (raw.data == NULL) die_with_err(errno);
+  if (raw.len != g.bytes) die("the size estimate is off, which is a bug");
+
+  char* filename = malloc(strlen(o.output) + 6);
+  if (filename == NULL) die_with_err(NBTX_EMEM);
+
+  sprintf(filename, "%s.raw", o.output);
+  FILE* fp = fopen(filename, "wb");
+  if (fp == NULL || fwrite(raw.data, 1, raw.len, fp) != raw.len || fclose(fp) != 0)
+    die("could not write the uncompressed tree");
+
+  sprintf(filename, "%s.nbtx", o.output);
+  fp = fopen(filename, "wb");
+  nbtx_status err;
+  if (fp == NULL) die("could not open the compressed tree for writing");
+  if ((err = nbtx_dump_file(root, fp, NBTX_STRATEGY_GZIP)) != NBTX_OK) die_with_err(err);
+  if (fclose(fp) != 0) die("could not write the compressed tree");
+
+  fprintf(stderr, "%s: %zu nodes, %zu bytes uncompressed\n", o.output, nbtx_size(root), raw.len);
+
+  free(filename);
+  buffer_free(&raw);
+  nbtx_free(root);
+  free(g.text);
+  free(g.data);
+  return 0;
+}